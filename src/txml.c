@@ -25,6 +25,10 @@
 #define strdup _strdup
 #endif
 
+#if !defined strtok_r
+#define strtok_r strtok_s
+#endif
+
 /* files */
 #if !defined stat
 #define stat _stat
@@ -38,13 +42,30 @@
 #endif // WIN32
 
 #include <string.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <ctype.h>
+#include <locale.h>
+#include <math.h>
 #ifdef USE_ICONV
 #include <iconv.h>
 #endif
 #include <errno.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+#ifdef THREAD_SAFE
+#include <pthread.h>
+#include <sched.h>
+#ifndef WIN32
+#include <poll.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#endif
 
 #include "txml.h"
 
@@ -78,17 +99,12 @@ typedef struct __txml_namespace_set_s {
     TAILQ_ENTRY(__txml_namespace_set_s) next;
 } txml_namespace_set_t;
 
-struct __txml_node_s {
-    char *path;
-    char *name;
-    struct __txml_node_s *parent;
-    char *value;
-    TAILQ_HEAD(,__txml_node_s) children;
-    TAILQ_HEAD(,__txml_attribute_s) attributes;
-#define TXML_NODETYPE_SIMPLE 0
-#define TXML_NODETYPE_COMMENT 1
-#define TXML_NODETYPE_CDATA 2
-    char type;
+/**
+    @brief Rarely used node fields, allocated on demand
+    (only nodes involved with namespaces or linked as root nodes need it)
+*/
+struct __txml_node_ext_s {
+    struct __txml_s *context; // set only if rootnode (otherwise it's always NULL)
     struct __txml_namespace_s *ns;  // namespace of this node (if any)
     struct __txml_namespace_s *cns; // new default namespace defined by this node
     struct __txml_namespace_s *hns; // hinerited namespace (if any)
@@ -97,11 +113,396 @@ struct __txml_node_s {
     // storage for newly defined namespaces 
     // (needed keep track of allocated txml_namespace_t structures for later release)
     TAILQ_HEAD(,__txml_namespace_s) namespaces; 
+    // immutable copy of the branch published in the last snapshot (if any)
+    struct __txml_snapshot_node_s *frozen;
+    // the children changed since 'frozen' was built (its own data is still valid)
+    char frozen_stale;
+    // content not parsed yet (lazy parsing), points into the source of the context
+    char *pending;
+#ifdef THREAD_SAFE
+    pthread_rwlock_t *lock; // only on branch nodes, if fine grained locking is enabled
+#endif
+};
+
+struct __txml_node_s {
+    char *name; // points to a static string for comment, cdata and text nodes
+    char *value; // points to txml_empty_string if the node has no value
+    struct __txml_node_s *parent;
+    TAILQ_HEAD(,__txml_node_s) children;
+    TAILQ_HEAD(,__txml_attribute_s) attributes;
     TAILQ_ENTRY(__txml_node_s) siblings;
-    struct __txml_s *context; // set only if rootnode (otherwise it's always NULL)
+    struct __txml_node_ext_s *ext;
+    char type;
+    char flags;
+    unsigned short typed; // what 'decoded' holds (see txml_typed_lookup())
+    unsigned int order; // position in document order, valid while the context numbering is
+    unsigned int last;  // position of the last node of the branch
+    unsigned int depth; // 0 for the root nodes
+    unsigned long long hash; // content hash of the branch, 0 if not computed yet
+    unsigned long long decoded; // last typed value decoded from 'value' (the bits of doubles)
 };
 
+#define TXML_NODE_FLAG_INTERNED_NAME 0x01 // name points into a txml_name_t
+#define TXML_NODE_FLAG_SOURCE        0x02 // followed by a txml_node_source_t
+
+// a string as found in the source document (still escaped)
+typedef struct {
+    size_t start;
+    size_t len;
+} txml_span_t;
+
+#define TXML_SPAN_NONE ((size_t)-1) // start of a span not known
+
+typedef struct {
+    struct __txml_attribute_s *attr; // NULL once removed
+    size_t start; // of the name, the attribute ends with the quote after the value
+    txml_span_t value;
+} txml_attribute_source_t;
+
+// where an element and its attributes are within the document it has been
+// parsed from (or saved to, see txml_map_file()). Allocated along with the node
+// if the positions are being tracked, so that the others don't pay for it
+typedef struct {
+    txml_span_t element; // from the start tag to the end tag, both included
+    txml_span_t value;
+    unsigned int nattrs;
+    txml_attribute_source_t attrs[];
+} txml_node_source_t;
+
+#define TXML_NODE_SOURCE(__n) \
+    (((__n)->flags & TXML_NODE_FLAG_SOURCE) ? (txml_node_source_t *)((__n) + 1) : NULL)
+
+// accessors for the fields stored in the (optional) extension
+#define TXML_NODE_CONTEXT(__n) ((__n)->ext ? (__n)->ext->context : NULL)
+#define TXML_NODE_NS(__n) ((__n)->ext ? (__n)->ext->ns : NULL)
+#define TXML_NODE_CNS(__n) ((__n)->ext ? (__n)->ext->cns : NULL)
+#define TXML_NODE_HNS(__n) ((__n)->ext ? (__n)->ext->hns : NULL)
+
 TAILQ_HEAD(nodelist_head, __txml_node_s);
+TAILQ_HEAD(attrlist_head, __txml_attribute_s);
+
+/*
+ * Snapshots are made of immutable nodes, independent from the live tree.
+ * Each live node caches its frozen copy, so publishing a new snapshot after
+ * a change only needs to copy the nodes along the modified spine,
+ * all the untouched branches are shared (refcounted) with older versions.
+ */
+struct __txml_snapshot_data_s {
+    int refcnt;
+    char type;
+    char *name;
+    char *value;
+    unsigned long nattrs;
+    char **attrs; // name/value pairs, allocated together with the structure
+};
+
+struct __txml_snapshot_node_s {
+    int refcnt;
+    struct __txml_snapshot_data_s *data; // shared across versions if only the children changed
+    struct __txml_snapshot_node_s *next; // used only while releasing
+    unsigned long nchildren;
+    struct __txml_snapshot_node_s *children[];
+};
+
+struct __txml_snapshot_s {
+    int refcnt;
+    int allow_multiple_root_nodes;
+    unsigned long nbranches;
+    struct __txml_snapshot_node_s *branches[];
+};
+
+#define TXML_NODE_CHANGED_SELF     1 // name, value or attributes
+#define TXML_NODE_CHANGED_CHILDREN 2 // a child has been added or removed
+
+#ifdef THREAD_SAFE
+/*
+ * Read-mostly (big-reader) lock protecting a whole context.
+ * Each thread increments its own cache-line-sized reader slot, so uncontended
+ * readers never share (and bounce) a cache line. A writer raises the writer
+ * flag, which makes new readers back off, and then waits for all the slots
+ * to drain. The write lock is recursive for the owning thread, and readers
+ * running in the thread owning the write lock pass through without locking.
+ */
+#define TXML_RWLOCK_SLOTS 64
+#define TXML_CACHELINE_SIZE 64
+
+typedef struct {
+    int readers;
+    char pad[TXML_CACHELINE_SIZE - sizeof(int)];
+} txml_rwlock_slot_t;
+
+typedef struct {
+    txml_rwlock_slot_t slots[TXML_RWLOCK_SLOTS];
+    int writer;
+    int depth;
+    pthread_t owner;
+    pthread_mutex_t wlock;
+} txml_rwlock_t;
+#endif
+
+/*
+ * Node names interned by a context (used by txml_node_clone() so that
+ * copies of the same template share their names).
+ * Each node using an entry holds a reference, the table itself holds one
+ * which is dropped when the context is destroyed, so names survive it
+ * if nodes using them are still around.
+ */
+typedef struct __txml_name_s {
+    int refcnt;
+    unsigned int hash;
+    struct __txml_name_s *next;
+    char name[];
+} txml_name_t;
+
+typedef struct {
+    txml_name_t **buckets;
+    unsigned int size;
+    unsigned int count;
+    char lock;
+} txml_names_t;
+
+#define TXML_NAME_ENTRY(__name) ((txml_name_t *)((__name) - offsetof(txml_name_t, name)))
+
+/*
+ * Incremental hash of a byte stream, a word at a time. The result doesn't
+ * depend on how the stream is split in chunks
+ */
+typedef struct {
+    unsigned long long hash;
+    unsigned char pending[8]; // bytes of the last word, not hashed yet
+    size_t len;
+} txml_hasher_t;
+
+/*
+ * Growable buffer used by the serializer (and as scratch space by the parser).
+ * Allocation failures are sticky: once one happened all the following
+ * appends are ignored and the caller finds out by checking 'err'.
+ * If 'file' is set, the content is written there instead of growing the buffer
+ * (write errors are sticky as well)
+ */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t size;
+    int err;
+    FILE *file;
+    txml_hasher_t *hasher; // if set, what is written to 'file' is hashed as well
+    size_t flushed; // bytes written to 'file' so far
+    int positions;  // record where the values are written in the source of the nodes
+} txml_buffer_t;
+
+#define TXML_BUFFER_INIT { .data = NULL } // an empty buffer (all the fields zeroed)
+
+/*
+ * Storage released by txml_context_reset() and kept aside for the next
+ * document parsed into the same context (see txml_set_retention()).
+ * Strings are recycled by size class, so all the strings owned by nodes,
+ * attributes and namespaces are allocated rounded up to the size of their
+ * class (see txml_strndup()), whatever the context they are used with
+ */
+#define TXML_POOL_STRING_MIN 16
+#define TXML_POOL_STRING_BINS 6 // 16, 32, 64, 128, 256 and 512 bytes
+
+typedef struct __txml_pool_item_s {
+    struct __txml_pool_item_s *next;
+} txml_pool_item_t;
+
+typedef struct {
+    txml_pool_item_t *head;
+    unsigned long count;
+} txml_freelist_t;
+
+typedef struct {
+    unsigned long max; // high-water mark of each list, 0 if retention is disabled
+    txml_freelist_t nodes;
+    txml_freelist_t exts;
+    txml_freelist_t attributes;
+    txml_freelist_t namespaces;
+    txml_freelist_t nsitems;
+    txml_freelist_t strings[TXML_POOL_STRING_BINS];
+} txml_pool_t;
+
+/*
+ * Path patterns selecting the parts of a document to be parsed
+ * (see txml_set_parse_filter())
+ */
+typedef struct {
+    char *buffer;       // copy of the pattern, split in place
+    char **steps;       // element names, "*" matches any name
+    unsigned int nsteps;
+    char *attr;         // the attribute selected by the pattern, if any
+    int exclude;
+} txml_filter_pattern_t;
+
+typedef struct {
+    txml_filter_pattern_t *patterns;
+    unsigned int count;
+    unsigned int includes; // how many of them are include patterns
+} txml_filter_t;
+
+#define TXML_FILTER_SKIP 0 // the element and its content are skipped
+#define TXML_FILTER_PATH 1 // only the element (and the selected attributes) on the way to included nodes
+#define TXML_FILTER_KEEP 2 // the whole element, but for excluded nodes
+
+// filter state of an open element
+typedef struct {
+    int mode;
+    unsigned long first; // patterns still matching (their indexes within the alive list)
+    unsigned long count;
+} txml_filter_level_t;
+
+// temporary storage used by the parser while reading a tag or a value
+typedef struct {
+    txml_buffer_t text; // copies of the strings being parsed
+    size_t *offsets;    // position of the attribute names and values within 'text'
+    size_t *sources;    // positions of the attributes in the source document
+    char **strings;     // the same as NULL-terminated lists of names and values
+    unsigned int size;  // entries allocated in 'offsets' and 'strings' (twice as many in 'sources')
+    txml_filter_level_t *levels; // the document level followed by the open elements
+    unsigned long depth;
+    unsigned long nlevels;       // entries allocated in 'levels'
+    unsigned int *alive;         // lists of patterns matching the open elements
+    unsigned long nalive;
+    unsigned long alive_size;    // entries allocated in 'alive'
+} txml_scratch_t;
+
+// byte range of an element in the source of a lazy document
+typedef struct {
+    size_t start;
+    size_t end;
+} txml_range_t;
+
+// source of a child of the root element, as found by the last (re)load
+typedef struct {
+    unsigned long long hash; // of the bytes in the range
+    size_t start;
+    size_t length;
+    txml_node_t *node;       // the child built from them
+    unsigned long long node_hash; // and its hash
+} txml_reload_unit_t;
+
+// what the context knows about the file it has been loaded from
+typedef struct {
+    char *path;
+    off_t size;
+    time_t mtime;
+    long mtime_nsec;
+    unsigned long long hash;  // of the whole content
+    unsigned long long frame; // of everything but the children of the root element
+    txml_node_t *root;        // NULL if the children can't be reloaded one by one
+    unsigned long long root_hash; // still set only if nothing changed since the load
+    txml_reload_unit_t *units;
+    unsigned long nunits;
+    unsigned long units_size;
+} txml_reload_t;
+
+// positions of the nodes in a long list of siblings (text nodes don't count)
+typedef struct {
+    void *list;          // &parent->children or &xml->root_elements, NULL if the entry is unused
+    txml_node_t **nodes; // in order
+    unsigned long count;
+    unsigned long size;
+    unsigned long *slots; // hash of the nodes, each slot holds the position of a node + 1 (0 if empty)
+    unsigned long nslots; // a power of 2, at least twice the count
+} txml_positions_t;
+
+#define TXML_JOURNAL_POSITIONS 4  // lists indexed at once
+#define TXML_JOURNAL_SHORT_LIST 128 // positions in shorter lists are just counted
+
+// append-only log of the mutations applied on top of a base file (see txml_journal_open())
+typedef struct {
+    txml_t *xml;
+    char *path;     // of the base file
+    char *log_path; // of the log (path.journal)
+    int fd;
+    off_t size;     // of the log
+    unsigned long threshold; // log size triggering a compaction (0 to compact only on request)
+    int dirty;      // the document changed in a way the log can't hold, it must be saved as a whole
+    int compacting; // a compaction has been scheduled and didn't complete yet
+    txml_positions_t positions[TXML_JOURNAL_POSITIONS]; // of the long lists met lately
+    unsigned int next_positions; // the entry to reuse next
+#ifdef THREAD_SAFE
+    pthread_mutex_t lock; // serializes the records (and the replacement of the log)
+    pthread_t thread;     // of the last compaction
+    int thread_started;
+#endif
+} txml_journal_t;
+
+// a document file mapped in memory, to patch its values in place (see txml_map_file())
+typedef struct {
+    char *path;
+    int fd;
+    char *data;
+    size_t size;   // of the file
+    size_t length; // of the mapping, there is always a terminator past the file
+    dev_t dev;     // identity of the file, to recognize it when saved again
+    ino_t ino;
+    int stale;     // the positions of the values don't match the file anymore
+} txml_map_t;
+
+// a sidecar index file starts with a header, followed by the entries
+// (sorted by hash, then by position) and by the strings they refer to
+#define TXML_SIDECAR_MAGIC "TXMLIDX1"
+
+typedef struct {
+    char magic[8];
+    unsigned long long size;       // of the indexed file, when indexed
+    long long mtime;
+    long long mtime_nsec;
+    unsigned long long count;      // entries
+    unsigned long long strings;    // bytes taken by the strings
+} txml_sidecar_header_t;
+
+typedef struct {
+    unsigned long long hash;       // of the path and of the key
+    unsigned long long start;      // of the element in the indexed file
+    unsigned long long end;        // right after the element
+    unsigned long long path;       // offset of the path among the strings
+    unsigned long long key;        // offset of the key (0 is the empty string)
+} txml_sidecar_entry_t;
+
+struct __txml_sidecar_s {
+    int fd;                        // of the indexed file
+    char *index;                   // the whole index file, mapped
+    size_t length;
+    txml_sidecar_header_t *header;
+    txml_sidecar_entry_t *entries;
+    char *strings;
+};
+
+// an attribute whose value is indexed (the value itself is the key, nothing is copied)
+typedef struct __txml_index_entry_s {
+    txml_attribute_t *attr;
+    unsigned int hash; // of the value
+    struct __txml_index_entry_s *next;
+} txml_index_entry_t;
+
+// the nodes of a document by the value of one of their attributes (see txml_index_create())
+typedef struct __txml_index_s {
+    char *name; // of the attribute
+    txml_index_entry_t **buckets;
+    unsigned long nbuckets; // a power of 2 (0 until the first entry)
+    unsigned long count;
+    TAILQ_ENTRY(__txml_index_s) next;
+} txml_index_t;
+
+// the elements sharing a name, in document order
+typedef struct __txml_name_list_s {
+    char *name; // interned in the names of the context
+    unsigned int hash;
+    txml_node_t **nodes;
+    unsigned long count;
+    unsigned long size;
+    struct __txml_name_list_s *next;
+} txml_name_list_t;
+
+// the elements of a document by name (see txml_name_index_create())
+typedef struct {
+    txml_name_list_t **buckets;
+    unsigned long nbuckets; // a power of 2
+    unsigned long count;    // of lists
+    int stale; // the lists don't match the document anymore, the next query rebuilds them
+} txml_name_index_t;
 
 struct __txml_s {
     txml_node_t *cnode;
@@ -113,10 +514,100 @@ struct __txml_s {
     int allow_multiple_root_nodes;
     int ignore_white_spaces;
     int ignore_blanks;
+    struct __txml_snapshot_s *snapshot; // last published snapshot
+    int snapshots; // set once the first snapshot has been requested
+    int snapshot_stale; // the list of root nodes changed since the last publish
+    char snapshot_lock; // protects the swap of 'snapshot' against acquirers
+    int lock_depth; // 0 if the whole document is locked at once
+    int batch; // nesting level of txml_batch_begin()
+    int batch_dirty; // namespace scopes must be updated at the end of the batch
+    txml_names_t names;
+    txml_pool_t pool;
+    txml_scratch_t scratch;
+    txml_filter_t *filter; // parse filter (if any)
+    int lazy; // parse the content of the elements only when first accessed
+    char *source; // copy of the document parsed lazily, referenced by the pending nodes
+    unsigned long pending; // nodes whose content has not been parsed yet
+    txml_range_t *ranges; // elements found skipping the pending content, sorted by start
+    unsigned long nranges;
+    unsigned long ranges_size;
+    txml_reload_t *reload; // set by txml_reload_file()
+    int refcnt; // references to a version published by txml_watch()
+    int save_sync; // TXML_SYNC_* policy of txml_save()
+    txml_journal_t *journal; // set by txml_journal_open()
+    int track; // TXML_TRACK_* flags, what to record about the positions while parsing
+    char *origin; // the document the positions refer to, while parsing lazily
+    size_t *lines; // offsets where the lines (but the first) start, if tracked
+    size_t nlines;
+    size_t length; // of the document the lines are in
+    txml_map_t *map; // set by txml_map_file()
+    TAILQ_HEAD(, __txml_index_s) indexes; // of attribute values (see txml_index_create())
+    int nindexes;
+    int indexes_stale; // some attributes are missing from the indexes, they must be rebuilt
+    txml_name_index_t *name_index; // set by txml_name_index_create()
+    int order_stale; // the positions of the nodes must be computed again before being used
+    unsigned int order_step; // gap between the positions, when last computed
+    int depth_stale; // the depths of the nodes must be computed again before being used
+#ifdef THREAD_SAFE
+    txml_rwlock_t *lock;
+    pthread_mutex_t lazy_lock; // serializes the parsing of pending nodes
+#endif
 };
 
-static txml_namespace_t *txml_namespace_create(char *ns_name, char *ns_uri);
-static void txml_namespace_destroy(txml_namespace_t *ns);
+typedef struct __txml_lock_state_s txml_lock_state_t;
+
+static txml_namespace_t *txml_namespace_create(txml_pool_t *pool, char *ns_name, char *ns_uri);
+static void txml_namespace_destroy(txml_pool_t *pool, txml_namespace_t *ns);
+static void txml_node_destroy_unlocked(txml_node_t *node);
+static void txml_node_release_branch(txml_pool_t *pool, txml_node_t *node);
+static void txml_reload_destroy(txml_reload_t *state);
+static void txml_map_destroy(txml_map_t *map);
+static int txml_map_is(txml_map_t *map, char *path);
+static txml_err_t txml_map_save(txml_t *xml);
+static txml_err_t txml_node_add_child_unlocked(txml_pool_t *pool, txml_node_t *parent, txml_node_t *child);
+static txml_err_t txml_node_add_attribute_unlocked(txml_pool_t *pool, txml_node_t *node, char *name, char *val);
+static txml_namespace_t *txml_node_add_namespace_unlocked(txml_pool_t *pool, txml_node_t *node, char *ns_name, char *ns_uri);
+static txml_namespace_t *txml_node_get_namespace_byname_unlocked(txml_node_t *node, char *ns_name);
+static unsigned long txml_node_count_attributes_unlocked(txml_node_t *node);
+static txml_node_t *txml_get_branch_unlocked(txml_t *xml, unsigned long index);
+static txml_err_t txml_parse_buffer_parallel_unlocked(txml_t *xml, char *buf, int nthreads);
+static void txml_node_expand(txml_node_t *node);
+static void txml_node_expand_branch(txml_node_t *branch);
+static void txml_expand_all(txml_t *xml);
+static txml_attribute_t *txml_node_get_attribute_byname_unlocked(txml_node_t *node, char *name);
+static void txml_index_clear(txml_index_t *index);
+static void txml_indexes_destroy(txml_t *xml);
+static void txml_name_index_clear(txml_t *xml);
+
+// materialize the children of a node parsed lazily, if not done yet
+#define TXML_NODE_EXPAND(__n) do { \
+    if ((__n)->ext && __atomic_load_n(&(__n)->ext->pending, __ATOMIC_ACQUIRE)) \
+        txml_node_expand(__n); \
+} while (0)
+static void txml_snapshot_publish(txml_t *xml);
+txml_t *txml_context_get(txml_node_t *node);
+static void txml_snapshot_node_release(txml_snapshot_node_t *node);
+
+// a mutation being recorded to the journal of a document
+typedef struct {
+    txml_journal_t *journal; // NULL if there is nothing to record
+    int dirty; // the mutation can't be recorded, the document must be saved as a whole
+    int destroys; // nodes are going away, and the indexes of positions with them (see txml_journal_position())
+    txml_buffer_t buf;
+} txml_record_t;
+
+static int txml_journals = 0; // journals open, mutations are looked at only if there is any
+#define TXML_JOURNALING() __atomic_load_n(&txml_journals, __ATOMIC_RELAXED)
+static int txml_record_begin(txml_record_t *rec, txml_t *xml, char op);
+static void txml_record_node(txml_record_t *rec, txml_node_t *node);
+static void txml_record_number(txml_record_t *rec, unsigned long number);
+static void txml_record_string(txml_record_t *rec, char *string);
+static void txml_record_branch(txml_record_t *rec, txml_t *xml, txml_node_t *node);
+static void txml_record_added(txml_record_t *rec, txml_node_t *parent, txml_node_t *node);
+static void txml_record_end(txml_record_t *rec, txml_err_t err);
+static void txml_record_move(txml_record_t *rec, txml_t *from, txml_t *to, txml_node_t *parent, txml_node_t *child);
+static void txml_record_insert(txml_record_t *rec, txml_t *from, txml_t *to, txml_node_t *parent,
+                               txml_node_t *child, txml_err_t err);
 
 //
 // INTERNAL HELPERS
@@ -169,62 +660,76 @@ detect_encoding(char *buffer) {
 
 int errno;
 
-static inline char *
-dexmlize(char *string)
+// unescape 'string' into 'unescaped' (which can be 'string' itself,
+// the output is never longer than the input). Returns -1 on bad entities
+static int
+txml_unescape(char *unescaped, char *string)
 {
     int i, p = 0;
     int len = strlen(string);
-    char *unescaped = NULL;
 
-    if (string) {
-        unescaped = (char *)calloc(1, len+1); // inlude null-byte
-        for (i = 0; i < len; i++) {
-            switch (string[i]) {
-                case '&':
-                    if (string[i+1] == '#') {
-                        char *marker;
+    for (i = 0; i < len; i++) {
+        switch (string[i]) {
+            case '&':
+                if (string[i+1] == '#') {
+                    char *marker;
+                    i+=2;
+                    marker = &string[i];
+                    if (string[i] >= '0' && string[i] <= '9' &&
+                        string[i+1] >= '0' && string[i+1] <= '9')
+                    {
+                        char chr = 0;
                         i+=2;
-                        marker = &string[i];
-                        if (string[i] >= '0' && string[i] <= '9' &&
-                            string[i+1] >= '0' && string[i+1] <= '9')
-                        {
-                            char chr = 0;
-                            i+=2;
-                            if (string[i] >= '0' && string[i] <= '9' && string[i+1] == ';')
-                                i++;
-                            else if (string[i] == ';')
-                                ; // do nothing
-                            else
-                                return NULL;
-                            chr = (char)strtol(marker, NULL, 0);
-                            unescaped[p] = chr;
-                        }
-                    } else if (strncmp(&string[i], "&amp;", 5) == 0) {
-                        i+=4;
-                        unescaped[p] = '&';
-                    } else if (strncmp(&string[i], "&lt;", 4) == 0) {
-                        i+=3;
-                        unescaped[p] = '<';
-                    } else if (strncmp(&string[i], "&gt;", 4) == 0) {
-                        i+=3;
-                        unescaped[p] = '>';
-                    } else if (strncmp(&string[i], "&quot;", 6) == 0) {
-                        i+=5;
-                        unescaped[p] = '"';
-                    } else if (strncmp(&string[i], "&apos;", 6) == 0) {
-                        i+=5;
-                        unescaped[p] = '\'';
+                        if (string[i] >= '0' && string[i] <= '9' && string[i+1] == ';')
+                            i++;
+                        else if (string[i] == ';')
+                            ; // do nothing
+                        else
+                            return -1;
+                        chr = (char)strtol(marker, NULL, 0);
+                        unescaped[p] = chr;
                     } else {
-                        return NULL;
+                        unescaped[p] = 0;
                     }
-                    p++;
-                    break;
-                default:
-                    unescaped[p] = string[i];
-                    p++;
-            }
+                } else if (strncmp(&string[i], "&amp;", 5) == 0) {
+                    i+=4;
+                    unescaped[p] = '&';
+                } else if (strncmp(&string[i], "&lt;", 4) == 0) {
+                    i+=3;
+                    unescaped[p] = '<';
+                } else if (strncmp(&string[i], "&gt;", 4) == 0) {
+                    i+=3;
+                    unescaped[p] = '>';
+                } else if (strncmp(&string[i], "&quot;", 6) == 0) {
+                    i+=5;
+                    unescaped[p] = '"';
+                } else if (strncmp(&string[i], "&apos;", 6) == 0) {
+                    i+=5;
+                    unescaped[p] = '\'';
+                } else {
+                    return -1;
+                }
+                p++;
+                break;
+            default:
+                unescaped[p] = string[i];
+                p++;
         }
     }
+    unescaped[p] = 0;
+    return 0;
+}
+
+static inline char *
+dexmlize(char *string)
+{
+    char *unescaped = (char *)calloc(1, strlen(string)+1); // inlude null-byte
+    if (!unescaped)
+        return NULL;
+    if (txml_unescape(unescaped, string) != 0) {
+        free(unescaped);
+        return NULL;
+    }
     return unescaped;
 }
 
@@ -323,1948 +828,10404 @@ char *txml_strcasestr (char *h, char *n)
    return NULL; 
 }
 
-//
-// TXML IMPLEMENTATION
-//
-
-txml_t *
-txml_context_create()
+// tiny spinlock, only held for the few instructions needed
+// to swap or to acquire a snapshot, or to look up an interned name
+static inline void
+txml_spin_lock(char *lock)
 {
-    txml_t *xml;
-
-    xml = (txml_t *)calloc(1, sizeof(txml_t));
-    xml->cnode = NULL;
-    xml->ignore_white_spaces = 1; // defaults to old behaviour (all blanks are not taken into account)
-    xml->ignore_blanks = 1; // defaults to old behaviour (all blanks are not taken into account)
-    TAILQ_INIT(&xml->root_elements);
-    xml->head = NULL;
-    // default is UTF-8
-    sprintf(xml->output_encoding, "utf-8");
-    sprintf(xml->document_encoding, "utf-8");
-    return xml;
+    while (__atomic_test_and_set(lock, __ATOMIC_ACQUIRE))
+        ;
 }
 
-void
-txml_context_reset(txml_t *xml)
+static inline void
+txml_spin_unlock(char *lock)
 {
-    txml_node_t *rnode, *tmp;
-    TAILQ_FOREACH_SAFE(rnode, &xml->root_elements, siblings, tmp) {
-        TAILQ_REMOVE(&xml->root_elements, rnode, siblings);
-        txml_node_destroy(rnode);
-    }
-    if(xml->head)
-        free(xml->head);
-    xml->head = NULL;
+    __atomic_clear(lock, __ATOMIC_RELEASE);
 }
 
-txml_t *
-txml_context_get(txml_node_t *node)
+// shared by all the nodes (and attributes) with an empty value
+static char txml_empty_string[] = "";
+
+static char txml_comment_name[] = "#comment";
+static char txml_cdata_name[] = "#cdata-section";
+static char txml_text_name[] = "#text";
+
+static inline void
+txml_hasher_init(txml_hasher_t *hasher)
 {
-    txml_node_t *p = node;
-    do {
-        if (!p->parent)
-            return p->context;
-        p = p->parent;
-    } while (p);
-    return NULL; // should never arrive here
+    hasher->hash = 14695981039346656037ULL;
+    hasher->len = 0;
 }
 
-void
-txml_document_set_encoding(txml_t *xml, char *encoding)
+static inline unsigned long long
+txml_hash_word(unsigned long long hash, unsigned long long word)
 {
-    strncpy(xml->document_encoding, encoding, sizeof(xml->document_encoding)-1);
+    hash = (hash ^ word) * 1099511628211ULL;
+    return hash ^ (hash >> 32); // let the high bits of the word reach the low bits of the hash
 }
 
-void
-txml_set_output_encoding(txml_t *xml, char *encoding)
+static void
+txml_hasher_update(txml_hasher_t *hasher, char *data, size_t len)
 {
-    strncpy(xml->output_encoding, encoding, sizeof(xml->output_encoding)-1);
+    unsigned long long word;
+    size_t fill = hasher->len % sizeof(word);
+
+    hasher->len += len;
+    if (fill) {
+        // complete the pending word first
+        while (len && fill < sizeof(word)) {
+            hasher->pending[fill++] = *data++;
+            len--;
+        }
+        if (fill < sizeof(word))
+            return;
+        memcpy(&word, hasher->pending, sizeof(word));
+        hasher->hash = txml_hash_word(hasher->hash, word);
+    }
+    while (len >= sizeof(word)) {
+        memcpy(&word, data, sizeof(word));
+        hasher->hash = txml_hash_word(hasher->hash, word);
+        data += sizeof(word);
+        len -= sizeof(word);
+    }
+    memcpy(hasher->pending, data, len);
 }
 
-void
-txml_context_destroy(txml_t *xml)
+static unsigned long long
+txml_hasher_final(txml_hasher_t *hasher)
 {
-    txml_context_reset(xml);
-    free(xml);
+    unsigned long long hash = hasher->hash;
+    size_t i;
+
+    for (i = 0; i < hasher->len % sizeof(unsigned long long); i++)
+        hash = (hash ^ hasher->pending[i]) * 1099511628211ULL;
+    return txml_hash_word(hash, hasher->len);
 }
 
-static void
-txml_node_set_path(txml_node_t *node, txml_node_t *parent)
+static unsigned long long
+txml_hash_bytes(char *data, size_t len)
 {
-    unsigned int path_len;
+    txml_hasher_t hasher;
+    txml_hasher_init(&hasher);
+    txml_hasher_update(&hasher, data, len);
+    return txml_hasher_final(&hasher);
+}
 
-    if (node->path)
-        free(node->path);
+// write out the content of a streaming buffer
+static int
+txml_buffer_flush(txml_buffer_t *buf)
+{
+    if (buf->err)
+        return -1;
+    if (buf->len && fwrite(buf->data, 1, buf->len, buf->file) != buf->len) {
+        buf->err = 1;
+        return -1;
+    }
+    if (buf->hasher)
+        txml_hasher_update(buf->hasher, buf->data, buf->len);
+    buf->flushed += buf->len;
+    buf->len = 0;
+    return 0;
+}
 
-    if(parent) {
-        if(parent->path) {
-            path_len = (unsigned int)strlen(parent->path)+1+strlen(node->name)+1;
-            node->path = (char *)calloc(1, path_len);
-            sprintf(node->path, "%s/%s", parent->path, node->name);
-        } else {
-            path_len = (unsigned int)strlen(parent->name)+1+strlen(node->name)+1;
-            node->path = (char *)calloc(1, path_len);
-            sprintf(node->path, "%s/%s", parent->name, node->name);
+static int
+txml_buffer_reserve(txml_buffer_t *buf, size_t len)
+{
+    if (buf->err)
+        return -1;
+    if (buf->len + len + 1 > buf->size) {
+        size_t size = buf->size ? buf->size : 256;
+        if (buf->file && buf->len) {
+            if (txml_buffer_flush(buf) != 0)
+                return -1;
+            if (len + 1 <= buf->size)
+                return 0;
+        }
+        char *data;
+        while (size < buf->len + len + 1)
+            size *= 2;
+        data = realloc(buf->data, size);
+        if (!data) {
+            buf->err = 1;
+            return -1;
         }
-    } else { /* root node */
-        node->path = (char *)calloc(1, strlen(node->name)+2);
-        sprintf(node->path, "/%s", node->name);
+        buf->data = data;
+        buf->size = size;
     }
+    return 0;
+}
 
+static inline void
+txml_buffer_append(txml_buffer_t *buf, char *data, size_t len)
+{
+    if (txml_buffer_reserve(buf, len) != 0)
+        return;
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    buf->data[buf->len] = 0;
 }
 
-txml_node_t *
-txml_node_create(char *name, char *value, txml_node_t *parent)
+static inline void
+txml_buffer_append_string(txml_buffer_t *buf, char *string)
 {
-    txml_node_t *node = NULL;
-    node = (txml_node_t *)calloc(1, sizeof(txml_node_t));
-    if(!node || !name)
-        return NULL;
+    txml_buffer_append(buf, string, strlen(string));
+}
 
-    TAILQ_INIT(&node->attributes);
-    TAILQ_INIT(&node->children);
-    TAILQ_INIT(&node->namespaces);
-    TAILQ_INIT(&node->known_namespaces);
+static inline void *
+txml_pool_pop(txml_freelist_t *list)
+{
+    txml_pool_item_t *item = list->head;
 
-    node->name = strdup(name);
+    if (item) {
+        list->head = item->next;
+        list->count--;
+    }
+    return item;
+}
 
-    if (parent)
-        txml_node_add_child(parent, node);
-    else
-        txml_node_set_path(node, NULL);
+// same as calloc(1, size), reusing a retained item if available
+static void *
+txml_pool_alloc(txml_freelist_t *list, size_t size)
+{
+    void *item = list ? txml_pool_pop(list) : NULL;
 
-    if(value && strlen(value) > 0)
-        node->value = strdup(value);
-    else
-        node->value = (char *)calloc(1, 1);
-    return node;
+    if (!item)
+        return calloc(1, size);
+    memset(item, 0, size);
+    return item;
 }
 
-void
-txml_node_destroy(txml_node_t *node)
+static void
+txml_pool_free(txml_pool_t *pool, txml_freelist_t *list, void *ptr)
 {
-    txml_attribute_t *attr, *attrtmp;
-    txml_node_t *child, *childtmp;
-    txml_namespace_t *ns, *nstmp;
-    txml_namespace_set_t *item, *itemtmp;
+    txml_pool_item_t *item = (txml_pool_item_t *)ptr;
 
-    TAILQ_FOREACH_SAFE(attr, &node->attributes, list, attrtmp) {
-        TAILQ_REMOVE(&node->attributes, attr, list);
-        if(attr->name)
-            free(attr->name);
-        if(attr->value)
-            free(attr->value);
-        free(attr);
+    if (!pool || list->count >= pool->max) {
+        free(ptr);
+        return;
     }
+    item->next = list->head;
+    list->head = item;
+    list->count++;
+}
 
-    TAILQ_FOREACH_SAFE(child, &node->children, siblings, childtmp) {
-        TAILQ_REMOVE(&node->children, child, siblings);
-        txml_node_destroy(child);
-    }
+// release the items exceeding the high-water mark
+static void
+txml_pool_trim_list(txml_pool_t *pool, txml_freelist_t *list)
+{
+    while (list->count > pool->max)
+        free(txml_pool_pop(list));
+}
 
-    TAILQ_FOREACH_SAFE(item, &node->known_namespaces, next, itemtmp) {
-        TAILQ_REMOVE(&node->known_namespaces, item, next);
-        free(item);
-    }
+static void
+txml_pool_trim(txml_pool_t *pool)
+{
+    int i;
+
+    txml_pool_trim_list(pool, &pool->nodes);
+    txml_pool_trim_list(pool, &pool->exts);
+    txml_pool_trim_list(pool, &pool->attributes);
+    txml_pool_trim_list(pool, &pool->namespaces);
+    txml_pool_trim_list(pool, &pool->nsitems);
+    for (i = 0; i < TXML_POOL_STRING_BINS; i++)
+        txml_pool_trim_list(pool, &pool->strings[i]);
+}
 
-    TAILQ_FOREACH_SAFE(ns, &node->namespaces, list, nstmp) {
-        TAILQ_REMOVE(&node->namespaces, ns, list);
-        txml_namespace_destroy(ns);
-    }
+#define TXML_POOL_ALLOC(__pool, __list, __size) \
+    txml_pool_alloc((__pool) ? &(__pool)->__list : NULL, __size)
 
-    if(node->name)
-        free(node->name);
-    if(node->path)
-        free(node->path);
-    if(node->value)
-        free(node->value);
-    free(node);
-}
+#define TXML_POOL_FREE(__pool, __list, __ptr) \
+    txml_pool_free(__pool, (__pool) ? &(__pool)->__list : NULL, __ptr)
 
-txml_err_t
-txml_node_set_value(txml_node_t *node, char *val)
+// size class of a string (including its terminator), -1 if too big to be recycled
+static inline int
+txml_string_class(size_t size)
 {
-    if(!val)
-        return TXML_BADARGS;
+    size_t class_size = TXML_POOL_STRING_MIN;
+    int bin = 0;
 
-    if(node->value)
-        free(node->value);
-    node->value = strdup(val);
-    return TXML_NOERR;
+    while (class_size < size) {
+        if (++bin == TXML_POOL_STRING_BINS)
+            return -1;
+        class_size <<= 1;
+    }
+    return bin;
 }
 
-char *
-txml_node_get_value(txml_node_t *node)
+static char *
+txml_strndup(txml_pool_t *pool, char *string, size_t len)
 {
-    if(!node)
+    int bin = txml_string_class(len + 1);
+    char *copy;
+
+    if (bin < 0)
+        copy = malloc(len + 1);
+    else if (!pool || !(copy = txml_pool_pop(&pool->strings[bin])))
+        copy = malloc(TXML_POOL_STRING_MIN << bin);
+    if (!copy)
         return NULL;
-    return node->value;
+    memcpy(copy, string, len);
+    copy[len] = 0;
+    return copy;
 }
 
-char *
-txml_node_get_name(txml_node_t *node)
+static inline char *
+txml_strdup(txml_pool_t *pool, char *string)
 {
-    if(!node)
-        return NULL;
-    return node->name;
+    return txml_strndup(pool, string, strlen(string));
 }
 
-static void
-txml_node_remove_child(txml_node_t *parent, txml_node_t *child)
+static inline void
+txml_strfree(txml_pool_t *pool, char *string)
 {
-    txml_node_t *p, *tmp;
-    TAILQ_FOREACH_SAFE(p, &parent->children, siblings, tmp) {
-        if (p == child) {
-            TAILQ_REMOVE(&parent->children, p, siblings);
-            p->parent = NULL;
-            txml_node_set_path(p, NULL);
-            break;
-        }
-    }
+    int bin = txml_string_class(strlen(string) + 1);
+
+    if (!pool || bin < 0)
+        free(string);
+    else
+        txml_pool_free(pool, &pool->strings[bin], string);
+}
+
+static inline char *
+txml_strdup_value(txml_pool_t *pool, char *value)
+{
+    if (!value || !*value)
+        return txml_empty_string;
+    return txml_strdup(pool, value);
 }
 
 static inline void
-txml_update_known_namespaces(txml_node_t *node)
+txml_free_value(txml_pool_t *pool, char *value)
 {
-    txml_namespace_t *ns;
-    txml_namespace_set_t *new_item;
-    
-    // first empty actual list
-    if (!TAILQ_EMPTY(&node->known_namespaces)) {
-        txml_namespace_set_t *old_item;
-        while((old_item = TAILQ_FIRST(&node->known_namespaces))) {
-            TAILQ_REMOVE(&node->known_namespaces, old_item, next);
-            free(old_item);
-        }
-    }
+    if (value && value != txml_empty_string)
+        txml_strfree(pool, value);
+}
 
-    // than start populating the list with actual default namespace
-    if (node->cns) {
-        new_item = (txml_namespace_set_t *)calloc(1, sizeof(txml_namespace_set_t));
-        new_item->ns = node->cns;
-        TAILQ_INSERT_TAIL(&node->known_namespaces, new_item, next);
-    } else if (node->hns) {
-        new_item = (txml_namespace_set_t *)calloc(1, sizeof(txml_namespace_set_t));
-        new_item->ns = node->hns;
-        TAILQ_INSERT_TAIL(&node->known_namespaces, new_item, next);
+static inline unsigned int
+txml_hash_string(char *string)
+{
+    unsigned int hash = 2166136261U; // FNV-1a
+    while (*string) {
+        hash ^= (unsigned char)*string++;
+        hash *= 16777619U;
     }
+    return hash;
+}
 
-    // add all namespaces defined by this node
-    TAILQ_FOREACH(ns, &node->namespaces, list) {
-        if (ns->name) { // skip an eventual default namespace since has been handled earlier
-            new_item = (txml_namespace_set_t *)calloc(1, sizeof(txml_namespace_set_t));
-            new_item->ns = ns;
-            TAILQ_INSERT_TAIL(&node->known_namespaces, new_item, next);
-        }
+// same as txml_hash_string(), for the 'len' bytes starting at 'string'
+static inline unsigned int
+txml_hash_span(char *string, size_t len)
+{
+    unsigned int hash = 2166136261U;
+    while (len--) {
+        hash ^= (unsigned char)*string++;
+        hash *= 16777619U;
     }
+    return hash;
+}
 
-    // and now import namespaces already valid in the scope of our parent
-    if (node->parent) {
-        if (!TAILQ_EMPTY(&node->parent->known_namespaces)) {
-            txml_namespace_set_t *parent_item;
-            TAILQ_FOREACH(parent_item, &node->parent->known_namespaces, next) {
-                if (parent_item->ns->name) { // skip the default namespace
-                    new_item = (txml_namespace_set_t *)calloc(1, sizeof(txml_namespace_set_t));
-                    new_item->ns = parent_item->ns;
-                    TAILQ_INSERT_TAIL(&node->known_namespaces, new_item, next);
-                }
+// returns a referenced name from the table, adding it if not there yet
+static char *
+txml_name_intern(txml_names_t *names, char *name)
+{
+    unsigned int hash = txml_hash_string(name);
+    txml_name_t *entry;
+    int len;
+
+    txml_spin_lock(&names->lock);
+    if (names->size) {
+        for (entry = names->buckets[hash & (names->size - 1)]; entry; entry = entry->next) {
+            if (entry->hash == hash && strcmp(entry->name, name) == 0) {
+                __atomic_add_fetch(&entry->refcnt, 1, __ATOMIC_RELAXED);
+                txml_spin_unlock(&names->lock);
+                return entry->name;
             }
-        } else { // this shouldn't happen until known_namespaces is properly kept synchronized
-            TAILQ_FOREACH(ns, &node->parent->namespaces, list) {
-                if (ns->name) { // skip the default namespace
-                    new_item = (txml_namespace_set_t *)calloc(1, sizeof(txml_namespace_set_t));
-                    new_item->ns = ns;
-                    TAILQ_INSERT_TAIL(&node->known_namespaces, new_item, next);
-                }
+        }
+    }
+
+    if (names->count >= names->size) {
+        unsigned int size = names->size ? names->size * 2 : 64;
+        txml_name_t **buckets = calloc(size, sizeof(txml_name_t *));
+        unsigned int i;
+        if (!buckets) {
+            txml_spin_unlock(&names->lock);
+            return NULL;
+        }
+        for (i = 0; i < names->size; i++) {
+            while ((entry = names->buckets[i])) {
+                names->buckets[i] = entry->next;
+                entry->next = buckets[entry->hash & (size - 1)];
+                buckets[entry->hash & (size - 1)] = entry;
             }
         }
+        free(names->buckets);
+        names->buckets = buckets;
+        names->size = size;
     }
+
+    len = strlen(name);
+    entry = malloc(sizeof(txml_name_t) + len + 1);
+    if (!entry) {
+        txml_spin_unlock(&names->lock);
+        return NULL;
+    }
+    entry->refcnt = 2; // the table and the caller
+    entry->hash = hash;
+    memcpy(entry->name, name, len + 1);
+    entry->next = names->buckets[hash & (names->size - 1)];
+    names->buckets[hash & (names->size - 1)] = entry;
+    names->count++;
+    txml_spin_unlock(&names->lock);
+    return entry->name;
 }
 
-// update the hinerited namespace across a branch.
-// This happens if a node (with all its childnodes) is moved across
-// 2 different documents. The hinerited namespace must be updated
-// accordingly to the new context, so we traverse the branches
-// under the moved node to update the the hinerited namespace where
-// necessary.
-// NOTE: if a node defines a new default itself, it's not necessary
-//       to go deeper in that same branch
 static inline void
-txml_update_branch_namespace(txml_node_t *node, txml_namespace_t *ns)
+txml_name_release(char *name)
 {
-    txml_node_t *child;
-    txml_namespace_set_t *nsitem;
+    txml_name_t *entry = TXML_NAME_ENTRY(name);
+    if (__atomic_sub_fetch(&entry->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+        free(entry);
+}
 
-    if (node->hns != ns && !node->cns) // skip update if not necessary
-        node->hns = ns; 
+// drop the references held by the table, the names still in use are released with their last node
+static void
+txml_names_destroy(txml_names_t *names)
+{
+    txml_name_t *entry;
+    unsigned int i;
 
-    txml_update_known_namespaces(node);
+    for (i = 0; i < names->size; i++) {
+        while ((entry = names->buckets[i])) {
+            names->buckets[i] = entry->next;
+            txml_name_release(entry->name);
+        }
+    }
+    free(names->buckets);
+    memset(names, 0, sizeof(txml_names_t));
+}
 
-    if (node->ns) { // we are bound to a specific ns.... let's see if it's known
-        int missing = 1;
+static struct __txml_node_ext_s *
+txml_node_ext_alloc(txml_pool_t *pool, txml_node_t *node)
+{
+    if (!node->ext) {
+        node->ext = (struct __txml_node_ext_s *)TXML_POOL_ALLOC(pool, exts, sizeof(struct __txml_node_ext_s));
+        if (!node->ext)
+            return NULL;
+        TAILQ_INIT(&node->ext->known_namespaces);
+        TAILQ_INIT(&node->ext->namespaces);
+    }
+    return node->ext;
+}
 
-        TAILQ_FOREACH(nsitem, &node->known_namespaces, next) 
-            if (strcmp(node->ns->uri, nsitem->ns->uri) == 0) 
-                if (!(node->ns->name && !nsitem->ns->name) && strcmp(node->ns->name, nsitem->ns->name) == 0)
-                    missing = 0;
+static inline struct __txml_node_ext_s *
+txml_node_ext(txml_node_t *node)
+{
+    return txml_node_ext_alloc(NULL, node);
+}
 
-        if (missing) {
-            txml_namespace_t *new_ns;
-            txml_namespace_set_t *newitem;
-            char *newattr;
+// kinds of typed values cached in the nodes
+#define TXML_TYPED_INT64  1
+#define TXML_TYPED_DOUBLE 2
+#define TXML_TYPED_BOOL   3
 
-            new_ns = txml_node_add_namespace(node, node->ns->name, node->ns->uri);
-            node->ns = new_ns;
-            newitem = (txml_namespace_set_t *)calloc(1, sizeof(txml_namespace_set_t));
-            newitem->ns = new_ns;
-            TAILQ_INSERT_TAIL(&node->known_namespaces, newitem, next);
-            newattr = malloc(strlen(new_ns->name)+7); // prefix + xmlns + :
-            sprintf(newattr, "xmlns:%s", node->ns->name);
-            // enforce the definition for our namepsace in the new context
-            txml_node_add_attribute(node, newattr, node->ns->uri); 
-            free(newattr);
-        }
-    }
+// the 'typed' state of a node: a busy bit (a reader is caching a value),
+// the kind of the value cached and a generation counter above them
+#define TXML_TYPED_BUSY  0x01
+#define TXML_TYPED_MASK  0x07
+#define TXML_TYPED_GEN   0x08
+#define TXML_TYPED_STATE(__kind) ((__kind) << 1)
 
-    TAILQ_FOREACH(child, &node->children, siblings) // update our descendants
-        txml_update_branch_namespace(child, node->cns?node->cns:node->hns); // recursion here
+// drop the typed value cached in a node (the writers are exclusive)
+static inline void
+txml_typed_invalidate(txml_node_t *node)
+{
+    unsigned short state = __atomic_load_n(&node->typed, __ATOMIC_RELAXED);
+    if (state & TXML_TYPED_MASK)
+        __atomic_store_n(&node->typed, (state + TXML_TYPED_GEN) & ~TXML_TYPED_MASK, __ATOMIC_RELAXED);
 }
 
-txml_err_t
-txml_node_add_child(txml_node_t *parent, txml_node_t *child)
+// invalidate the frozen copies of a node and of its ancestors.
+// A node can't hold a valid frozen copy unless all its descendants do,
+// so the walk stops at the first ancestor already invalidated
+static void
+txml_node_changed(txml_node_t *node, int what)
 {
-    if(!child)
-        return TXML_BADARGS;
+    txml_node_t *p;
 
-    // now we can update the parent
-    if (child->parent)
-        txml_node_remove_child(child->parent, child);
+    // the same goes for the hashes, which cover the whole branch
+    for (p = node; p && p->hash; p = p->parent)
+        __atomic_store_n(&p->hash, 0, __ATOMIC_RELAXED);
 
-    TAILQ_INSERT_TAIL(&parent->children, child, siblings);
-    child->parent = parent;
+    if ((what & TXML_NODE_CHANGED_SELF))
+        txml_typed_invalidate(node);
 
-    // udate/propagate the default namespace (if any) to the newly attached node 
-    // (and all its descendants)
-    // Also scan for unknown namespaces defined/used in the newly attached branch
-    txml_update_branch_namespace(child, parent->cns?parent->cns:parent->hns);
-    txml_node_set_path(child, parent);
-    return TXML_NOERR;
+    if (!node->ext || !node->ext->frozen)
+        return;
+
+    if ((what & TXML_NODE_CHANGED_SELF)) {
+        txml_snapshot_node_release(node->ext->frozen);
+        node->ext->frozen = NULL;
+        node->ext->frozen_stale = 0;
+    } else if (node->ext->frozen_stale) {
+        return;
+    } else {
+        node->ext->frozen_stale = 1;
+    }
+
+    for (p = node->parent; p; p = p->parent) {
+        if (!p->ext || !p->ext->frozen || p->ext->frozen_stale)
+            break;
+        p->ext->frozen_stale = 1;
+    }
 }
 
-txml_node_t *
-txml_node_next_sibling(txml_node_t *node)
+//
+// LOCKING
+//
+
+#ifdef THREAD_SAFE
+static __thread int txml_thread_slot = -1;
+static int txml_slot_counter = 0;
+
+static inline int
+txml_rwlock_slot()
 {
-    return TAILQ_NEXT(node, siblings);
+    if (txml_thread_slot < 0)
+        txml_thread_slot = __atomic_fetch_add(&txml_slot_counter, 1, __ATOMIC_RELAXED) % TXML_RWLOCK_SLOTS;
+    return txml_thread_slot;
 }
 
-txml_node_t *
-txml_node_prev_sibling(txml_node_t *node)
+static txml_rwlock_t *
+txml_rwlock_create()
 {
-    return TAILQ_PREV(node, nodelist_head, siblings);
+    txml_rwlock_t *lock = NULL;
+    if (posix_memalign((void **)&lock, TXML_CACHELINE_SIZE, sizeof(txml_rwlock_t)) != 0)
+        return NULL;
+    memset(lock, 0, sizeof(txml_rwlock_t));
+    pthread_mutex_init(&lock->wlock, NULL);
+    return lock;
 }
 
-txml_err_t
-txml_add_root_node(txml_t *xml, txml_node_t *node)
+static void
+txml_rwlock_destroy(txml_rwlock_t *lock)
 {
-    if(!node)
-        return TXML_BADARGS;
+    pthread_mutex_destroy(&lock->wlock);
+    free(lock);
+}
 
-    if (!TAILQ_EMPTY(&xml->root_elements) && !xml->allow_multiple_root_nodes) {
-        return TXML_MROOT_ERR;
+static inline int
+txml_rwlock_is_owner(txml_rwlock_t *lock)
+{
+    return __atomic_load_n(&lock->writer, __ATOMIC_SEQ_CST) &&
+           pthread_equal(__atomic_load_n(&lock->owner, __ATOMIC_RELAXED), pthread_self());
+}
+
+// returns the slot to pass to txml_rdunlock() (-1 if no lock has been taken)
+static inline int
+txml_rdlock(txml_t *xml)
+{
+    txml_rwlock_t *lock = xml->lock;
+    int slot;
+
+    slot = txml_rwlock_slot();
+    for (;;) {
+        __atomic_add_fetch(&lock->slots[slot].readers, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&lock->writer, __ATOMIC_SEQ_CST))
+            return slot;
+        __atomic_sub_fetch(&lock->slots[slot].readers, 1, __ATOMIC_SEQ_CST);
+        if (txml_rwlock_is_owner(lock))
+            return -1; // we already own the write lock
+        while (__atomic_load_n(&lock->writer, __ATOMIC_ACQUIRE))
+            sched_yield();
     }
+}
 
-    TAILQ_INSERT_TAIL(&xml->root_elements, node, siblings);
-    node->context = xml;
-    txml_update_known_namespaces(node);
-    return TXML_NOERR;
+static inline void
+txml_rdunlock(txml_t *xml, int slot)
+{
+    if (slot >= 0)
+        __atomic_sub_fetch(&xml->lock->slots[slot].readers, 1, __ATOMIC_RELEASE);
 }
 
-txml_err_t
-txml_node_add_attribute(txml_node_t *node, char *name, char *val)
+static void
+txml_wrlock(txml_t *xml)
 {
-    txml_attribute_t *attr;
+    txml_rwlock_t *lock = xml->lock;
+    int i;
 
-    if(!name || !node)
-        return TXML_BADARGS;
+    if (txml_rwlock_is_owner(lock)) {
+        lock->depth++;
+        return;
+    }
+    pthread_mutex_lock(&lock->wlock);
+    __atomic_store_n(&lock->owner, pthread_self(), __ATOMIC_RELAXED);
+    __atomic_store_n(&lock->writer, 1, __ATOMIC_SEQ_CST);
+    for (i = 0; i < TXML_RWLOCK_SLOTS; i++) {
+        while (__atomic_load_n(&lock->slots[i].readers, __ATOMIC_SEQ_CST))
+            sched_yield();
+    }
+    lock->depth = 1;
+}
 
-    attr = (txml_attribute_t *)calloc(1, sizeof(txml_attribute_t));
-    attr->name = strdup(name);
-    attr->value = val?strdup(val):strdup("");
-    attr->node = node;
+static void
+txml_wrunlock(txml_t *xml)
+{
+    txml_rwlock_t *lock = xml->lock;
+
+    if (--lock->depth)
+        return;
+    // all the changes are done, let snapshot readers see them
+    txml_snapshot_publish(xml);
+    __atomic_store_n(&lock->writer, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&lock->wlock);
+}
 
-    TAILQ_INSERT_TAIL(&node->attributes, attr, list);
-    return TXML_NOERR;
+/*
+ * Fine grained locking (see txml_set_lock_depth()):
+ * the nodes at level 'lock_depth - 1' (root nodes being at level 0) carry
+ * their own reader/writer lock, guarding the content of the whole branch
+ * below them. Branch writers hold the context lock in read mode, so any
+ * change to the levels above the branch nodes (which needs the context
+ * lock in write mode) still excludes all of them. When more branch locks
+ * are needed they are always acquired in address order.
+ */
+struct __txml_lock_state_s {
+    txml_t *ctx;
+    int slot; // reader slot, if the context is held in read mode
+    int exclusive; // the context is held in write mode
+    pthread_rwlock_t *branch; // branch lock held (if any)
+};
+
+static inline int
+txml_fine_locking(txml_t *xml)
+{
+    // snapshots and indexes are maintained document-wide, by exclusive writers
+    return (__atomic_load_n(&xml->lock_depth, __ATOMIC_RELAXED) &&
+            !__atomic_load_n(&xml->snapshots, __ATOMIC_RELAXED) &&
+            !__atomic_load_n(&xml->nindexes, __ATOMIC_RELAXED) &&
+            !__atomic_load_n(&xml->name_index, __ATOMIC_RELAXED));
 }
 
-int
-txml_node_remove_attribute(txml_node_t *node, unsigned long index)
+// the node guarding the branch a node belongs to (NULL if the node is above the branches level)
+static txml_node_t *
+txml_node_branch(txml_node_t *node, int depth)
 {
-    txml_attribute_t *attr, *tmp;
-    int count = 0;
+    txml_node_t *p;
+    int level = 0;
 
-    TAILQ_FOREACH_SAFE(attr, &node->attributes, list, tmp) {
-        if (count++ == index) {
-            TAILQ_REMOVE(&node->attributes, attr, list);
-            free(attr->name);
-            free(attr->value);
-            free(attr);
-            return TXML_NOERR;
-        }
-    }
-    return TXML_GENERIC_ERR;
+    for (p = node; p->parent; p = p->parent)
+        level++;
+    if (level < depth - 1)
+        return NULL;
+    for (p = node; level > depth - 1; level--)
+        p = p->parent;
+    return p;
 }
 
-void
-txml_node_clear_attributes(txml_node_t *node)
+// branch locks (and the extensions holding them) are created on demand
+// by threads which might be holding the context lock in read mode only
+static pthread_rwlock_t *
+txml_node_branch_lock(txml_node_t *node)
 {
-    txml_attribute_t *attr, *tmp;
+    struct __txml_node_ext_s *ext = __atomic_load_n(&node->ext, __ATOMIC_ACQUIRE);
+    pthread_rwlock_t *lock;
+
+    if (!ext) {
+        struct __txml_node_ext_s *new_ext = calloc(1, sizeof(struct __txml_node_ext_s));
+        TAILQ_INIT(&new_ext->known_namespaces);
+        TAILQ_INIT(&new_ext->namespaces);
+        if (__atomic_compare_exchange_n(&node->ext, &ext, new_ext, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            ext = new_ext;
+        else
+            free(new_ext);
+    }
 
-    TAILQ_FOREACH_SAFE(attr, &node->attributes, list, tmp) {
-        TAILQ_REMOVE(&node->attributes, attr, list);
-        free(attr->name);
-        free(attr->value);
-        free(attr);
+    lock = __atomic_load_n(&ext->lock, __ATOMIC_ACQUIRE);
+    if (!lock) {
+        pthread_rwlock_t *new_lock = malloc(sizeof(pthread_rwlock_t));
+        pthread_rwlock_init(new_lock, NULL);
+        if (__atomic_compare_exchange_n(&ext->lock, &lock, new_lock, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            lock = new_lock;
+        } else {
+            pthread_rwlock_destroy(new_lock);
+            free(new_lock);
+        }
     }
+    return lock;
 }
 
-txml_attribute_t
-*txml_node_get_attribute_byname(txml_node_t *node, char *name)
+// path lookups hold the context lock in read mode and,
+// once they reach the branches level, the lock of the branch they walk into
+static void
+txml_path_rdlock(txml_t *xml, txml_lock_state_t *state)
 {
-    txml_attribute_t *attr;
-    TAILQ_FOREACH(attr, &node->attributes, list) {
-        if (strcmp(attr->name, name) == 0)
-            return attr;
-    }
-    return NULL;
+    memset(state, 0, sizeof(txml_lock_state_t));
+    state->ctx = xml;
+    state->slot = txml_rdlock(xml);
 }
 
-txml_attribute_t
-*txml_node_get_attribute(txml_node_t *node, unsigned long index)
+static void
+txml_lock_branch_read(txml_lock_state_t *state, txml_node_t *branch)
 {
-    txml_attribute_t *attr;
-    int count = 0;
-    TAILQ_FOREACH(attr, &node->attributes, list) {
-        if (count++ == index)
-            return attr;
-    }
-    return NULL;
+    if (state->slot < 0 || !txml_fine_locking(state->ctx))
+        return;
+    state->branch = txml_node_branch_lock(branch);
+    pthread_rwlock_rdlock(state->branch);
 }
 
-char *
-txml_attribute_get_name(txml_attribute_t *attr)
+static inline void
+txml_unlock(txml_lock_state_t *state)
 {
-    if (!attr)
-        return NULL;
-    return attr->name;
+    if (state->branch)
+        pthread_rwlock_unlock(state->branch);
+    if (!state->ctx)
+        return;
+    if (state->exclusive)
+        txml_wrunlock(state->ctx);
+    else
+        txml_rdunlock(state->ctx, state->slot);
 }
 
-char *
-txml_attribute_get_value(txml_attribute_t *attr)
+// read lock for document-wide traversals, which must exclude the branch writers as well
+static void
+txml_doc_rdlock(txml_t *xml, txml_lock_state_t *state)
 {
-    if (!attr)
-        return NULL;
-    return attr->value;
+    memset(state, 0, sizeof(txml_lock_state_t));
+    state->ctx = xml;
+    state->slot = txml_rdlock(xml);
+    if (state->slot < 0 || !txml_fine_locking(xml))
+        return;
+    txml_rdunlock(xml, state->slot);
+    txml_wrlock(xml);
+    state->exclusive = 1;
 }
 
-static txml_err_t
-txml_extra_node_handler(txml_t *xml, char *content, char type)
+// document-wide read locks on two contexts, taken in address order
+static void
+txml_doc_rdlock2(txml_t *xml1, txml_t *xml2, txml_lock_state_t *state1, txml_lock_state_t *state2)
 {
-    txml_node_t *new_node = NULL;
-    txml_err_t res = TXML_NOERR;
-    char fake_name[256];
-
-    sprintf(fake_name, "_fakenode_%d_", type);
-    new_node = txml_node_create(fake_name, content, xml->cnode);
-    new_node->type = type;
-    if(!new_node || !new_node->name) {
-        /* XXX - ERROR MESSAGES HERE */
-        res = TXML_GENERIC_ERR;
-        return res;
-    }
-    if(xml->cnode) {
-        res = txml_node_add_child(xml->cnode, new_node);
-        if(res != TXML_NOERR) {
-            txml_node_destroy(new_node);
-            return res;
-        }
+    if (xml1 == xml2) {
+        memset(state2, 0, sizeof(txml_lock_state_t));
+        txml_doc_rdlock(xml1, state1);
+    } else if (xml1 < xml2) {
+        txml_doc_rdlock(xml1, state1);
+        txml_doc_rdlock(xml2, state2);
     } else {
-        res = txml_add_root_node(xml, new_node) ;
-        if(res != TXML_NOERR) {
-            txml_node_destroy(new_node);
-            return res;
-        }
+        txml_doc_rdlock(xml2, state2);
+        txml_doc_rdlock(xml1, state1);
     }
-    return res;
 }
 
-static txml_err_t
-txml_start_handler(txml_t *xml, char *element, char **attr_names, char **attr_values)
+// lock the context a node belongs to (if any, detached nodes are owned by the caller).
+// The context is looked up again once the lock has been obtained,
+// in case the node has been moved to a different document meanwhile
+static void
+txml_node_rdlock(txml_node_t *node, txml_lock_state_t *state)
 {
-    txml_node_t *new_node = NULL;
-    unsigned int offset = 0;
-    txml_err_t res = TXML_NOERR;
-    char *nodename = NULL;
-    char *nssep = NULL;
-
-    if(!element || strlen(element) == 0)
-        return TXML_BADARGS;
-
-    // unescape read element to be used as nodename
-    nodename = dexmlize(element);
-    if (!nodename)
-        return TXML_BAD_CHARS;
-
-    if ((nssep = strchr(nodename, ':'))) { // a namespace is defined
-        txml_namespace_t *ns = NULL;
-        *nssep = 0; // nodename now starts with the null-terminated namespace 
-                    // followed by the real name (nssep + 1)
-        new_node = txml_node_create(nssep+1, NULL, xml->cnode);
-        if (xml->cnode)
-            ns = txml_node_get_namespace_byname(xml->cnode, nodename);
-        if (!ns) { 
-            // TODO - Error condition
+    memset(state, 0, sizeof(txml_lock_state_t));
+    for (;;) {
+        txml_t *xml = node ? txml_context_get(node) : NULL;
+        txml_node_t *branch;
+        int slot;
+        if (!xml)
+            return;
+        slot = txml_rdlock(xml);
+        if (txml_context_get(node) != xml) {
+            txml_rdunlock(xml, slot);
+            continue;
         }
-        new_node->ns = ns;
-    } else {
-        new_node = txml_node_create(nodename, NULL, xml->cnode);
-    }
-    free(nodename);
-    if(!new_node || !new_node->name) {
-        /* XXX - ERROR MESSAGES HERE */
-        return TXML_MEMORY_ERR;
-    }
-    /* handle attributes if present */
-    if(attr_names && attr_values) {
-        while(attr_names[offset] != NULL) {
-            char *nsp = NULL;
-            res = txml_node_add_attribute(new_node, attr_names[offset], attr_values[offset]);
-            if(res != TXML_NOERR) {
-                txml_node_destroy(new_node);
-                return res;
-            }
-            if ((nsp = txml_strcasestr(attr_names[offset], "xmlns"))) {
-                if ((nssep = strchr(nsp, ':'))) {  // declaration of a new namespace
-                    *nssep = 0;
-                    txml_node_add_namespace(new_node, nssep+1, attr_values[offset]);
-                } else { // definition of the default ns
-                    new_node->cns = txml_node_add_namespace(new_node, NULL, attr_values[offset]);
-                }
+        if (slot >= 0 && txml_fine_locking(xml) &&
+            (branch = txml_node_branch(node, xml->lock_depth)))
+        {
+            pthread_rwlock_t *lock = txml_node_branch_lock(branch);
+            pthread_rwlock_rdlock(lock);
+            if (txml_node_branch(node, xml->lock_depth) != branch) {
+                // moved to a different branch meanwhile
+                pthread_rwlock_unlock(lock);
+                txml_rdunlock(xml, slot);
+                continue;
             }
-            offset++;
+            state->branch = lock;
         }
+        state->ctx = xml;
+        state->slot = slot;
+        return;
     }
-    if(xml->cnode) {
-        res = txml_node_add_child(xml->cnode, new_node);
-        if(res != TXML_NOERR) {
-            txml_node_destroy(new_node);
-            return res;
+}
+
+// try locking only the branch a node belongs to, returns 0 if the whole context must be locked.
+// If the node is going to be unlinked it can't be a branch node itself
+static int
+txml_node_wrlock_branch(txml_node_t *node, txml_t *xml, int unlink, txml_lock_state_t *state)
+{
+    txml_node_t *branch;
+    pthread_rwlock_t *lock;
+    int slot;
+
+    for (;;) {
+        slot = txml_rdlock(xml);
+        if (slot < 0) // we already own the context exclusively
+            return 0;
+        if (!txml_fine_locking(xml) || txml_context_get(node) != xml ||
+            !(branch = txml_node_branch(node, xml->lock_depth)) || (unlink && branch == node))
+        {
+            txml_rdunlock(xml, slot);
+            return 0;
         }
-    } else {
-        res = txml_add_root_node(xml, new_node) ;
-        if(res != TXML_NOERR) {
-            txml_node_destroy(new_node);
-            return res;
+        lock = txml_node_branch_lock(branch);
+        pthread_rwlock_wrlock(lock);
+        if (txml_node_branch(node, xml->lock_depth) == branch) {
+            state->ctx = xml;
+            state->slot = slot;
+            state->branch = lock;
+            return 1;
         }
+        pthread_rwlock_unlock(lock);
+        txml_rdunlock(xml, slot);
     }
-    xml->cnode = new_node;
-
-    return res;
 }
 
-static txml_err_t
-txml_end_handler(txml_t *xml, char *element)
+static void
+txml_node_wrlock(txml_node_t *node, int unlink, txml_lock_state_t *state)
 {
-    txml_node_t *parent;
-    if(xml->cnode) {
-        parent = xml->cnode->parent;
-        xml->cnode = parent;
-        return TXML_NOERR;
+    memset(state, 0, sizeof(txml_lock_state_t));
+    for (;;) {
+        txml_t *xml = node ? txml_context_get(node) : NULL;
+        if (!xml)
+            return;
+        if (txml_fine_locking(xml) && txml_node_wrlock_branch(node, xml, unlink, state))
+            return;
+        txml_wrlock(xml);
+        if (txml_context_get(node) == xml) {
+            state->ctx = xml;
+            state->exclusive = 1;
+            return;
+        }
+        txml_wrunlock(xml);
     }
-    return TXML_GENERIC_ERR;
 }
 
-static txml_err_t
-txml_value_handler(txml_t *xml, char *text)
+// lock the branches of a parent and of a (deep enough) child being moved
+// under it within the same document, returns 0 if not possible
+static int
+txml_node_wrlock2_branch(txml_node_t *parent, txml_node_t *child, txml_t *xml,
+                         txml_lock_state_t *state1, txml_lock_state_t *state2)
 {
-    char *p;
-    if(text) {
-        // remove heading blanks
-        if (xml->ignore_white_spaces) { // first check if we want to ignore any kind of whitespace between nodes
-                                      // (which means : 'no whitespace-only values' and 'any value will be trimmed')
-            while((*text == ' ' || *text == '\t' || *text == '\r' || *text == '\n') &&
-                   *text != 0)
-            {
-                text++;
-            }
-        } else if (xml->ignore_blanks) { // or if perhaps we want to consider pure whitespaces: ' '
-                                        // as part of the value. (but we still want to skip newlines and
-                                        // tabs, which are assumed to be there to prettify the text layout
-            while((*text == '\t' || *text == '\r' || *text == '\n') && 
-                   *text != 0)
-            {
-                text++;
-            }
+    txml_node_t *pbranch, *cbranch = NULL;
+    pthread_rwlock_t *plock, *clock = NULL;
+    int slot;
+
+    for (;;) {
+        txml_t *cxml;
+        slot = txml_rdlock(xml);
+        if (slot < 0)
+            return 0;
+        cxml = txml_context_get(child);
+        if (!txml_fine_locking(xml) || txml_context_get(parent) != xml ||
+            (cxml && cxml != xml) || !(pbranch = txml_node_branch(parent, xml->lock_depth)) ||
+            (cxml && ((cbranch = txml_node_branch(child, xml->lock_depth)) == NULL || cbranch == child)))
+        {
+            // the child is a branch node itself (or lives above the branches),
+            // moving it changes the upper levels of the document
+            txml_rdunlock(xml, slot);
+            return 0;
         }
-
-        p = text+strlen(text)-1;
-
-        // remove trailing blanks
-        if (xml->ignore_white_spaces) { // XXX - read above
-            while((*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') &&
-                    p != text)
-            {
-                *p = 0;
-                p--;
-            }
-        } else if (xml->ignore_blanks) { // XXX = read above
-            while((*p == '\t' || *p == '\r' || *p == '\n') &&
-                    p != text)
-            {
-                *p = 0;
-                p--;
-            }
+        plock = txml_node_branch_lock(pbranch);
+        clock = cxml ? txml_node_branch_lock(cbranch) : NULL;
+        if (clock == plock)
+            clock = NULL;
+        if (clock && clock < plock) {
+            pthread_rwlock_wrlock(clock);
+            pthread_rwlock_wrlock(plock);
+        } else {
+            pthread_rwlock_wrlock(plock);
+            if (clock)
+                pthread_rwlock_wrlock(clock);
+        }
+        if (txml_node_branch(parent, xml->lock_depth) == pbranch &&
+            (!cxml || (txml_context_get(child) == xml && txml_node_branch(child, xml->lock_depth) == cbranch)))
+        {
+            state1->ctx = xml;
+            state1->slot = slot;
+            state1->branch = plock;
+            state2->branch = clock;
+            return 1;
         }
+        if (clock)
+            pthread_rwlock_unlock(clock);
+        pthread_rwlock_unlock(plock);
+        txml_rdunlock(xml, slot);
+    }
+}
 
-        if(xml->cnode)  {
-            char *rtext = dexmlize(text);
-            if (!rtext)
-                return TXML_BAD_CHARS;
-            txml_node_set_value(xml->cnode, rtext);
-            free(rtext);
-        } else {
-            fprintf(stderr, "ctag == NULL while handling a value!!");
+// lock the contexts of two nodes, always in the same (address) order
+static void
+txml_node_wrlock2(txml_node_t *node1, txml_node_t *node2, txml_lock_state_t *state1, txml_lock_state_t *state2)
+{
+    memset(state1, 0, sizeof(txml_lock_state_t));
+    memset(state2, 0, sizeof(txml_lock_state_t));
+    for (;;) {
+        txml_t *xml1 = txml_context_get(node1);
+        txml_t *xml2 = txml_context_get(node2);
+        if (xml1 && (xml2 == xml1 || !xml2) && txml_fine_locking(xml1) &&
+            txml_node_wrlock2_branch(node1, node2, xml1, state1, state2))
+        {
+            return;
         }
-        return TXML_NOERR;
+        if (xml1 == xml2) {
+            xml2 = NULL;
+        } else if (xml1 > xml2) {
+            txml_t *tmp = xml1;
+            xml1 = xml2;
+            xml2 = tmp;
+        }
+        // xml1 is now the lowest address (possibly NULL)
+        if (xml1)
+            txml_wrlock(xml1);
+        if (xml2)
+            txml_wrlock(xml2);
+        if ((txml_context_get(node1) == xml1 && txml_context_get(node2) == (xml2 ? xml2 : xml1)) ||
+            (txml_context_get(node1) == xml2 && txml_context_get(node2) == xml1))
+        {
+            state1->ctx = xml1;
+            state1->exclusive = 1;
+            state2->ctx = xml2;
+            state2->exclusive = 1;
+            return;
+        }
+        if (xml2)
+            txml_wrunlock(xml2);
+        if (xml1)
+            txml_wrunlock(xml1);
     }
-    return TXML_GENERIC_ERR;
 }
 
+#define TXML_RDLOCK(__xml) int __txml_slot = txml_rdlock(__xml)
+#define TXML_RDUNLOCK(__xml) txml_rdunlock(__xml, __txml_slot)
+#define TXML_WRLOCK(__xml) txml_wrlock(__xml)
+#define TXML_WRUNLOCK(__xml) txml_wrunlock(__xml)
+#define TXML_DOC_RDLOCK(__xml) txml_lock_state_t __txml_state; txml_doc_rdlock(__xml, &__txml_state)
+#define TXML_DOC_RDUNLOCK(__xml) txml_unlock(&__txml_state)
+#define TXML_PATH_RDLOCK(__xml) txml_lock_state_t __txml_state; txml_path_rdlock(__xml, &__txml_state)
+#define TXML_PATH_RDUNLOCK(__xml) txml_unlock(&__txml_state)
+#define TXML_PATH_LOCK_STATE (&__txml_state)
+#define TXML_NODE_RDLOCK(__node) txml_lock_state_t __txml_state; txml_node_rdlock(__node, &__txml_state)
+#define TXML_NODE_RDUNLOCK(__node) txml_unlock(&__txml_state)
+#define TXML_NODE_WRLOCK(__node) txml_lock_state_t __txml_state; txml_node_wrlock(__node, 0, &__txml_state)
+#define TXML_NODE_WRUNLOCK(__node) txml_unlock(&__txml_state)
+#define TXML_NODE_UNLINK_WRLOCK(__node) txml_lock_state_t __txml_state; txml_node_wrlock(__node, 1, &__txml_state)
+#define TXML_NODE_WRLOCK2(__node1, __node2) txml_lock_state_t __txml_state1, __txml_state2; \
+    txml_node_wrlock2(__node1, __node2, &__txml_state1, &__txml_state2)
+#define TXML_NODE_WRUNLOCK2(__node1, __node2) txml_unlock(&__txml_state2); txml_unlock(&__txml_state1)
+#define TXML_LAZY_LOCK(__xml) pthread_mutex_lock(&(__xml)->lazy_lock)
+#define TXML_LAZY_UNLOCK(__xml) pthread_mutex_unlock(&(__xml)->lazy_lock)
+#define TXML_DOC_RDLOCK2(__xml1, __xml2) txml_lock_state_t __txml_state1, __txml_state2; \
+    txml_doc_rdlock2(__xml1, __xml2, &__txml_state1, &__txml_state2)
+#define TXML_DOC_RDUNLOCK2(__xml1, __xml2) txml_unlock(&__txml_state2); txml_unlock(&__txml_state1)
+#else
+#define TXML_RDLOCK(__xml)
+#define TXML_RDUNLOCK(__xml)
+#define TXML_WRLOCK(__xml)
+#define TXML_WRUNLOCK(__xml) txml_snapshot_publish(__xml)
+#define TXML_DOC_RDLOCK(__xml)
+#define TXML_DOC_RDUNLOCK(__xml)
+#define TXML_PATH_RDLOCK(__xml)
+#define TXML_PATH_RDUNLOCK(__xml)
+#define TXML_PATH_LOCK_STATE NULL
+#define txml_lock_branch_read(__state, __branch)
+#define TXML_NODE_RDLOCK(__node)
+#define TXML_NODE_RDUNLOCK(__node)
+// no locking, but the contexts are still needed to publish snapshots
+#define TXML_NODE_WRLOCK(__node) txml_t *__txml_ctx = txml_context_get(__node)
+#define TXML_NODE_UNLINK_WRLOCK(__node) TXML_NODE_WRLOCK(__node)
+#define TXML_NODE_WRUNLOCK(__node) do { \
+    if (__txml_ctx) \
+        txml_snapshot_publish(__txml_ctx); \
+} while (0)
+#define TXML_NODE_WRLOCK2(__node1, __node2) txml_t *__txml_ctx1 = txml_context_get(__node1); \
+    txml_t *__txml_ctx2 = txml_context_get(__node2)
+#define TXML_NODE_WRUNLOCK2(__node1, __node2) do { \
+    if (__txml_ctx2 && __txml_ctx2 != __txml_ctx1) \
+        txml_snapshot_publish(__txml_ctx2); \
+    if (__txml_ctx1) \
+        txml_snapshot_publish(__txml_ctx1); \
+} while (0)
+#define TXML_LAZY_LOCK(__xml)
+#define TXML_LAZY_UNLOCK(__xml)
+#define txml_fine_locking(__xml) 0
+#define TXML_DOC_RDLOCK2(__xml1, __xml2)
+#define TXML_DOC_RDUNLOCK2(__xml1, __xml2)
+#endif
 
-txml_err_t
-txml_parse_buffer(txml_t *xml, char *buf)
+//
+// TXML IMPLEMENTATION
+//
+
+txml_t *
+txml_context_create()
 {
-    txml_err_t err = TXML_NOERR;
-    int state = XML_ELEMENT_NONE;
-    char *p = buf;
-    unsigned int i;
-    char *start = NULL;
-    char *end = NULL;
-    char **attrs = NULL;
-    char **values = NULL;
-    unsigned int nattrs = 0;
-    char *mark = NULL;
-    int quote = 0;
+    txml_t *xml;
+
+    xml = (txml_t *)calloc(1, sizeof(txml_t));
+    xml->cnode = NULL;
+    xml->ignore_white_spaces = 1; // defaults to old behaviour (all blanks are not taken into account)
+    xml->ignore_blanks = 1; // defaults to old behaviour (all blanks are not taken into account)
+    xml->save_sync = TXML_SYNC_DATA;
+    TAILQ_INIT(&xml->root_elements);
+    TAILQ_INIT(&xml->indexes);
+    xml->order_stale = 1;
+    xml->depth_stale = 1;
+    xml->head = NULL;
+    // default is UTF-8
+    sprintf(xml->output_encoding, "utf-8");
+    sprintf(xml->document_encoding, "utf-8");
+#ifdef THREAD_SAFE
+    xml->lock = txml_rwlock_create();
+    if (!xml->lock) {
+        free(xml);
+        return NULL;
+    }
+    pthread_mutex_init(&xml->lazy_lock, NULL);
+#endif
+    return xml;
+}
+
+// with retention enabled the released nodes (and everything they own)
+// are kept in the context freelists, up to the configured high-water mark
+static void
+txml_context_reset_unlocked(txml_t *xml)
+{
+    txml_node_t *rnode, *tmp;
+    txml_index_t *index;
+    TAILQ_FOREACH_SAFE(rnode, &xml->root_elements, siblings, tmp) {
+        TAILQ_REMOVE(&xml->root_elements, rnode, siblings);
+        txml_node_release_branch(&xml->pool, rnode);
+    }
+    xml->snapshot_stale = 1;
+    TAILQ_FOREACH(index, &xml->indexes, next) // the definitions apply to the next document
+        txml_index_clear(index);
+    xml->indexes_stale = 0;
+    if (xml->name_index)
+        txml_name_index_clear(xml);
+    xml->order_stale = 1; // numbered again when needed
+    xml->depth_stale = 1;
+    if(xml->head)
+        txml_strfree(&xml->pool, xml->head);
+    xml->head = NULL;
+    // no pending node is left around
+    free(xml->source);
+    xml->source = NULL;
+    xml->origin = NULL;
+    free(xml->lines);
+    xml->lines = NULL;
+    xml->nlines = xml->length = 0;
+    txml_map_destroy(xml->map);
+    xml->map = NULL;
+    free(xml->ranges);
+    xml->ranges = NULL;
+    xml->nranges = xml->ranges_size = 0;
+    xml->pending = 0;
+    txml_reload_destroy(xml->reload);
+    xml->reload = NULL;
+}
 
-    txml_context_reset(xml); // reset the context if we are parsing a new document
+void
+txml_context_reset(txml_t *xml)
+{
+    TXML_WRLOCK(xml);
+    txml_context_reset_unlocked(xml);
+    TXML_WRUNLOCK(xml);
+}
 
-    //unsigned int offset = filestat.st_size;
+txml_t *
+txml_context_get(txml_node_t *node)
+{
+    txml_node_t *p = node;
+    if (!node)
+        return NULL;
+    do {
+        if (!p->parent)
+            return TXML_NODE_CONTEXT(p);
+        p = p->parent;
+    } while (p);
+    return NULL; // should never arrive here
+}
 
-#define XML_FREE_ATTRIBUTES \
-    if(nattrs>0) {\
-        for(i = 0; i < nattrs; i++) {\
-            if(attrs[i]) \
-                free(attrs[i]);\
-            if(values[i]) \
-                free(values[i]);\
-        }\
-        free(attrs);\
-        attrs = NULL;\
-        free(values);\
-        values = NULL;\
-        nattrs = 0;\
-    }\
+static void
+txml_document_set_encoding_unlocked(txml_t *xml, char *encoding)
+{
+    strncpy(xml->document_encoding, encoding, sizeof(xml->document_encoding)-1);
+}
 
-// skip tabs and new-lines
-#define SKIP_BLANKS(__p) \
-    while((*__p == '\t' || *__p == '\r' || *__p == '\n') && *__p != 0) __p++;
+void
+txml_document_set_encoding(txml_t *xml, char *encoding)
+{
+    TXML_WRLOCK(xml);
+    txml_document_set_encoding_unlocked(xml, encoding);
+    TXML_WRUNLOCK(xml);
+}
 
-// skip any kind of whitespace
-#define SKIP_WHITESPACES(__p) \
-    SKIP_BLANKS(__p); \
-    while(*__p == ' ') {\
-        __p++;\
-        SKIP_BLANKS(__p);\
-        if(*__p == 0) break;\
+static void
+txml_set_output_encoding_unlocked(txml_t *xml, char *encoding)
+{
+    strncpy(xml->output_encoding, encoding, sizeof(xml->output_encoding)-1);
+}
+
+void
+txml_set_output_encoding(txml_t *xml, char *encoding)
+{
+    TXML_WRLOCK(xml);
+    txml_set_output_encoding_unlocked(xml, encoding);
+    TXML_WRUNLOCK(xml);
+}
+
+void
+txml_set_allow_multiple_root_nodes(txml_t *xml, int allow)
+{
+    TXML_WRLOCK(xml);
+    xml->allow_multiple_root_nodes = allow ? 1 : 0;
+    TXML_WRUNLOCK(xml);
+}
+
+void
+txml_set_save_sync(txml_t *xml, int policy)
+{
+    TXML_WRLOCK(xml);
+    xml->save_sync = policy;
+    TXML_WRUNLOCK(xml);
+}
+
+void
+txml_set_lock_depth(txml_t *xml, int depth)
+{
+    TXML_WRLOCK(xml);
+    __atomic_store_n(&xml->lock_depth, depth > 0 ? depth : 0, __ATOMIC_RELAXED);
+    TXML_WRUNLOCK(xml);
+}
+
+static void
+txml_scratch_release(txml_scratch_t *scratch)
+{
+    free(scratch->text.data);
+    free(scratch->offsets);
+    free(scratch->sources);
+    free(scratch->strings);
+    free(scratch->levels);
+    free(scratch->alive);
+    memset(scratch, 0, sizeof(txml_scratch_t));
+}
+
+void
+txml_set_retention(txml_t *xml, unsigned long max_items)
+{
+    TXML_WRLOCK(xml);
+    xml->pool.max = max_items;
+    txml_pool_trim(&xml->pool);
+    if (!max_items)
+        txml_scratch_release(&xml->scratch);
+    TXML_WRUNLOCK(xml);
+}
+
+static void
+txml_filter_destroy(txml_filter_t *filter)
+{
+    unsigned int i;
+    if (!filter)
+        return;
+    for (i = 0; i < filter->count; i++) {
+        free(filter->patterns[i].buffer);
+        free(filter->patterns[i].steps);
     }
+    free(filter->patterns);
+    free(filter);
+}
 
-#define ADVANCE_ELEMENT(__p) \
-    while(*__p != '>' && *__p != ' ' && *__p != '\t' && *__p != '\r' && *__p != '\n' && *__p != 0) __p++;
+// split a pattern like /a/b/@c in its steps
+static txml_err_t
+txml_filter_pattern_compile(txml_filter_pattern_t *pattern, char *string, int exclude)
+{
+    char *p;
+    unsigned int nsteps = 0;
 
-#define ADVANCE_TO_ATTR_VALUE(__p) \
-    while(*__p != '=' && *__p != ' ' && *__p != '\t' && *__p != '\r' && *__p != '\n' && *__p != 0) __p++;\
-    SKIP_WHITESPACES(__p);
+    if (!string || *string != '/')
+        return TXML_BADARGS;
+    for (p = string; *p; p++) {
+        if (*p == '/')
+            nsteps++;
+    }
+    pattern->exclude = exclude;
+    pattern->buffer = strdup(string + 1);
+    pattern->steps = (char **)calloc(nsteps, sizeof(char *));
+    if (!pattern->buffer || !pattern->steps)
+        return TXML_MEMORY_ERR;
 
-    while(*p != 0) {
-        if (xml->ignore_white_spaces) {
-            SKIP_WHITESPACES(p);
-        } else if (xml->ignore_blanks) {
-            SKIP_BLANKS(p);
+    p = pattern->buffer;
+    while (p) {
+        char *step = p;
+        if ((p = strchr(p, '/')))
+            *p++ = 0;
+        if (!*step || pattern->attr) // empty step or something after the attribute
+            return TXML_BADARGS;
+        if (*step == '@')
+            pattern->attr = step + 1;
+        else
+            pattern->steps[pattern->nsteps++] = step;
+    }
+    if (!pattern->nsteps || (pattern->attr && !*pattern->attr))
+        return TXML_BADARGS;
+    return TXML_NOERR;
+}
+
+txml_err_t
+txml_set_parse_filter(txml_t *xml, char **include, char **exclude)
+{
+    txml_filter_t *filter = NULL;
+    unsigned int ninclude = 0, nexclude = 0, i;
+    txml_err_t res = TXML_NOERR;
+
+    while (include && include[ninclude])
+        ninclude++;
+    while (exclude && exclude[nexclude])
+        nexclude++;
+
+    if (ninclude + nexclude) {
+        filter = (txml_filter_t *)calloc(1, sizeof(txml_filter_t));
+        if (!filter)
+            return TXML_MEMORY_ERR;
+        filter->patterns = (txml_filter_pattern_t *)calloc(ninclude + nexclude, sizeof(txml_filter_pattern_t));
+        if (!filter->patterns) {
+            free(filter);
+            return TXML_MEMORY_ERR;
         }
-        if(*p == '<') { // an xml entity starts here
-            p++;
-            if(*p == '/') { // check if this is a closing node
-                p++;
-                SKIP_WHITESPACES(p);
-                mark = p;
-                while(*p != '>' && *p != 0)
-                    p++;
-                if(*p == '>') {
-                    end = (char *)malloc(p-mark+1);
-                    if(!end) {
-                        err = TXML_MEMORY_ERR;
-                        return err;
-                    }
-                    strncpy(end, mark, p-mark);
-                    end[p-mark] = 0;
-                    p++;
-                    state = XML_ELEMENT_END;
-                    err = txml_end_handler(xml, end);
-                    free(end);
-                    if(err != TXML_NOERR)
-                        return err;
-                }
-            } else if(strncmp(p, "!ENTITY", 8) == 0) { // XXX - IGNORING !ENTITY NODES
-                p += 8;
-                mark = p;
-                p = strstr(mark, ">");
-                if(!p) {
-                    fprintf(stderr, "Can't find where the !ENTITY element ends\n");
-                    err = TXML_PARSER_GENERIC_ERR;
-                    return err;
-                }
-                p++;
-            } else if(strncmp(p, "!NOTATION", 9) == 0) { // XXX - IGNORING !NOTATION NODES
-                p += 9;
-                mark = p;
-                p = strstr(mark, ">");
-                if(!p) {
-                    fprintf(stderr, "Can't find where the !NOTATION element ends\n");
-                    err = TXML_PARSER_GENERIC_ERR;
-                    return err;
-                }
-                p++;
-            } else if(strncmp(p, "!ATTLIST", 8) == 0) { // XXX - IGNORING !ATTLIST NODES
-                p += 8;
-                mark = p;
-                p = strstr(mark, ">");
-                if(!p) {
-                    fprintf(stderr, "Can't find where the !NOTATION element ends\n");
-                    err = TXML_PARSER_GENERIC_ERR;
-                    return err;
-                }
-                p++;
-            } else if(strncmp(p, "!--", 3) == 0) { /* comment */
-                char *comment = NULL;
-                p += 3; /* skip !-- */
-                mark = p;
-                p = strstr(mark, "-->");
-                if(!p) {
-                    /* XXX - TODO - This error condition must be handled asap */
-                }
-                comment = (char *)calloc(1, p-mark+1);
-                if(!comment) {
-                    err = TXML_MEMORY_ERR;
-                    return err;
-                }
-                strncpy(comment, mark, p-mark);
-                err = txml_extra_node_handler(xml, comment, TXML_NODETYPE_COMMENT);
-                free(comment);
-                p+=3;
-            } else if(strncmp(p, "![", 2) == 0) {
-                mark = p;
-                p += 2; /* skip ![ */
-                SKIP_WHITESPACES(p);
-                //mark = p;
-                if(strncmp(p, "CDATA", 5) == 0) {
-                    char *cdata = NULL;
-                    p+=5;
-                    SKIP_WHITESPACES(p);
-                    if(*p != '[') {
-                        fprintf(stderr, "Unsupported entity type at \"... -->%15s\"", mark);
-                        err = TXML_PARSER_GENERIC_ERR;
-                        return err;
-                    }
-                    mark = ++p;
+        filter->includes = ninclude;
+        for (i = 0; i < ninclude + nexclude && res == TXML_NOERR; i++) {
+            filter->count++;
+            if (i < ninclude)
+                res = txml_filter_pattern_compile(&filter->patterns[i], include[i], 0);
+            else
+                res = txml_filter_pattern_compile(&filter->patterns[i], exclude[i - ninclude], 1);
+        }
+        if (res != TXML_NOERR) {
+            txml_filter_destroy(filter);
+            return res;
+        }
+    }
+
+    TXML_WRLOCK(xml);
+    txml_filter_destroy(xml->filter);
+    xml->filter = filter;
+    TXML_WRUNLOCK(xml);
+    return TXML_NOERR;
+}
+
+void
+txml_set_lazy_parsing(txml_t *xml, int enable)
+{
+    TXML_WRLOCK(xml);
+    xml->lazy = enable;
+    TXML_WRUNLOCK(xml);
+}
+
+void
+txml_set_track_positions(txml_t *xml, int flags)
+{
+    TXML_WRLOCK(xml);
+    // lines are turned into offsets, they make no sense without them
+    xml->track = (flags & TXML_TRACK_OFFSETS) ? flags & (TXML_TRACK_OFFSETS | TXML_TRACK_LINES) : 0;
+    TXML_WRUNLOCK(xml);
+}
+
+void
+txml_context_destroy(txml_t *xml)
+{
+    txml_journal_close(xml); // waits for a running compaction
+    TXML_WRLOCK(xml);
+    xml->snapshots = 0; // nobody can ask for a new one anymore
+    xml->pool.max = 0;
+    txml_context_reset_unlocked(xml);
+    txml_indexes_destroy(xml);
+    txml_pool_trim(&xml->pool);
+    txml_scratch_release(&xml->scratch);
+    txml_filter_destroy(xml->filter);
+    TXML_WRUNLOCK(xml);
+#ifdef THREAD_SAFE
+    txml_rwlock_destroy(xml->lock);
+    pthread_mutex_destroy(&xml->lazy_lock);
+#endif
+    // snapshots still referenced by readers survive the context
+    if (xml->snapshot)
+        txml_snapshot_release(xml->snapshot);
+    txml_names_destroy(&xml->names);
+    free(xml);
+}
+
+static txml_node_t *
+txml_node_alloc(txml_pool_t *pool, char type)
+{
+    txml_node_t *node = (txml_node_t *)TXML_POOL_ALLOC(pool, nodes, sizeof(txml_node_t));
+    if (!node)
+        return NULL;
+
+    TAILQ_INIT(&node->attributes);
+    TAILQ_INIT(&node->children);
+    node->type = type;
+    node->value = txml_empty_string;
+    return node;
+}
+
+static txml_node_t *
+txml_node_create_simple(txml_pool_t *pool, char *name, char *value)
+{
+    txml_node_t *node = txml_node_alloc(pool, TXML_NODETYPE_SIMPLE);
+    if (!node)
+        return NULL;
+
+    node->name = txml_strdup(pool, name);
+    node->value = txml_strdup_value(pool, value);
+    return node;
+}
+
+// same as txml_node_create_simple(), with room for the positions of the node
+// and of its first 'nattrs' attributes in the source document
+static txml_node_t *
+txml_node_create_source(txml_pool_t *pool, char *name, unsigned int nattrs)
+{
+    txml_node_source_t *source;
+    txml_node_t *node;
+
+    // not recycled, the retained nodes are smaller
+    node = (txml_node_t *)calloc(1, sizeof(txml_node_t) + sizeof(txml_node_source_t) +
+                                    nattrs * sizeof(txml_attribute_source_t));
+    if (!node)
+        return NULL;
+    TAILQ_INIT(&node->attributes);
+    TAILQ_INIT(&node->children);
+    node->type = TXML_NODETYPE_SIMPLE;
+    node->flags = TXML_NODE_FLAG_SOURCE;
+    node->value = txml_empty_string;
+    node->name = txml_strdup(pool, name);
+    source = TXML_NODE_SOURCE(node);
+    source->element.start = TXML_SPAN_NONE;
+    source->value.start = TXML_SPAN_NONE;
+    source->nattrs = nattrs;
+    return node;
+}
+
+// the position of an attribute in the source document, NULL if not known
+static txml_attribute_source_t *
+txml_attribute_source(txml_attribute_t *attr)
+{
+    txml_node_source_t *source = TXML_NODE_SOURCE(attr->node);
+    unsigned int i;
+
+    for (i = 0; source && i < source->nattrs; i++) {
+        if (source->attrs[i].attr == attr)
+            return &source->attrs[i];
+    }
+    return NULL;
+}
+
+// the end tag of a node has been parsed, 'end' is right after it
+static inline void
+txml_node_source_close(txml_node_t *node, char *origin, char *end)
+{
+    txml_node_source_t *source = node ? TXML_NODE_SOURCE(node) : NULL;
+    if (source && source->element.start != TXML_SPAN_NONE)
+        source->element.len = (end - origin) - source->element.start;
+}
+
+// an attribute is going away (NULL if all of them are)
+static void
+txml_attribute_source_forget(txml_node_t *node, txml_attribute_t *attr)
+{
+    txml_node_source_t *source = TXML_NODE_SOURCE(node);
+    unsigned int i;
+
+    for (i = 0; source && i < source->nattrs; i++) {
+        if (!attr || source->attrs[i].attr == attr)
+            source->attrs[i].attr = NULL;
+    }
+}
+
+txml_node_t *
+txml_node_create(char *name, char *value, txml_node_t *parent)
+{
+    txml_node_t *node = NULL;
+    if (!name)
+        return NULL;
+
+    node = txml_node_create_simple(NULL, name, value);
+    if (!node)
+        return NULL;
+
+    if (parent)
+        txml_node_add_child(parent, node);
+
+    return node;
+}
+
+static txml_node_t *
+txml_node_create_special(txml_pool_t *pool, char type, char *value, txml_node_t *parent)
+{
+    txml_node_t *node = txml_node_alloc(pool, type);
+    if (!node)
+        return NULL;
+
+    switch(type) {
+        case TXML_NODETYPE_COMMENT:
+            node->name = txml_comment_name;
+            break;
+        case TXML_NODETYPE_CDATA:
+            node->name = txml_cdata_name;
+            break;
+        default:
+            node->name = txml_text_name;
+            break;
+    }
+    node->value = txml_strdup_value(pool, value);
+
+    if (parent)
+        txml_node_add_child(parent, node);
+
+    return node;
+}
+
+txml_node_t *
+txml_node_create_comment(char *text, txml_node_t *parent)
+{
+    return txml_node_create_special(NULL, TXML_NODETYPE_COMMENT, text, parent);
+}
+
+txml_node_t *
+txml_node_create_cdata(char *data, txml_node_t *parent)
+{
+    return txml_node_create_special(NULL, TXML_NODETYPE_CDATA, data, parent);
+}
+
+txml_node_t *
+txml_node_create_text(char *text, txml_node_t *parent)
+{
+    return txml_node_create_special(NULL, TXML_NODETYPE_TEXT, text, parent);
+}
+
+int
+txml_node_get_type(txml_node_t *node)
+{
+    return node->type;
+}
+
+//
+// DOCUMENT ORDER
+// The nodes of a document are numbered in document order, with gaps: each node
+// has its own position and the position of the last node of its branch, so that
+// ordering and ancestry are just comparisons. The numbering is computed by the
+// first query needing it. Branches joining a numbered document take positions
+// in the gap where they land, if it's wide enough, otherwise the positions of
+// the smallest aligned range around the gap which isn't too crowded are spread
+// evenly again (list labelling), so that a busy spot doesn't cost a numbering of
+// the whole document. Removing nodes leaves the positions of the others valid.
+// The depths are set along with the first numbering and then kept up to date by
+// every attach, whatever happens to the positions
+//
+
+#define TXML_ORDER_SPAN 0x80000000U // positions given by a full numbering, the rest is for appending
+#define TXML_ORDER_DENSITY 1.1 // how much more crowded a range can be than the one twice as large
+
+// whether 'a' comes before 'b' in document order (both belong to the same document), walking the tree
+static int
+txml_node_precedes(txml_node_t *a, txml_node_t *b)
+{
+    txml_node_t *p;
+    int da = 0, db = 0;
+
+    for (p = a; p->parent; p = p->parent)
+        da++;
+    for (p = b; p->parent; p = p->parent)
+        db++;
+    for (; da > db; da--) {
+        if ((a = a->parent) == b)
+            return 0; // 'b' is an ancestor of 'a'
+    }
+    for (; db > da; db--) {
+        if ((b = b->parent) == a)
+            return 1; // 'a' is an ancestor of 'b'
+    }
+    if (a == b)
+        return 0;
+    while (a->parent != b->parent) {
+        a = a->parent;
+        b = b->parent;
+    }
+    for (p = TAILQ_NEXT(a, siblings); p; p = TAILQ_NEXT(p, siblings)) {
+        if (p == b)
+            return 1;
+    }
+    return 0;
+}
+
+// whether the positions of the nodes of 'xml' can be trusted right now
+static inline int
+txml_order_valid(txml_t *xml)
+{
+    return !__atomic_load_n(&xml->order_stale, __ATOMIC_ACQUIRE);
+}
+
+// same as txml_node_precedes(), in O(1) if the document is numbered already
+static inline int
+txml_node_before(txml_t *xml, txml_node_t *a, txml_node_t *b)
+{
+    if (txml_order_valid(xml))
+        return a->order < b->order;
+    return txml_node_precedes(a, b);
+}
+
+// give positions to the nodes of a branch, from 'key' on, 'step' apart
+static void
+txml_order_assign(txml_node_t *branch, unsigned int key, unsigned int step)
+{
+    txml_node_t *node = branch;
+    txml_node_t *child;
+
+    for (;;) {
+        node->order = node->last = key;
+        key += step;
+        if ((child = TAILQ_FIRST(&node->children))) {
+            node = child;
+            continue;
+        }
+        while (node != branch && !TAILQ_NEXT(node, siblings)) {
+            node = node->parent;
+            node->last = key - step; // its branch is complete
+        }
+        if (node == branch)
+            break;
+        node = TAILQ_NEXT(node, siblings);
+    }
+}
+
+// set the depths of the nodes of a branch, starting from the one of its parent
+static void
+txml_depth_assign(txml_node_t *branch)
+{
+    txml_node_t *node = branch;
+    txml_node_t *child;
+
+    branch->depth = branch->parent ? branch->parent->depth + 1 : 0;
+    for (;;) {
+        if ((child = TAILQ_FIRST(&node->children))) {
+            child->depth = node->depth + 1;
+            node = child;
+            continue;
+        }
+        while (node != branch && !TAILQ_NEXT(node, siblings))
+            node = node->parent;
+        if (node == branch)
+            break;
+        TAILQ_NEXT(node, siblings)->depth = node->depth;
+        node = TAILQ_NEXT(node, siblings);
+    }
+}
+
+// the node before 'node' in document order (NULL for the first node of the document)
+static txml_node_t *
+txml_node_preorder_prev(txml_node_t *node)
+{
+    txml_node_t *prev, *child;
+
+    if (!(prev = TAILQ_PREV(node, nodelist_head, siblings)))
+        return node->parent;
+    while ((child = TAILQ_LAST(&prev->children, nodelist_head)))
+        prev = child;
+    return prev;
+}
+
+// the node after 'node' in document order (NULL for the last node of the document)
+static txml_node_t *
+txml_node_preorder_next(txml_node_t *node)
+{
+    txml_node_t *child;
+
+    if ((child = TAILQ_FIRST(&node->children)))
+        return child;
+    while (!TAILQ_NEXT(node, siblings) && node->parent)
+        node = node->parent;
+    return TAILQ_NEXT(node, siblings);
+}
+
+static unsigned long
+txml_branch_size(txml_node_t *branch)
+{
+    txml_node_t *node = branch;
+    txml_node_t *child;
+    unsigned long count = 0;
+
+    for (;;) {
+        count++;
+        if ((child = TAILQ_FIRST(&node->children))) {
+            node = child;
+            continue;
+        }
+        while (node != branch && !TAILQ_NEXT(node, siblings))
+            node = node->parent;
+        if (node == branch)
+            break;
+        node = TAILQ_NEXT(node, siblings);
+    }
+    return count;
+}
+
+// number the whole document (positions start from 1, 0 comes before everything)
+static void
+txml_order_renumber(txml_t *xml)
+{
+    txml_node_t *rnode;
+    unsigned long count = 0;
+    unsigned int step, key;
+
+    TAILQ_FOREACH(rnode, &xml->root_elements, siblings)
+        count += txml_branch_size(rnode);
+    step = TXML_ORDER_SPAN / (count + 1);
+    if (!step)
+        step = 1;
+    key = step;
+    TAILQ_FOREACH(rnode, &xml->root_elements, siblings) {
+        txml_order_assign(rnode, key, step);
+        if (xml->depth_stale)
+            txml_depth_assign(rnode);
+        key = rnode->last + step;
+    }
+    xml->order_step = step;
+}
+
+// bring the numbering up to date, returns 0 if it can't be used
+// (fine grained writers don't maintain it, pending nodes are not numbered).
+// Readers can get here concurrently, the first one numbers the document while the others wait
+static int
+txml_order_ready(txml_t *xml)
+{
+    int ready;
+
+    if (txml_fine_locking(xml))
+        return 0;
+    if (txml_order_valid(xml))
+        return 1;
+    TXML_LAZY_LOCK(xml);
+    ready = !xml->pending;
+    if (ready && xml->order_stale) {
+        txml_order_renumber(xml);
+        __atomic_store_n(&xml->depth_stale, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&xml->order_stale, 0, __ATOMIC_RELEASE);
+    }
+    TXML_LAZY_UNLOCK(xml);
+    return ready;
+}
+
+static inline void
+txml_order_invalidate(txml_t *xml)
+{
+    __atomic_store_n(&xml->depth_stale, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&xml->order_stale, 1, __ATOMIC_RELEASE);
+}
+
+// 'node' has no children, the branches ending with it end at its position
+static void
+txml_order_close(txml_node_t *node)
+{
+    txml_node_t *p;
+
+    node->last = node->order;
+    for (p = node; !TAILQ_NEXT(p, siblings) && p->parent; p = p->parent)
+        p->parent->last = node->order;
+}
+
+// the gap where a branch of 'size' nodes landed, right after 'prev' (NULL at the start
+// of the document), is full: spread evenly the positions of the smallest aligned range
+// around it that can take the branch without getting too crowded (the larger the range,
+// the more crowded it may be). The cost is amortized over the attaches that filled the range.
+// Returns 0 if not even the whole range of positions would do
+static int
+txml_order_relabel(txml_node_t *branch, txml_node_t *prev, unsigned long long size)
+{
+    txml_node_t *first = branch; // the first node of the range, in document order
+    txml_node_t *next, *node, *p;
+    unsigned long long lo, wlo, whi, count = size, step, key;
+    double limit = 1.0;
+    int bits;
+
+    for (p = branch; p && !TAILQ_NEXT(p, siblings); p = p->parent)
+        ;
+    next = p ? TAILQ_NEXT(p, siblings) : NULL;
+    lo = prev ? prev->order : 0;
+    for (bits = 1; bits <= 32; bits++) {
+        limit *= 2 / TXML_ORDER_DENSITY;
+        wlo = lo & ~((1ULL << bits) - 1);
+        whi = wlo + (1ULL << bits);
+        for (; prev && prev->order >= wlo; count++) {
+            first = prev;
+            prev = txml_node_preorder_prev(prev);
+        }
+        for (; next && next->order < whi; count++)
+            next = txml_node_preorder_next(next);
+        if (count <= limit && count < whi - wlo)
+            break;
+    }
+    if (bits > 32)
+        return 0;
+    // the branches ending right before the range may still reach the positions
+    // of nodes removed since, which are going to be given to other nodes
+    if (prev && TAILQ_EMPTY(&prev->children))
+        txml_order_close(prev);
+    step = (whi - wlo) / (count + 1);
+    key = wlo;
+    for (node = first; count--; node = txml_node_preorder_next(node)) {
+        key += step;
+        node->order = key;
+        if (TAILQ_EMPTY(&node->children)) // else its last position is the one of a descendant
+            txml_order_close(node);
+    }
+    return 1;
+}
+
+// a branch joined the document of 'xml'
+static void
+txml_order_attach(txml_t *xml, txml_node_t *branch)
+{
+    txml_node_t *prev, *p;
+    unsigned long long lo, hi, size, step;
+
+    if (xml->batch || xml->pending || txml_fine_locking(xml)) {
+        txml_order_invalidate(xml);
+        return;
+    }
+    if (!xml->depth_stale)
+        txml_depth_assign(branch);
+    if (!txml_order_valid(xml))
+        return;
+    // the gap is between the node preceding the branch and the one following it
+    prev = TAILQ_PREV(branch, nodelist_head, siblings);
+    lo = prev ? prev->last : (branch->parent ? branch->parent->order : 0);
+    for (p = branch; p && !TAILQ_NEXT(p, siblings); p = p->parent)
+        ;
+    hi = p ? TAILQ_NEXT(p, siblings)->order : 0x100000000ULL;
+    size = txml_branch_size(branch);
+    step = (hi - lo) / (size + 1);
+    if (!p && step > xml->order_step) // appending, leave room for more
+        step = xml->order_step;
+    if (!step) {
+        // the whole document is numbered again only if all the positions are too crowded
+        if (!txml_order_relabel(branch, txml_node_preorder_prev(branch), size))
+            __atomic_store_n(&xml->order_stale, 1, __ATOMIC_RELEASE);
+        return;
+    }
+    txml_order_assign(branch, lo + step, step);
+    for (p = branch->parent; p && p->last < branch->last; p = p->parent)
+        p->last = branch->last;
+}
+
+static int
+txml_node_compare_positions(const void *a, const void *b)
+{
+    unsigned int pa = (*(txml_node_t **)a)->order;
+    unsigned int pb = (*(txml_node_t **)b)->order;
+    return pa < pb ? -1 : pa > pb;
+}
+
+static int
+txml_node_compare_walking(const void *a, const void *b)
+{
+    txml_node_t *na = *(txml_node_t **)a;
+    txml_node_t *nb = *(txml_node_t **)b;
+    if (na == nb)
+        return 0;
+    return txml_node_precedes(na, nb) ? -1 : 1;
+}
+
+int
+txml_node_compare_order(txml_node_t *a, txml_node_t *b)
+{
+    txml_t *xml;
+    int res = 0;
+
+    if (!a || !b || a == b)
+        return 0;
+    TXML_NODE_RDLOCK(a);
+    xml = txml_context_get(a);
+    if (xml && txml_order_ready(xml))
+        res = a->order < b->order ? -1 : 1;
+    else
+        res = txml_node_precedes(a, b) ? -1 : 1;
+    TXML_NODE_RDUNLOCK(a);
+    return res;
+}
+
+int
+txml_node_is_ancestor(txml_node_t *a, txml_node_t *b)
+{
+    txml_node_t *p;
+    txml_t *xml;
+    int res = 0;
+
+    if (!a || !b || a == b)
+        return 0;
+    TXML_NODE_RDLOCK(b);
+    xml = txml_context_get(b);
+    if (xml && txml_order_ready(xml)) {
+        res = (a->order < b->order && b->order <= a->last);
+    } else {
+        for (p = b->parent; p && p != a; p = p->parent)
+            ;
+        res = (p != NULL);
+    }
+    TXML_NODE_RDUNLOCK(b);
+    return res;
+}
+
+unsigned int
+txml_node_depth(txml_node_t *node)
+{
+    txml_node_t *p;
+    unsigned int res = 0;
+    txml_t *xml;
+
+    if (!node)
+        return 0;
+    TXML_NODE_RDLOCK(node);
+    xml = txml_context_get(node);
+    // kept by the attaches once known, never worth a numbering of the document
+    if (xml && !txml_fine_locking(xml) && !__atomic_load_n(&xml->depth_stale, __ATOMIC_ACQUIRE)) {
+        res = node->depth;
+    } else {
+        for (p = node->parent; p; p = p->parent)
+            res++;
+    }
+    TXML_NODE_RDUNLOCK(node);
+    return res;
+}
+
+unsigned long
+txml_sort_nodes(txml_t *xml, txml_node_t **nodes, unsigned long count)
+{
+    unsigned long i, n = 0;
+
+    if (!xml || !nodes || count < 2)
+        return nodes ? count : 0;
+    TXML_DOC_RDLOCK(xml);
+    if (txml_order_ready(xml))
+        qsort(nodes, count, sizeof(txml_node_t *), txml_node_compare_positions);
+    else
+        qsort(nodes, count, sizeof(txml_node_t *), txml_node_compare_walking);
+    TXML_DOC_RDUNLOCK(xml);
+    for (i = 0; i < count; i++) {
+        if (!n || nodes[i] != nodes[n - 1])
+            nodes[n++] = nodes[i];
+    }
+    return n;
+}
+
+//
+// ATTRIBUTE INDEXES
+// The nodes of a document can be indexed by the value of an attribute,
+// to be found without walking the tree. The entries are kept up to date
+// as attributes change and as branches join or leave the document
+// (in batch mode the indexes are marked stale and rebuilt at the end).
+// Predicates on indexed attributes ( "name[@id='value']" ) use them
+//
+
+static int txml_indexes_count = 0; // in all the contexts, nobody pays for them until the first one
+
+// the context of a node, if it has indexes to maintain (of attributes or of names)
+static inline txml_t *
+txml_index_context(txml_node_t *node)
+{
+    txml_t *xml;
+    if (!__atomic_load_n(&txml_indexes_count, __ATOMIC_RELAXED))
+        return NULL;
+    xml = txml_context_get(node);
+    return (xml && (xml->nindexes || xml->name_index)) ? xml : NULL;
+}
+
+static txml_index_t *
+txml_index_find(txml_t *xml, char *name)
+{
+    txml_index_t *index;
+    TAILQ_FOREACH(index, &xml->indexes, next) {
+        if (strcmp(index->name, name) == 0)
+            return index;
+    }
+    return NULL;
+}
+
+static void
+txml_index_insert(txml_t *xml, txml_index_t *index, txml_attribute_t *attr)
+{
+    txml_index_entry_t *entry, *next, **buckets;
+    unsigned long i, nbuckets;
+
+    if (index->count >= index->nbuckets) { // keep the chains short
+        nbuckets = index->nbuckets ? index->nbuckets * 2 : 64;
+        buckets = (txml_index_entry_t **)calloc(nbuckets, sizeof(txml_index_entry_t *));
+        if (buckets) {
+            for (i = 0; i < index->nbuckets; i++) {
+                for (entry = index->buckets[i]; entry; entry = next) {
+                    next = entry->next;
+                    entry->next = buckets[entry->hash & (nbuckets - 1)];
+                    buckets[entry->hash & (nbuckets - 1)] = entry;
+                }
+            }
+            free(index->buckets);
+            index->buckets = buckets;
+            index->nbuckets = nbuckets;
+        }
+    }
+    entry = index->nbuckets ? (txml_index_entry_t *)malloc(sizeof(txml_index_entry_t)) : NULL;
+    if (!entry) {
+        xml->indexes_stale = 1; // lookups walk the document until the next rebuild
+        return;
+    }
+    entry->attr = attr;
+    entry->hash = txml_hash_string(attr->value);
+    entry->next = index->buckets[entry->hash & (index->nbuckets - 1)];
+    index->buckets[entry->hash & (index->nbuckets - 1)] = entry;
+    index->count++;
+}
+
+static void
+txml_index_remove(txml_index_t *index, txml_attribute_t *attr)
+{
+    txml_index_entry_t *entry, **prev;
+
+    if (!index->nbuckets)
+        return;
+    prev = &index->buckets[txml_hash_string(attr->value) & (index->nbuckets - 1)];
+    for (entry = *prev; entry; prev = &entry->next, entry = entry->next) {
+        if (entry->attr == attr) {
+            *prev = entry->next;
+            free(entry);
+            index->count--;
+            return;
+        }
+    }
+}
+
+static void
+txml_index_clear(txml_index_t *index)
+{
+    txml_index_entry_t *entry, *next;
+    unsigned long i;
+
+    for (i = 0; i < index->nbuckets; i++) {
+        for (entry = index->buckets[i]; entry; entry = next) {
+            next = entry->next;
+            free(entry);
+        }
+    }
+    free(index->buckets);
+    index->buckets = NULL;
+    index->nbuckets = index->count = 0;
+}
+
+// an attribute joined (add != 0) or left the document of 'xml',
+// either for all of its indexes or for a single one ('only')
+static void
+txml_index_attribute(txml_t *xml, txml_index_t *only, txml_attribute_t *attr, int add)
+{
+    txml_index_t *index;
+
+    if (xml->indexes_stale)
+        return; // everything will be indexed again anyway
+    for (index = only ? only : TAILQ_FIRST(&xml->indexes); index;
+         index = only ? NULL : TAILQ_NEXT(index, next))
+    {
+        if (strcmp(index->name, attr->name) != 0)
+            continue;
+        if (add)
+            txml_index_insert(xml, index, attr);
+        else
+            txml_index_remove(index, attr);
+    }
+}
+
+// a whole branch joined or left the document of 'xml'
+static void
+txml_index_branch(txml_t *xml, txml_index_t *only, txml_node_t *branch, int add)
+{
+    txml_node_t *node = branch;
+    txml_attribute_t *attr;
+    txml_node_t *child;
+
+    for (;;) {
+        TAILQ_FOREACH(attr, &node->attributes, list)
+            txml_index_attribute(xml, only, attr, add);
+        if ((child = TAILQ_FIRST(&node->children))) {
+            node = child;
+            continue;
+        }
+        while (node != branch && !TAILQ_NEXT(node, siblings))
+            node = node->parent;
+        if (node == branch)
+            break;
+        node = TAILQ_NEXT(node, siblings);
+    }
+}
+
+// index the whole document again, once the entries went out of sync
+static void
+txml_indexes_rebuild(txml_t *xml)
+{
+    txml_index_t *index;
+    txml_node_t *rnode;
+
+    TAILQ_FOREACH(index, &xml->indexes, next)
+        txml_index_clear(index);
+    xml->indexes_stale = 0;
+    TAILQ_FOREACH(rnode, &xml->root_elements, siblings)
+        txml_index_branch(xml, NULL, rnode, 1);
+}
+
+// the first node (in document order) whose attribute indexed by 'index' is 'value'.
+// If 'parent' is not NULL only its children named 'name' are considered
+static txml_node_t *
+txml_index_get(txml_t *xml, txml_index_t *index, char *value, txml_node_t *parent, char *name)
+{
+    txml_index_entry_t *entry;
+    txml_node_t *node, *res = NULL;
+    unsigned int hash;
+
+    if (!index->nbuckets)
+        return NULL;
+    hash = txml_hash_string(value);
+    for (entry = index->buckets[hash & (index->nbuckets - 1)]; entry; entry = entry->next) {
+        if (entry->hash != hash || strcmp(entry->attr->value, value) != 0)
+            continue;
+        node = entry->attr->node;
+        if (parent && (node->parent != parent || strcmp(node->name, name) != 0))
+            continue;
+        // only the first attribute with the indexed name counts, as in a linear lookup
+        if (txml_node_get_attribute_byname_unlocked(node, index->name) != entry->attr)
+            continue;
+        if (!res || txml_node_before(xml, node, res))
+            res = node;
+    }
+    return res;
+}
+
+// what txml_index_get() would return if the index were up to date
+static txml_node_t *
+txml_index_scan(txml_t *xml, char *name, char *value)
+{
+    txml_attribute_t *attr;
+    txml_node_t *rnode, *node, *child;
+
+    TAILQ_FOREACH(rnode, &xml->root_elements, siblings) {
+        node = rnode;
+        for (;;) {
+            attr = txml_node_get_attribute_byname_unlocked(node, name);
+            if (attr && strcmp(attr->value, value) == 0)
+                return node;
+            if ((child = TAILQ_FIRST(&node->children))) {
+                node = child;
+                continue;
+            }
+            while (node != rnode && !TAILQ_NEXT(node, siblings))
+                node = node->parent;
+            if (node == rnode)
+                break;
+            node = TAILQ_NEXT(node, siblings);
+        }
+    }
+    return NULL;
+}
+
+// the child of 'node' selected by "name[@attr='value']", through an index on 'attr'.
+// Returns 0 if there is no such index to use (the children must be scanned)
+static int
+txml_index_select(txml_node_t *node, char *name, char *attr_name, char *attr_value, txml_node_t **child)
+{
+    txml_t *xml = txml_index_context(node);
+    txml_index_t *index;
+
+    if (!xml || xml->indexes_stale || !(index = txml_index_find(xml, attr_name)))
+        return 0;
+    *child = txml_index_get(xml, index, attr_value, node, name);
+    return 1;
+}
+
+txml_err_t
+txml_index_create(txml_t *xml, char *attr_name)
+{
+    txml_index_t *index;
+    txml_node_t *rnode;
+
+    if (!xml || !attr_name)
+        return TXML_BADARGS;
+    TXML_WRLOCK(xml);
+    if (txml_index_find(xml, attr_name)) {
+        TXML_WRUNLOCK(xml);
+        return TXML_NOERR;
+    }
+    index = (txml_index_t *)calloc(1, sizeof(txml_index_t));
+    if (!index || !(index->name = strdup(attr_name))) {
+        free(index);
+        TXML_WRUNLOCK(xml);
+        return TXML_MEMORY_ERR;
+    }
+    // the pending nodes would be indexed while being expanded by readers
+    txml_expand_all(xml);
+    TAILQ_FOREACH(rnode, &xml->root_elements, siblings)
+        txml_index_branch(xml, index, rnode, 1);
+    TAILQ_INSERT_TAIL(&xml->indexes, index, next);
+    __atomic_store_n(&xml->nindexes, xml->nindexes + 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&txml_indexes_count, 1, __ATOMIC_RELAXED);
+    TXML_WRUNLOCK(xml);
+    return TXML_NOERR;
+}
+
+txml_err_t
+txml_index_destroy(txml_t *xml, char *attr_name)
+{
+    txml_index_t *index;
+
+    if (!xml || !attr_name)
+        return TXML_BADARGS;
+    TXML_WRLOCK(xml);
+    index = txml_index_find(xml, attr_name);
+    if (index) {
+        TAILQ_REMOVE(&xml->indexes, index, next);
+        txml_index_clear(index);
+        free(index->name);
+        free(index);
+        __atomic_store_n(&xml->nindexes, xml->nindexes - 1, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&txml_indexes_count, 1, __ATOMIC_RELAXED);
+    }
+    TXML_WRUNLOCK(xml);
+    return index ? TXML_NOERR : TXML_BADARGS;
+}
+
+txml_node_t *
+txml_index_lookup(txml_t *xml, char *attr_name, char *value)
+{
+    txml_index_t *index;
+    txml_node_t *res = NULL;
+
+    if (!xml || !attr_name || !value)
+        return NULL;
+    TXML_RDLOCK(xml);
+    if ((index = txml_index_find(xml, attr_name)))
+        res = xml->indexes_stale ? txml_index_scan(xml, attr_name, value) : txml_index_get(xml, index, value, NULL, NULL);
+    TXML_RDUNLOCK(xml);
+    return res;
+}
+
+//
+// NAME INDEX
+// The elements of a document can be listed by name, each list in document order.
+// Elements joining the document at its end (as while parsing) are appended
+// to the lists and branches leaving it from its end are dropped from them,
+// any other change marks the lists stale: the next query rebuilds them all
+// with a single walk of the document
+//
+
+// whether nothing follows a node in document order
+static int
+txml_node_is_last(txml_node_t *node)
+{
+    for (; node; node = node->parent) {
+        if (TAILQ_NEXT(node, siblings))
+            return 0;
+    }
+    return 1;
+}
+
+static txml_name_list_t *
+txml_name_list_get(txml_t *xml, char *name, int create)
+{
+    txml_name_index_t *index = xml->name_index;
+    txml_name_list_t *list, *next, **buckets;
+    unsigned int hash = txml_hash_string(name);
+    unsigned long i, nbuckets;
+
+    for (list = index->buckets[hash & (index->nbuckets - 1)]; list; list = list->next) {
+        if (list->hash == hash && strcmp(list->name, name) == 0)
+            return list;
+    }
+    if (!create)
+        return NULL;
+
+    if (index->count >= index->nbuckets) { // keep the chains short
+        nbuckets = index->nbuckets * 2;
+        buckets = (txml_name_list_t **)calloc(nbuckets, sizeof(txml_name_list_t *));
+        if (buckets) {
+            for (i = 0; i < index->nbuckets; i++) {
+                for (list = index->buckets[i]; list; list = next) {
+                    next = list->next;
+                    list->next = buckets[list->hash & (nbuckets - 1)];
+                    buckets[list->hash & (nbuckets - 1)] = list;
+                }
+            }
+            free(index->buckets);
+            index->buckets = buckets;
+            index->nbuckets = nbuckets;
+        }
+    }
+    list = (txml_name_list_t *)calloc(1, sizeof(txml_name_list_t));
+    if (!list)
+        return NULL;
+    list->name = txml_name_intern(&xml->names, name);
+    if (!list->name) {
+        free(list);
+        return NULL;
+    }
+    list->hash = hash;
+    list->next = index->buckets[hash & (index->nbuckets - 1)];
+    index->buckets[hash & (index->nbuckets - 1)] = list;
+    index->count++;
+    return list;
+}
+
+// append the elements of a branch to the lists, returns -1 if out of memory
+static int
+txml_name_index_add(txml_t *xml, txml_node_t *branch)
+{
+    txml_node_t *node = branch;
+    txml_node_t *child;
+    txml_name_list_t *list;
+
+    for (;;) {
+        if (node->type == TXML_NODETYPE_SIMPLE) {
+            list = txml_name_list_get(xml, node->name, 1);
+            if (!list)
+                return -1;
+            if (list->count == list->size) {
+                unsigned long size = list->size ? list->size * 2 : 16;
+                txml_node_t **nodes = (txml_node_t **)realloc(list->nodes, size * sizeof(txml_node_t *));
+                if (!nodes)
+                    return -1;
+                list->nodes = nodes;
+                list->size = size;
+            }
+            list->nodes[list->count++] = node;
+        }
+        if ((child = TAILQ_FIRST(&node->children))) {
+            node = child;
+            continue;
+        }
+        while (node != branch && !TAILQ_NEXT(node, siblings))
+            node = node->parent;
+        if (node == branch)
+            break;
+        node = TAILQ_NEXT(node, siblings);
+    }
+    return 0;
+}
+
+// a branch joined the document of 'xml'
+static void
+txml_name_index_attach(txml_t *xml, txml_node_t *branch)
+{
+    txml_name_index_t *index = xml->name_index;
+
+    if (!index || index->stale || branch->type != TXML_NODETYPE_SIMPLE)
+        return;
+    if (xml->batch || !txml_node_is_last(branch) || txml_name_index_add(xml, branch) != 0)
+        index->stale = 1;
+}
+
+// a branch is going to leave the document of 'xml'
+static void
+txml_name_index_detach(txml_t *xml, txml_node_t *branch)
+{
+    txml_name_index_t *index = xml->name_index;
+    txml_node_t *node = branch;
+    txml_node_t *child;
+    txml_name_list_t *list;
+
+    if (!index || index->stale || branch->type != TXML_NODETYPE_SIMPLE)
+        return;
+    if (xml->batch || !txml_node_is_last(branch)) {
+        index->stale = 1;
+        return;
+    }
+    // the elements of the branch are the tails of their lists
+    for (;;) {
+        if (node->type == TXML_NODETYPE_SIMPLE && (list = txml_name_list_get(xml, node->name, 0)))
+            list->count--;
+        if ((child = TAILQ_FIRST(&node->children))) {
+            node = child;
+            continue;
+        }
+        while (node != branch && !TAILQ_NEXT(node, siblings))
+            node = node->parent;
+        if (node == branch)
+            break;
+        node = TAILQ_NEXT(node, siblings);
+    }
+}
+
+static inline void
+txml_name_index_invalidate(txml_t *xml)
+{
+    if (xml->name_index)
+        xml->name_index->stale = 1;
+}
+
+static void
+txml_name_index_clear(txml_t *xml)
+{
+    txml_name_index_t *index = xml->name_index;
+    txml_name_list_t *list, *next;
+    unsigned long i;
+
+    for (i = 0; i < index->nbuckets; i++) {
+        for (list = index->buckets[i]; list; list = next) {
+            next = list->next;
+            txml_name_release(list->name);
+            free(list->nodes);
+            free(list);
+        }
+        index->buckets[i] = NULL;
+    }
+    index->count = 0;
+    index->stale = 0;
+}
+
+// bring the lists up to date, returns 0 if they can't be used (out of memory).
+// Readers can get here concurrently, the first one rebuilds the lists while the others wait
+static int
+txml_name_index_ready(txml_t *xml)
+{
+    txml_name_index_t *index = xml->name_index;
+    txml_node_t *rnode;
+    int stale = 0;
+
+    if (!index)
+        return 0;
+    if (__atomic_load_n(&index->stale, __ATOMIC_ACQUIRE)) {
+        TXML_LAZY_LOCK(xml);
+        if (index->stale) {
+            txml_name_index_clear(xml);
+            TAILQ_FOREACH(rnode, &xml->root_elements, siblings) {
+                if (rnode->type == TXML_NODETYPE_SIMPLE && txml_name_index_add(xml, rnode) != 0) {
+                    stale = 1;
+                    break;
+                }
+            }
+            __atomic_store_n(&index->stale, stale, __ATOMIC_RELEASE);
+        }
+        TXML_LAZY_UNLOCK(xml);
+    }
+    return !__atomic_load_n(&index->stale, __ATOMIC_ACQUIRE);
+}
+
+// collect the elements named 'name' within a branch (the branch itself excluded),
+// in document order. Returns how many there are, only 'size' are stored
+static unsigned long
+txml_branch_collect(txml_node_t *branch, char *name, txml_node_t **nodes, unsigned long size, unsigned long count)
+{
+    txml_node_t *node = branch;
+    txml_node_t *child;
+
+    for (;;) {
+        TXML_NODE_EXPAND(node);
+        if ((child = TAILQ_FIRST(&node->children))) {
+            node = child;
+        } else {
+            while (node != branch && !TAILQ_NEXT(node, siblings))
+                node = node->parent;
+            if (node == branch)
+                break;
+            node = TAILQ_NEXT(node, siblings);
+        }
+        if (node->type == TXML_NODETYPE_SIMPLE && strcmp(node->name, name) == 0) {
+            if (count < size)
+                nodes[count] = node;
+            count++;
+        }
+    }
+    return count;
+}
+
+txml_err_t
+txml_name_index_create(txml_t *xml)
+{
+    txml_name_index_t *index;
+
+    if (!xml)
+        return TXML_BADARGS;
+    TXML_WRLOCK(xml);
+    if (xml->name_index) {
+        TXML_WRUNLOCK(xml);
+        return TXML_NOERR;
+    }
+    index = (txml_name_index_t *)calloc(1, sizeof(txml_name_index_t));
+    if (index)
+        index->buckets = (txml_name_list_t **)calloc(64, sizeof(txml_name_list_t *));
+    if (!index || !index->buckets) {
+        free(index);
+        TXML_WRUNLOCK(xml);
+        return TXML_MEMORY_ERR;
+    }
+    index->nbuckets = 64;
+    index->stale = 1; // built by the first query
+    // the pending nodes would be indexed while being expanded by readers
+    txml_expand_all(xml);
+    __atomic_store_n(&xml->name_index, index, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&txml_indexes_count, 1, __ATOMIC_RELAXED);
+    TXML_WRUNLOCK(xml);
+    return TXML_NOERR;
+}
+
+static void
+txml_name_index_destroy_unlocked(txml_t *xml)
+{
+    if (!xml->name_index)
+        return;
+    txml_name_index_clear(xml);
+    free(xml->name_index->buckets);
+    free(xml->name_index);
+    __atomic_store_n(&xml->name_index, NULL, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&txml_indexes_count, 1, __ATOMIC_RELAXED);
+}
+
+void
+txml_name_index_destroy(txml_t *xml)
+{
+    TXML_WRLOCK(xml);
+    txml_name_index_destroy_unlocked(xml);
+    TXML_WRUNLOCK(xml);
+}
+
+unsigned long
+txml_get_elements_byname(txml_t *xml, char *name, txml_node_t **nodes, unsigned long size)
+{
+    txml_name_list_t *list;
+    txml_node_t *rnode;
+    unsigned long count = 0;
+
+    if (!xml || !name)
+        return 0;
+    TXML_DOC_RDLOCK(xml);
+    if (txml_name_index_ready(xml)) {
+        if ((list = txml_name_list_get(xml, name, 0))) {
+            count = list->count;
+            memcpy(nodes, list->nodes, (count < size ? count : size) * sizeof(txml_node_t *));
+        }
+    } else {
+        TAILQ_FOREACH(rnode, &xml->root_elements, siblings) {
+            if (rnode->type != TXML_NODETYPE_SIMPLE)
+                continue;
+            if (strcmp(rnode->name, name) == 0) {
+                if (count < size)
+                    nodes[count] = rnode;
+                count++;
+            }
+            count = txml_branch_collect(rnode, name, nodes, size, count);
+        }
+    }
+    TXML_DOC_RDUNLOCK(xml);
+    return count;
+}
+
+unsigned long
+txml_node_get_descendants_byname(txml_node_t *node, char *name, txml_node_t **nodes, unsigned long size)
+{
+    txml_name_list_t *list;
+    txml_node_t *p;
+    unsigned long i, count = 0;
+    txml_t *xml;
+
+    if (!node || !name)
+        return 0;
+    TXML_NODE_RDLOCK(node);
+    xml = txml_context_get(node);
+    if (xml && txml_name_index_ready(xml)) {
+        list = txml_name_list_get(xml, name, 0);
+        if (list && txml_order_ready(xml)) {
+            // the descendants are contiguous in the list, right after the node
+            unsigned long lo = 0, hi = list->count, mid;
+            while (lo < hi) {
+                mid = lo + (hi - lo) / 2;
+                if (list->nodes[mid]->order <= node->order)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            for (i = lo; i < list->count && list->nodes[i]->order <= node->last; i++) {
+                if (count < size)
+                    nodes[count] = list->nodes[i];
+                count++;
+            }
+        } else if (list) {
+            for (i = 0; i < list->count; i++) {
+                for (p = list->nodes[i]->parent; p && p != node; p = p->parent)
+                    ;
+                if (!p)
+                    continue;
+                if (count < size)
+                    nodes[count] = list->nodes[i];
+                count++;
+            }
+        }
+    } else {
+        count = txml_branch_collect(node, name, nodes, size, 0);
+    }
+    TXML_NODE_RDUNLOCK(node);
+    return count;
+}
+
+// drop all the indexes of a context
+static void
+txml_indexes_destroy(txml_t *xml)
+{
+    txml_index_t *index;
+
+    while ((index = TAILQ_FIRST(&xml->indexes))) {
+        TAILQ_REMOVE(&xml->indexes, index, next);
+        txml_index_clear(index);
+        free(index->name);
+        free(index);
+    }
+    if (xml->nindexes)
+        __atomic_fetch_sub(&txml_indexes_count, xml->nindexes, __ATOMIC_RELAXED);
+    xml->nindexes = 0;
+    txml_name_index_destroy_unlocked(xml);
+}
+
+// detach a node from its parent (or from the root nodes of its context)
+static void
+txml_node_unlink(txml_node_t *node)
+{
+    txml_t *xml;
+    if ((xml = txml_index_context(node))) {
+        if (xml->nindexes)
+            txml_index_branch(xml, NULL, node, 0);
+        txml_name_index_detach(xml, node);
+    }
+    if (node->parent) {
+        TAILQ_REMOVE(&node->parent->children, node, siblings);
+        txml_node_changed(node->parent, TXML_NODE_CHANGED_CHILDREN);
+        node->parent = NULL;
+    } else if ((xml = TXML_NODE_CONTEXT(node))) {
+        TAILQ_REMOVE(&xml->root_elements, node, siblings);
+        xml->snapshot_stale = 1;
+        if (xml->reload) // the children of the root element can't be reloaded in place anymore
+            xml->reload->root = NULL;
+        node->ext->context = NULL;
+        if (xml->cnode == node)
+            xml->cnode = NULL;
+    }
+}
+
+// release a single node (its children must have been released already),
+// either to the system or to the retained storage of a context
+static void
+txml_node_free(txml_pool_t *pool, txml_node_t *node)
+{
+    txml_attribute_t *attr, *attrtmp;
+    txml_namespace_t *ns, *nstmp;
+    txml_namespace_set_t *item, *itemtmp;
+
+    TAILQ_FOREACH_SAFE(attr, &node->attributes, list, attrtmp) {
+        TAILQ_REMOVE(&node->attributes, attr, list);
+        if(attr->name)
+            txml_strfree(pool, attr->name);
+        txml_free_value(pool, attr->value);
+        TXML_POOL_FREE(pool, attributes, attr);
+    }
+
+    if (node->ext) {
+        TAILQ_FOREACH_SAFE(item, &node->ext->known_namespaces, next, itemtmp) {
+            TAILQ_REMOVE(&node->ext->known_namespaces, item, next);
+            TXML_POOL_FREE(pool, nsitems, item);
+        }
+
+        TAILQ_FOREACH_SAFE(ns, &node->ext->namespaces, list, nstmp) {
+            TAILQ_REMOVE(&node->ext->namespaces, ns, list);
+            txml_namespace_destroy(pool, ns);
+        }
+        if (node->ext->frozen)
+            txml_snapshot_node_release(node->ext->frozen);
+#ifdef THREAD_SAFE
+        if (node->ext->lock) {
+            pthread_rwlock_destroy(node->ext->lock);
+            free(node->ext->lock);
+        }
+#endif
+        TXML_POOL_FREE(pool, exts, node->ext);
+    }
+
+    if (node->name && node->type == TXML_NODETYPE_SIMPLE) {
+        if ((node->flags & TXML_NODE_FLAG_INTERNED_NAME))
+            txml_name_release(node->name);
+        else
+            txml_strfree(pool, node->name);
+    }
+    txml_free_value(pool, node->value);
+    TXML_POOL_FREE(pool, nodes, node);
+}
+
+// release a whole branch, without recursion: each child is detached
+// before descending into it, and its parent pointer leads us back up
+static void
+txml_node_release_branch(txml_pool_t *pool, txml_node_t *node)
+{
+    txml_node_t *p = node;
+    txml_node_t *child, *parent;
+
+    for (;;) {
+        child = TAILQ_FIRST(&p->children);
+        if (child) {
+            TAILQ_REMOVE(&p->children, child, siblings);
+            p = child;
+            continue;
+        }
+        parent = (p == node) ? NULL : p->parent;
+        txml_node_free(pool, p);
+        if (!parent)
+            break;
+        p = parent;
+    }
+}
+
+static void
+txml_node_destroy_unlocked(txml_node_t *node)
+{
+    txml_node_release_branch(NULL, node);
+}
+
+void
+txml_node_destroy(txml_node_t *node)
+{
+    txml_record_t rec = { NULL };
+    TXML_NODE_UNLINK_WRLOCK(node);
+    if (TXML_JOURNALING() && txml_record_begin(&rec, txml_context_get(node), 'D'))
+        txml_record_node(&rec, node);
+    txml_node_unlink(node);
+    txml_node_destroy_unlocked(node);
+    txml_record_end(&rec, TXML_NOERR);
+    TXML_NODE_WRUNLOCK(node);
+}
+
+static txml_err_t
+txml_node_set_value_unlocked(txml_pool_t *pool, txml_node_t *node, char *val)
+{
+    if(!val)
+        return TXML_BADARGS;
+
+    txml_free_value(pool, node->value);
+    node->value = txml_strdup_value(pool, val);
+    txml_node_changed(node, TXML_NODE_CHANGED_SELF);
+    return TXML_NOERR;
+}
+
+txml_err_t
+txml_node_set_value(txml_node_t *node, char *val)
+{
+    txml_err_t res;
+    txml_record_t rec = { NULL };
+    TXML_NODE_WRLOCK(node);
+    if (TXML_JOURNALING() && txml_record_begin(&rec, txml_context_get(node), 'V')) {
+        txml_record_node(&rec, node);
+        txml_record_string(&rec, val);
+    }
+    res = txml_node_set_value_unlocked(NULL, node, val);
+    txml_record_end(&rec, res);
+    TXML_NODE_WRUNLOCK(node);
+    return res;
+}
+
+static char *
+txml_node_get_value_unlocked(txml_node_t *node)
+{
+    if(!node)
+        return NULL;
+    return node->value;
+}
+
+char *
+txml_node_get_value(txml_node_t *node)
+{
+    char *res;
+    TXML_NODE_RDLOCK(node);
+    res = txml_node_get_value_unlocked(node);
+    TXML_NODE_RDUNLOCK(node);
+    return res;
+}
+
+char *
+txml_node_get_name(txml_node_t *node)
+{
+    if(!node)
+        return NULL;
+    return node->name;
+}
+
+static inline void
+txml_known_namespaces_add(txml_pool_t *pool, txml_node_t *node, txml_namespace_t *ns)
+{
+    txml_namespace_set_t *new_item;
+    new_item = (txml_namespace_set_t *)TXML_POOL_ALLOC(pool, nsitems, sizeof(txml_namespace_set_t));
+    new_item->ns = ns;
+    TAILQ_INSERT_TAIL(&txml_node_ext_alloc(pool, node)->known_namespaces, new_item, next);
+}
+
+static inline void
+txml_update_known_namespaces(txml_pool_t *pool, txml_node_t *node)
+{
+    txml_namespace_t *ns;
+    txml_node_t *parent = node->parent;
+    
+    // first empty actual list
+    if (node->ext && !TAILQ_EMPTY(&node->ext->known_namespaces)) {
+        txml_namespace_set_t *old_item;
+        while((old_item = TAILQ_FIRST(&node->ext->known_namespaces))) {
+            TAILQ_REMOVE(&node->ext->known_namespaces, old_item, next);
+            TXML_POOL_FREE(pool, nsitems, old_item);
+        }
+    }
+
+    // than start populating the list with actual default namespace
+    if (TXML_NODE_CNS(node)) {
+        txml_known_namespaces_add(pool, node, node->ext->cns);
+    } else if (TXML_NODE_HNS(node)) {
+        txml_known_namespaces_add(pool, node, node->ext->hns);
+    }
+
+    // add all namespaces defined by this node
+    if (node->ext) {
+        TAILQ_FOREACH(ns, &node->ext->namespaces, list) {
+            if (ns->name) // skip an eventual default namespace since has been handled earlier
+                txml_known_namespaces_add(pool, node, ns);
+        }
+    }
+
+    // and now import namespaces already valid in the scope of our parent
+    if (parent && parent->ext) {
+        if (!TAILQ_EMPTY(&parent->ext->known_namespaces)) {
+            txml_namespace_set_t *parent_item;
+            TAILQ_FOREACH(parent_item, &parent->ext->known_namespaces, next) {
+                if (parent_item->ns->name) // skip the default namespace
+                    txml_known_namespaces_add(pool, node, parent_item->ns);
+            }
+        } else { // this shouldn't happen until known_namespaces is properly kept synchronized
+            TAILQ_FOREACH(ns, &parent->ext->namespaces, list) {
+                if (ns->name) // skip the default namespace
+                    txml_known_namespaces_add(pool, node, ns);
+            }
+        }
+    }
+}
+
+// update the namespace scope of a single node, given the default
+// namespace of the scope it has been linked into
+static inline void
+txml_update_node_namespace(txml_pool_t *pool, txml_node_t *node, txml_namespace_t *ns)
+{
+    txml_namespace_set_t *nsitem;
+    txml_namespace_t *node_ns;
+
+    if (TXML_NODE_HNS(node) != ns && !TXML_NODE_CNS(node)) // skip update if not necessary
+        txml_node_ext_alloc(pool, node)->hns = ns; 
+
+    txml_update_known_namespaces(pool, node);
+
+    node_ns = TXML_NODE_NS(node);
+    if (node_ns) { // we are bound to a specific ns.... let's see if it's known
+        int missing = 1;
+
+        TAILQ_FOREACH(nsitem, &node->ext->known_namespaces, next) 
+            if (strcmp(node_ns->uri, nsitem->ns->uri) == 0) 
+                if (!(node_ns->name && !nsitem->ns->name) && strcmp(node_ns->name, nsitem->ns->name) == 0)
+                    missing = 0;
+
+        if (missing) {
+            txml_namespace_t *new_ns;
+            char *newattr;
+
+            new_ns = txml_node_add_namespace_unlocked(pool, node, node_ns->name, node_ns->uri);
+            node->ext->ns = new_ns;
+            txml_known_namespaces_add(pool, node, new_ns);
+            newattr = malloc(strlen(new_ns->name)+7); // prefix + xmlns + :
+            sprintf(newattr, "xmlns:%s", new_ns->name);
+            // enforce the definition for our namepsace in the new context
+            txml_node_add_attribute_unlocked(pool, node, newattr, new_ns->uri); 
+            free(newattr);
+        }
+    }
+}
+
+// update the hinerited namespace across a branch.
+// This happens if a node (with all its childnodes) is moved across
+// 2 different documents. The hinerited namespace must be updated
+// accordingly to the new context, so we traverse the branches
+// under the moved node to update the the hinerited namespace where
+// necessary.
+// The branch is walked in pre-order following the parent pointers
+// (no recursion), so each node is updated after its parent.
+// NOTE: comments, cdata and text nodes don't take part in namespace
+//       scoping, so we never go below them
+static void
+txml_update_branch_namespace(txml_pool_t *pool, txml_node_t *branch, txml_namespace_t *ns)
+{
+    txml_node_t *node = branch;
+    txml_node_t *child;
+
+    for (;;) {
+        if (node->type == TXML_NODETYPE_SIMPLE) {
+            if (node == branch) {
+                txml_update_node_namespace(pool, node, ns);
+            } else {
+                txml_node_t *parent = node->parent;
+                txml_update_node_namespace(pool, node, TXML_NODE_CNS(parent)?parent->ext->cns:TXML_NODE_HNS(parent));
+            }
+            child = TAILQ_FIRST(&node->children);
+            if (child) { // update our descendants
+                node = child;
+                continue;
+            }
+        }
+        while (node != branch && !TAILQ_NEXT(node, siblings))
+            node = node->parent;
+        if (node == branch)
+            break;
+        node = TAILQ_NEXT(node, siblings);
+    }
+}
+
+static txml_err_t
+txml_node_add_child_unlocked(txml_pool_t *pool, txml_node_t *parent, txml_node_t *child)
+{
+    txml_t *xml;
+
+    if(!child)
+        return TXML_BADARGS;
+
+    // detach the child from its old parent (or from the root nodes of its old context)
+    txml_node_unlink(child);
+
+    TAILQ_INSERT_TAIL(&parent->children, child, siblings);
+    child->parent = parent;
+    txml_node_changed(parent, TXML_NODE_CHANGED_CHILDREN);
+
+    xml = txml_context_get(parent);
+    if (xml && xml->batch) {
+        // namespaces (and indexes) will be fixed up once, at the end of the batch
+        xml->batch_dirty = 1;
+        if (xml->nindexes)
+            xml->indexes_stale = 1;
+        txml_name_index_invalidate(xml);
+        txml_order_invalidate(xml);
+        return TXML_NOERR;
+    }
+    if (xml) {
+        if (xml->nindexes)
+            txml_index_branch(xml, NULL, child, 1);
+        if (xml->name_index)
+            txml_name_index_attach(xml, child);
+        txml_order_attach(xml, child);
+    }
+
+    // udate/propagate the default namespace (if any) to the newly attached node 
+    // (and all its descendants)
+    // Also scan for unknown namespaces defined/used in the newly attached branch
+    txml_update_branch_namespace(pool, child, TXML_NODE_CNS(parent)?parent->ext->cns:TXML_NODE_HNS(parent));
+    return TXML_NOERR;
+}
+
+txml_err_t
+txml_node_add_child(txml_node_t *parent, txml_node_t *child)
+{
+    txml_err_t res;
+    txml_t *from, *to;
+    txml_record_t rec[2] = { { NULL }, { NULL } };
+    TXML_NODE_WRLOCK2(parent, child);
+    TXML_NODE_EXPAND(parent);
+    // pending nodes can't leave the context owning their source
+    from = txml_context_get(child);
+    to = txml_context_get(parent);
+    if (from && from->pending && from != to)
+        txml_node_expand_branch(child);
+    if (TXML_JOURNALING())
+        txml_record_move(&rec[0], from, to, parent, child);
+    res = txml_node_add_child_unlocked(NULL, parent, child);
+    if (TXML_JOURNALING())
+        txml_record_insert(&rec[1], from, to, parent, child, res);
+    txml_record_end(&rec[0], res);
+    TXML_NODE_WRUNLOCK2(parent, child);
+    return res;
+}
+
+// namespaces already copied by txml_node_clone() (old -> new)
+typedef struct {
+    txml_namespace_t **map;
+    unsigned long count;
+    unsigned long size;
+} txml_nsmap_t;
+
+static txml_namespace_t *
+txml_nsmap_lookup(txml_nsmap_t *nsmap, txml_namespace_t *ns)
+{
+    unsigned long i;
+    for (i = 0; i < nsmap->count; i++) {
+        if (nsmap->map[2 * i] == ns)
+            return nsmap->map[2 * i + 1];
+    }
+    return ns; // defined outside of the cloned branch, fixed up later
+}
+
+static int
+txml_nsmap_add(txml_nsmap_t *nsmap, txml_namespace_t *old_ns, txml_namespace_t *new_ns)
+{
+    if (nsmap->count == nsmap->size) {
+        unsigned long size = nsmap->size ? nsmap->size * 2 : 8;
+        txml_namespace_t **map = realloc(nsmap->map, 2 * size * sizeof(txml_namespace_t *));
+        if (!map)
+            return -1;
+        nsmap->map = map;
+        nsmap->size = size;
+    }
+    nsmap->map[2 * nsmap->count] = old_ns;
+    nsmap->map[2 * nsmap->count + 1] = new_ns;
+    nsmap->count++;
+    return 0;
+}
+
+// copy a single node (without its children)
+static txml_node_t *
+txml_node_clone_one(txml_node_t *node, txml_t *xml, txml_nsmap_t *nsmap)
+{
+    txml_node_t *copy = txml_node_alloc(NULL, node->type);
+    txml_attribute_t *attr, *new_attr;
+    txml_namespace_t *ns, *new_ns;
+
+    if (!copy)
+        return NULL;
+
+    if (node->type != TXML_NODETYPE_SIMPLE) {
+        copy->name = node->name; // static string
+    } else if (xml && (copy->name = txml_name_intern(&xml->names, node->name))) {
+        copy->flags |= TXML_NODE_FLAG_INTERNED_NAME;
+    } else if (!(copy->name = txml_strdup(NULL, node->name))) {
+        free(copy);
+        return NULL;
+    }
+    copy->value = txml_strdup_value(NULL, node->value);
+
+    TAILQ_FOREACH(attr, &node->attributes, list) {
+        new_attr = (txml_attribute_t *)calloc(1, sizeof(txml_attribute_t));
+        if (!new_attr) {
+            txml_node_destroy_unlocked(copy);
+            return NULL;
+        }
+        new_attr->name = txml_strdup(NULL, attr->name);
+        new_attr->value = txml_strdup_value(NULL, attr->value);
+        new_attr->node = copy;
+        TAILQ_INSERT_TAIL(&copy->attributes, new_attr, list);
+    }
+
+    if (node->ext) {
+        TAILQ_FOREACH(ns, &node->ext->namespaces, list) {
+            new_ns = txml_node_add_namespace_unlocked(NULL, copy, ns->name, ns->uri);
+            if (!new_ns || txml_nsmap_add(nsmap, ns, new_ns) != 0) {
+                txml_node_destroy_unlocked(copy);
+                return NULL;
+            }
+        }
+        if (node->ext->ns)
+            txml_node_ext(copy)->ns = txml_nsmap_lookup(nsmap, node->ext->ns);
+        if (node->ext->cns)
+            txml_node_ext(copy)->cns = txml_nsmap_lookup(nsmap, node->ext->cns);
+    }
+    return copy;
+}
+
+static txml_node_t *
+txml_node_clone_unlocked(txml_node_t *node, txml_t *xml)
+{
+    txml_node_t **stack = NULL; // pairs of (original, copy) whose children are still to be copied
+    unsigned long depth = 0, size = 0;
+    txml_nsmap_t nsmap = { NULL, 0, 0 };
+    txml_node_t *root, *child, *orig, *copy, *p;
+    txml_namespace_t *dns = NULL;
+
+    root = txml_node_clone_one(node, xml, &nsmap);
+    if (!root)
+        goto error;
+
+    // the default namespace inherited by the original is declared on the copy
+    if (node->type == TXML_NODETYPE_SIMPLE && !TXML_NODE_CNS(node)) {
+        dns = TXML_NODE_HNS(node);
+        for (p = node->parent; !dns && p; p = p->parent)
+            dns = TXML_NODE_CNS(p);
+    }
+    if (dns) {
+        if (!(txml_node_ext(root)->cns = txml_node_add_namespace_unlocked(NULL, root, NULL, dns->uri)) ||
+            txml_node_add_attribute_unlocked(NULL, root, "xmlns", dns->uri) != TXML_NOERR)
+        {
+            goto error;
+        }
+        root->ext->hns = root->ext->cns; // as the original, it's in that namespace
+    }
+
+    orig = node;
+    copy = root;
+    TXML_NODE_EXPAND(node);
+    for (;;) {
+        TAILQ_FOREACH(child, &orig->children, siblings) {
+            txml_node_t *new_child = txml_node_clone_one(child, xml, &nsmap);
+            if (!new_child)
+                goto error;
+            TAILQ_INSERT_TAIL(&copy->children, new_child, siblings);
+            new_child->parent = copy;
+            TXML_NODE_EXPAND(child);
+            if (TAILQ_EMPTY(&child->children))
+                continue;
+            if (depth == size) {
+                txml_node_t **new_stack;
+                size = size ? size * 2 : 32;
+                new_stack = realloc(stack, 2 * size * sizeof(txml_node_t *));
+                if (!new_stack)
+                    goto error;
+                stack = new_stack;
+            }
+            stack[2 * depth] = child;
+            stack[2 * depth + 1] = new_child;
+            depth++;
+        }
+        if (!depth)
+            break;
+        depth--;
+        orig = stack[2 * depth];
+        copy = stack[2 * depth + 1];
+    }
+    free(stack);
+
+    // resolve the namespaces defined outside of the cloned branch
+    // (and the inherited ones) once, now that the whole branch is there
+    txml_update_branch_namespace(NULL, root, NULL);
+    free(nsmap.map);
+    return root;
+
+error:
+    if (root)
+        txml_node_destroy_unlocked(root);
+    free(stack);
+    free(nsmap.map);
+    return NULL;
+}
+
+txml_node_t *
+txml_node_clone(txml_node_t *node, txml_t *target_ctx)
+{
+    txml_node_t *res;
+    if (!node)
+        return NULL;
+    TXML_NODE_RDLOCK(node);
+    res = txml_node_clone_unlocked(node, target_ctx);
+    TXML_NODE_RDUNLOCK(node);
+    return res;
+}
+
+void
+txml_batch_begin(txml_t *xml)
+{
+    TXML_WRLOCK(xml);
+    xml->batch++;
+}
+
+txml_err_t
+txml_batch_end(txml_t *xml)
+{
+    txml_node_t *rnode;
+
+    if (!xml->batch)
+        return TXML_GENERIC_ERR; // not holding the lock, nothing to release
+
+    if (--xml->batch == 0 && xml->batch_dirty) {
+        // propagate the namespace scopes across the whole document, once
+        TAILQ_FOREACH(rnode, &xml->root_elements, siblings)
+            txml_update_branch_namespace(&xml->pool, rnode, NULL);
+        xml->batch_dirty = 0;
+    }
+    if (!xml->batch && xml->indexes_stale)
+        txml_indexes_rebuild(xml);
+    TXML_WRUNLOCK(xml);
+    return TXML_NOERR;
+}
+
+static txml_node_t *
+txml_node_next_sibling_unlocked(txml_node_t *node)
+{
+    return TAILQ_NEXT(node, siblings);
+}
+
+txml_node_t *
+txml_node_next_sibling(txml_node_t *node)
+{
+    txml_node_t *res;
+    TXML_NODE_RDLOCK(node);
+    res = txml_node_next_sibling_unlocked(node);
+    TXML_NODE_RDUNLOCK(node);
+    return res;
+}
+
+static txml_node_t *
+txml_node_prev_sibling_unlocked(txml_node_t *node)
+{
+    return TAILQ_PREV(node, nodelist_head, siblings);
+}
+
+txml_node_t *
+txml_node_prev_sibling(txml_node_t *node)
+{
+    txml_node_t *res;
+    TXML_NODE_RDLOCK(node);
+    res = txml_node_prev_sibling_unlocked(node);
+    TXML_NODE_RDUNLOCK(node);
+    return res;
+}
+
+//
+// ITERATORS
+//
+
+struct __txml_iter_s {
+    txml_node_t *root;
+    txml_node_t *node;  // last returned node
+    unsigned int depth; // depth of the last returned node (relative to root)
+    int order;
+    int started;
+    int skip;
+};
+
+txml_iter_t *
+txml_iter_create(txml_node_t *root, int order)
+{
+    txml_iter_t *iter;
+
+    if (!root || (order != TXML_ITER_PREORDER && order != TXML_ITER_POSTORDER))
+        return NULL;
+
+    iter = (txml_iter_t *)calloc(1, sizeof(txml_iter_t));
+    if (!iter)
+        return NULL;
+    iter->root = root;
+    iter->order = order;
+    return iter;
+}
+
+// follow the first children down to the deepest one
+static inline txml_node_t *
+txml_iter_leftmost(txml_iter_t *iter, txml_node_t *node)
+{
+    txml_node_t *child;
+    for (;;) {
+        TXML_NODE_EXPAND(node);
+        if (!(child = TAILQ_FIRST(&node->children)))
+            break;
+        node = child;
+        iter->depth++;
+    }
+    return node;
+}
+
+static txml_node_t *
+txml_iter_next_unlocked(txml_iter_t *iter)
+{
+    txml_node_t *node = iter->node;
+    txml_node_t *next;
+
+    if (!iter->started) {
+        iter->started = 1;
+        iter->depth = 0;
+        if (iter->order == TXML_ITER_PREORDER)
+            iter->node = iter->root;
+        else
+            iter->node = txml_iter_leftmost(iter, iter->root);
+        return iter->node;
+    }
+
+    if (!node)
+        return NULL; // already completed
+
+    if (iter->order == TXML_ITER_POSTORDER) {
+        if (node == iter->root) {
+            iter->node = NULL;
+        } else if ((next = TAILQ_NEXT(node, siblings))) {
+            iter->node = txml_iter_leftmost(iter, next);
+        } else {
+            iter->node = node->parent;
+            iter->depth--;
+        }
+        return iter->node;
+    }
+
+    // pre-order
+    if (!iter->skip)
+        TXML_NODE_EXPAND(node);
+    if (!iter->skip && (next = TAILQ_FIRST(&node->children))) {
+        iter->node = next;
+        iter->depth++;
+        return next;
+    }
+    iter->skip = 0;
+    while (node != iter->root) {
+        if ((next = TAILQ_NEXT(node, siblings))) {
+            iter->node = next;
+            return next;
+        }
+        node = node->parent;
+        iter->depth--;
+    }
+    iter->node = NULL;
+    return NULL;
+}
+
+txml_node_t *
+txml_iter_next(txml_iter_t *iter)
+{
+    txml_node_t *res;
+    TXML_NODE_RDLOCK(iter->root);
+    res = txml_iter_next_unlocked(iter);
+    TXML_NODE_RDUNLOCK(iter->root);
+    return res;
+}
+
+unsigned int
+txml_iter_depth(txml_iter_t *iter)
+{
+    return iter->depth;
+}
+
+void
+txml_iter_skip(txml_iter_t *iter)
+{
+    if (iter->order == TXML_ITER_PREORDER)
+        iter->skip = 1;
+}
+
+void
+txml_iter_destroy(txml_iter_t *iter)
+{
+    free(iter);
+}
+
+static txml_err_t
+txml_add_root_node_unlocked(txml_t *xml, txml_node_t *node)
+{
+    if(!node)
+        return TXML_BADARGS;
+
+    if (!TAILQ_EMPTY(&xml->root_elements) && !xml->allow_multiple_root_nodes) {
+        return TXML_MROOT_ERR;
+    }
+
+    TAILQ_INSERT_TAIL(&xml->root_elements, node, siblings);
+    txml_node_ext_alloc(&xml->pool, node)->context = xml;
+    xml->snapshot_stale = 1;
+    if (xml->reload)
+        xml->reload->root = NULL;
+    if (node->type == TXML_NODETYPE_SIMPLE)
+        txml_update_known_namespaces(&xml->pool, node);
+    if (xml->nindexes)
+        txml_index_branch(xml, NULL, node, 1);
+    txml_name_index_attach(xml, node);
+    txml_order_attach(xml, node);
+    return TXML_NOERR;
+}
+
+txml_err_t
+txml_add_root_node(txml_t *xml, txml_node_t *node)
+{
+    txml_err_t res;
+    txml_record_t rec = { NULL };
+    TXML_WRLOCK(xml);
+    res = txml_add_root_node_unlocked(xml, node);
+    if (TXML_JOURNALING() && res == TXML_NOERR && txml_record_begin(&rec, xml, 'N')) {
+        txml_record_added(&rec, NULL, node);
+        txml_record_branch(&rec, xml, node);
+    }
+    txml_record_end(&rec, res);
+    TXML_WRUNLOCK(xml);
+    return res;
+}
+
+static txml_err_t
+txml_node_add_attribute_unlocked(txml_pool_t *pool, txml_node_t *node, char *name, char *val)
+{
+    txml_attribute_t *attr;
+    txml_t *xml;
+
+    if(!name || !node)
+        return TXML_BADARGS;
+
+    attr = (txml_attribute_t *)TXML_POOL_ALLOC(pool, attributes, sizeof(txml_attribute_t));
+    if (!attr)
+        return TXML_MEMORY_ERR;
+    attr->name = txml_strdup(pool, name);
+    attr->value = txml_strdup_value(pool, val);
+    attr->node = node;
+
+    TAILQ_INSERT_TAIL(&node->attributes, attr, list);
+    txml_node_changed(node, TXML_NODE_CHANGED_SELF);
+    if ((xml = txml_index_context(node)))
+        txml_index_attribute(xml, NULL, attr, 1);
+    return TXML_NOERR;
+}
+
+txml_err_t
+txml_node_add_attribute(txml_node_t *node, char *name, char *val)
+{
+    txml_err_t res;
+    txml_record_t rec = { NULL };
+    TXML_NODE_WRLOCK(node);
+    if (TXML_JOURNALING() && txml_record_begin(&rec, txml_context_get(node), 'A')) {
+        txml_record_node(&rec, node);
+        txml_record_string(&rec, name);
+        txml_record_string(&rec, val);
+    }
+    res = txml_node_add_attribute_unlocked(NULL, node, name, val);
+    txml_record_end(&rec, res);
+    TXML_NODE_WRUNLOCK(node);
+    return res;
+}
+
+static int
+txml_node_remove_attribute_unlocked(txml_node_t *node, unsigned long index)
+{
+    txml_attribute_t *attr, *tmp;
+    txml_t *xml;
+    int count = 0;
+
+    TAILQ_FOREACH_SAFE(attr, &node->attributes, list, tmp) {
+        if (count++ == index) {
+            if ((xml = txml_index_context(node)))
+                txml_index_attribute(xml, NULL, attr, 0);
+            TAILQ_REMOVE(&node->attributes, attr, list);
+            txml_attribute_source_forget(node, attr);
+            free(attr->name);
+            txml_free_value(NULL, attr->value);
+            free(attr);
+            txml_node_changed(node, TXML_NODE_CHANGED_SELF);
+            return TXML_NOERR;
+        }
+    }
+    return TXML_GENERIC_ERR;
+}
+
+int
+txml_node_remove_attribute(txml_node_t *node, unsigned long index)
+{
+    int res;
+    txml_record_t rec = { NULL };
+    TXML_NODE_WRLOCK(node);
+    if (TXML_JOURNALING() && txml_record_begin(&rec, txml_context_get(node), 'R')) {
+        txml_record_node(&rec, node);
+        txml_record_number(&rec, index);
+    }
+    res = txml_node_remove_attribute_unlocked(node, index);
+    txml_record_end(&rec, res);
+    TXML_NODE_WRUNLOCK(node);
+    return res;
+}
+
+static void
+txml_node_clear_attributes_unlocked(txml_node_t *node)
+{
+    txml_attribute_t *attr, *tmp;
+    txml_t *xml = txml_index_context(node);
+
+    TAILQ_FOREACH_SAFE(attr, &node->attributes, list, tmp) {
+        if (xml)
+            txml_index_attribute(xml, NULL, attr, 0);
+        TAILQ_REMOVE(&node->attributes, attr, list);
+        free(attr->name);
+        txml_free_value(NULL, attr->value);
+        free(attr);
+    }
+    txml_attribute_source_forget(node, NULL);
+    txml_node_changed(node, TXML_NODE_CHANGED_SELF);
+}
+
+void
+txml_node_clear_attributes(txml_node_t *node)
+{
+    txml_record_t rec = { NULL };
+    TXML_NODE_WRLOCK(node);
+    if (TXML_JOURNALING() && txml_record_begin(&rec, txml_context_get(node), 'X'))
+        txml_record_node(&rec, node);
+    txml_node_clear_attributes_unlocked(node);
+    txml_record_end(&rec, TXML_NOERR);
+    TXML_NODE_WRUNLOCK(node);
+}
+
+static txml_attribute_t
+*txml_node_get_attribute_byname_unlocked(txml_node_t *node, char *name)
+{
+    txml_attribute_t *attr;
+    TAILQ_FOREACH(attr, &node->attributes, list) {
+        if (strcmp(attr->name, name) == 0)
+            return attr;
+    }
+    return NULL;
+}
+
+txml_attribute_t *
+txml_node_get_attribute_byname(txml_node_t *node, char *name)
+{
+    txml_attribute_t *res;
+    TXML_NODE_RDLOCK(node);
+    res = txml_node_get_attribute_byname_unlocked(node, name);
+    TXML_NODE_RDUNLOCK(node);
+    return res;
+}
+
+static txml_attribute_t
+*txml_node_get_attribute_unlocked(txml_node_t *node, unsigned long index)
+{
+    txml_attribute_t *attr;
+    int count = 0;
+    TAILQ_FOREACH(attr, &node->attributes, list) {
+        if (count++ == index)
+            return attr;
+    }
+    return NULL;
+}
+
+txml_attribute_t *
+txml_node_get_attribute(txml_node_t *node, unsigned long index)
+{
+    txml_attribute_t *res;
+    TXML_NODE_RDLOCK(node);
+    res = txml_node_get_attribute_unlocked(node, index);
+    TXML_NODE_RDUNLOCK(node);
+    return res;
+}
+
+char *
+txml_attribute_get_name(txml_attribute_t *attr)
+{
+    if (!attr)
+        return NULL;
+    return attr->name;
+}
+
+static char *
+txml_attribute_get_value_unlocked(txml_attribute_t *attr)
+{
+    if (!attr)
+        return NULL;
+    return attr->value;
+}
+
+char *
+txml_attribute_get_value(txml_attribute_t *attr)
+{
+    char *res;
+    TXML_NODE_RDLOCK(attr->node);
+    res = txml_attribute_get_value_unlocked(attr);
+    TXML_NODE_RDUNLOCK(attr->node);
+    return res;
+}
+
+//
+// TYPED VALUES
+// Numbers and booleans decoded straight from the value strings, without
+// allocating and whatever the locale. The last value decoded from a node is
+// cached in the node itself, until its value changes (see txml_node_changed())
+//
+
+static const double txml_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#define TXML_IS_BLANK(__c) ((__c) == ' ' || (__c) == '\t' || (__c) == '\r' || (__c) == '\n')
+
+// the span of a value without the surrounding whitespace, NULL if empty
+static char *
+txml_typed_trim(char *string, char **end)
+{
+    char *e;
+
+    while (TXML_IS_BLANK(*string))
+        string++;
+    if (!*string)
+        return NULL;
+    for (e = string + strlen(string); TXML_IS_BLANK(e[-1]); e--)
+        ;
+    *end = e;
+    return string;
+}
+
+static int
+txml_parse_int64(char *string, int64_t *value)
+{
+    unsigned long long n = 0, max = INT64_MAX;
+    char *p, *end;
+    int neg = 0;
+
+    if (!(p = txml_typed_trim(string, &end)))
+        return -1;
+    if (*p == '-' || *p == '+') {
+        neg = (*p++ == '-');
+        if (neg)
+            max++;
+    }
+    if (p == end)
+        return -1;
+    for (; p < end; p++) {
+        if (*p < '0' || *p > '9' || n > (max - (*p - '0')) / 10)
+            return -1;
+        n = n * 10 + (*p - '0');
+    }
+    *value = neg ? (int64_t)(0 - n) : (int64_t)n;
+    return 0;
+}
+
+#ifdef WIN32
+typedef _locale_t txml_locale_t;
+#define txml_locale_create() _create_locale(LC_NUMERIC, "C")
+#define txml_locale_free(_loc) _free_locale(_loc)
+#else
+typedef locale_t txml_locale_t;
+#define txml_locale_create() newlocale(LC_NUMERIC_MASK, "C", (locale_t)0)
+#define txml_locale_free(_loc) freelocale(_loc)
+#endif
+
+static txml_locale_t txml_c_locale;
+
+// the "C" locale, created by the first caller and kept for the lifetime of the process
+static txml_locale_t
+txml_c_locale_get(void)
+{
+    txml_locale_t loc = __atomic_load_n(&txml_c_locale, __ATOMIC_ACQUIRE);
+    txml_locale_t current = (txml_locale_t)0;
+
+    if (loc || !(loc = txml_locale_create()))
+        return loc;
+    if (!__atomic_compare_exchange_n(&txml_c_locale, &current, loc, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        txml_locale_free(loc); // created by another thread meanwhile
+        loc = current;
+    }
+    return loc;
+}
+
+// the fallback for the numbers which can't be converted exactly by txml_parse_double().
+// The span has been checked already, strtod() stops at its end (a blank or the terminator)
+static int
+txml_parse_double_slow(char *start, char *end, double *value)
+{
+    txml_locale_t loc = txml_c_locale_get();
+    char *stop;
+
+    if (!loc)
+        return -1;
+#ifdef WIN32
+    *value = _strtod_l(start, &stop, loc);
+#else
+    // the locale of the calling thread only, the other threads aren't affected
+    loc = uselocale(loc);
+    *value = strtod(start, &stop);
+    uselocale(loc);
+#endif
+    return (stop == end) ? 0 : -1;
+}
+
+// xsd:double lexical space ( "-1.5E3", ".5", "INF", "-INF", "NaN" ...)
+static int
+txml_parse_double(char *string, double *value)
+{
+    unsigned long long mantissa = 0;
+    int digits = 0, exponent = 0, exact = 1, any = 0;
+    int neg = 0, eneg = 0, e = 0;
+    char *p, *start, *end;
+    double d;
+
+    if (!(start = txml_typed_trim(string, &end)))
+        return -1;
+    p = start;
+    if (end - p == 3 && strncmp(p, "NaN", 3) == 0) {
+        *value = NAN;
+        return 0;
+    }
+    if (*p == '-' || *p == '+')
+        neg = (*p++ == '-');
+    if (end - p == 3 && strncmp(p, "INF", 3) == 0) {
+        *value = neg ? -HUGE_VAL : HUGE_VAL;
+        return 0;
+    }
+    // up to 19 significant digits fit the mantissa
+    for (; p < end && *p >= '0' && *p <= '9'; p++, any = 1) {
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits += (mantissa != 0);
+        } else {
+            exponent++;
+            exact &= (*p == '0');
+        }
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++, any = 1) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits += (mantissa != 0);
+                exponent--;
+            } else {
+                exact &= (*p == '0');
+            }
+        }
+    }
+    if (!any)
+        return -1;
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        if (++p < end && (*p == '-' || *p == '+'))
+            eneg = (*p++ == '-');
+        if (p == end)
+            return -1;
+        for (; p < end && *p >= '0' && *p <= '9'; p++) {
+            if (e < 100000)
+                e = e * 10 + (*p - '0');
+        }
+        exponent += eneg ? -e : e;
+    }
+    if (p != end)
+        return -1;
+
+    // exact when both the mantissa and the power of ten are exact doubles
+    if (!exact || mantissa > (1ULL << 53) || exponent < -22 || exponent > 22)
+        return txml_parse_double_slow(start, end, value);
+    d = (double)mantissa;
+    d = (exponent < 0) ? d / txml_pow10[-exponent] : d * txml_pow10[exponent];
+    *value = neg ? -d : d;
+    return 0;
+}
+
+// xsd:boolean lexical space ( "true", "false", "1", "0" )
+static int
+txml_parse_bool(char *string, int *value)
+{
+    char *p, *end;
+    size_t len;
+
+    if (!(p = txml_typed_trim(string, &end)))
+        return -1;
+    len = end - p;
+    if ((len == 4 && strncmp(p, "true", 4) == 0) || (len == 1 && *p == '1'))
+        *value = 1;
+    else if ((len == 5 && strncmp(p, "false", 5) == 0) || (len == 1 && *p == '0'))
+        *value = 0;
+    else
+        return -1;
+    return 0;
+}
+
+// decode a value as 'kind', storing the result in 'bits'
+static int
+txml_typed_parse(char *string, int kind, unsigned long long *bits)
+{
+    int64_t i;
+    double d;
+    int b;
+
+    switch (kind) {
+        case TXML_TYPED_INT64:
+            if (txml_parse_int64(string, &i) != 0)
+                return -1;
+            *bits = (unsigned long long)i;
+            return 0;
+        case TXML_TYPED_DOUBLE:
+            if (txml_parse_double(string, &d) != 0)
+                return -1;
+            memcpy(bits, &d, sizeof(d));
+            return 0;
+        default:
+            if (txml_parse_bool(string, &b) != 0)
+                return -1;
+            *bits = b;
+            return 0;
+    }
+}
+
+// the value of 'kind' cached in a node, if any. Readers cache values
+// concurrently, so the state is checked again once the value has been read
+static inline int
+txml_typed_lookup(txml_node_t *node, int kind, unsigned long long *bits)
+{
+    unsigned short state = __atomic_load_n(&node->typed, __ATOMIC_ACQUIRE);
+
+    if ((state & TXML_TYPED_MASK) != TXML_TYPED_STATE(kind))
+        return 0;
+    *bits = __atomic_load_n(&node->decoded, __ATOMIC_ACQUIRE);
+    return (__atomic_load_n(&node->typed, __ATOMIC_RELAXED) == state);
+}
+
+// cache a value decoded by a reader (unless another one is doing the same)
+static inline void
+txml_typed_store(txml_node_t *node, int kind, unsigned long long bits)
+{
+    unsigned short state = __atomic_load_n(&node->typed, __ATOMIC_RELAXED);
+
+    if ((state & TXML_TYPED_BUSY) ||
+        !__atomic_compare_exchange_n(&node->typed, &state, state | TXML_TYPED_BUSY, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+    __atomic_store_n(&node->decoded, bits, __ATOMIC_RELEASE);
+    __atomic_store_n(&node->typed, ((state + TXML_TYPED_GEN) & ~TXML_TYPED_MASK) | TXML_TYPED_STATE(kind),
+                     __ATOMIC_RELEASE);
+}
+
+static txml_err_t
+txml_node_get_typed(txml_node_t *node, int kind, unsigned long long *bits)
+{
+    txml_err_t res = TXML_NOERR;
+
+    if (!node)
+        return TXML_BADARGS;
+    TXML_NODE_RDLOCK(node);
+    if (!txml_typed_lookup(node, kind, bits)) {
+        if (txml_typed_parse(node->value, kind, bits) == 0)
+            txml_typed_store(node, kind, *bits);
+        else
+            res = TXML_BAD_VALUE;
+    }
+    TXML_NODE_RDUNLOCK(node);
+    return res;
+}
+
+static txml_err_t
+txml_attribute_get_typed(txml_attribute_t *attr, int kind, unsigned long long *bits)
+{
+    txml_err_t res = TXML_NOERR;
+
+    if (!attr)
+        return TXML_BADARGS;
+    TXML_NODE_RDLOCK(attr->node);
+    if (txml_typed_parse(attr->value, kind, bits) != 0)
+        res = TXML_BAD_VALUE;
+    TXML_NODE_RDUNLOCK(attr->node);
+    return res;
+}
+
+txml_err_t
+txml_node_get_int64(txml_node_t *node, int64_t *value)
+{
+    unsigned long long bits;
+    txml_err_t res = txml_node_get_typed(node, TXML_TYPED_INT64, &bits);
+    if (res == TXML_NOERR)
+        *value = (int64_t)bits;
+    return res;
+}
+
+txml_err_t
+txml_node_get_double(txml_node_t *node, double *value)
+{
+    unsigned long long bits;
+    txml_err_t res = txml_node_get_typed(node, TXML_TYPED_DOUBLE, &bits);
+    if (res == TXML_NOERR)
+        memcpy(value, &bits, sizeof(double));
+    return res;
+}
+
+txml_err_t
+txml_node_get_bool(txml_node_t *node, int *value)
+{
+    unsigned long long bits;
+    txml_err_t res = txml_node_get_typed(node, TXML_TYPED_BOOL, &bits);
+    if (res == TXML_NOERR)
+        *value = (int)bits;
+    return res;
+}
+
+txml_err_t
+txml_attribute_get_int64(txml_attribute_t *attr, int64_t *value)
+{
+    unsigned long long bits;
+    txml_err_t res = txml_attribute_get_typed(attr, TXML_TYPED_INT64, &bits);
+    if (res == TXML_NOERR)
+        *value = (int64_t)bits;
+    return res;
+}
+
+txml_err_t
+txml_attribute_get_double(txml_attribute_t *attr, double *value)
+{
+    unsigned long long bits;
+    txml_err_t res = txml_attribute_get_typed(attr, TXML_TYPED_DOUBLE, &bits);
+    if (res == TXML_NOERR)
+        memcpy(value, &bits, sizeof(double));
+    return res;
+}
+
+txml_err_t
+txml_attribute_get_bool(txml_attribute_t *attr, int *value)
+{
+    unsigned long long bits;
+    txml_err_t res = txml_attribute_get_typed(attr, TXML_TYPED_BOOL, &bits);
+    if (res == TXML_NOERR)
+        *value = (int)bits;
+    return res;
+}
+
+static txml_err_t
+txml_extra_node_handler(txml_t *xml, char *content, char type)
+{
+    txml_node_t *new_node = NULL;
+    txml_err_t res = TXML_NOERR;
+
+    new_node = txml_node_create_special(&xml->pool, type, content, NULL);
+    if(!new_node) {
+        /* XXX - ERROR MESSAGES HERE */
+        res = TXML_GENERIC_ERR;
+        return res;
+    }
+    if(xml->cnode) {
+        res = txml_node_add_child_unlocked(&xml->pool, xml->cnode, new_node);
+        if(res != TXML_NOERR) {
+            txml_node_destroy_unlocked(new_node);
+            return res;
+        }
+    } else {
+        res = txml_add_root_node_unlocked(xml, new_node) ;
+        if(res != TXML_NOERR) {
+            txml_node_destroy_unlocked(new_node);
+            return res;
+        }
+    }
+    return res;
+}
+
+// 'position' is where the start tag begins in the source document and 'sources' holds,
+// for each attribute, the position of its name, the position and the length of its value
+// (if tracked, TXML_SPAN_NONE and NULL otherwise)
+static txml_err_t
+txml_start_handler(txml_t *xml, char *element, char **attr_names, char **attr_values,
+                   size_t position, size_t *sources)
+{
+    txml_node_t *new_node = NULL;
+    unsigned int offset = 0;
+    txml_err_t res = TXML_NOERR;
+    char *nodename = NULL;
+    char *nssep = NULL;
+
+    if(!element || strlen(element) == 0)
+        return TXML_BADARGS;
+
+    // unescape read element to be used as nodename
+    // (it's a scratch copy owned by the parser, so we can do it in place)
+    if (txml_unescape(element, element) != 0)
+        return TXML_BAD_CHARS;
+    nodename = element;
+    if (sources) {
+        while (attr_names && attr_names[offset])
+            offset++;
+    }
+
+    if ((nssep = strchr(nodename, ':'))) { // a namespace is defined
+        txml_namespace_t *ns = NULL;
+        *nssep = 0; // nodename now starts with the null-terminated namespace 
+                    // followed by the real name (nssep + 1)
+        new_node = sources ? txml_node_create_source(&xml->pool, nssep+1, offset)
+                           : txml_node_create_simple(&xml->pool, nssep+1, NULL);
+        if (xml->cnode)
+            ns = txml_node_get_namespace_byname_unlocked(xml->cnode, nodename);
+        if (!ns) { 
+            // TODO - Error condition
+        } else if (new_node) {
+            txml_node_ext_alloc(&xml->pool, new_node)->ns = ns;
+        }
+    } else {
+        new_node = sources ? txml_node_create_source(&xml->pool, nodename, offset)
+                           : txml_node_create_simple(&xml->pool, nodename, NULL);
+    }
+    offset = 0;
+    if(!new_node || !new_node->name) {
+        /* XXX - ERROR MESSAGES HERE */
+        return TXML_MEMORY_ERR;
+    }
+    if (sources) // the end is known once the end tag is reached
+        TXML_NODE_SOURCE(new_node)->element.start = position;
+    /* handle attributes if present */
+    if(attr_names && attr_values) {
+        while(attr_names[offset] != NULL) {
+            char *nsp = NULL;
+            res = txml_node_add_attribute_unlocked(&xml->pool, new_node, attr_names[offset], attr_values[offset]);
+            if(res != TXML_NOERR) {
+                txml_node_destroy_unlocked(new_node);
+                return res;
+            }
+            if (sources) {
+                txml_attribute_source_t *source = &TXML_NODE_SOURCE(new_node)->attrs[offset];
+                source->attr = TAILQ_LAST(&new_node->attributes, attrlist_head);
+                source->start = sources[3*offset];
+                source->value.start = sources[3*offset+1];
+                source->value.len = sources[3*offset+2];
+            }
+            if ((nsp = txml_strcasestr(attr_names[offset], "xmlns"))) {
+                if ((nssep = strchr(nsp, ':'))) {  // declaration of a new namespace
+                    *nssep = 0;
+                    txml_node_add_namespace_unlocked(&xml->pool, new_node, nssep+1, attr_values[offset]);
+                } else { // definition of the default ns
+                    txml_node_ext_alloc(&xml->pool, new_node)->cns = txml_node_add_namespace_unlocked(&xml->pool, new_node, NULL, attr_values[offset]);
+                }
+            }
+            offset++;
+        }
+    }
+    if(xml->cnode) {
+        res = txml_node_add_child_unlocked(&xml->pool, xml->cnode, new_node);
+        if(res != TXML_NOERR) {
+            txml_node_destroy_unlocked(new_node);
+            return res;
+        }
+    } else {
+        res = txml_add_root_node_unlocked(xml, new_node) ;
+        if(res != TXML_NOERR) {
+            txml_node_destroy_unlocked(new_node);
+            return res;
+        }
+    }
+    xml->cnode = new_node;
+
+    return res;
+}
+
+static txml_err_t
+txml_end_handler(txml_t *xml, char *element)
+{
+    txml_node_t *parent;
+    if(xml->cnode) {
+        parent = xml->cnode->parent;
+        xml->cnode = parent;
+        return TXML_NOERR;
+    }
+    return TXML_GENERIC_ERR;
+}
+
+// 'position' is where the text starts in the source document, TXML_SPAN_NONE if not tracked
+static txml_err_t
+txml_value_handler(txml_t *xml, char *text, size_t position)
+{
+    txml_node_source_t *source;
+    char *raw = text;
+    char *p;
+    if(text) {
+        // remove heading blanks
+        if (xml->ignore_white_spaces) { // first check if we want to ignore any kind of whitespace between nodes
+                                      // (which means : 'no whitespace-only values' and 'any value will be trimmed')
+            while((*text == ' ' || *text == '\t' || *text == '\r' || *text == '\n') &&
+                   *text != 0)
+            {
+                text++;
+            }
+        } else if (xml->ignore_blanks) { // or if perhaps we want to consider pure whitespaces: ' '
+                                        // as part of the value. (but we still want to skip newlines and
+                                        // tabs, which are assumed to be there to prettify the text layout
+            while((*text == '\t' || *text == '\r' || *text == '\n') && 
+                   *text != 0)
+            {
+                text++;
+            }
+        }
+
+        p = text+strlen(text)-1;
+
+        // remove trailing blanks
+        if (xml->ignore_white_spaces) { // XXX - read above
+            while((*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') &&
+                    p != text)
+            {
+                *p = 0;
+                p--;
+            }
+        } else if (xml->ignore_blanks) { // XXX = read above
+            while((*p == '\t' || *p == '\r' || *p == '\n') &&
+                    p != text)
+            {
+                *p = 0;
+                p--;
+            }
+        }
+
+        if(xml->cnode)  {
+            if (position != TXML_SPAN_NONE && (source = TXML_NODE_SOURCE(xml->cnode))) {
+                // the value in place of what came before (as it happens to the value itself)
+                source->value.start = position + (text - raw);
+                source->value.len = strlen(text);
+            }
+            // the text is a scratch copy owned by the parser, unescape it in place
+            if (txml_unescape(text, text) != 0)
+                return TXML_BAD_CHARS;
+            txml_node_set_value_unlocked(&xml->pool, xml->cnode, text);
+        } else {
+            fprintf(stderr, "ctag == NULL while handling a value!!");
+        }
+        return TXML_NOERR;
+    }
+    return TXML_GENERIC_ERR;
+}
+
+
+//
+// PARSER SCRATCH SPACE
+// All the temporary copies made while parsing a tag or a value live in the
+// scratch buffer of the context, which is reused for the whole document
+// (and across documents if retention is enabled)
+//
+
+static inline void
+txml_scratch_reset(txml_scratch_t *scratch)
+{
+    scratch->text.len = 0;
+}
+
+// copy a string to the scratch buffer and return its offset
+static size_t
+txml_scratch_add(txml_scratch_t *scratch, char *string, size_t len)
+{
+    size_t offset = scratch->text.len;
+    txml_buffer_append(&scratch->text, string, len);
+    txml_buffer_append(&scratch->text, "", 1); // keep the terminator
+    return offset;
+}
+
+// copy a (quoted) attribute value collapsing the escaped quotes
+// and replacing the entities, return its offset
+static size_t
+txml_scratch_add_value(txml_scratch_t *scratch, char *value, size_t len, char quote)
+{
+    size_t offset = scratch->text.len;
+    size_t i, j = 0;
+    char *copy;
+
+    if (txml_buffer_reserve(&scratch->text, len) != 0)
+        return offset;
+    copy = scratch->text.data + offset;
+    for (i = 0; i < len; i++) {
+        if (value[i] == quote && value[i+1] == value[i])
+            i++;
+        copy[j++] = value[i];
+    }
+    copy[j] = 0;
+    if (txml_unescape(copy, copy) != 0)
+        *copy = 0; // values with bad entities are dropped
+    scratch->text.len = offset + strlen(copy) + 1;
+    return offset;
+}
+
+static int
+txml_scratch_grow(txml_scratch_t *scratch, unsigned int size)
+{
+    size_t *offsets;
+    char **strings;
+
+    if (size <= scratch->size)
+        return 0;
+    size = size < 16 ? 16 : size * 2;
+    offsets = (size_t *)realloc(scratch->offsets, size * sizeof(size_t));
+    if (!offsets)
+        return -1;
+    scratch->offsets = offsets;
+    // 3 entries per attribute (see txml_start_handler()), offsets take 2
+    offsets = (size_t *)realloc(scratch->sources, size * 2 * sizeof(size_t));
+    if (!offsets)
+        return -1;
+    scratch->sources = offsets;
+    strings = (char **)realloc(scratch->strings, size * sizeof(char *));
+    if (!strings)
+        return -1;
+    scratch->strings = strings;
+    scratch->size = size;
+    return 0;
+}
+
+//
+// MARKUP SCANNER
+// Finds where a tag (or a comment, cdata section, processing instruction...)
+// ends without building anything. Used to skip the elements excluded by the
+// parse filter and to pre-scan documents parsed in parallel
+//
+
+#define TXML_MARKUP_START  0 // start tag
+#define TXML_MARKUP_UNIQUE 1 // empty-element tag
+#define TXML_MARKUP_END    2 // end tag
+#define TXML_MARKUP_PI     3 // processing instruction
+#define TXML_MARKUP_DECL   4 // <!ENTITY, <!DOCTYPE and the like
+#define TXML_MARKUP_OTHER  5 // comment or cdata section
+
+// 'tag' points to a '<', returns the first byte after the markup
+// or NULL if it is not terminated
+static char *
+txml_scan_markup(char *tag, int *kind)
+{
+    char *p = tag + 1;
+    char quote;
+
+    if (*p == '/') {
+        *kind = TXML_MARKUP_END;
+        p = strchr(p, '>');
+        return p ? p + 1 : NULL;
+    } else if (strncmp(p, "!--", 3) == 0) {
+        *kind = TXML_MARKUP_OTHER;
+        p = strstr(p + 3, "-->");
+        return p ? p + 3 : NULL;
+    } else if (strncmp(p, "![CDATA[", 8) == 0) {
+        *kind = TXML_MARKUP_OTHER;
+        p = strstr(p + 8, "]]>");
+        return p ? p + 3 : NULL;
+    } else if (*p == '!') {
+        *kind = TXML_MARKUP_DECL;
+        p = strchr(p, '>');
+        return p ? p + 1 : NULL;
+    } else if (*p == '?') {
+        *kind = TXML_MARKUP_PI;
+        p = strstr(p + 1, "?>");
+        return p ? p + 2 : NULL;
+    }
+    while (*p != '>' && *p != 0) {
+        if (*p == '"' || *p == '\'') {
+            quote = *p++;
+            while (*p != quote && *p != 0)
+                p++;
+            if (*p == 0)
+                return NULL;
+        }
+        p++;
+    }
+    if (*p == 0)
+        return NULL;
+    *kind = (*(p-1) == '/') ? TXML_MARKUP_UNIQUE : TXML_MARKUP_START;
+    return p + 1;
+}
+
+// 'tag' points to a start tag, returns the first byte after the element
+// or NULL if the element is not terminated
+static char *
+txml_element_end(char *tag)
+{
+    char *p = tag;
+    long depth = 0;
+    int kind;
+
+    for (;;) {
+        p = txml_scan_markup(p, &kind);
+        if (!p)
+            return NULL;
+        if (kind == TXML_MARKUP_START)
+            depth++;
+        else if (kind == TXML_MARKUP_END)
+            depth--;
+        if (depth <= 0)
+            return p;
+        p = strchr(p, '<');
+        if (!p)
+            return NULL;
+    }
+}
+
+// same as above, but an element which is not terminated extends
+// up to the end of the buffer
+static char *
+txml_skip_element(char *tag)
+{
+    char *end = txml_element_end(tag);
+    return end ? end : tag + strlen(tag);
+}
+
+//
+// PARSE FILTER
+// The parser keeps the filter state of the open elements on a stack:
+// the mode of each element and the patterns matching the path to it
+//
+
+static inline int
+txml_filter_step_match(char *step, char *name)
+{
+    return (step[0] == '*' && step[1] == 0) || strcmp(step, name) == 0;
+}
+
+static int
+txml_filter_push(txml_scratch_t *scratch, int mode, unsigned long first)
+{
+    if (scratch->depth == scratch->nlevels) {
+        unsigned long size = scratch->nlevels ? scratch->nlevels * 2 : 32;
+        txml_filter_level_t *levels = realloc(scratch->levels, size * sizeof(txml_filter_level_t));
+        if (!levels)
+            return -1;
+        scratch->levels = levels;
+        scratch->nlevels = size;
+    }
+    scratch->levels[scratch->depth].mode = mode;
+    scratch->levels[scratch->depth].first = first;
+    scratch->levels[scratch->depth].count = scratch->nalive - first;
+    scratch->depth++;
+    return 0;
+}
+
+static int
+txml_filter_add_alive(txml_scratch_t *scratch, unsigned int index)
+{
+    if (scratch->nalive == scratch->alive_size) {
+        unsigned long size = scratch->alive_size ? scratch->alive_size * 2 : 64;
+        unsigned int *alive = realloc(scratch->alive, size * sizeof(unsigned int));
+        if (!alive)
+            return -1;
+        scratch->alive = alive;
+        scratch->alive_size = size;
+    }
+    scratch->alive[scratch->nalive++] = index;
+    return 0;
+}
+
+// the document level, where all the patterns are still matching
+static txml_err_t
+txml_filter_start(txml_t *xml)
+{
+    txml_scratch_t *scratch = &xml->scratch;
+    unsigned int i;
+
+    scratch->depth = 0;
+    scratch->nalive = 0;
+    for (i = 0; i < xml->filter->count; i++) {
+        if (txml_filter_add_alive(scratch, i) != 0)
+            return TXML_MEMORY_ERR;
+    }
+    if (txml_filter_push(scratch, xml->filter->includes ? TXML_FILTER_PATH : TXML_FILTER_KEEP, 0) != 0)
+        return TXML_MEMORY_ERR;
+    return TXML_NOERR;
+}
+
+// decide what to do with a new element, if it isn't skipped it becomes
+// the top of the stack until txml_filter_leave() is called for it
+static int
+txml_filter_enter(txml_t *xml, char *name)
+{
+    txml_scratch_t *scratch = &xml->scratch;
+    txml_filter_level_t *top = &scratch->levels[scratch->depth - 1];
+    unsigned long d = scratch->depth - 1; // depth of the new element
+    unsigned long first = scratch->nalive;
+    int mode = top->mode == TXML_FILTER_KEEP ? TXML_FILTER_KEEP : TXML_FILTER_SKIP;
+    txml_filter_pattern_t *pattern;
+    unsigned long i;
+    int last;
+
+    for (i = 0; i < top->count; i++) {
+        unsigned int index = scratch->alive[top->first + i];
+        pattern = &xml->filter->patterns[index];
+        if (d >= pattern->nsteps || !txml_filter_step_match(pattern->steps[d], name))
+            continue;
+        last = (d == pattern->nsteps - 1);
+        if (pattern->exclude && last && !pattern->attr) {
+            scratch->nalive = first;
+            return TXML_FILTER_SKIP;
+        }
+        if (!pattern->exclude && top->mode == TXML_FILTER_KEEP)
+            continue; // already included
+        if (!pattern->exclude && last && !pattern->attr) {
+            mode = TXML_FILTER_KEEP;
+            continue;
+        }
+        if (!pattern->exclude && mode == TXML_FILTER_SKIP)
+            mode = TXML_FILTER_PATH;
+        if (txml_filter_add_alive(scratch, index) != 0)
+            return -1;
+    }
+    if (mode == TXML_FILTER_SKIP) {
+        scratch->nalive = first;
+        return TXML_FILTER_SKIP;
+    }
+    if (txml_filter_push(scratch, mode, first) != 0)
+        return -1;
+    return mode;
+}
+
+// called once the element on top of the stack has been closed (xml->cnode
+// is its parent again). An element kept only on the way to included nodes
+// is dropped if none has been found below it (root elements are always kept)
+static inline void
+txml_filter_leave(txml_t *xml)
+{
+    txml_scratch_t *scratch = &xml->scratch;
+    txml_node_t *node;
+
+    if (!xml->filter || scratch->depth <= 1)
+        return;
+    scratch->depth--;
+    scratch->nalive = scratch->levels[scratch->depth].first;
+    if (scratch->levels[scratch->depth].mode != TXML_FILTER_PATH || !xml->cnode)
+        return;
+    node = TAILQ_LAST(&xml->cnode->children, nodelist_head);
+    if (node && TAILQ_EMPTY(&node->children) && TAILQ_EMPTY(&node->attributes)) {
+        txml_node_unlink(node);
+        txml_node_release_branch(&xml->pool, node);
+    }
+}
+
+// values, comments and cdata sections are kept only within included elements
+static inline int
+txml_filter_keep_content(txml_t *xml)
+{
+    return !xml->filter || xml->scratch.levels[xml->scratch.depth - 1].mode == TXML_FILTER_KEEP;
+}
+
+// check an attribute of the element on top of the stack
+static int
+txml_filter_keep_attribute(txml_t *xml, char *name)
+{
+    txml_scratch_t *scratch = &xml->scratch;
+    txml_filter_level_t *top = &scratch->levels[scratch->depth - 1];
+    txml_filter_pattern_t *pattern;
+    int keep = (top->mode == TXML_FILTER_KEEP);
+    unsigned long i;
+
+    if (strncmp(name, "xmlns", 5) == 0)
+        return 1; // namespace declarations are needed to resolve the names below
+    for (i = 0; i < top->count; i++) {
+        pattern = &xml->filter->patterns[scratch->alive[top->first + i]];
+        if (!pattern->attr || pattern->nsteps != scratch->depth - 1)
+            continue;
+        if (txml_filter_step_match(pattern->attr, name)) {
+            if (pattern->exclude)
+                return 0; // exclusions win
+            keep = 1;
+        }
+    }
+    return keep;
+}
+
+//
+// LAZY PARSING
+// A document parsed lazily has only its root elements built upfront,
+// any other element is built when its parent is first accessed.
+// Each element with children not parsed yet keeps a pointer to its
+// content in the copy of the document owned by the context.
+// Skipping an element records the ranges of all the elements inside it
+// having children, so that building them later doesn't need to scan
+// their content again
+//
+
+static txml_range_t *
+txml_range_add(txml_t *xml, size_t start)
+{
+    if (xml->nranges == xml->ranges_size) {
+        unsigned long size = xml->ranges_size ? xml->ranges_size * 2 : 1024;
+        txml_range_t *ranges = realloc(xml->ranges, size * sizeof(txml_range_t));
+        if (!ranges)
+            return NULL;
+        xml->ranges = ranges;
+        xml->ranges_size = size;
+    }
+    xml->ranges[xml->nranges].start = start;
+    xml->ranges[xml->nranges].end = 0; // not known yet
+    return &xml->ranges[xml->nranges++];
+}
+
+// same as txml_element_end(), recording the ranges of the elements found
+static char *
+txml_range_scan(txml_t *xml, char *tag)
+{
+    char *p = tag;
+    unsigned long *open = NULL; // ranges of the elements not closed yet
+    unsigned long depth = 0, size = 0;
+    unsigned long first = xml->nranges;
+    int kind;
+
+    for (;;) {
+        p = txml_scan_markup(p, &kind);
+        if (!p)
+            break;
+        if (kind == TXML_MARKUP_START) {
+            if (depth == size) {
+                unsigned long *new_open;
+                size = size ? size * 2 : 64;
+                new_open = realloc(open, size * sizeof(unsigned long));
+                if (!new_open)
+                    break;
+                open = new_open;
+            }
+            if (depth)
+                xml->ranges[open[depth - 1]].end = 1; // the parent has children
+            if (!txml_range_add(xml, p - xml->source))
+                break;
+            // the range starts at the content, where the pending nodes point
+            open[depth++] = xml->nranges - 1;
+        } else if (kind == TXML_MARKUP_END && depth) {
+            if (!xml->ranges[open[--depth]].end)
+                xml->nranges--; // no elements inside (so it's the last one), it will never be pending
+            else
+                xml->ranges[open[depth]].end = p - xml->source;
+        }
+        if (depth == 0) {
+            free(open);
+            return p;
+        }
+        p = strchr(p, '<');
+        if (!p)
+            break;
+    }
+    // not terminated (or out of memory), forget about it
+    free(open);
+    xml->nranges = first;
+    return NULL;
+}
+
+// find the end of the element starting at 'tag', whose content starts at 'content'
+static char *
+txml_range_end(txml_t *xml, char *tag, char *content)
+{
+    size_t start = content - xml->source;
+    unsigned long lo = 0, hi = xml->nranges, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (xml->ranges[mid].start < start)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < xml->nranges && xml->ranges[lo].start == start)
+        return xml->ranges[lo].end ? xml->source + xml->ranges[lo].end : NULL;
+    if (xml->nranges && xml->ranges[xml->nranges - 1].start > start)
+        return txml_element_end(tag); // can't be added keeping the ranges sorted
+    return txml_range_scan(xml, tag);
+}
+
+// parse the markup in 'buf' below the current node of the context.
+// If 'stop' is given, parsing ends when the end tag of 'stop' is reached.
+// In lazy mode the children of each element are not parsed: the element
+// is left pending and its content is skipped at tokenizer speed.
+// If 'origin' is given, the nodes record the position of their values
+// (and attribute values) relative to it
+static txml_err_t
+txml_parse_content(txml_t *xml, char *buf, txml_node_t *stop, int lazy, char *origin)
+{
+    txml_err_t err = TXML_NOERR;
+    txml_scratch_t *scratch = &xml->scratch;
+    int state = XML_ELEMENT_NONE;
+    char *p = buf;
+    unsigned int i;
+    char *start = NULL;
+    char *end = NULL;
+    unsigned int nattrs = 0, j;
+    char *mark = NULL;
+    char *tag = NULL;
+    char *lazy_tag = NULL; // start tag of the current element, while its first child is not known yet
+    char *lazy_body = NULL; // and where its content starts
+    char *attr = NULL; // where the name of the current attribute starts
+    int quote = 0;
+    int mode;
+
+    //unsigned int offset = filestat.st_size;
+
+// skip tabs and new-lines
+#define SKIP_BLANKS(__p) \
+    while((*__p == '\t' || *__p == '\r' || *__p == '\n') && *__p != 0) __p++;
+
+// skip any kind of whitespace
+#define SKIP_WHITESPACES(__p) \
+    SKIP_BLANKS(__p); \
+    while(*__p == ' ') {\
+        __p++;\
+        SKIP_BLANKS(__p);\
+        if(*__p == 0) break;\
+    }
+
+#define ADVANCE_ELEMENT(__p) \
+    while(*__p != '>' && *__p != ' ' && *__p != '\t' && *__p != '\r' && *__p != '\n' && *__p != 0) __p++;
+
+#define ADVANCE_TO_ATTR_VALUE(__p) \
+    while(*__p != '=' && *__p != ' ' && *__p != '\t' && *__p != '\r' && *__p != '\n' && *__p != 0) __p++;\
+    SKIP_WHITESPACES(__p);
+
+    while(*p != 0) {
+        if (xml->ignore_white_spaces) {
+            SKIP_WHITESPACES(p);
+        } else if (xml->ignore_blanks) {
+            SKIP_BLANKS(p);
+        }
+        if(*p == '<') { // an xml entity starts here
+            tag = p;
+            p++;
+            if(*p == '/') { // check if this is a closing node
+                p++;
+                SKIP_WHITESPACES(p);
+                mark = p;
+                while(*p != '>' && *p != 0)
+                    p++;
+                if(*p == '>') {
+                    lazy_tag = NULL;
+                    if (stop && xml->cnode == stop)
+                        return err; // done with the content of the pending node
+                    txml_scratch_reset(scratch);
+                    txml_scratch_add(scratch, mark, p-mark);
+                    if(scratch->text.err) {
+                        err = TXML_MEMORY_ERR;
+                        return err;
+                    }
+                    end = scratch->text.data;
+                    p++;
+                    state = XML_ELEMENT_END;
+                    if (origin)
+                        txml_node_source_close(xml->cnode, origin, p);
+                    err = txml_end_handler(xml, end);
+                    if(err != TXML_NOERR)
+                        return err;
+                    txml_filter_leave(xml);
+                }
+            } else if(strncmp(p, "!ENTITY", 8) == 0) { // XXX - IGNORING !ENTITY NODES
+                p += 8;
+                mark = p;
+                p = strstr(mark, ">");
+                if(!p) {
+                    fprintf(stderr, "Can't find where the !ENTITY element ends\n");
+                    err = TXML_PARSER_GENERIC_ERR;
+                    return err;
+                }
+                p++;
+            } else if(strncmp(p, "!NOTATION", 9) == 0) { // XXX - IGNORING !NOTATION NODES
+                p += 9;
+                mark = p;
+                p = strstr(mark, ">");
+                if(!p) {
+                    fprintf(stderr, "Can't find where the !NOTATION element ends\n");
+                    err = TXML_PARSER_GENERIC_ERR;
+                    return err;
+                }
+                p++;
+            } else if(strncmp(p, "!ATTLIST", 8) == 0) { // XXX - IGNORING !ATTLIST NODES
+                p += 8;
+                mark = p;
+                p = strstr(mark, ">");
+                if(!p) {
+                    fprintf(stderr, "Can't find where the !NOTATION element ends\n");
+                    err = TXML_PARSER_GENERIC_ERR;
+                    return err;
+                }
+                p++;
+            } else if(strncmp(p, "!--", 3) == 0) { /* comment */
+                char *comment = NULL;
+                p += 3; /* skip !-- */
+                mark = p;
+                p = strstr(mark, "-->");
+                if(!p) {
+                    /* XXX - TODO - This error condition must be handled asap */
+                }
+                txml_scratch_reset(scratch);
+                txml_scratch_add(scratch, mark, p-mark);
+                if(scratch->text.err) {
+                    err = TXML_MEMORY_ERR;
+                    return err;
+                }
+                comment = scratch->text.data;
+                if (txml_filter_keep_content(xml))
+                    err = txml_extra_node_handler(xml, comment, TXML_NODETYPE_COMMENT);
+                p+=3;
+            } else if(strncmp(p, "![", 2) == 0) {
+                mark = p;
+                p += 2; /* skip ![ */
+                SKIP_WHITESPACES(p);
+                //mark = p;
+                if(strncmp(p, "CDATA", 5) == 0) {
+                    char *cdata = NULL;
+                    p+=5;
+                    SKIP_WHITESPACES(p);
+                    if(*p != '[') {
+                        fprintf(stderr, "Unsupported entity type at \"... -->%15s\"", mark);
+                        err = TXML_PARSER_GENERIC_ERR;
+                        return err;
+                    }
+                    mark = ++p;
                     p = strstr(mark, "]]>");
                     if(!p) {
                         /* XXX - TODO - This error condition must be handled asap */
                     }
-                    cdata = (char *)calloc(1, p-mark+1);
-                    if(!cdata) {
-                        err = TXML_MEMORY_ERR;
+                    txml_scratch_reset(scratch);
+                    txml_scratch_add(scratch, mark, p-mark);
+                    if(scratch->text.err) {
+                        err = TXML_MEMORY_ERR;
+                        return err;
+                    }
+                    cdata = scratch->text.data;
+                    if (txml_filter_keep_content(xml))
+                        err = txml_extra_node_handler(xml, cdata, TXML_NODETYPE_CDATA);
+                    p+=3;
+                } else {
+                    fprintf(stderr, "Unsupported entity type at \"... -->%15s\"", mark);
+                    err = TXML_PARSER_GENERIC_ERR;
+                    return err;
+                }
+            } else if(*p =='?') { /* head */
+                char *encoding = NULL;
+                p++;
+                mark = p;
+                p = strstr(mark, "?>");
+                if (stop) { // expanding a pending node, the head could be in use by the readers
+                    if (!p)
+                        break;
+                    p += 2;
+                    continue;
+                }
+                if(xml->head) // we are going to overwrite existing head (if any)
+                    txml_strfree(&xml->pool, xml->head); /* XXX - should notify this behaviour? */
+                xml->head = txml_strndup(&xml->pool, mark, p-mark);
+                if(!xml->head) {
+                    err = TXML_MEMORY_ERR;
+                    return err;
+                }
+                encoding = strstr(xml->head, "encoding=");
+                if (encoding) {
+                    encoding += 9;
+                    if (*encoding == '"' || *encoding == '\'') {
+                        int encoding_length = 0;
+                        quote = *encoding;
+                        encoding++;
+                        end = (char *)strchr(encoding, quote);
+                        if (!end) {
+                            fprintf(stderr, "Unquoted encoding string in the <?xml> section");
+                            err = TXML_PARSER_GENERIC_ERR;
+                            return err;
+                        }
+                        encoding_length = end - encoding;
+                        if (encoding_length < sizeof(xml->document_encoding)) {
+                            strncpy(xml->document_encoding, encoding, encoding_length);
+                            // ensure to terminate it, if we are reusing a context we 
+                            // could have still the old encoding there possibly with a 
+                            // longer name (so poisoning the buffer)
+                            xml->document_encoding[encoding_length] = 0; 
+                        }
+                    }
+                } else {
+                }
+                p+=2;
+            } else { /* start tag */
+                if (lazy_tag && (end = txml_range_end(xml, lazy_tag, lazy_body))) {
+                    // the current element has children, leave them for later
+                    struct __txml_node_ext_s *ext = txml_node_ext_alloc(&xml->pool, xml->cnode);
+                    if (!ext)
+                        return TXML_MEMORY_ERR;
+                    ext->pending = tag;
+                    xml->pending++;
+                    lazy_tag = NULL;
+                    p = end;
+                    state = XML_ELEMENT_END;
+                    if (origin)
+                        txml_node_source_close(xml->cnode, origin, end);
+                    err = txml_end_handler(xml, NULL);
+                    if(err != TXML_NOERR)
+                        return err;
+                    continue;
+                }
+                lazy_tag = NULL;
+                nattrs = 0;
+                state = XML_ELEMENT_START;
+                SKIP_WHITESPACES(p);
+                mark = p;
+                ADVANCE_ELEMENT(p);
+                txml_scratch_reset(scratch);
+                if(*p == '>' && *(p-1) == '/') {
+                    txml_scratch_add(scratch, mark, p-mark-1);
+                    state = XML_ELEMENT_UNIQUE;
+                } else {
+                    txml_scratch_add(scratch, mark, p-mark);
+                }
+                if (xml->filter) {
+                    if (scratch->text.err || (mode = txml_filter_enter(xml, scratch->text.data)) < 0)
+                        return TXML_MEMORY_ERR;
+                    if (mode == TXML_FILTER_SKIP) { // jump over the whole element
+                        p = txml_skip_element(tag);
+                        state = XML_ELEMENT_END;
+                        continue;
+                    }
+                }
+
+                SKIP_WHITESPACES(p);
+                if(*p == '>' || (*p == '/' && *(p+1) == '>')) {
+                    if (*p == '/') {
+                        state = XML_ELEMENT_UNIQUE;
+                        p++;
+                    }
+                }
+                while(*p != '>' && *p != 0) {
+                    mark = attr = p;
+                    ADVANCE_TO_ATTR_VALUE(p);
+                    if(*p == '=') {
+                        size_t name_offset = txml_scratch_add(scratch, mark, p-mark);
+                        p++;
+                        SKIP_WHITESPACES(p);
+                        if(*p == '"' || *p == '\'') {
+                            quote = *p;
+                            p++;
+                            mark = p;
+                            while(*p != 0) {
+                                if (*p == quote) {
+                                    if (*(p+1) != quote) // handle quote escaping
+                                        break;
+                                    else
+                                        p++;
+                                }
+                                p++;
+                            }
+                            if(*p == quote) {
+                                /* add new attribute */
+                                if(txml_scratch_grow(scratch, 2*nattrs+4) != 0)
+                                    return TXML_MEMORY_ERR;
+                                scratch->offsets[2*nattrs] = name_offset;
+                                scratch->offsets[2*nattrs+1] = txml_scratch_add_value(scratch, mark, p-mark, quote);
+                                if (origin) {
+                                    scratch->sources[3*nattrs] = attr - origin;
+                                    scratch->sources[3*nattrs+1] = mark - origin;
+                                    scratch->sources[3*nattrs+2] = p - mark;
+                                }
+                                nattrs++;
+                                p++;
+                                SKIP_WHITESPACES(p);
+                            }
+                            else {
+                                scratch->text.len = name_offset;
+                            }
+                        } /* if(*p == '"' || *p == '\'') */
+                        else {
+                            scratch->text.len = name_offset;
+                        }
+                    } /* if(*p=='=') */
+                    if(*p == '/' && *(p+1) == '>') {
+                        p++;
+                        state = XML_ELEMENT_UNIQUE;
+                    }
+                } /* while(*p != '>' && *p != 0) */
+                if(scratch->text.err)
+                    return TXML_MEMORY_ERR;
+                // the scratch buffer doesn't move anymore, the strings can be referenced now
+                start = scratch->text.data;
+                if (xml->filter) { // drop the attributes we are not interested in
+                    for(i = 0, j = 0; i < nattrs; i++) {
+                        if (!txml_filter_keep_attribute(xml, start + scratch->offsets[2*i]))
+                            continue;
+                        scratch->offsets[2*j] = scratch->offsets[2*i];
+                        scratch->offsets[2*j+1] = scratch->offsets[2*i+1];
+                        if (origin)
+                            memcpy(&scratch->sources[3*j], &scratch->sources[3*i], 3 * sizeof(size_t));
+                        j++;
+                    }
+                    nattrs = j;
+                }
+                for(i = 0; i < nattrs; i++) {
+                    scratch->strings[i] = start + scratch->offsets[2*i];
+                    scratch->strings[nattrs+1+i] = start + scratch->offsets[2*i+1];
+                }
+                if(nattrs > 0) {
+                    scratch->strings[nattrs] = NULL;
+                    scratch->strings[2*nattrs+1] = NULL;
+                }
+                if (origin && txml_scratch_grow(scratch, 2) != 0)
+                    return TXML_MEMORY_ERR;
+                err = txml_start_handler(xml, start,
+                                         nattrs ? scratch->strings : NULL,
+                                         nattrs ? scratch->strings+nattrs+1 : NULL,
+                                         origin ? (size_t)(tag - origin) : TXML_SPAN_NONE,
+                                         origin ? scratch->sources : NULL);
+                if(err != TXML_NOERR)
+                    return err;
+                if(state == XML_ELEMENT_UNIQUE) {
+                    if (origin)
+                        txml_node_source_close(xml->cnode, origin, p + 1);
+                    err = txml_end_handler(xml, start);
+                    if(err != TXML_NOERR)
                         return err;
+                    txml_filter_leave(xml);
+                } else if (lazy) {
+                    lazy_tag = tag;
+                    lazy_body = p + 1;
+                }
+                p++;
+            } /* end of start tag */
+        } /* if(*p == '<') */
+        else if(state == XML_ELEMENT_START) {
+            state = XML_ELEMENT_VALUE;
+            mark = p;
+            while(*p != '<' && *p != 0)
+                p++;
+            if(*p == '<' && txml_filter_keep_content(xml)) { // p now points to the beginning of next node
+                char *value;
+                txml_scratch_reset(scratch);
+                txml_scratch_add(scratch, mark, p-mark);
+                if(scratch->text.err)
+                    return TXML_MEMORY_ERR;
+                value = scratch->text.data;
+                err = txml_value_handler(xml, value, origin ? (size_t)(mark - origin) : TXML_SPAN_NONE);
+                if(err != TXML_NOERR)
+                    return(err);
+                //p++;
+            }
+        }
+        else if (*p) {
+            /* XXX */
+            p++;
+        }
+    } // while(*p != 0)
+
+    return err;
+}
+
+// record where the lines of a document start
+static int
+txml_lines_build(txml_t *xml, char *buf)
+{
+    size_t size = 16;
+    size_t *lines;
+    char *end = buf + strlen(buf);
+    char *p = buf;
+
+    // allocated even if empty, to tell that the lines are known
+    xml->lines = (size_t *)malloc(size * sizeof(size_t));
+    if (!xml->lines)
+        return -1;
+    xml->nlines = 0;
+    xml->length = end - buf;
+    while ((p = memchr(p, '\n', end - p))) {
+        p++;
+        if (xml->nlines == size) {
+            size *= 2;
+            lines = (size_t *)realloc(xml->lines, size * sizeof(size_t));
+            if (!lines)
+                return -1;
+            xml->lines = lines;
+        }
+        xml->lines[xml->nlines++] = p - buf;
+    }
+    return 0;
+}
+
+static txml_err_t
+txml_parse_document(txml_t *xml, char *buf)
+{
+    txml_context_reset_unlocked(xml); // reset the context if we are parsing a new document
+    xml->cnode = NULL;
+    if (xml->filter) { // a filtered document is always parsed upfront
+        if (txml_filter_start(xml) != TXML_NOERR)
+            return TXML_MEMORY_ERR;
+    } else if (xml->lazy && !xml->nindexes && !xml->name_index) { // indexes need the whole document
+        // the pending nodes point into our own copy of the document
+        xml->source = strdup(buf);
+        if (!xml->source)
+            return TXML_MEMORY_ERR;
+        if ((xml->track & TXML_TRACK_LINES) && txml_lines_build(xml, xml->source) != 0)
+            return TXML_MEMORY_ERR;
+        xml->origin = xml->track ? xml->source : NULL; // until the last node is expanded
+        return txml_parse_content(xml, xml->source, NULL, 1, xml->origin);
+    }
+    if ((xml->track & TXML_TRACK_LINES) && txml_lines_build(xml, buf) != 0)
+        return TXML_MEMORY_ERR;
+    return txml_parse_content(xml, buf, NULL, 0, xml->track ? buf : NULL);
+}
+
+static void
+txml_node_expand(txml_node_t *node)
+{
+    txml_t *xml = txml_context_get(node);
+    txml_node_t *cnode;
+    char *pending;
+
+    if (!xml)
+        return; // can't happen, pending nodes are expanded before leaving their context
+
+    // readers can get here concurrently (holding just the read lock),
+    // the first one parses the content while the others wait for it
+    TXML_LAZY_LOCK(xml);
+    pending = node->ext->pending;
+    if (pending) {
+        txml_filter_t *filter = xml->filter;
+        cnode = xml->cnode;
+        xml->cnode = node;
+        xml->filter = NULL; // a filter set after parsing doesn't apply
+        // errors in the content are not reported, what has been parsed is kept
+        txml_parse_content(xml, pending, node, 1, xml->origin);
+        xml->filter = filter;
+        xml->cnode = cnode;
+        __atomic_store_n(&node->ext->pending, NULL, __ATOMIC_RELEASE);
+        if (--xml->pending == 0 && !xml->pool.max)
+            txml_scratch_release(&xml->scratch);
+    }
+    TXML_LAZY_UNLOCK(xml);
+}
+
+// materialize a whole branch
+static void
+txml_node_expand_branch(txml_node_t *branch)
+{
+    txml_node_t *node = branch;
+    txml_node_t *child;
+
+    for (;;) {
+        TXML_NODE_EXPAND(node);
+        if ((child = TAILQ_FIRST(&node->children))) {
+            node = child;
+            continue;
+        }
+        while (node != branch && !TAILQ_NEXT(node, siblings))
+            node = node->parent;
+        if (node == branch)
+            break;
+        node = TAILQ_NEXT(node, siblings);
+    }
+}
+
+// materialize the whole document
+static void
+txml_expand_all(txml_t *xml)
+{
+    txml_node_t *rnode;
+    if (!xml->pending)
+        return;
+    TAILQ_FOREACH(rnode, &xml->root_elements, siblings)
+        txml_node_expand_branch(rnode);
+}
+
+static txml_err_t
+txml_parse_buffer_unlocked(txml_t *xml, char *buf)
+{
+    txml_err_t err = txml_parse_document(xml, buf);
+    // keep the scratch space only if we are retaining memory across documents
+    // (or until there is some content left to parse)
+    if (!xml->pool.max && !xml->pending)
+        txml_scratch_release(&xml->scratch);
+    return err;
+}
+
+txml_err_t
+txml_parse_buffer(txml_t *xml, char *buf)
+{
+    txml_err_t res;
+    TXML_WRLOCK(xml);
+    res = txml_parse_buffer_unlocked(xml, buf);
+    TXML_WRUNLOCK(xml);
+    return res;
+}
+
+#ifdef WIN32
+//************************************************************************
+// BOOL W32LockFile (FILE* filestream)
+//
+// locks the specific file for exclusive access, nonblocking
+//
+// returns 0 on success
+//************************************************************************
+static BOOL
+W32LockFile (FILE* filestream)
+{
+    BOOL res = TRUE;
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    unsigned long size = 0;
+    int fd = 0;
+
+    // check params
+    if (!filestream)
+        return FALSE;
+
+    // get handle from stream
+    fd = _fileno (filestream);
+    hFile = (HANDLE)_get_osfhandle(fd);
+
+    // lock file until access is permitted
+    size = GetFileSize(hFile, NULL);
+    res = LockFile (hFile, 0, 0, size, 0);
+    if (res)
+        res = 0;
+
+    return res;
+}
+
+//************************************************************************
+// BOOL W32UnlockFile (FILE* filestream)
+//
+// unlocks the specific file locked by W32LockFile
+//
+// returns 0 on success
+//************************************************************************
+static BOOL
+W32UnlockFile (FILE* filestream)
+{
+    BOOL res = TRUE;
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    unsigned long size = 0;
+    int tries = 0;
+    int fd = 0;
+
+    // check params
+    if (!filestream)
+        return FALSE;
+
+    // get handle from stream
+    fd = _fileno (filestream);
+    hFile = (HANDLE)_get_osfhandle(fd);
+
+    // unlock
+    size = GetFileSize(hFile, NULL);
+    res = UnlockFile (hFile, 0, 0, size, 0);
+    if (res)
+        res = 0;
+
+    return res;
+}
+#endif // #ifdef WIN32
+
+static txml_err_t
+txml_file_lock(FILE *file)
+{
+    int tries = 0;
+    if(file) {
+#ifdef WIN32
+        while(W32LockFile(file) != 0) {
+#else
+        while(ftrylockfile(file) != 0) {
+#endif
+    // warning("can't obtain a lock on xml file %s... waiting (%d)", xml_file, tries);
+            tries++;
+            if(tries>5) {
+                fprintf(stderr, "sticky lock on xml file!!!");
+                return TXML_GENERIC_ERR;
+            }
+            sleep(1);
+        }
+        return TXML_NOERR;
+    }
+    return TXML_GENERIC_ERR;
+}
+
+static txml_err_t
+txml_file_unlock(FILE *file)
+{
+    if(file) {
+#ifdef WIN32
+        if(W32UnlockFile(file) == 0)
+#else
+        funlockfile(file);
+
+#endif
+        return TXML_NOERR;
+    }
+    return TXML_GENERIC_ERR;
+}
+
+// read a whole file (converted to utf8 if needed) into a new buffer.
+// If 'hash' is given, it's set to the hash of the content as found in the file
+static txml_err_t
+txml_file_read(char *path, struct stat *filestat, char **out, unsigned long long *hash)
+{
+    FILE *infile;
+    char *buffer;
+    int rc = 0;
+
+    infile = NULL;
+    if(!path)
+        return TXML_BADARGS;
+    rc = stat(path, filestat);
+    if (rc != 0)
+        return TXML_BADARGS;
+    if(filestat->st_size>0) {
+        infile = fopen(path, "r");
+        if(infile) {
+#ifdef USE_ICONV
+            iconv_t ich;
+            char *iconvin, *iconvout;
+#endif
+            size_t rb, ilen, olen;
+            char *encoding_from = NULL;
+
+            if(txml_file_lock(infile) != TXML_NOERR) {
+                fprintf(stderr, "Can't lock %s for opening ", path);
+                fclose(infile);
+                return -1;
+            }
+            olen = ilen = filestat->st_size;
+            buffer = (char *)malloc(ilen+1);
+            if (!buffer) {
+                txml_file_unlock(infile);
+                fclose(infile);
+                return TXML_MEMORY_ERR;
+            }
+            rb = fread(buffer, 1, ilen, infile);
+            if (ilen != rb) {
+                fprintf(stderr, "Can't read %s content", path);
+                free(buffer);
+                txml_file_unlock(infile);
+                fclose(infile);
+                return -1;
+            }
+            buffer[ilen] = 0;
+            if (hash)
+                *hash = txml_hash_bytes(buffer, ilen);
+            switch(detect_encoding(buffer)) {
+                case ENCODING_UTF16LE:
+                    encoding_from = "UTF-16LE";
+                    break;
+                case ENCODING_UTF16BE:
+                    encoding_from = "UTF-16BE";
+                    break;
+                case ENCODING_UTF32LE:
+                    encoding_from = "UTF-32LE";
+                    break;
+                case ENCODING_UTF32BE:
+                    encoding_from = "UTF-32BE";
+                    break;
+                case ENCODING_UTF7:
+                    encoding_from = "UTF-7";
+                    olen = ilen*2; // we need a bigger output buffer
+                    break;
+            }
+            if (encoding_from) {
+#ifdef USE_ICONV
+                ich = iconv_open ("UTF-8", encoding_from);
+                if (ich == (iconv_t)(-1)) {
+                    fprintf(stderr, "Can't init iconv: %s\n", strerror(errno));
+                    free(buffer);
+                    txml_file_unlock(infile);
+                    fclose(infile);
+                    return -1;
+                }
+                char *out = (char *)calloc(1, olen);
+                iconvin = buffer;
+                iconvout = out;
+                int cb = iconv(ich, &iconvin, &ilen, &iconvout, &olen);
+                if (cb == -1) {
+                    fprintf(stderr, "Can't convert encoding: %s\n", strerror(errno));
+                    free(buffer);
+                    free(out);
+                    txml_file_unlock(infile);
+                    fclose(infile);
+                    return -1;
+                }
+                free(buffer); // release initial buffer
+                buffer = out; // point to the converted buffer
+                iconv_close(ich);
+#else
+                fprintf(stderr, "Iconv missing: can't open file %s encoded in %s. Convert it to utf8 and try again\n",
+                        path, encoding_from);
+                free(buffer);
+                txml_file_unlock(infile);
+                fclose(infile);
+                return -1;
+#endif
+            }
+            txml_file_unlock(infile);
+            fclose(infile);
+        } else {
+            fprintf(stderr, "Can't open xmlfile %s\n", path);
+            return -1;
+        }
+    } else {
+        fprintf(stderr, "Can't stat xmlfile %s\n", path);
+        return -1;
+    }
+    *out = buffer;
+    return TXML_NOERR;
+}
+
+static txml_err_t
+txml_parse_file_threads(txml_t *xml, char *path, int nthreads)
+{
+    char *buffer;
+    txml_err_t err;
+    struct stat filestat;
+
+    err = txml_file_read(path, &filestat, &buffer, NULL);
+    if (err != TXML_NOERR)
+        return err;
+    TXML_WRLOCK(xml);
+    err = txml_parse_buffer_parallel_unlocked(xml, buffer, nthreads);
+    TXML_WRUNLOCK(xml);
+    free(buffer); // release either the initial or the converted buffer
+    return err;
+}
+
+txml_err_t
+txml_parse_file(txml_t *xml, char *path)
+{
+    return txml_parse_file_threads(xml, path, 1);
+}
+
+txml_err_t
+txml_parse_file_parallel(txml_t *xml, char *path, int nthreads)
+{
+    return txml_parse_file_threads(xml, path, nthreads);
+}
+
+//
+// BATCH PARSING
+//
+
+typedef struct {
+    size_t size;
+    unsigned long index;
+} txml_batch_item_t;
+
+typedef struct {
+    char **inputs;
+    int files; // inputs are paths rather than buffers
+    txml_t **contexts;
+    txml_err_t *results;
+    txml_batch_item_t *items; // sorted by size, largest first
+    unsigned long count;
+    unsigned long next; // next item to be picked by a worker
+    // called by the worker right after a document has been parsed successfully
+    void (*done)(txml_t *xml, void *priv);
+    void *priv;
+} txml_batch_t;
+
+static int
+txml_batch_item_cmp(const void *a, const void *b)
+{
+    const txml_batch_item_t *ia = (const txml_batch_item_t *)a;
+    const txml_batch_item_t *ib = (const txml_batch_item_t *)b;
+    if (ia->size == ib->size)
+        return (ia->index > ib->index) - (ia->index < ib->index);
+    return ia->size < ib->size ? 1 : -1;
+}
+
+// each worker keeps picking the largest document not yet taken
+static void *
+txml_batch_worker(void *priv)
+{
+    txml_batch_t *batch = (txml_batch_t *)priv;
+    unsigned long i, index;
+    txml_t *xml;
+
+    for (;;) {
+        i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+        if (i >= batch->count)
+            break;
+        index = batch->items[i].index;
+        xml = batch->contexts[index];
+        if (!xml) {
+            xml = txml_context_create();
+            if (!xml) {
+                batch->results[index] = TXML_MEMORY_ERR;
+                continue;
+            }
+            batch->contexts[index] = xml;
+        }
+        if (batch->files)
+            batch->results[index] = txml_parse_file(xml, batch->inputs[index]);
+        else
+            batch->results[index] = txml_parse_buffer(xml, batch->inputs[index]);
+        if (batch->done && batch->results[index] == TXML_NOERR)
+            batch->done(xml, batch->priv);
+    }
+    return NULL;
+}
+
+static txml_err_t
+txml_batch_run(char **inputs, int files, unsigned long count, txml_t **contexts,
+               txml_err_t *results, int nthreads, void (*done)(txml_t *xml, void *priv), void *priv)
+{
+    txml_batch_t batch;
+    txml_err_t *own_results = NULL;
+    unsigned long i;
+    txml_err_t res = TXML_NOERR;
+#ifdef THREAD_SAFE
+    pthread_t *threads = NULL;
+    int nworkers = 0;
+#endif
+
+    if (!inputs || !contexts)
+        return TXML_BADARGS;
+    if (!count)
+        return TXML_NOERR;
+
+    if (!results) {
+        own_results = (txml_err_t *)calloc(count, sizeof(txml_err_t));
+        if (!own_results)
+            return TXML_MEMORY_ERR;
+        results = own_results;
+    }
+
+    memset(&batch, 0, sizeof(batch));
+    batch.inputs = inputs;
+    batch.files = files;
+    batch.contexts = contexts;
+    batch.results = results;
+    batch.count = count;
+    batch.done = done;
+    batch.priv = priv;
+    batch.items = (txml_batch_item_t *)malloc(count * sizeof(txml_batch_item_t));
+    if (!batch.items) {
+        free(own_results);
+        return TXML_MEMORY_ERR;
+    }
+    for (i = 0; i < count; i++) {
+        struct stat st;
+        batch.items[i].index = i;
+        if (!files)
+            batch.items[i].size = inputs[i] ? strlen(inputs[i]) : 0;
+        else
+            batch.items[i].size = (inputs[i] && stat(inputs[i], &st) == 0) ? st.st_size : 0;
+    }
+    // starting from the largest documents keeps the last workers
+    // from being left alone with a big one at the end
+    qsort(batch.items, count, sizeof(txml_batch_item_t), txml_batch_item_cmp);
+
+#ifdef THREAD_SAFE
+    if (nthreads > count)
+        nthreads = count;
+    if (nthreads > 1)
+        threads = (pthread_t *)malloc((nthreads - 1) * sizeof(pthread_t));
+    // the calling thread is a worker as well
+    while (threads && nworkers < nthreads - 1 &&
+           pthread_create(&threads[nworkers], NULL, txml_batch_worker, &batch) == 0)
+    {
+        nworkers++;
+    }
+    txml_batch_worker(&batch);
+    for (i = 0; i < nworkers; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+#else
+    txml_batch_worker(&batch);
+#endif
+
+    for (i = 0; i < count; i++) {
+        if (results[i] != TXML_NOERR) {
+            res = TXML_PARSER_GENERIC_ERR;
+            break;
+        }
+    }
+    free(batch.items);
+    free(own_results);
+    return res;
+}
+
+txml_err_t
+txml_parse_batch(char **buffers, unsigned long count, txml_t **contexts, txml_err_t *results, int nthreads)
+{
+    return txml_batch_run(buffers, 0, count, contexts, results, nthreads, NULL, NULL);
+}
+
+txml_err_t
+txml_parse_file_batch(char **paths, unsigned long count, txml_t **contexts, txml_err_t *results, int nthreads)
+{
+    return txml_batch_run(paths, 1, count, contexts, results, nthreads, NULL, NULL);
+}
+
+//
+// PARALLEL PARSING OF A SINGLE DOCUMENT
+// A quick structural pre-scan finds the boundaries of the top-level elements
+// (the children of the root element, or the root elements themselves if
+// there are many), the document is cut there and the slices are parsed
+// concurrently by txml_batch_run() into temporary contexts.
+// The resulting nodes are then moved to the context being filled.
+//
+
+#define TXML_PARALLEL_MIN_CHUNK (64 * 1024)
+#define TXML_PARALLEL_CHUNKS_PER_THREAD 4 // smaller chunks balance the load better
+
+typedef struct {
+    char *root;            // start tag of the first root element
+    char *body;            // its content
+    char *root_close;      // its end tag
+    char *root_end;        // the first byte after its end tag
+    unsigned long nroots;  // number of root elements
+    int nested_pi;         // processing instructions found within the root elements
+    char **splits[2];      // start tags at depth 0 and 1, far enough from each other
+    unsigned long nsplits[2];
+} txml_prescan_t;
+
+// follow the nesting of the elements (without building anything) and pick the
+// places where the document can be split, at least 'chunk' bytes apart.
+// Returns -1 if the document uses anything we prefer to leave to the parser
+// (DTD declarations, unterminated or unbalanced tags)
+static int
+txml_prescan(char *buf, size_t chunk, unsigned long max_splits, txml_prescan_t *scan)
+{
+    char *last[2] = { buf, buf };
+    char *p = buf;
+    char *tag;
+    long depth = 0;
+    int kind;
+
+    while ((p = strchr(p, '<'))) {
+        tag = p;
+        p = txml_scan_markup(tag, &kind);
+        if (!p || kind == TXML_MARKUP_DECL)
+            return -1;
+        if (kind == TXML_MARKUP_END) {
+            if (--depth < 0)
+                return -1;
+            if (depth == 0 && scan->nroots == 1) {
+                scan->root_close = tag;
+                scan->root_end = p;
+            }
+        } else if (kind == TXML_MARKUP_PI) {
+            if (depth)
+                scan->nested_pi = 1;
+        } else if (kind == TXML_MARKUP_START || kind == TXML_MARKUP_UNIQUE) {
+            if (depth < 2 && (size_t)(tag - last[depth]) >= chunk && scan->nsplits[depth] < max_splits) {
+                scan->splits[depth][scan->nsplits[depth]++] = tag;
+                last[depth] = tag;
+            }
+            if (depth == 0 && ++scan->nroots == 1) {
+                scan->root = tag;
+                scan->body = kind == TXML_MARKUP_UNIQUE ? NULL : p;
+            }
+            if (kind == TXML_MARKUP_START)
+                depth++;
+        }
+    }
+    return depth == 0 ? 0 : -1;
+}
+
+typedef struct {
+    txml_node_t *root; // the root element of the context being filled
+} txml_parallel_t;
+
+static txml_node_t *
+txml_parallel_root(txml_t *xml)
+{
+    txml_node_t *rnode;
+    TAILQ_FOREACH(rnode, &xml->root_elements, siblings) {
+        if (rnode->type == TXML_NODETYPE_SIMPLE)
+            return rnode;
+    }
+    return NULL;
+}
+
+// point the namespace references of a branch to the replacements in 'nsmap'
+static void
+txml_update_branch_nsmap(txml_node_t *branch, txml_nsmap_t *nsmap)
+{
+    txml_node_t *node = branch;
+    txml_namespace_set_t *nsitem;
+
+    for (;;) {
+        if (node->ext) {
+            node->ext->ns = txml_nsmap_lookup(nsmap, node->ext->ns);
+            node->ext->hns = txml_nsmap_lookup(nsmap, node->ext->hns);
+            TAILQ_FOREACH(nsitem, &node->ext->known_namespaces, next)
+                nsitem->ns = txml_nsmap_lookup(nsmap, nsitem->ns);
+        }
+        if (!TAILQ_EMPTY(&node->children)) {
+            node = TAILQ_FIRST(&node->children);
+            continue;
+        }
+        while (node != branch && !TAILQ_NEXT(node, siblings))
+            node = node->parent;
+        if (node == branch)
+            break;
+        node = TAILQ_NEXT(node, siblings);
+    }
+}
+
+// run by the batch workers on each parsed slice of the content of the root
+// element, while it's still private to the worker. The slice has been parsed
+// within a copy of the root element, so the references to the namespaces
+// declared there are replaced with the original ones
+static void
+txml_parallel_chunk_done(txml_t *chunk, void *priv)
+{
+    txml_parallel_t *parallel = (txml_parallel_t *)priv;
+    txml_nsmap_t nsmap = { NULL, 0, 0 };
+    txml_namespace_t *ns, *orig_ns;
+    txml_node_t *rnode, *node;
+
+    rnode = txml_parallel_root(chunk);
+    if (!rnode || !rnode->ext || !parallel->root->ext)
+        return;
+    orig_ns = TAILQ_FIRST(&parallel->root->ext->namespaces);
+    TAILQ_FOREACH(ns, &rnode->ext->namespaces, list) {
+        if (!orig_ns || txml_nsmap_add(&nsmap, ns, orig_ns) != 0)
+            break;
+        orig_ns = TAILQ_NEXT(orig_ns, list);
+    }
+    if (nsmap.count) {
+        TAILQ_FOREACH(node, &rnode->children, siblings)
+            txml_update_branch_nsmap(node, &nsmap);
+    }
+    free(nsmap.map);
+}
+
+static txml_err_t
+txml_parse_buffer_parallel_unlocked(txml_t *xml, char *buf, int nthreads)
+{
+    txml_prescan_t scan;
+    txml_parallel_t parallel;
+    txml_err_t err = TXML_GENERIC_ERR;
+    size_t len, chunk, tag_len, close_len;
+    unsigned long max_splits, nchunks = 0, i;
+    char **buffers = NULL;
+    txml_t **contexts = NULL;
+    char *start, *end, *prolog;
+    txml_node_t *rnode, *node;
+    int split_root;
+
+#ifndef THREAD_SAFE
+    nthreads = 1; // there is nobody to share the work with
+#endif
+    if (!buf)
+        return TXML_BADARGS;
+    // lazy documents are parsed on demand, the positions are relative to the whole document
+    if (nthreads <= 1 || xml->lazy || xml->track)
+        return txml_parse_buffer_unlocked(xml, buf);
+
+    len = strlen(buf);
+    max_splits = nthreads * TXML_PARALLEL_CHUNKS_PER_THREAD;
+    chunk = len / max_splits;
+    if (chunk < TXML_PARALLEL_MIN_CHUNK)
+        chunk = TXML_PARALLEL_MIN_CHUNK;
+
+    memset(&scan, 0, sizeof(scan));
+    scan.splits[0] = (char **)malloc(max_splits * sizeof(char *));
+    scan.splits[1] = (char **)malloc(max_splits * sizeof(char *));
+    if (!scan.splits[0] || !scan.splits[1] || txml_prescan(buf, chunk, max_splits, &scan) != 0)
+        goto sequential;
+
+    if (scan.nroots == 1 && scan.body && scan.root_close && !scan.nested_pi && scan.nsplits[1])
+        split_root = 1; // slice the content of the root element
+    else if (scan.nroots > 1 && xml->allow_multiple_root_nodes && scan.nsplits[0])
+        split_root = 0; // slice the list of root elements
+    else
+        goto sequential;
+
+    nchunks = scan.nsplits[split_root] + 1;
+    buffers = (char **)calloc(nchunks, sizeof(char *));
+    contexts = (txml_t **)calloc(nchunks, sizeof(txml_t *));
+    if (!buffers || !contexts)
+        goto sequential;
+
+    memset(&parallel, 0, sizeof(parallel));
+    if (split_root) {
+        // the document without the content of the root element
+        // provides the root element itself and whatever surrounds it
+        prolog = (char *)malloc((scan.body - buf) + (len - (scan.root_close - buf)) + 1);
+        if (!prolog)
+            goto sequential;
+        memcpy(prolog, buf, scan.body - buf);
+        strcpy(prolog + (scan.body - buf), scan.root_close);
+        err = txml_parse_document(xml, prolog);
+        free(prolog);
+        if (err != TXML_NOERR || !(parallel.root = txml_parallel_root(xml)))
+            goto sequential;
+    }
+
+    // each slice of the root content is wrapped in a copy of the root element,
+    // so that its namespaces are in scope
+    tag_len = split_root ? scan.body - scan.root : 0;
+    close_len = split_root ? scan.root_end - scan.root_close : 0;
+    for (i = 0; i < nchunks; i++) {
+        start = i ? scan.splits[split_root][i-1] : (split_root ? scan.body : buf);
+        end = i < nchunks - 1 ? scan.splits[split_root][i] : (split_root ? scan.root_close : buf + len);
+        buffers[i] = (char *)malloc(tag_len + (end - start) + close_len + 1);
+        contexts[i] = txml_context_create();
+        if (!buffers[i] || !contexts[i])
+            goto sequential;
+        memcpy(buffers[i], scan.root, tag_len);
+        memcpy(buffers[i] + tag_len, start, end - start);
+        memcpy(buffers[i] + tag_len + (end - start), scan.root_close, close_len);
+        buffers[i][tag_len + (end - start) + close_len] = 0;
+        contexts[i]->use_namespaces = xml->use_namespaces;
+        contexts[i]->allow_multiple_root_nodes = xml->allow_multiple_root_nodes;
+        contexts[i]->ignore_white_spaces = xml->ignore_white_spaces;
+        contexts[i]->ignore_blanks = xml->ignore_blanks;
+        contexts[i]->filter = xml->filter; // borrowed, the slices are filtered as well
+    }
+
+    err = txml_batch_run(buffers, 0, nchunks, contexts, NULL, nthreads,
+                         split_root ? txml_parallel_chunk_done : NULL, &parallel);
+    if (err != TXML_NOERR)
+        goto sequential;
+
+    // stitch the slices together, in document order
+    if (!split_root)
+        txml_context_reset_unlocked(xml);
+    for (i = 0; i < nchunks; i++) {
+        if (split_root) {
+            rnode = txml_parallel_root(contexts[i]);
+            if (!rnode)
+                continue;
+            if (i == 0) { // the value of the root element is right after its start tag
+                txml_free_value(&xml->pool, parallel.root->value);
+                parallel.root->value = rnode->value;
+                rnode->value = txml_empty_string;
+            }
+            TAILQ_FOREACH(node, &rnode->children, siblings)
+                node->parent = parallel.root;
+            TAILQ_CONCAT(&parallel.root->children, &rnode->children, siblings);
+            continue;
+        }
+        if (contexts[i]->head) { // the last one wins, as if parsed sequentially
+            if (xml->head)
+                txml_strfree(&xml->pool, xml->head);
+            xml->head = contexts[i]->head;
+            contexts[i]->head = NULL;
+            if (strstr(xml->head, "encoding="))
+                memcpy(xml->document_encoding, contexts[i]->document_encoding, sizeof(xml->document_encoding));
+        }
+        TAILQ_FOREACH(rnode, &contexts[i]->root_elements, siblings)
+            rnode->ext->context = xml;
+        TAILQ_CONCAT(&xml->root_elements, &contexts[i]->root_elements, siblings);
+    }
+    xml->cnode = NULL;
+    xml->snapshot_stale = 1;
+    if (xml->nindexes) // the slices have been linked in without being indexed
+        txml_indexes_rebuild(xml);
+    txml_name_index_invalidate(xml);
+    txml_order_invalidate(xml);
+    err = TXML_NOERR;
+    goto done;
+
+sequential:
+    // too small, not splittable or failed: the sequential parser has the last word
+    err = txml_parse_document(xml, buf);
+done:
+    for (i = 0; i < nchunks; i++) {
+        if (contexts && contexts[i]) {
+            contexts[i]->filter = NULL;
+            txml_context_destroy(contexts[i]);
+        }
+        if (buffers)
+            free(buffers[i]);
+    }
+    free(contexts);
+    free(buffers);
+    free(scan.splits[0]);
+    free(scan.splits[1]);
+    if (!xml->pool.max)
+        txml_scratch_release(&xml->scratch);
+    return err;
+}
+
+txml_err_t
+txml_parse_buffer_parallel(txml_t *xml, char *buf, int nthreads)
+{
+    txml_err_t res;
+    TXML_WRLOCK(xml);
+    res = txml_parse_buffer_parallel_unlocked(xml, buf, nthreads);
+    TXML_WRUNLOCK(xml);
+    return res;
+}
+
+static inline void
+txml_buffer_append_tabs(txml_buffer_t *buf, unsigned int count)
+{
+    if (txml_buffer_reserve(buf, count) != 0)
+        return;
+    memset(buf->data + buf->len, '\t', count);
+    buf->len += count;
+    buf->data[buf->len] = 0;
+}
+
+// same as xmlize(), but writing straight to the output buffer
+static void
+txml_buffer_append_escaped(txml_buffer_t *buf, char *string)
+{
+    char *p = string;
+    char *entity;
+
+    for (;; p++) {
+        switch (*p) {
+            case '&':
+                entity = "&amp;";
+                break;
+            case '<':
+                entity = "&lt;";
+                break;
+            case '>':
+                entity = "&gt;";
+                break;
+            case '"':
+                entity = "&quot;";
+                break;
+            case '\'':
+                entity = "&apos;";
+                break;
+            case 0:
+                txml_buffer_append(buf, string, p - string);
+                return;
+            default:
+                continue;
+        }
+        txml_buffer_append(buf, string, p - string);
+        txml_buffer_append_string(buf, entity);
+        string = p + 1;
+    }
+}
+
+// the position where the next byte will be written
+#define TXML_BUFFER_POSITION(__buf) ((__buf)->flushed + (__buf)->len)
+
+// write a value, recording where it lands in 'span' (if given)
+static inline void
+txml_dump_value(txml_buffer_t *buf, char *value, txml_span_t *span)
+{
+    size_t start = TXML_BUFFER_POSITION(buf);
+
+    txml_buffer_append_escaped(buf, value);
+    if (span) {
+        span->start = start;
+        span->len = TXML_BUFFER_POSITION(buf) - start;
+    }
+}
+
+static inline void
+txml_dump_node_name(txml_buffer_t *buf, txml_node_t *node)
+{
+    txml_namespace_t *ns = TXML_NODE_NS(node);
+    if (ns && ns->name) {
+        txml_buffer_append_string(buf, ns->name);
+        txml_buffer_append(buf, ":", 1);
+    }
+    txml_buffer_append_string(buf, node->name);
+}
+
+// write the end tag of a node
+static void
+txml_dump_node_close(txml_t *xml, txml_buffer_t *buf, txml_node_t *node, unsigned int depth,
+                     txml_node_source_t *source)
+{
+    if (xml->ignore_blanks)
+        txml_buffer_append_tabs(buf, depth);
+    txml_buffer_append(buf, "</", 2);
+    txml_dump_node_name(buf, node);
+    txml_buffer_append(buf, ">", 1);
+    if (source)
+        source->element.len = TXML_BUFFER_POSITION(buf) - source->element.start;
+    if (xml->ignore_blanks)
+        txml_buffer_append(buf, "\n", 1);
+}
+
+// write everything preceding the children of a node.
+// Returns 1 if the children have to be dumped (and the node closed afterwards)
+static int
+txml_dump_node_open(txml_t *xml, txml_buffer_t *buf, txml_node_t *node, unsigned int depth)
+{
+    txml_node_source_t *source = buf->positions ? TXML_NODE_SOURCE(node) : NULL;
+    txml_attribute_source_t *attr_source;
+    txml_attribute_t *attr;
+    int has_children;
+
+    /* First check if this is a special node (a comment, a CDATA or a text node) */
+    if (node->type != TXML_NODETYPE_SIMPLE) {
+        if (xml->ignore_blanks)
+            txml_buffer_append_tabs(buf, depth);
+        switch(node->type) {
+            case TXML_NODETYPE_COMMENT:
+                txml_buffer_append(buf, "<!--", 4);
+                txml_buffer_append_string(buf, node->value);
+                txml_buffer_append(buf, "-->", 3);
+                break;
+            case TXML_NODETYPE_CDATA:
+                txml_buffer_append(buf, "<![CDATA[", 9);
+                txml_buffer_append_string(buf, node->value);
+                txml_buffer_append(buf, "]]>", 3);
+                break;
+            default:
+                txml_buffer_append_escaped(buf, node->value);
+                break;
+        }
+        if (xml->ignore_blanks)
+            txml_buffer_append(buf, "\n", 1);
+        return 0;
+    }
+
+    if (xml->ignore_blanks)
+        txml_buffer_append_tabs(buf, depth);
+    if (source)
+        source->element.start = TXML_BUFFER_POSITION(buf);
+    txml_buffer_append(buf, "<", 1);
+    txml_dump_node_name(buf, node);
+    TAILQ_FOREACH(attr, &node->attributes, list) {
+        txml_buffer_append(buf, " ", 1);
+        attr_source = source ? txml_attribute_source(attr) : NULL;
+        if (attr_source)
+            attr_source->start = TXML_BUFFER_POSITION(buf);
+        txml_buffer_append_string(buf, attr->name);
+        txml_buffer_append(buf, "=\"", 2);
+        txml_dump_value(buf, attr->value, attr_source ? &attr_source->value : NULL);
+        txml_buffer_append(buf, "\"", 1);
+    }
+    if (source)
+        source->value.start = TXML_SPAN_NONE; // unless written below
+
+    TXML_NODE_EXPAND(node);
+    has_children = !TAILQ_EMPTY(&node->children);
+    if (!*node->value && !has_children) {
+        txml_buffer_append(buf, "/>", 2);
+        if (source)
+            source->element.len = TXML_BUFFER_POSITION(buf) - source->element.start;
+        if (xml->ignore_blanks)
+            txml_buffer_append(buf, "\n", 1);
+        return 0;
+    }
+
+    if (has_children) {
+        txml_buffer_append(buf, xml->ignore_blanks ? ">\n" : ">", xml->ignore_blanks ? 2 : 1);
+        if (*node->value) {
+            txml_dump_value(buf, node->value, source ? &source->value : NULL);
+            if (xml->ignore_blanks)
+                txml_buffer_append(buf, "\n", 1);
+        }
+        return 1;
+    }
+
+    // a value but no children, the closing tag goes on the same line
+    txml_buffer_append(buf, ">", 1);
+    txml_dump_value(buf, node->value, source ? &source->value : NULL);
+    txml_dump_node_close(xml, buf, node, 0, source);
+    return 0;
+}
+
+// serialize a branch walking it through the parent pointers (no recursion)
+static void
+txml_dump_branch_to_buffer(txml_t *xml, txml_buffer_t *buf, txml_node_t *rnode, unsigned int depth)
+{
+    txml_node_t *node = rnode;
+    txml_node_t *next;
+
+    for (;;) {
+        if (txml_dump_node_open(xml, buf, node, depth)) {
+            node = TAILQ_FIRST(&node->children);
+            depth++;
+            continue;
+        }
+        for (;;) {
+            if (node == rnode)
+                return;
+            next = TAILQ_NEXT(node, siblings);
+            if (next) {
+                node = next;
+                break;
+            }
+            node = node->parent;
+            depth--;
+            txml_dump_node_close(xml, buf, node, depth,
+                                 buf->positions ? TXML_NODE_SOURCE(node) : NULL);
+        }
+    }
+}
+
+static char *
+txml_dump_branch_unlocked(txml_t *xml, txml_node_t *rnode, unsigned int depth)
+{
+    txml_buffer_t buf = TXML_BUFFER_INIT;
+
+    if (!rnode || !rnode->name)
+        return NULL;
+
+    txml_dump_branch_to_buffer(xml, &buf, rnode, depth);
+    if (buf.err) {
+        free(buf.data);
+        return NULL;
+    }
+    return buf.data;
+}
+
+char *
+txml_dump_branch(txml_t *xml, txml_node_t *rnode, unsigned int depth)
+{
+    char *res;
+    TXML_DOC_RDLOCK(xml);
+    res = txml_dump_branch_unlocked(xml, rnode, depth);
+    TXML_DOC_RDUNLOCK(xml);
+    return res;
+}
+
+// build the xml declaration of the document.
+// Returns 1 if the dump has to be converted to the output encoding
+static int
+txml_dump_head(txml_t *xml, char *head, size_t size)
+{
+    int do_conversion = 0;
+
+    memset(head, 0, size);
+    if (xml->head) {
+        int quote;
+        char *start, *end, *encoding;
+        char *initial = strdup(xml->head);
+        start = strstr(initial, "encoding=");
+        if (start) {
+            *start = 0;
+            encoding = start+9;
+            if (*encoding == '"' || *encoding == '\'') {
+                quote = *encoding;
+                encoding++;
+                end = (char *)strchr(encoding, quote);
+                if (!end) {
+                    /* TODO - Error Messages */
+                } else if ((end-encoding) >= sizeof(xml->output_encoding)) {
+                    /* TODO - Error Messages */
+                }
+                *end = 0;
+                // check if document encoding matches
+                if (strncasecmp(encoding, xml->document_encoding, end-encoding) != 0) {
+                    /* TODO - Error Messages */
+                } 
+                if (strncasecmp(encoding, xml->output_encoding, end-encoding) != 0) {
+#ifdef USE_ICONV
+                    snprintf(head, size, "%sencoding=\"%s\"%s",
+                        initial, xml->output_encoding, ++end);
+                    do_conversion = 1;
+#else
+                    fprintf(stderr, "Iconv missing: will not convert output to %s\n", xml->output_encoding);
+                    snprintf(head, size, "%s", xml->head);
+#endif
+                } else {
+                    snprintf(head, size, "%s", xml->head);
+                }
+
+            }
+        } else {
+#ifdef USE_ICONV
+            if (strcasecmp(xml->output_encoding, "utf-8") != 0) {
+                do_conversion = 1;
+                fprintf(stderr, "Iconv missing: will not convert output to %s\n", xml->output_encoding);
+            }
+            snprintf(head, size, "xml version=\"1.0\" encoding=\"%s\"", 
+                xml->output_encoding);
+#else
+            if (strcasecmp(xml->output_encoding, "utf-8") != 0) {
+                fprintf(stderr, "Iconv missing: will not convert output to %s\n", xml->output_encoding);
+            }
+            snprintf(head, size, "xml version=\"1.0\" encoding=\"utf-8\"");
+#endif
+        }
+        free(initial);
+    } else {
+#ifdef USE_ICONV
+        if (strcasecmp(xml->output_encoding, "utf-8") != 0) {
+            do_conversion = 1;
+        }
+        snprintf(head, size, "xml version=\"1.0\" encoding=\"%s\"", 
+            xml->output_encoding);
+#else
+        if (strcasecmp(xml->output_encoding, "utf-8") != 0) {
+            fprintf(stderr, "Iconv missing: will not convert output to %s\n", xml->output_encoding);
+        }
+        snprintf(head, size, "xml version=\"1.0\" encoding=\"utf-8\"");
+#endif
+    }
+    return do_conversion;
+}
+
+// serialize the whole document
+static void
+txml_dump_document_to_buffer(txml_t *xml, txml_buffer_t *buf, char *head)
+{
+    txml_node_t *rnode;
+
+    txml_buffer_append(buf, "<?", 2);
+    txml_buffer_append_string(buf, head);
+    txml_buffer_append(buf, "?>\n", 3);
+    TAILQ_FOREACH(rnode, &xml->root_elements, siblings)
+        txml_dump_branch_to_buffer(xml, buf, rnode, 0);
+}
+
+static char *
+txml_dump_unlocked(txml_t *xml, int *outlen)
+{
+    char *dump;
+    txml_buffer_t buf = TXML_BUFFER_INIT;
+    char head[256]; // should be enough
+#ifdef USE_ICONV
+    int do_conversion = txml_dump_head(xml, head, sizeof(head));
+#else
+    txml_dump_head(xml, head, sizeof(head));
+#endif
+
+    txml_dump_document_to_buffer(xml, &buf, head);
+    if (buf.err) {
+        free(buf.data);
+        return NULL;
+    }
+    dump = buf.data;
+    if (outlen) // check if we need to report the output size
+        *outlen = buf.len;
+#ifdef USE_ICONV
+    if (do_conversion) {
+        iconv_t ich;
+        size_t ilen, olen, cb;
+        char *out;
+        char *iconvin;
+        char *iconvout;
+        ilen = strlen(dump);
+        // the most expensive conversion would be from ascii to utf-32/ucs-4
+        // ( 4 bytes for each char )
+        olen = ilen * 4; 
+        // we still don't know how big the output buffer is going to be
+        // we will update outlen later once iconv tell us the size
+        if (outlen) 
+            *outlen = olen;
+        out = (char *)calloc(1, olen);
+        ich = iconv_open (xml->output_encoding, xml->document_encoding);
+        if (ich == (iconv_t)(-1)) {
+            free(dump);
+            free(out);
+            fprintf(stderr, "Can't init iconv: %s\n", strerror(errno));
+            return NULL;
+        }
+        iconvin = dump;
+        iconvout = out;
+        cb = iconv(ich, &iconvin, &ilen, &iconvout, &olen);
+        if (cb == -1) {
+            free(dump);
+            free(out);
+            fprintf(stderr, "Error from iconv: %s\n", strerror(errno));
+            return NULL;
+        }
+        iconv_close(ich);
+        free(dump); // release the old buffer (in the original encoding)
+        dump = out;
+        if (outlen) // update the outputsize if we have to
+            *outlen -= olen;
+    }
+#endif
+    return(dump);
+}
+
+char *
+txml_dump(txml_t *xml, int *outlen)
+{
+    char *res;
+    TXML_DOC_RDLOCK(xml);
+    res = txml_dump_unlocked(xml, outlen);
+    TXML_DOC_RDUNLOCK(xml);
+    return res;
+}
+
+#define TXML_SAVE_CHUNK (64 * 1024) // the document is written out in chunks of this size
+
+static unsigned int txml_save_counter = 0;
+
+// the directory holding a file (to be freed by the caller)
+static char *
+txml_dirname(char *path)
+{
+    char *slash = strrchr(path, '/');
+    char *dir;
+
+    if (!slash)
+        return strdup(".");
+    if (slash == path)
+        return strdup("/");
+    dir = (char *)malloc(slash - path + 1);
+    if (dir) {
+        memcpy(dir, path, slash - path);
+        dir[slash - path] = 0;
+    }
+    return dir;
+}
+
+#ifndef WIN32
+#define TXML_SAVE_MAX_LINKS 40 // as many symbolic links as the kernel follows in a path
+
+// the file a path leads to through symbolic links, even if it doesn't exist yet
+// (the links found in the last component only, rename() follows the ones in the directories).
+// 'target' is set to a copy of the path if it's not a link
+static txml_err_t
+txml_link_target(char *path, char **target)
+{
+    struct stat linkstat;
+    char *link, *dir;
+    ssize_t len;
+    int hops;
+
+    if (!(*target = strdup(path)))
+        return TXML_MEMORY_ERR;
+    for (hops = 0; lstat(*target, &linkstat) == 0 && S_ISLNK(linkstat.st_mode); hops++) {
+        if (hops == TXML_SAVE_MAX_LINKS)
+            return TXML_BADARGS;
+        if (!(link = (char *)malloc(linkstat.st_size + 1)))
+            return TXML_MEMORY_ERR;
+        len = readlink(*target, link, linkstat.st_size + 1);
+        if (len < 0 || len > linkstat.st_size) { // changed meanwhile
+            free(link);
+            return TXML_BADARGS;
+        }
+        link[len] = 0;
+        if (*link != '/') {
+            // relative to the directory holding the link
+            dir = txml_dirname(*target);
+            free(*target);
+            *target = dir ? (char *)malloc(strlen(dir) + len + 2) : NULL;
+            if (*target)
+                sprintf(*target, "%s/%s", dir, link);
+            free(dir);
+            free(link);
+            if (!*target)
+                return TXML_MEMORY_ERR;
+        } else {
+            free(*target);
+            *target = link;
+        }
+    }
+    return TXML_NOERR;
+}
+#endif
+
+// make sure a file (or the directory entries, if a directory) reached the disk
+static int
+txml_sync_fd(int fd, int policy)
+{
+#ifndef WIN32
+    if (policy == TXML_SYNC_FULL)
+        return fsync(fd);
+    if (policy == TXML_SYNC_DATA)
+#ifdef __linux__
+        return fdatasync(fd);
+#else
+        return fsync(fd);
+#endif
+#endif
+    return 0;
+}
+
+// make sure the entries of the directory holding a file (a rename) reached the disk
+static void
+txml_sync_dir(char *path)
+{
+    char *dir = txml_dirname(path);
+    int fd;
+
+    if (!dir)
+        return;
+    if ((fd = open(dir, O_RDONLY)) >= 0) {
+        txml_sync_fd(fd, TXML_SYNC_FULL);
+        close(fd);
+    }
+    free(dir);
+}
+
+// create a new file next to 'target', to be renamed over it once complete.
+// 'tmp_path' must have room for strlen(target) + 32 bytes
+static int
+txml_tmp_open(char *target, char *tmp_path)
+{
+    int tries, fd = -1;
+
+    for (tries = 0; fd < 0 && tries < 100; tries++) {
+        sprintf(tmp_path, "%s.%ld.%u.tmp", target, (long)getpid(),
+                __atomic_fetch_add(&txml_save_counter, 1, __ATOMIC_RELAXED));
+        fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+        if (fd < 0 && errno != EEXIST)
+            break;
+    }
+    if (fd < 0)
+        fprintf(stderr, "Can't open output file %s", tmp_path);
+    return fd;
+}
+
+// save the document, hashing what is written if 'hasher' is given.
+// If 'positions' is given and set, the nodes tracking their positions record
+// where their values are written (it's cleared if they can't)
+static txml_err_t
+txml_save_file(txml_t *xml, char *xml_file, txml_hasher_t *hasher, int *positions)
+{
+    txml_buffer_t buf = TXML_BUFFER_INIT;
+    struct stat filestat;
+    char *target = NULL;
+    char *tmp_path = NULL;
+    char *backup_path = NULL;
+    char *dump;
+    int dump_len = 0;
+    char head[256]; // should be enough
+    FILE *out = NULL;
+    int exists, fd = -1;
+    txml_err_t err = TXML_GENERIC_ERR;
+
+    if (!xml_file)
+        return TXML_BADARGS;
+
+#ifndef WIN32
+    // replace (or create) the file a symbolic link leads to, not the link
+    err = txml_link_target(xml_file, &target);
+    if (err != TXML_NOERR) {
+        if (err == TXML_BADARGS)
+            fprintf(stderr, "Can't follow the symbolic links of %s", xml_file);
+        goto done;
+    }
+#else
+    target = strdup(xml_file);
+#endif
+    err = TXML_GENERIC_ERR;
+    tmp_path = target ? (char *)malloc(strlen(target) + 32) : NULL;
+    backup_path = target ? (char *)malloc(strlen(target) + 5) : NULL;
+    if (!tmp_path || !backup_path) {
+        err = TXML_MEMORY_ERR;
+        goto done;
+    }
+    exists = (stat(target, &filestat) == 0);
+
+    // write the new version aside, in the same directory (so that it can be renamed)
+    if ((fd = txml_tmp_open(target, tmp_path)) < 0)
+        goto done;
+#ifndef WIN32
+    if (exists)
+        fchmod(fd, filestat.st_mode & 07777); // keep the permissions of the file being replaced
+#endif
+    out = fdopen(fd, "w");
+    if (!out) {
+        close(fd);
+        goto failed;
+    }
+    setvbuf(out, NULL, _IONBF, 0); // the serializer buffers already
+
+    if (txml_dump_head(xml, head, sizeof(head))) {
+        // the conversion to the output encoding works on the whole dump
+        dump = txml_dump_unlocked(xml, &dump_len);
+        if (positions) // converted, the values could land anywhere
+            *positions = 0;
+        if (!dump || fwrite(dump, 1, dump_len, out) != dump_len)
+            buf.err = 1;
+        else if (hasher)
+            txml_hasher_update(hasher, dump, dump_len);
+        free(dump);
+    } else {
+        // stream the document through a small buffer
+        txml_buffer_reserve(&buf, TXML_SAVE_CHUNK);
+        buf.file = out;
+        buf.hasher = hasher;
+        buf.positions = positions && *positions;
+        txml_dump_document_to_buffer(xml, &buf, head);
+        txml_buffer_flush(&buf);
+        free(buf.data);
+    }
+    if (buf.err || fflush(out) != 0 || txml_sync_fd(fd, xml->save_sync) != 0) {
+        fprintf(stderr, "Can't write output file %s", tmp_path);
+        goto failed;
+    }
+    if (fclose(out) != 0) {
+        out = NULL;
+        goto failed;
+    }
+    out = NULL;
+
+    // the previous version becomes the backup, through a new link to it
+    if (exists && filestat.st_size > 0) {
+        sprintf(backup_path, "%s.bck", target);
+        unlink(backup_path);
+#ifndef WIN32
+        if (link(target, backup_path) != 0)
+#endif
+        {
+            // no hard links here, the file is missing until the new one replaces it
+            if (rename(target, backup_path) != 0) {
+                fprintf(stderr, "Can't create backup file %s", backup_path);
+                goto failed;
+            }
+        }
+    }
+
+    // readers find either the old version or the new one, never a partial one
+    if (rename(tmp_path, target) != 0) {
+        fprintf(stderr, "Can't replace %s", target);
+        goto failed;
+    }
+    if (xml->save_sync == TXML_SYNC_FULL)
+        txml_sync_dir(target); // the rename itself
+    err = TXML_NOERR;
+    goto done;
+
+failed:
+    if (out)
+        fclose(out);
+    unlink(tmp_path);
+done:
+    free(target);
+    free(tmp_path);
+    free(backup_path);
+    return err;
+}
+
+static txml_err_t
+txml_save_unlocked(txml_t *xml, char *xml_file)
+{
+    if (xml->map && xml_file && txml_map_is(xml->map, xml_file))
+        return txml_map_save(xml);
+    return txml_save_file(xml, xml_file, NULL, NULL);
+}
+
+txml_err_t
+txml_save(txml_t *xml, char *xml_file)
+{
+    txml_err_t res;
+    if (xml->map) { // the new positions of the values may have to be recorded in the nodes
+        TXML_WRLOCK(xml);
+        res = txml_save_unlocked(xml, xml_file);
+        TXML_WRUNLOCK(xml);
+        return res;
+    }
+    TXML_DOC_RDLOCK(xml);
+    res = txml_save_unlocked(xml, xml_file);
+    TXML_DOC_RDUNLOCK(xml);
+    return res;
+}
+
+static unsigned long
+txml_node_count_attributes_unlocked(txml_node_t *node)
+{
+    txml_attribute_t *attr;
+    int cnt = 0;
+    TAILQ_FOREACH(attr, &node->attributes, list) 
+        cnt++;
+    return cnt;
+}
+
+unsigned long
+txml_node_count_attributes(txml_node_t *node)
+{
+    unsigned long res;
+    TXML_NODE_RDLOCK(node);
+    res = txml_node_count_attributes_unlocked(node);
+    TXML_NODE_RDUNLOCK(node);
+    return res;
+}
+
+static unsigned long
+txml_node_count_children_unlocked(txml_node_t *node)
+{
+    txml_node_t *child;
+    int cnt = 0; 
+    TXML_NODE_EXPAND(node);
+    TAILQ_FOREACH(child, &node->children, siblings)
+        cnt++;
+    return cnt;
+}
+
+unsigned long
+txml_node_count_children(txml_node_t *node)
+{
+    unsigned long res;
+    TXML_NODE_RDLOCK(node);
+    res = txml_node_count_children_unlocked(node);
+    TXML_NODE_RDUNLOCK(node);
+    return res;
+}
+
+static unsigned long
+txml_count_branches_unlocked(txml_t *xml)
+{
+    txml_node_t *node;
+    int cnt = 0;
+    TAILQ_FOREACH(node, &xml->root_elements, siblings)
+        cnt++;
+    return cnt;
+}
+
+unsigned long
+txml_count_branches(txml_t *xml)
+{
+    unsigned long res;
+    TXML_RDLOCK(xml);
+    res = txml_count_branches_unlocked(xml);
+    TXML_RDUNLOCK(xml);
+    return res;
+}
+
+txml_err_t
+txml_remove_node(txml_t *xml, char *path)
+{
+    /* XXX - UNIMPLEMENTED */
+    return TXML_GENERIC_ERR;
+}
+
+static txml_err_t
+txml_remove_branch_unlocked(txml_t *xml, unsigned long index)
+{
+    int count = 0;
+    txml_node_t *branch, *tmp;
+    TAILQ_FOREACH_SAFE(branch, &xml->root_elements, siblings, tmp) {
+        if (count++ == index) {
+            if (xml->nindexes)
+                txml_index_branch(xml, NULL, branch, 0);
+            txml_name_index_detach(xml, branch);
+            TAILQ_REMOVE(&xml->root_elements, branch, siblings);
+            txml_node_destroy_unlocked(branch);
+            xml->snapshot_stale = 1;
+            if (xml->reload)
+                xml->reload->root = NULL;
+            return TXML_NOERR;
+        }
+    }
+    return TXML_GENERIC_ERR;
+}
+
+txml_err_t
+txml_remove_branch(txml_t *xml, unsigned long index)
+{
+    txml_err_t res;
+    txml_record_t rec = { NULL };
+    txml_node_t *branch;
+    TXML_WRLOCK(xml);
+    if (TXML_JOURNALING() && (branch = txml_get_branch_unlocked(xml, index)) &&
+        txml_record_begin(&rec, xml, 'D'))
+    {
+        txml_record_node(&rec, branch);
+    }
+    res = txml_remove_branch_unlocked(xml, index);
+    txml_record_end(&rec, res);
+    TXML_WRUNLOCK(xml);
+    return res;
+}
+
+static txml_node_t
+*txml_node_get_child_unlocked(txml_node_t *node, unsigned long index)
+{
+    txml_node_t *child;
+    int count = 0;
+    if(!node)
+        return NULL;
+    TXML_NODE_EXPAND(node);
+    TAILQ_FOREACH(child, &node->children, siblings) {
+        if (count++ == index) {
+            return child;
+            break;
+        }
+    }
+    return NULL;
+}
+
+txml_node_t *
+txml_node_get_child(txml_node_t *node, unsigned long index)
+{
+    txml_node_t *res;
+    TXML_NODE_RDLOCK(node);
+    res = txml_node_get_child_unlocked(node, index);
+    TXML_NODE_RDUNLOCK(node);
+    return res;
+}
+
+/*
+ * A path component selecting a child by name, optionally followed by
+ * an index ( "name[2]" ) or by an attribute predicate ( "name[@attr]" or
+ * "name[@attr='value']" ). Parsed once and then matched against the children.
+ */
+typedef struct {
+    char *buf; // private copy of the expression (name and attr_name point inside it)
+    char *name;
+    int index;
+    char *attr_name;
+    char *attr_value; // already dexmlized (NULL if no value has been specified)
+    char *unescaped; // copy holding attr_value, if it contained entities
+} txml_selector_t;
+
+static int
+txml_selector_parse(txml_selector_t *sel, char *expr)
+{
+    char *p;
+    char *attr_val;
+    int len;
+
+    memset(sel, 0, sizeof(txml_selector_t));
+    sel->buf = strdup(expr); // make a copy to avoid changing the provided buffer
+    if (!sel->buf)
+        return -1;
+    sel->name = sel->buf;
+    len = strlen(sel->buf);
+
+    if (len && sel->buf[len-1] == ']' && (p = strchr(sel->buf, '['))) {
+        *p = 0;
+        p++;
+        if (sscanf(p, "%d]", &sel->index) == 1) {
+            sel->index--;
+        } else if (*p == '@') {
+            p++;
+            p[strlen(p)-1] = 0;
+            sel->attr_name = p;
+            attr_val = strchr(p, '=');
+            if (attr_val) {
+                *attr_val = 0;
+                attr_val++;
+                if (*attr_val == '\'' || *attr_val == '"') {
+                    char quote = *attr_val;
+                    int n, j=0;
+                    // inplace dequoting
+                    attr_val++;
+                    for (n = 0; attr_val[n] != 0; n++) {
+                        if (attr_val[n] == quote) {
+                            if (n && attr_val[n-1] == quote) { // quote escaping (XXX - perhaps out of spec)
+                                if (j)
+                                    j--;
+                            } else {
+                                attr_val[n] = 0;
+                                break;
+                            }
+                        }
+                        if (j != n)
+                            attr_val[j] = attr_val[n];
+                        j++;
                     }
-                    strncpy(cdata, mark, p-mark);
-                    err = txml_extra_node_handler(xml, cdata, TXML_NODETYPE_CDATA);
-                    free(cdata);
-                    p+=3;
+
+                }
+                if (!strchr(attr_val, '&')) { // nothing to unescape
+                    sel->attr_value = attr_val;
+                } else if ((sel->unescaped = dexmlize(attr_val))) {
+                    sel->attr_value = sel->unescaped;
                 } else {
-                    fprintf(stderr, "Unsupported entity type at \"... -->%15s\"", mark);
-                    err = TXML_PARSER_GENERIC_ERR;
-                    return err;
+                    free(sel->buf);
+                    return -1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+static void
+txml_selector_release(txml_selector_t *sel)
+{
+    free(sel->buf);
+    free(sel->unescaped);
+}
+
+// check a child already matching the selector name.
+// 'attr_value' is the value of its 'attr_name' attribute (NULL if missing)
+static inline int
+txml_selector_select(txml_selector_t *sel, char *attr_value)
+{
+    if (sel->attr_name) {
+        if (!attr_value)
+            return 0;
+        return (!sel->attr_value || strcmp(attr_value, sel->attr_value) == 0);
+    }
+    return (sel->index-- == 0);
+}
+
+/* XXX - if multiple children shares the same name, only the first is returned */
+static txml_node_t
+*txml_node_get_child_byname_unlocked(txml_node_t *node, char *name)
+{
+    txml_node_t *child;
+    txml_selector_t sel;
+
+    if(!node || txml_selector_parse(&sel, name) != 0)
+        return NULL;
+
+    if (sel.attr_value && txml_index_select(node, sel.name, sel.attr_name, sel.attr_value, &child)) {
+        txml_selector_release(&sel);
+        return child;
+    }
+    TXML_NODE_EXPAND(node);
+    TAILQ_FOREACH(child, &node->children, siblings) {
+        if(strcmp(child->name, sel.name) == 0) {
+            char *attr_value = NULL;
+            if (sel.attr_name) {
+                txml_attribute_t *attr = txml_node_get_attribute_byname_unlocked(child, sel.attr_name);
+                if (attr)
+                    attr_value = attr->value;
+            }
+            if (txml_selector_select(&sel, attr_value))
+                break;
+        }
+    }
+    txml_selector_release(&sel);
+    return child;
+}
+
+txml_node_t *
+txml_node_get_child_byname(txml_node_t *node, char *name)
+{
+    txml_node_t *res;
+    TXML_NODE_RDLOCK(node);
+    res = txml_node_get_child_byname_unlocked(node, name);
+    TXML_NODE_RDUNLOCK(node);
+    return res;
+}
+
+static txml_node_t *
+txml_get_node_unlocked(txml_t *xml, char *path, txml_lock_state_t *state)
+{
+    char *buff, *walk;
+    char *tag;
+    unsigned long i = 0;
+    int level = 0;
+    txml_node_t *cnode = NULL;
+    txml_node_t *wnode = NULL;
+//#ifndef WIN32
+    char *brkb;
+//#endif
+    if(!path)
+        return NULL;
+
+    buff = strdup(path);
+    walk = buff;
+
+    // check if we are allowing multiple rootnodes to determine
+    // if it's included in the path or not
+    if (xml->allow_multiple_root_nodes) {
+        /* skip leading slashes '/' */
+        while(*walk == '/')
+            walk++;
+
+        /* select the root node */
+#ifndef WIN32
+        tag  = strtok_r(walk, "/", &brkb);
+#else
+        tag = strtok(walk, "/");
+#endif
+        if(!tag) {
+            free(buff);
+            return NULL;
+        }
+
+        for(i = 0; i < txml_count_branches_unlocked(xml); i++) {
+            wnode = txml_get_branch_unlocked(xml, i);
+            if(strcmp(wnode->name, tag) == 0) {
+                cnode = wnode;
+                break;
+            }
+        }
+        /* now cnode points to the root node ... let's find requested node */
+#ifndef WIN32
+        tag = strtok_r(NULL, "/", &brkb);
+#else
+        tag = strtok(NULL, "/");
+#endif
+    } else { // no multiple rootnodes
+        cnode = txml_get_branch_unlocked(xml, 0);
+        // TODO - this could be done in a cleaner and more efficient way
+        if (*walk != '/') {
+            buff = malloc(strlen(walk)+2);
+            sprintf(buff, "/%s", walk);
+            free(walk);
+            walk = buff;
+        }
+#ifndef WIN32
+        tag = strtok_r(walk, "/", &brkb);
+#else
+        tag = strtok(walk, "/");
+#endif
+    }
+
+    if(!cnode) {
+        free(buff);
+        return NULL;
+    }
+
+    if (state && xml->lock_depth == 1)
+        txml_lock_branch_read(state, cnode);
+
+    while(tag) {
+        wnode = txml_node_get_child_byname_unlocked(cnode, tag);
+        if(!wnode) {
+            free(buff);
+            return NULL;
+        }
+        cnode = wnode; // update current node
+        if (state && ++level == xml->lock_depth - 1)
+            txml_lock_branch_read(state, cnode);
+#ifndef WIN32
+        tag = strtok_r(NULL, "/", &brkb);
+#else
+        tag = strtok(NULL, "/");
+#endif
+    }
+
+    free(buff);
+    return cnode;
+}
+
+txml_node_t *
+txml_get_node(txml_t *xml, char *path)
+{
+    txml_node_t *res;
+    TXML_PATH_RDLOCK(xml);
+    res = txml_get_node_unlocked(xml, path, TXML_PATH_LOCK_STATE);
+    TXML_PATH_RDUNLOCK(xml);
+    return res;
+}
+
+//
+// MULTI-PATH LOOKUPS
+// A set of paths compiled into a trie of their steps (shared prefixes being
+// stored once), resolved against a document in a single descent. Each node
+// reached is scanned once for all the steps following it
+//
+
+typedef struct {
+    char *token; // the step as written in the paths ("name", "name[2]", "name[@attr='value']")
+    txml_selector_t sel;
+    unsigned int hash; // of the selector name
+    unsigned long first; // the steps following this one are contiguous, sorted by hash
+    unsigned long count;
+} txml_path_step_t;
+
+struct __txml_paths_s {
+    txml_path_step_t *steps; // breadth first, steps[0] being the start of all the paths
+    unsigned long nsteps;
+    unsigned long *targets; // the step where each path ends
+    unsigned long count;
+    char *strings; // storage for the tokens of all the steps
+};
+
+// a step of the trie while it's being built
+typedef struct {
+    char *token;
+    unsigned int key; // hash of the token
+    unsigned int hash;
+    unsigned long child; // first child (0 if none, the start being never a child)
+    unsigned long sibling;
+    unsigned long count;
+} txml_path_build_t;
+
+// the child of 'parent' for the 'len' bytes long 'token', added if not there yet
+// (copying the token at 'strings'). Returns 0 on errors
+static unsigned long
+txml_paths_add_step(txml_path_build_t **build, unsigned long *nbuild, unsigned long *size,
+                    char **strings, unsigned long parent, char *token, size_t len)
+{
+    txml_path_build_t *b = *build;
+    txml_path_build_t *step;
+    unsigned int key = txml_hash_span(token, len);
+    unsigned long i;
+    char *p;
+
+    for (i = b[parent].child; i; i = b[i].sibling) {
+        if (b[i].key == key && strncmp(b[i].token, token, len) == 0 && b[i].token[len] == 0)
+            return i;
+    }
+    if (*nbuild == *size) {
+        b = (txml_path_build_t *)realloc(b, sizeof(txml_path_build_t) * *size * 2);
+        if (!b)
+            return 0;
+        *build = b;
+        *size *= 2;
+    }
+    step = &b[*nbuild];
+    memset(step, 0, sizeof(txml_path_build_t));
+    step->token = *strings;
+    memcpy(step->token, token, len);
+    step->token[len] = 0;
+    *strings += len + 1;
+    step->key = key;
+    // hash the selected name, as txml_selector_parse() would split it
+    if (len && token[len-1] == ']' && (p = memchr(token, '[', len)))
+        step->hash = txml_hash_span(token, p - token);
+    else
+        step->hash = key;
+    step->sibling = b[parent].child;
+    b[parent].child = *nbuild;
+    b[parent].count++;
+    return (*nbuild)++;
+}
+
+txml_paths_t *
+txml_paths_compile(char **paths, unsigned long count)
+{
+    txml_paths_t *compiled;
+    txml_path_build_t *build;
+    unsigned long *order = NULL, *map = NULL;
+    unsigned long nbuild = 1, size = 64;
+    unsigned long i, j, k, head, tail;
+    size_t len = 0;
+    char *tag, *end, *strings;
+
+    if (!paths && count)
+        return NULL;
+    for (i = 0; i < count; i++) {
+        if (!paths[i])
+            return NULL;
+        len += strlen(paths[i]) + 1;
+    }
+    compiled = (txml_paths_t *)calloc(1, sizeof(txml_paths_t));
+    build = (txml_path_build_t *)calloc(size, sizeof(txml_path_build_t));
+    if (!compiled || !build || !(compiled->targets = (unsigned long *)calloc(count + 1, sizeof(unsigned long))) ||
+        !(compiled->strings = strings = (char *)malloc(len + 1)))
+    {
+        goto error;
+    }
+    compiled->count = count;
+
+    // split the paths the same way txml_get_node() does (empty steps are skipped)
+    for (i = 0; i < count; i++) {
+        unsigned long step = 0;
+        for (tag = paths[i]; *tag; tag = *end ? end + 1 : end) {
+            if (!(end = strchr(tag, '/')))
+                end = tag + strlen(tag);
+            if (end > tag && !(step = txml_paths_add_step(&build, &nbuild, &size, &strings, step, tag, end - tag)))
+                goto error;
+        }
+        compiled->targets[i] = step;
+    }
+
+    // lay the steps out breadth first, the children of each step next to each other
+    order = (unsigned long *)malloc(sizeof(unsigned long) * nbuild);
+    map = (unsigned long *)malloc(sizeof(unsigned long) * nbuild);
+    compiled->steps = (txml_path_step_t *)calloc(nbuild, sizeof(txml_path_step_t));
+    if (!order || !map || !compiled->steps)
+        goto error;
+    compiled->nsteps = nbuild;
+    order[0] = 0;
+    for (head = 0, tail = 1; head < tail; head++) {
+        txml_path_step_t *step = &compiled->steps[head];
+        step->first = tail;
+        step->count = build[order[head]].count;
+        for (j = build[order[head]].child; j; j = build[j].sibling) {
+            // insertion sort by hash (the steps sharing a parent are usually few)
+            for (k = tail; k > step->first && build[order[k-1]].hash > build[j].hash; k--)
+                order[k] = order[k-1];
+            order[k] = j;
+            tail++;
+        }
+    }
+    for (i = 0; i < nbuild; i++) {
+        txml_path_step_t *step = &compiled->steps[i];
+        map[order[i]] = i;
+        if (!i)
+            continue;
+        step->token = build[order[i]].token;
+        step->hash = build[order[i]].hash;
+        if (!strchr(step->token, '[')) {
+            // plain name, nothing to parse
+            step->sel.name = step->token;
+        } else if (txml_selector_parse(&step->sel, step->token) != 0) {
+            step->sel.buf = NULL;
+            goto error;
+        }
+    }
+    for (i = 0; i < count; i++)
+        compiled->targets[i] = map[compiled->targets[i]];
+
+    free(order);
+    free(map);
+    free(build);
+    return compiled;
+
+error:
+    free(build);
+    free(order);
+    free(map);
+    txml_paths_destroy(compiled);
+    return NULL;
+}
+
+void
+txml_paths_destroy(txml_paths_t *paths)
+{
+    unsigned long i;
+
+    if (!paths)
+        return;
+    for (i = 1; i < paths->nsteps; i++)
+        txml_selector_release(&paths->steps[i].sel);
+    free(paths->steps);
+    free(paths->targets);
+    free(paths->strings);
+    free(paths);
+}
+
+// resolve the steps following 'step' from 'node', scanning its children once.
+// 'skip' and 'done' are per step scratch space
+static void
+txml_paths_select(txml_paths_t *paths, txml_path_step_t *step, txml_node_t *node,
+                  txml_node_t **resolved, int *skip, char *done)
+{
+    txml_path_step_t *steps = paths->steps;
+    unsigned long last = step->first + step->count;
+    unsigned long pending = 0;
+    unsigned long i, lo, hi;
+    unsigned int hash;
+    txml_node_t *child;
+
+    for (i = step->first; i < last; i++) {
+        txml_selector_t *sel = &steps[i].sel;
+        skip[i] = sel->index;
+        done[i] = (sel->attr_value && txml_index_select(node, sel->name, sel->attr_name, sel->attr_value, &resolved[i]));
+        if (!done[i])
+            pending++;
+    }
+    if (!pending)
+        return;
+
+    TXML_NODE_EXPAND(node);
+    TAILQ_FOREACH(child, &node->children, siblings) {
+        hash = txml_hash_string(child->name);
+        // the first step with this hash
+        for (lo = step->first, hi = last; lo < hi; ) {
+            i = lo + (hi - lo) / 2;
+            if (steps[i].hash < hash)
+                lo = i + 1;
+            else
+                hi = i;
+        }
+        for (i = lo; i < last && steps[i].hash == hash; i++) {
+            txml_selector_t *sel = &steps[i].sel;
+            if (done[i] || strcmp(child->name, sel->name) != 0)
+                continue;
+            if (sel->attr_name) {
+                txml_attribute_t *attr = txml_node_get_attribute_byname_unlocked(child, sel->attr_name);
+                if (!attr || (sel->attr_value && strcmp(attr->value, sel->attr_value) != 0))
+                    continue;
+            } else if (skip[i]-- != 0) {
+                continue;
+            }
+            resolved[i] = child;
+            done[i] = 1;
+            if (--pending == 0)
+                return;
+        }
+    }
+}
+
+static void
+txml_paths_resolve_unlocked(txml_t *xml, txml_paths_t *paths, txml_node_t **resolved, int *skip, char *done)
+{
+    txml_path_step_t *step;
+    txml_node_t *rnode;
+    unsigned long i, j;
+
+    step = &paths->steps[0];
+    if (xml->allow_multiple_root_nodes) {
+        // the first steps select the root elements, by name only
+        resolved[0] = NULL;
+        for (j = step->first; j < step->first + step->count; j++) {
+            TAILQ_FOREACH(rnode, &xml->root_elements, siblings) {
+                if (strcmp(rnode->name, paths->steps[j].token) == 0) {
+                    resolved[j] = rnode;
+                    break;
                 }
-            } else if(*p =='?') { /* head */
-                char *encoding = NULL;
-                p++;
-                mark = p;
-                p = strstr(mark, "?>");
-                if(xml->head) // we are going to overwrite existing head (if any)
-                    free(xml->head); /* XXX - should notify this behaviour? */
-                xml->head = (char *)calloc(1, p-mark+1);
-                strncpy(xml->head, mark, p-mark);
-                encoding = strstr(xml->head, "encoding=");
-                if (encoding) {
-                    encoding += 9;
-                    if (*encoding == '"' || *encoding == '\'') {
-                        int encoding_length = 0;
-                        quote = *encoding;
-                        encoding++;
-                        end = (char *)strchr(encoding, quote);
-                        if (!end) {
-                            fprintf(stderr, "Unquoted encoding string in the <?xml> section");
-                            err = TXML_PARSER_GENERIC_ERR;
-                            return err;
-                        }
-                        encoding_length = end - encoding;
-                        if (encoding_length < sizeof(xml->document_encoding)) {
-                            strncpy(xml->document_encoding, encoding, encoding_length);
-                            // ensure to terminate it, if we are reusing a context we 
-                            // could have still the old encoding there possibly with a 
-                            // longer name (so poisoning the buffer)
-                            xml->document_encoding[encoding_length] = 0; 
-                        }
-                    }
-                } else {
+            }
+        }
+    } else {
+        resolved[0] = txml_get_branch_unlocked(xml, 0);
+        if (resolved[0])
+            txml_paths_select(paths, step, resolved[0], resolved, skip, done);
+    }
+    // the steps being breadth first, each node has been resolved before its children
+    for (i = 1; i < paths->nsteps; i++) {
+        step = &paths->steps[i];
+        if (step->count && resolved[i])
+            txml_paths_select(paths, step, resolved[i], resolved, skip, done);
+    }
+}
+
+unsigned long
+txml_paths_resolve(txml_t *xml, txml_paths_t *paths, txml_node_t **nodes)
+{
+    txml_node_t **resolved;
+    unsigned long i, found = 0;
+    int *skip;
+    char *done;
+
+    if (!xml || !paths || !nodes)
+        return 0;
+    // a single allocation for all the scratch space
+    resolved = (txml_node_t **)calloc(paths->nsteps, sizeof(txml_node_t *) + sizeof(int) + sizeof(char));
+    if (!resolved) {
+        memset(nodes, 0, sizeof(txml_node_t *) * paths->count);
+        return 0;
+    }
+    skip = (int *)(resolved + paths->nsteps);
+    done = (char *)(skip + paths->nsteps);
+
+    TXML_DOC_RDLOCK(xml);
+    txml_paths_resolve_unlocked(xml, paths, resolved, skip, done);
+    TXML_DOC_RDUNLOCK(xml);
+
+    for (i = 0; i < paths->count; i++) {
+        nodes[i] = resolved[paths->targets[i]];
+        if (nodes[i])
+            found++;
+    }
+    free(resolved);
+    return found;
+}
+
+unsigned long
+txml_get_nodes(txml_t *xml, char **paths, unsigned long count, txml_node_t **nodes)
+{
+    txml_paths_t *compiled;
+    unsigned long found;
+
+    if (!xml || !nodes)
+        return 0;
+    compiled = txml_paths_compile(paths, count);
+    if (!compiled) {
+        memset(nodes, 0, sizeof(txml_node_t *) * count);
+        return 0;
+    }
+    found = txml_paths_resolve(xml, compiled, nodes);
+    txml_paths_destroy(compiled);
+    return found;
+}
+
+static txml_node_t
+*txml_get_branch_unlocked(txml_t *xml, unsigned long index)
+{
+    txml_node_t *node;
+    int cnt = 0;
+    if(!xml)
+        return NULL;
+    TAILQ_FOREACH(node, &xml->root_elements, siblings) {
+        if (cnt++ == index)
+            return node;
+    }
+    return NULL;
+}
+
+txml_node_t *
+txml_get_branch(txml_t *xml, unsigned long index)
+{
+    txml_node_t *res;
+    TXML_RDLOCK(xml);
+    res = txml_get_branch_unlocked(xml, index);
+    TXML_RDUNLOCK(xml);
+    return res;
+}
+
+static txml_err_t
+txml_subst_branch_unlocked(txml_t *xml, unsigned long index, txml_node_t *new_branch)
+{
+    txml_node_t *branch, *tmp;
+    int cnt = 0;
+    TAILQ_FOREACH_SAFE(branch, &xml->root_elements, siblings, tmp) {
+        if (cnt++ == index) {
+            txml_node_expand_branch(branch); // it's going to leave the context
+            if (xml->nindexes) {
+                txml_index_branch(xml, NULL, branch, 0);
+                txml_index_branch(xml, NULL, new_branch, 1);
+            }
+            txml_name_index_invalidate(xml);
+            txml_order_invalidate(xml);
+            TAILQ_INSERT_BEFORE(branch, new_branch, siblings);
+            TAILQ_REMOVE(&xml->root_elements, branch, siblings);
+            txml_node_ext(new_branch)->context = xml;
+            branch->ext->context = NULL;
+            xml->snapshot_stale = 1;
+            if (xml->reload)
+                xml->reload->root = NULL;
+            return TXML_NOERR;
+        }
+    }
+    return TXML_LINKLIST_ERR;
+}
+
+txml_err_t
+txml_subst_branch(txml_t *xml, unsigned long index, txml_node_t *new_branch)
+{
+    txml_err_t res;
+    txml_record_t rec = { NULL };
+    txml_node_t *branch;
+    TXML_WRLOCK(xml);
+    if (TXML_JOURNALING() && (branch = txml_get_branch_unlocked(xml, index)) &&
+        txml_record_begin(&rec, xml, 'S'))
+    {
+        txml_record_node(&rec, branch);
+    }
+    res = txml_subst_branch_unlocked(xml, index, new_branch);
+    if (res == TXML_NOERR)
+        txml_record_branch(&rec, xml, new_branch);
+    txml_record_end(&rec, res);
+    TXML_WRUNLOCK(xml);
+    return res;
+}
+
+txml_namespace_t *
+txml_namespace_create(txml_pool_t *pool, char *ns_name, char *ns_uri) {
+    txml_namespace_t *new_ns;
+    new_ns = (txml_namespace_t *)TXML_POOL_ALLOC(pool, namespaces, sizeof(txml_namespace_t));
+    if (!new_ns)
+        return NULL;
+    if (ns_name)
+        new_ns->name = txml_strdup(pool, ns_name);
+    new_ns->uri = txml_strdup(pool, ns_uri);
+    return new_ns;
+}
+
+void
+txml_namespace_destroy(txml_pool_t *pool, txml_namespace_t *ns)
+{
+    if (ns) {
+        if (ns->name)
+            txml_strfree(pool, ns->name);
+        if (ns->uri)
+            txml_strfree(pool, ns->uri);
+        TXML_POOL_FREE(pool, namespaces, ns);
+    }
+}
+
+static txml_namespace_t *
+txml_node_add_namespace_unlocked(txml_pool_t *pool, txml_node_t *node, char *ns_name, char *ns_uri) {
+    txml_namespace_t *new_ns = NULL;
+    if (!node || !ns_uri)
+        return NULL;
+
+    if ((new_ns = txml_namespace_create(pool, ns_name, ns_uri)))
+        TAILQ_INSERT_TAIL(&txml_node_ext_alloc(pool, node)->namespaces, new_ns, list);
+    return new_ns;
+}
+
+txml_namespace_t *
+txml_node_add_namespace(txml_node_t *node, char *ns_name, char *ns_uri)
+{
+    txml_namespace_t *res;
+    TXML_NODE_WRLOCK(node);
+    res = txml_node_add_namespace_unlocked(NULL, node, ns_name, ns_uri);
+    TXML_NODE_WRUNLOCK(node);
+    return res;
+}
+
+static txml_namespace_t *
+txml_node_get_namespace_byname_unlocked(txml_node_t *node, char *ns_name) {
+    txml_namespace_set_t *item;
+    if (!node->ext)
+        return NULL;
+    // TODO - check if node->known_namespaces needs to be updated
+    TAILQ_FOREACH(item, &node->ext->known_namespaces, next) {
+        if (item->ns->name && strcmp(item->ns->name, ns_name) == 0)
+            return item->ns;
+    }
+    return NULL;
+}
+
+txml_namespace_t *
+txml_node_get_namespace_byname(txml_node_t *node, char *ns_name)
+{
+    txml_namespace_t *res;
+    TXML_NODE_RDLOCK(node);
+    res = txml_node_get_namespace_byname_unlocked(node, ns_name);
+    TXML_NODE_RDUNLOCK(node);
+    return res;
+}
+
+static txml_namespace_t *
+txml_node_get_namespace_byuri_unlocked(txml_node_t *node, char *ns_uri) {
+    txml_namespace_set_t *item;
+    if (!node->ext)
+        return NULL;
+    // TODO - check if node->known_namespaces needs to be updated
+    TAILQ_FOREACH(item, &node->ext->known_namespaces, next) {
+        if (strcmp(item->ns->uri, ns_uri) == 0)
+            return item->ns;
+    }
+    return NULL;
+}
+
+txml_namespace_t *
+txml_node_get_namespace_byuri(txml_node_t *node, char *ns_uri)
+{
+    txml_namespace_t *res;
+    TXML_NODE_RDLOCK(node);
+    res = txml_node_get_namespace_byuri_unlocked(node, ns_uri);
+    TXML_NODE_RDUNLOCK(node);
+    return res;
+}
+
+static txml_namespace_t *
+txml_node_get_namespace_unlocked(txml_node_t *node) {
+    txml_node_t *p = node->parent;
+    if (TXML_NODE_NS(node)) // my namespace
+        return node->ext->ns;
+    if (TXML_NODE_HNS(node)) // hinerited namespace
+        return node->ext->hns;
+    // search for a default naspace defined in our hierarchy
+    // this should happen only if a node has been moved across 
+    // multiple documents and it's hinerited namespace has been lost
+    while (p) { 
+        if (TXML_NODE_CNS(p))
+            return p->ext->cns;
+        p = p->parent;
+    }
+    return NULL;
+}
+
+txml_namespace_t *
+txml_node_get_namespace(txml_node_t *node)
+{
+    txml_namespace_t *res;
+    TXML_NODE_RDLOCK(node);
+    res = txml_node_get_namespace_unlocked(node);
+    TXML_NODE_RDUNLOCK(node);
+    return res;
+}
+
+static unsigned long
+txml_node_count_namespaces_unlocked(txml_node_t *node)
+{
+    txml_namespace_t *ns;
+    int cnt = 0;
+    if (!node->ext)
+        return 0;
+    TAILQ_FOREACH(ns, &node->ext->namespaces, list) 
+        cnt++;
+    return cnt;
+}
+
+unsigned long
+txml_node_count_namespaces(txml_node_t *node)
+{
+    unsigned long res;
+    TXML_NODE_RDLOCK(node);
+    res = txml_node_count_namespaces_unlocked(node);
+    TXML_NODE_RDUNLOCK(node);
+    return res;
+}
+
+static unsigned long
+txml_node_get_namespaces_unlocked(txml_node_t *node, txml_namespace_t **output_list, unsigned long list_size)
+{
+    txml_namespace_t *ns;
+    int cnt = 0;
+    if (!node->ext)
+        return 0;
+    TAILQ_FOREACH(ns, &node->ext->namespaces, list) {
+        output_list[cnt++] = ns;
+        cnt++;
+        if (cnt >= list_size)
+            break;
+    }
+    return cnt;
+   
+}
+
+unsigned long
+txml_node_get_namespaces(txml_node_t *node, txml_namespace_t **output_list, unsigned long list_size)
+{
+    unsigned long res;
+    TXML_NODE_RDLOCK(node);
+    res = txml_node_get_namespaces_unlocked(node, output_list, list_size);
+    TXML_NODE_RDUNLOCK(node);
+    return res;
+}
+
+char *
+txml_namespace_get_name(txml_namespace_t *ns)
+{
+    if (!ns)
+        return NULL;
+    return ns->name;
+}
+
+char *
+txml_namespace_get_uri(txml_namespace_t *ns)
+{
+    if (!ns)
+        return NULL;
+    return ns->uri;
+}
+
+static int
+txml_node_is_linked_unlocked(txml_node_t *node)
+{
+    return (TXML_NODE_CONTEXT(node) != NULL || node->parent != NULL);
+}
+
+int
+txml_node_is_linked(txml_node_t *node)
+{
+    int res;
+    TXML_NODE_RDLOCK(node);
+    res = txml_node_is_linked_unlocked(node);
+    TXML_NODE_RDUNLOCK(node);
+    return res;
+}
+
+//
+// SNAPSHOTS
+//
+
+static inline char *
+txml_snapshot_copy_string(char **p, char *string)
+{
+    char *copy = *p;
+    int len = strlen(string) + 1;
+    memcpy(copy, string, len);
+    *p += len;
+    return copy;
+}
+
+static struct __txml_snapshot_data_s *
+txml_snapshot_data_create(txml_node_t *node)
+{
+    struct __txml_snapshot_data_s *data;
+    txml_attribute_t *attr;
+    unsigned long nattrs = 0;
+    size_t size = sizeof(struct __txml_snapshot_data_s) + strlen(node->value) + 1;
+    char *p;
+
+    if (node->type == TXML_NODETYPE_SIMPLE)
+        size += strlen(node->name) + 1;
+    TAILQ_FOREACH(attr, &node->attributes, list) {
+        size += 2 * sizeof(char *) + strlen(attr->name) + strlen(attr->value) + 2;
+        nattrs++;
+    }
+
+    // the strings are stored right after the structure and the attributes table
+    data = (struct __txml_snapshot_data_s *)malloc(size);
+    if (!data)
+        return NULL;
+    data->refcnt = 1;
+    data->type = node->type;
+    data->nattrs = nattrs;
+    data->attrs = (char **)(data + 1);
+    p = (char *)(data->attrs + 2 * nattrs);
+
+    if (node->type == TXML_NODETYPE_SIMPLE)
+        data->name = txml_snapshot_copy_string(&p, node->name);
+    else
+        data->name = node->name; // static string
+    data->value = txml_snapshot_copy_string(&p, node->value);
+    nattrs = 0;
+    TAILQ_FOREACH(attr, &node->attributes, list) {
+        data->attrs[nattrs++] = txml_snapshot_copy_string(&p, attr->name);
+        data->attrs[nattrs++] = txml_snapshot_copy_string(&p, attr->value);
+    }
+    return data;
+}
+
+static inline void
+txml_snapshot_data_release(struct __txml_snapshot_data_s *data)
+{
+    if (__atomic_sub_fetch(&data->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+        free(data);
+}
+
+static void
+txml_snapshot_node_release(txml_snapshot_node_t *node)
+{
+    txml_snapshot_node_t *pending;
+    unsigned long i;
+
+    if (__atomic_sub_fetch(&node->refcnt, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    // nodes which dropped their last reference are queued instead of
+    // being released recursively, so deep branches can't exhaust the stack
+    node->next = NULL;
+    pending = node;
+    while (pending) {
+        node = pending;
+        pending = node->next;
+        for (i = 0; i < node->nchildren; i++) {
+            txml_snapshot_node_t *child = node->children[i];
+            if (__atomic_sub_fetch(&child->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+                child->next = pending;
+                pending = child;
+            }
+        }
+        txml_snapshot_data_release(node->data);
+        free(node);
+    }
+}
+
+static inline int
+txml_node_frozen_valid(txml_node_t *node)
+{
+    return (node->ext && node->ext->frozen && !node->ext->frozen_stale);
+}
+
+// return the first node, starting from 'node' and following its siblings,
+// whose frozen copy needs to be (re)built
+static inline txml_node_t *
+txml_node_next_unfrozen(txml_node_t *node)
+{
+    while (node && txml_node_frozen_valid(node))
+        node = TAILQ_NEXT(node, siblings);
+    return node;
+}
+
+// (re)build the frozen copy of a single node.
+// All its children must already have a valid frozen copy
+static txml_snapshot_node_t *
+txml_node_freeze_node(txml_node_t *node)
+{
+    struct __txml_node_ext_s *ext = txml_node_ext(node);
+    txml_snapshot_node_t *frozen;
+    txml_node_t *child;
+    unsigned long count = 0;
+
+    if (!ext)
+        return NULL;
+
+    TAILQ_FOREACH(child, &node->children, siblings)
+        count++;
+
+    frozen = (txml_snapshot_node_t *)malloc(sizeof(txml_snapshot_node_t) +
+                                            count * sizeof(txml_snapshot_node_t *));
+    if (!frozen)
+        return NULL;
+    frozen->refcnt = 1; // owned by the live node
+    frozen->nchildren = 0;
+    if (ext->frozen) { // only the children changed, reuse our own data
+        frozen->data = ext->frozen->data;
+        __atomic_add_fetch(&frozen->data->refcnt, 1, __ATOMIC_RELAXED);
+    } else {
+        frozen->data = txml_snapshot_data_create(node);
+        if (!frozen->data) {
+            free(frozen);
+            return NULL;
+        }
+    }
+
+    TAILQ_FOREACH(child, &node->children, siblings) {
+        txml_snapshot_node_t *frozen_child = child->ext->frozen;
+        __atomic_add_fetch(&frozen_child->refcnt, 1, __ATOMIC_RELAXED);
+        frozen->children[frozen->nchildren++] = frozen_child;
+    }
+
+    if (ext->frozen)
+        txml_snapshot_node_release(ext->frozen);
+    ext->frozen = frozen;
+    ext->frozen_stale = 0;
+    return frozen;
+}
+
+// return the frozen copy of a live branch, rebuilding only the parts
+// which changed since it has been built last time.
+// The branch is walked in post-order through the parent pointers,
+// entering only the subtrees which have been invalidated.
+// The returned copy is referenced by the live node, callers willing
+// to keep it must take their own reference
+static txml_snapshot_node_t *
+txml_node_freeze(txml_node_t *node)
+{
+    txml_node_t *cur = node;
+    txml_node_t *next;
+
+    if (txml_node_frozen_valid(node))
+        return node->ext->frozen;
+
+    for (;;) {
+        // go down to the deepest invalid node
+        while ((next = txml_node_next_unfrozen(TAILQ_FIRST(&cur->children))))
+            cur = next;
+
+        for (;;) {
+            if (!txml_node_freeze_node(cur))
+                return NULL;
+            if (cur == node)
+                return node->ext->frozen;
+            next = txml_node_next_unfrozen(TAILQ_NEXT(cur, siblings));
+            if (next) {
+                cur = next;
+                break;
+            }
+            // all the siblings are done, the parent can be built now
+            cur = cur->parent;
+        }
+    }
+}
+
+// build and publish a new snapshot if anything changed since the previous one.
+// Must be called holding the write lock, once all the pending changes are done
+static void
+txml_snapshot_publish(txml_t *xml)
+{
+    txml_snapshot_t *snapshot, *old;
+    txml_node_t *node;
+    unsigned long count = 0;
+    int stale = xml->snapshot_stale || !xml->snapshot;
+
+    if (!xml->snapshots || xml->batch)
+        return;
+
+    txml_expand_all(xml); // frozen copies are complete
+
+    TAILQ_FOREACH(node, &xml->root_elements, siblings) {
+        if (!node->ext || !node->ext->frozen || node->ext->frozen_stale)
+            stale = 1;
+        count++;
+    }
+    if (!stale)
+        return;
+
+    snapshot = (txml_snapshot_t *)malloc(sizeof(txml_snapshot_t) +
+                                         count * sizeof(txml_snapshot_node_t *));
+    if (!snapshot)
+        return; // readers will keep getting the previous version
+    snapshot->refcnt = 1; // owned by the context
+    snapshot->allow_multiple_root_nodes = xml->allow_multiple_root_nodes;
+    snapshot->nbranches = 0;
+    TAILQ_FOREACH(node, &xml->root_elements, siblings) {
+        txml_snapshot_node_t *frozen = txml_node_freeze(node);
+        if (!frozen) {
+            txml_snapshot_release(snapshot);
+            return;
+        }
+        __atomic_add_fetch(&frozen->refcnt, 1, __ATOMIC_RELAXED);
+        snapshot->branches[snapshot->nbranches++] = frozen;
+    }
+
+    txml_spin_lock(&xml->snapshot_lock);
+    old = xml->snapshot;
+    xml->snapshot = snapshot;
+    txml_spin_unlock(&xml->snapshot_lock);
+    xml->snapshot_stale = 0;
+
+    if (old)
+        txml_snapshot_release(old);
+}
+
+txml_snapshot_t *
+txml_snapshot(txml_t *xml)
+{
+    txml_snapshot_t *snapshot;
+
+    if (!__atomic_load_n(&xml->snapshots, __ATOMIC_ACQUIRE)) {
+        // first request, from now on a new snapshot is published after each change
+        TXML_WRLOCK(xml);
+        __atomic_store_n(&xml->snapshots, 1, __ATOMIC_RELEASE);
+        TXML_WRUNLOCK(xml);
+    }
+
+    txml_spin_lock(&xml->snapshot_lock);
+    snapshot = xml->snapshot;
+    if (snapshot)
+        __atomic_add_fetch(&snapshot->refcnt, 1, __ATOMIC_RELAXED);
+    txml_spin_unlock(&xml->snapshot_lock);
+    return snapshot;
+}
+
+void
+txml_snapshot_release(txml_snapshot_t *snapshot)
+{
+    unsigned long i;
+
+    if (!snapshot || __atomic_sub_fetch(&snapshot->refcnt, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    for (i = 0; i < snapshot->nbranches; i++)
+        txml_snapshot_node_release(snapshot->branches[i]);
+    free(snapshot);
+}
+
+unsigned long
+txml_snapshot_count_branches(txml_snapshot_t *snapshot)
+{
+    return snapshot->nbranches;
+}
+
+txml_snapshot_node_t *
+txml_snapshot_get_branch(txml_snapshot_t *snapshot, unsigned long index)
+{
+    if (index >= snapshot->nbranches)
+        return NULL;
+    return snapshot->branches[index];
+}
+
+txml_snapshot_node_t *
+txml_snapshot_get_node(txml_snapshot_t *snapshot, char *path)
+{
+    char *buff, *tag, *brkb;
+    txml_snapshot_node_t *cnode = NULL;
+    unsigned long i;
+
+    if (!path)
+        return NULL;
+
+    buff = strdup(path);
+    if (!buff)
+        return NULL;
+
+    tag = strtok_r(buff, "/", &brkb);
+    // check if we are allowing multiple rootnodes to determine
+    // if it's included in the path or not
+    if (snapshot->allow_multiple_root_nodes) {
+        if (tag) {
+            for (i = 0; i < snapshot->nbranches; i++) {
+                if (strcmp(snapshot->branches[i]->data->name, tag) == 0) {
+                    cnode = snapshot->branches[i];
+                    break;
                 }
-                p+=2;
-            } else { /* start tag */
-                attrs = NULL;
-                values = NULL;
-                nattrs = 0;
-                state = XML_ELEMENT_START;
-                SKIP_WHITESPACES(p);
-                mark = p;
-                ADVANCE_ELEMENT(p);
-                start = (char *)malloc(p-mark+2);
-                if(start == NULL)
-                    return TXML_MEMORY_ERR;
-                strncpy(start, mark, p-mark);
+            }
+            tag = strtok_r(NULL, "/", &brkb);
+        }
+    } else if (snapshot->nbranches) {
+        cnode = snapshot->branches[0];
+    }
+
+    while (cnode && tag) {
+        cnode = txml_snapshot_node_get_child_byname(cnode, tag);
+        tag = strtok_r(NULL, "/", &brkb);
+    }
+
+    free(buff);
+    return cnode;
+}
+
+char *
+txml_snapshot_node_get_name(txml_snapshot_node_t *node)
+{
+    return node->data->name;
+}
+
+char *
+txml_snapshot_node_get_value(txml_snapshot_node_t *node)
+{
+    return node->data->value;
+}
+
+int
+txml_snapshot_node_get_type(txml_snapshot_node_t *node)
+{
+    return node->data->type;
+}
+
+unsigned long
+txml_snapshot_node_count_children(txml_snapshot_node_t *node)
+{
+    return node->nchildren;
+}
+
+txml_snapshot_node_t *
+txml_snapshot_node_get_child(txml_snapshot_node_t *node, unsigned long index)
+{
+    if (index >= node->nchildren)
+        return NULL;
+    return node->children[index];
+}
+
+txml_snapshot_node_t *
+txml_snapshot_node_get_child_byname(txml_snapshot_node_t *node, char *name)
+{
+    txml_snapshot_node_t *child = NULL;
+    txml_selector_t sel;
+    unsigned long i;
+
+    if (txml_selector_parse(&sel, name) != 0)
+        return NULL;
+
+    for (i = 0; i < node->nchildren; i++) {
+        if (strcmp(node->children[i]->data->name, sel.name) == 0) {
+            char *attr_value = NULL;
+            if (sel.attr_name)
+                attr_value = txml_snapshot_node_get_attribute_byname(node->children[i], sel.attr_name);
+            if (txml_selector_select(&sel, attr_value)) {
+                child = node->children[i];
+                break;
+            }
+        }
+    }
+    txml_selector_release(&sel);
+    return child;
+}
+
+unsigned long
+txml_snapshot_node_count_attributes(txml_snapshot_node_t *node)
+{
+    return node->data->nattrs;
+}
+
+char *
+txml_snapshot_node_get_attribute_name(txml_snapshot_node_t *node, unsigned long index)
+{
+    if (index >= node->data->nattrs)
+        return NULL;
+    return node->data->attrs[2 * index];
+}
+
+char *
+txml_snapshot_node_get_attribute_value(txml_snapshot_node_t *node, unsigned long index)
+{
+    if (index >= node->data->nattrs)
+        return NULL;
+    return node->data->attrs[2 * index + 1];
+}
+
+char *
+txml_snapshot_node_get_attribute_byname(txml_snapshot_node_t *node, char *name)
+{
+    unsigned long i;
+    for (i = 0; i < node->data->nattrs; i++) {
+        if (strcmp(node->data->attrs[2 * i], name) == 0)
+            return node->data->attrs[2 * i + 1];
+    }
+    return NULL;
+}
+
+//
+// HASHING AND DIFF
+// Each node caches a hash of its whole branch (name, namespace, value,
+// attributes and the hashes of its children), computed on demand and
+// dropped by txml_node_changed() along the path to the root.
+// Branches with the same (64 bits) hash are assumed to be identical
+//
+
+// a hash found set (by any thread) guarantees that the whole branch
+// has been expanded and hashed, the hashes are published with release semantics
+static inline unsigned long long
+txml_node_cached_hash(txml_node_t *node)
+{
+    return __atomic_load_n(&node->hash, __ATOMIC_ACQUIRE);
+}
+
+static inline unsigned long long
+txml_hash_add(unsigned long long hash, char *string)
+{
+    // FNV-1a, including the terminator to tell "ab","c" from "a","bc"
+    do {
+        hash ^= (unsigned char)*string;
+        hash *= 1099511628211ULL;
+    } while (*string++);
+    return hash;
+}
+
+// hash everything in a node but its children
+static unsigned long long
+txml_node_hash_self(txml_node_t *node)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    txml_namespace_t *ns = TXML_NODE_NS(node);
+    txml_attribute_t *attr;
+
+    hash = (hash ^ (unsigned char)node->type) * 1099511628211ULL;
+    hash = txml_hash_add(hash, node->name);
+    if (ns)
+        hash = txml_hash_add(hash, ns->uri);
+    hash = txml_hash_add(hash, node->value);
+    TAILQ_FOREACH(attr, &node->attributes, list) {
+        hash = txml_hash_add(hash, attr->name);
+        hash = txml_hash_add(hash, attr->value);
+    }
+    return hash;
+}
+
+static inline unsigned long long
+txml_hash_add_child(unsigned long long hash, unsigned long long child)
+{
+    int i;
+    for (i = 0; i < 64; i += 8) {
+        hash ^= (child >> i) & 0xff;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static inline unsigned long long
+txml_node_hash_store(txml_node_t *node, unsigned long long hash)
+{
+    unsigned long long res = hash;
+    if (!res)
+        res = 1; // 0 means not computed
+    __atomic_store_n(&node->hash, res, __ATOMIC_RELEASE);
+    return res;
+}
+
+// hash a single node, the hashes of its children are known already
+static unsigned long long
+txml_node_hash_node(txml_node_t *node)
+{
+    unsigned long long hash = txml_node_hash_self(node);
+    txml_node_t *child;
+
+    TAILQ_FOREACH(child, &node->children, siblings)
+        hash = txml_hash_add_child(hash, txml_node_cached_hash(child));
+    return txml_node_hash_store(node, hash);
+}
+
+static inline txml_node_t *
+txml_node_next_unhashed(txml_node_t *node)
+{
+    while (node && txml_node_cached_hash(node))
+        node = TAILQ_NEXT(node, siblings);
+    return node;
+}
+
+// compute the hash of a branch, walking in post-order (through the parent
+// pointers) only the subtrees whose hash has been dropped.
+// Readers computing the same hashes concurrently store the same values
+static unsigned long long
+txml_node_hash_unlocked(txml_node_t *node)
+{
+    txml_node_t *cur = node;
+    txml_node_t *next;
+    unsigned long long hash = txml_node_cached_hash(node);
+
+    if (hash)
+        return hash;
+
+    for (;;) {
+        // go down to the deepest node without a hash
+        for (;;) {
+            TXML_NODE_EXPAND(cur);
+            if (!(next = txml_node_next_unhashed(TAILQ_FIRST(&cur->children))))
+                break;
+            cur = next;
+        }
+        for (;;) {
+            hash = txml_node_hash_node(cur);
+            if (cur == node)
+                return hash;
+            next = txml_node_next_unhashed(TAILQ_NEXT(cur, siblings));
+            if (next) {
+                cur = next;
+                break;
+            }
+            // all the siblings are done, the parent can be hashed now
+            cur = cur->parent;
+        }
+    }
+}
+
+unsigned long long
+txml_node_hash(txml_node_t *node)
+{
+    unsigned long long res;
+    if (!node)
+        return 0;
+    TXML_NODE_RDLOCK(node);
+    res = txml_node_hash_unlocked(node);
+    TXML_NODE_RDUNLOCK(node);
+    return res;
+}
 
-                if(*p == '>' && *(p-1) == '/') {
-                    start[p-mark-1] = 0;
-                    state = XML_ELEMENT_UNIQUE;
-                } else {
-                    start[p-mark] = 0;
-                }
+static int
+txml_node_same_attributes(txml_node_t *a, txml_node_t *b)
+{
+    txml_attribute_t *aattr = TAILQ_FIRST(&a->attributes);
+    txml_attribute_t *battr = TAILQ_FIRST(&b->attributes);
+
+    while (aattr && battr) {
+        if (strcmp(aattr->name, battr->name) != 0 || strcmp(aattr->value, battr->value) != 0)
+            return 0;
+        aattr = TAILQ_NEXT(aattr, list);
+        battr = TAILQ_NEXT(battr, list);
+    }
+    return !aattr && !battr;
+}
 
-                SKIP_WHITESPACES(p);
-                if(*p == '>' || (*p == '/' && *(p+1) == '>')) {
-                    if (*p == '/') {
-                        state = XML_ELEMENT_UNIQUE;
-                        p++;
-                    }
-                }
-                while(*p != '>' && *p != 0) {
-                    mark = p;
-                    ADVANCE_TO_ATTR_VALUE(p);
-                    if(*p == '=') {
-                        char *tmpattr = (char *)malloc(p-mark+1);
-                        strncpy(tmpattr, mark, p-mark);
-                        tmpattr[p-mark] = 0;
-                        p++;
-                        SKIP_WHITESPACES(p);
-                        if(*p == '"' || *p == '\'') {
-                            quote = *p;
-                            p++;
-                            mark = p;
-                            while(*p != 0) {
-                                if (*p == quote) {
-                                    if (*(p+1) != quote) // handle quote escaping
-                                        break;
-                                    else
-                                        p++;
-                                }
-                                p++;
-                            }
-                            if(*p == quote) {
-                                char *dexmlized;
-                                char *tmpval = (char *)malloc(p-mark+2);
-                                int i, j=0;
-                                for (i = 0; i < p-mark; i++) {
-                                    if ( mark[i] == quote && mark[i+1] == mark[i] )
-                                        i++;
-                                    tmpval[j++] = mark[i]; 
-                                }
-                                tmpval[p-mark] = 0;
-                                /* add new attribute */
-                                nattrs++;
-                                attrs = (char **)realloc(attrs, sizeof(char *)*(nattrs+1));
-                                attrs[nattrs-1] = tmpattr;
-                                attrs[nattrs] = NULL;
-                                values = (char **)realloc(values, sizeof(char *)*(nattrs+1));
-                                dexmlized = dexmlize(tmpval);
-                                free(tmpval);
-                                values[nattrs-1] = dexmlized;
-                                values[nattrs] = NULL;
-                                p++;
-                                SKIP_WHITESPACES(p);
-                            }
-                            else {
-                                free(tmpattr);
-                            }
-                        } /* if(*p == '"' || *p == '\'') */
-                        else {
-                            free(tmpattr);
-                        }
-                    } /* if(*p=='=') */
-                    if(*p == '/' && *(p+1) == '>') {
-                        p++;
-                        state = XML_ELEMENT_UNIQUE;
-                    }
-                } /* while(*p != '>' && *p != 0) */
-                err = txml_start_handler(xml, start, attrs, values);
-                if(err != TXML_NOERR) {
-                    XML_FREE_ATTRIBUTES
-                    free(start);
-                    return err;
-                }
-                if(state == XML_ELEMENT_UNIQUE) {
-                    err = txml_end_handler(xml, start);
-                    if(err != TXML_NOERR) {
-                        XML_FREE_ATTRIBUTES
-                        free(start);
-                        return err;
-                    }
-                }
-                XML_FREE_ATTRIBUTES
-                free(start);
-                p++;
-            } /* end of start tag */
-        } /* if(*p == '<') */
-        else if(state == XML_ELEMENT_START) {
-            state = XML_ELEMENT_VALUE;
-            mark = p;
-            while(*p != '<' && *p != 0)
-                p++;
-            if(*p == '<') { // p now points to the beginning of next node
-                char *value = (char *)malloc(p-mark+1);
-                strncpy(value, mark, p-mark);
-                value[p-mark] = 0;
-                err = txml_value_handler(xml, value);
-                if(value)
-                    free(value);
-                if(err != TXML_NOERR)
-                    return(err);
-                //p++;
-            }
+// compare the data of two nodes with the same name, ignoring their children
+static int
+txml_node_same_data(txml_node_t *a, txml_node_t *b)
+{
+    txml_namespace_t *ans = TXML_NODE_NS(a), *bns = TXML_NODE_NS(b);
+
+    if (strcmp(a->value, b->value) != 0)
+        return 0;
+    if ((ans != NULL) != (bns != NULL) || (ans && strcmp(ans->uri, bns->uri) != 0))
+        return 0;
+    return txml_node_same_attributes(a, b);
+}
+
+typedef struct {
+    txml_node_t **nodes;
+    unsigned long count;
+    unsigned long size;
+} txml_nodes_t;
+
+static int
+txml_nodes_add(txml_nodes_t *list, txml_node_t *node)
+{
+    if (list->count == list->size) {
+        unsigned long size = list->size ? list->size * 2 : 32;
+        txml_node_t **nodes = realloc(list->nodes, size * sizeof(txml_node_t *));
+        if (!nodes)
+            return -1;
+        list->nodes = nodes;
+        list->size = size;
+    }
+    list->nodes[list->count++] = node;
+    return 0;
+}
+
+// siblings are matched in three rounds, each one on what the previous left
+#define TXML_DIFF_MATCH_CONTENT 0 // identical branches
+#define TXML_DIFF_MATCH_KEY     1 // same name and attributes
+#define TXML_DIFF_MATCH_NAME    2 // same name
+
+// a difference found, notified once the documents have been unlocked
+typedef struct {
+    txml_node_t *a;
+    txml_node_t *b;
+    int change;
+} txml_diff_event_t;
+
+// the state of a diff, reused for all the levels
+typedef struct {
+    txml_diff_event_t *events;
+    unsigned long nevents;
+    unsigned long events_size;
+    txml_nodes_t a; // siblings being compared (but for the common head and tail)
+    txml_nodes_t b;
+    txml_nodes_t pairs; // pairs of nodes whose children are still to be compared
+    unsigned long *buckets; // hash table over the siblings in b (index + 1)
+    unsigned long *next; // chains of the hash table
+    char *matched; // siblings in a and b already matched
+    unsigned long size; // entries allocated in 'next' and 'matched'
+    unsigned long nbuckets;
+} txml_diff_state_t;
+
+static int
+txml_diff_grow(txml_diff_state_t *diff, unsigned long count)
+{
+    unsigned long nbuckets = 64;
+    while (nbuckets < 2 * count)
+        nbuckets *= 2;
+    if (nbuckets > diff->nbuckets) {
+        unsigned long *buckets = realloc(diff->buckets, nbuckets * sizeof(unsigned long));
+        if (!buckets)
+            return -1;
+        diff->buckets = buckets;
+        diff->nbuckets = nbuckets;
+    }
+    if (count > diff->size) {
+        unsigned long *next = realloc(diff->next, count * sizeof(unsigned long));
+        char *matched;
+        if (!next)
+            return -1;
+        diff->next = next;
+        matched = realloc(diff->matched, 2 * count);
+        if (!matched)
+            return -1;
+        diff->matched = matched;
+        diff->size = count;
+    }
+    return 0;
+}
+
+static int
+txml_diff_report(txml_diff_state_t *diff, txml_node_t *a, txml_node_t *b, int change)
+{
+    if (diff->nevents == diff->events_size) {
+        unsigned long size = diff->events_size ? diff->events_size * 2 : 32;
+        txml_diff_event_t *events = realloc(diff->events, size * sizeof(txml_diff_event_t));
+        if (!events)
+            return -1;
+        diff->events = events;
+        diff->events_size = size;
+    }
+    diff->events[diff->nevents].a = a;
+    diff->events[diff->nevents].b = b;
+    diff->events[diff->nevents].change = change;
+    diff->nevents++;
+    return 0;
+}
+
+static unsigned long
+txml_diff_key(txml_node_t *node, int round)
+{
+    unsigned long long key;
+    txml_attribute_t *attr;
+
+    if (round == TXML_DIFF_MATCH_CONTENT)
+        return txml_node_cached_hash(node);
+    key = txml_hash_add(14695981039346656037ULL, node->name);
+    if (round == TXML_DIFF_MATCH_KEY) {
+        TAILQ_FOREACH(attr, &node->attributes, list) {
+            key = txml_hash_add(key, attr->name);
+            key = txml_hash_add(key, attr->value);
         }
-        else {
-            /* XXX */
-            p++;
+    }
+    return (unsigned long)key;
+}
+
+static int
+txml_diff_match(txml_node_t *a, txml_node_t *b, int round)
+{
+    if (round == TXML_DIFF_MATCH_CONTENT)
+        return txml_node_cached_hash(a) == txml_node_cached_hash(b);
+    if (a->type != b->type || strcmp(a->name, b->name) != 0)
+        return 0;
+    return round == TXML_DIFF_MATCH_NAME || txml_node_same_attributes(a, b);
+}
+
+// fill the hash table with the siblings in b not matched yet.
+// The chains keep the document order
+static void
+txml_diff_index(txml_diff_state_t *diff, int round)
+{
+    unsigned long mask = diff->nbuckets - 1;
+    unsigned long i, *bucket;
+
+    memset(diff->buckets, 0, diff->nbuckets * sizeof(unsigned long));
+    for (i = diff->b.count; i > 0; i--) { // insert at the head, backwards
+        if (diff->matched[diff->a.count + i - 1])
+            continue;
+        bucket = &diff->buckets[txml_diff_key(diff->b.nodes[i - 1], round) & mask];
+        diff->next[i - 1] = *bucket;
+        *bucket = i;
+    }
+}
+
+// find (and take) the first sibling in b not matched yet which matches 'node'
+static txml_node_t *
+txml_diff_lookup(txml_diff_state_t *diff, txml_node_t *node, int round)
+{
+    unsigned long *link = &diff->buckets[txml_diff_key(node, round) & (diff->nbuckets - 1)];
+    txml_node_t *candidate;
+
+    while (*link) {
+        unsigned long i = *link - 1;
+        candidate = diff->b.nodes[i];
+        if (txml_diff_match(node, candidate, round)) {
+            diff->matched[diff->a.count + i] = 1;
+            *link = diff->next[i];
+            return candidate;
         }
-    } // while(*p != 0)
+        link = &diff->next[i];
+    }
+    return NULL;
+}
 
-    return err;
+// compare two lists of siblings (from first to last, both included).
+// Past the common head and tail, identical branches are matched by their hash
+// (wherever they are), the others by their name and attributes or just by
+// their name (in document order) and queued to be compared further.
+// Anything left is either removed or inserted
+static int
+txml_diff_siblings(txml_diff_state_t *diff, txml_node_t *afirst, txml_node_t *alast,
+                   txml_node_t *bfirst, txml_node_t *blast)
+{
+    unsigned long npairs = diff->pairs.count, i;
+    txml_node_t *node, *match;
+    int round;
+
+    while (afirst && bfirst && txml_node_hash_unlocked(afirst) == txml_node_hash_unlocked(bfirst)) {
+        afirst = (afirst == alast) ? NULL : TAILQ_NEXT(afirst, siblings);
+        bfirst = (bfirst == blast) ? NULL : TAILQ_NEXT(bfirst, siblings);
+    }
+    if (!afirst)
+        alast = NULL;
+    if (!bfirst)
+        blast = NULL;
+    while (alast && blast && txml_node_hash_unlocked(alast) == txml_node_hash_unlocked(blast)) {
+        alast = (alast == afirst) ? NULL : TAILQ_PREV(alast, nodelist_head, siblings);
+        blast = (blast == bfirst) ? NULL : TAILQ_PREV(blast, nodelist_head, siblings);
+    }
+
+    diff->a.count = diff->b.count = 0;
+    for (node = alast ? afirst : NULL; node; node = (node == alast) ? NULL : TAILQ_NEXT(node, siblings)) {
+        if (txml_nodes_add(&diff->a, node) != 0)
+            return TXML_MEMORY_ERR;
+        txml_node_hash_unlocked(node);
+    }
+    for (node = blast ? bfirst : NULL; node; node = (node == blast) ? NULL : TAILQ_NEXT(node, siblings)) {
+        if (txml_nodes_add(&diff->b, node) != 0)
+            return TXML_MEMORY_ERR;
+        txml_node_hash_unlocked(node);
+    }
+
+    if (txml_diff_grow(diff, diff->a.count + diff->b.count) != 0)
+        return TXML_MEMORY_ERR;
+    memset(diff->matched, 0, diff->a.count + diff->b.count);
+
+    for (round = TXML_DIFF_MATCH_CONTENT; diff->a.count && diff->b.count && round <= TXML_DIFF_MATCH_NAME; round++) {
+        txml_diff_index(diff, round);
+        for (i = 0; i < diff->a.count; i++) {
+            if (diff->matched[i])
+                continue;
+            node = diff->a.nodes[i];
+            match = txml_diff_lookup(diff, node, round);
+            if (!match)
+                continue;
+            diff->matched[i] = 1;
+            if (round == TXML_DIFF_MATCH_CONTENT)
+                continue; // identical
+            if (!txml_node_same_data(node, match) && txml_diff_report(diff, node, match, TXML_DIFF_CHANGED) != 0)
+                return TXML_MEMORY_ERR;
+            if (txml_nodes_add(&diff->pairs, node) != 0 || txml_nodes_add(&diff->pairs, match) != 0)
+                return TXML_MEMORY_ERR;
+        }
+    }
+
+    for (i = 0; i < diff->a.count; i++) {
+        if (!diff->matched[i] && txml_diff_report(diff, diff->a.nodes[i], NULL, TXML_DIFF_REMOVED) != 0)
+            return TXML_MEMORY_ERR;
+    }
+    for (i = 0; i < diff->b.count; i++) {
+        if (!diff->matched[diff->a.count + i] && txml_diff_report(diff, NULL, diff->b.nodes[i], TXML_DIFF_INSERTED) != 0)
+            return TXML_MEMORY_ERR;
+    }
+
+    // reverse the pairs just queued, so that they are compared in document order
+    for (i = 0; i < (diff->pairs.count - npairs) / 4; i++) {
+        unsigned long x = npairs + 2 * i;
+        unsigned long y = diff->pairs.count - 2 - 2 * i;
+        txml_node_t *tmp_a = diff->pairs.nodes[x], *tmp_b = diff->pairs.nodes[x + 1];
+        diff->pairs.nodes[x] = diff->pairs.nodes[y];
+        diff->pairs.nodes[x + 1] = diff->pairs.nodes[y + 1];
+        diff->pairs.nodes[y] = tmp_a;
+        diff->pairs.nodes[y + 1] = tmp_b;
+    }
+    return TXML_NOERR;
+}
+
+txml_err_t
+txml_diff(txml_t *a, txml_t *b, txml_diff_callback_t cb, void *priv)
+{
+    txml_diff_state_t diff;
+    txml_node_t *anode, *bnode;
+    unsigned long i;
+    int rc;
+
+    if (!a || !b || !cb)
+        return TXML_BADARGS;
+    if (a == b)
+        return TXML_NOERR;
+
+    memset(&diff, 0, sizeof(diff));
+
+    TXML_DOC_RDLOCK2(a, b);
+    rc = txml_diff_siblings(&diff, TAILQ_FIRST(&a->root_elements), TAILQ_LAST(&a->root_elements, nodelist_head),
+                            TAILQ_FIRST(&b->root_elements), TAILQ_LAST(&b->root_elements, nodelist_head));
+    while (rc == TXML_NOERR && diff.pairs.count) {
+        bnode = diff.pairs.nodes[--diff.pairs.count];
+        anode = diff.pairs.nodes[--diff.pairs.count];
+        // both have been hashed, so they are expanded already
+        rc = txml_diff_siblings(&diff, TAILQ_FIRST(&anode->children), TAILQ_LAST(&anode->children, nodelist_head),
+                                TAILQ_FIRST(&bnode->children), TAILQ_LAST(&bnode->children, nodelist_head));
+    }
+    TXML_DOC_RDUNLOCK2(a, b);
+
+    // the callback is free to access the documents (the locks are not reentrant)
+    for (i = 0; rc == TXML_NOERR && i < diff.nevents; i++) {
+        if (cb(diff.events[i].a, diff.events[i].b, diff.events[i].change, priv) != 0)
+            break;
+    }
+
+    free(diff.events);
+    free(diff.a.nodes);
+    free(diff.b.nodes);
+    free(diff.pairs.nodes);
+    free(diff.buckets);
+    free(diff.next);
+    free(diff.matched);
+    return rc;
 }
 
-#ifdef WIN32
-//************************************************************************
-// BOOL W32LockFile (FILE* filestream)
 //
-// locks the specific file for exclusive access, nonblocking
+// INCREMENTAL RELOAD
+// The context remembers the file it has been loaded from and the hash of
+// the source of each child of the root element. When the file changes, only
+// the children whose source changed are parsed again, the other ones are
+// kept (and so are the pointers to them) as long as the rest of the
+// document (the prolog, the root element itself and the epilog) is the same
 //
-// returns 0 on success
-//************************************************************************
-static BOOL
-W32LockFile (FILE* filestream)
+
+static void
+txml_reload_destroy(txml_reload_t *state)
 {
-    BOOL res = TRUE;
-    HANDLE hFile = INVALID_HANDLE_VALUE;
-    unsigned long size = 0;
-    int fd = 0;
+    if (!state)
+        return;
+    free(state->path);
+    free(state->units);
+    free(state);
+}
 
-    // check params
-    if (!filestream)
-        return FALSE;
+static inline long
+txml_stat_mtime_nsec(struct stat *filestat)
+{
+#if defined(WIN32)
+    return 0;
+#elif defined(__APPLE__)
+    return filestat->st_mtimespec.tv_nsec;
+#else
+    return filestat->st_mtim.tv_nsec;
+#endif
+}
+
+static int
+txml_reload_unit_add(txml_reload_t *state, char *buf, char *start, char *end)
+{
+    txml_reload_unit_t *unit;
+
+    if (state->nunits == state->units_size) {
+        unsigned long size = state->units_size ? state->units_size * 2 : 64;
+        txml_reload_unit_t *units = (txml_reload_unit_t *)realloc(state->units, size * sizeof(txml_reload_unit_t));
+        if (!units)
+            return -1;
+        state->units = units;
+        state->units_size = size;
+    }
+    unit = &state->units[state->nunits++];
+    unit->start = start - buf;
+    unit->length = end - start;
+    unit->hash = txml_hash_bytes(start, unit->length);
+    unit->node = NULL;
+    return 0;
+}
+
+// find the source of the children of the (only) root element.
+// Each of them must be an element, a comment or a cdata section,
+// separated only by white spaces, so that each one builds exactly one node.
+// Returns -1 if the document doesn't look like that
+static int
+txml_reload_split(char *buf, txml_reload_t *state)
+{
+    char *p = buf;
+    char *tag, *first, *close;
+    int kind;
+
+    // the root element can be preceded only by comments and processing instructions
+    for (;;) {
+        if (!(tag = strchr(p, '<')) || !(p = txml_scan_markup(tag, &kind)))
+            return -1;
+        if (kind == TXML_MARKUP_START)
+            break;
+        if (kind != TXML_MARKUP_PI && kind != TXML_MARKUP_OTHER)
+            return -1;
+    }
+
+    if (!(tag = strchr(p, '<')))
+        return -1;
+    first = tag;
+    for (;;) {
+        if (!(p = txml_scan_markup(tag, &kind)))
+            return -1;
+        if (kind == TXML_MARKUP_END)
+            break; // the end tag of the root element
+        if (kind == TXML_MARKUP_START)
+            p = txml_element_end(tag);
+        else if (kind != TXML_MARKUP_UNIQUE && kind != TXML_MARKUP_OTHER)
+            return -1;
+        if (!p || txml_reload_unit_add(state, buf, tag, p) != 0)
+            return -1;
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+            p++;
+        if (*p != '<')
+            return -1;
+        tag = p;
+    }
+    close = tag;
+
+    // nothing but comments and processing instructions can follow
+    while ((tag = strchr(p, '<'))) {
+        if (!(p = txml_scan_markup(tag, &kind)))
+            return -1;
+        if (kind != TXML_MARKUP_PI && kind != TXML_MARKUP_OTHER)
+            return -1;
+    }
+
+    state->frame = txml_hash_bytes(buf, first - buf) * 1099511628211ULL ^ txml_hash_bytes(close, strlen(close));
+    return 0;
+}
+
+// bind the units to the children of the root element just parsed
+static void
+txml_reload_bind(txml_t *xml, txml_reload_t *state)
+{
+    txml_node_t *root = txml_parallel_root(xml);
+    txml_node_t *node;
+    unsigned long i = 0;
+
+    state->root = NULL;
+    if (!root || TAILQ_NEXT(root, siblings))
+        return;
+    TAILQ_FOREACH(node, &root->children, siblings) {
+        if (i == state->nunits)
+            return;
+        state->units[i++].node = node;
+    }
+    if (i != state->nunits)
+        return;
+    state->root = root;
+    state->root_hash = txml_node_hash_unlocked(root);
+    for (i = 0; i < state->nunits; i++)
+        state->units[i].node_hash = txml_node_cached_hash(state->units[i].node);
+}
+
+// rebuild the children of the root element, parsing only the new units
+static txml_err_t
+txml_reload_merge(txml_t *xml, char *buf, txml_reload_t *old, txml_reload_t *state)
+{
+    txml_node_t *root = old->root;
+    txml_node_t *node, *last, *prev_node = NULL;
+    txml_reload_unit_t *unit;
+    unsigned long *buckets, *next;
+    unsigned long nbuckets = 1;
+    unsigned long i, j, *prev;
+    unsigned long last_index = 0;
+    unsigned long long hash;
+    int reordered = 0;
+    txml_err_t err = TXML_NOERR;
+    char c;
+
+    while (nbuckets < old->nunits * 2)
+        nbuckets <<= 1;
+    buckets = (unsigned long *)malloc(nbuckets * sizeof(unsigned long));
+    next = (unsigned long *)malloc((old->nunits + 1) * sizeof(unsigned long));
+    if (!buckets || !next) {
+        free(buckets);
+        free(next);
+        return TXML_MEMORY_ERR;
+    }
+    // chains of old units (numbered from 1) in document order
+    memset(buckets, 0, nbuckets * sizeof(unsigned long));
+    for (i = old->nunits; i > 0; i--) {
+        j = old->units[i - 1].hash & (nbuckets - 1);
+        next[i] = buckets[j];
+        buckets[j] = i;
+    }
+    // each new unit takes the first unused old one with the same source
+    for (i = 0; i < state->nunits; i++) {
+        unit = &state->units[i];
+        prev = &buckets[unit->hash & (nbuckets - 1)];
+        for (j = *prev; j; prev = &next[j], j = next[j]) {
+            if (old->units[j - 1].hash == unit->hash && old->units[j - 1].length == unit->length) {
+                unit->node = old->units[j - 1].node;
+                unit->node_hash = old->units[j - 1].node_hash;
+                old->units[j - 1].node = NULL;
+                *prev = next[j];
+                if (j <= last_index)
+                    reordered = 1;
+                last_index = j;
+                break;
+            }
+        }
+    }
+    free(buckets);
+    free(next);
+
+    for (i = 0; i < old->nunits; i++) {
+        if ((node = old->units[i].node)) {
+            if (xml->nindexes)
+                txml_index_branch(xml, NULL, node, 0);
+            TAILQ_REMOVE(&root->children, node, siblings);
+            txml_node_release_branch(&xml->pool, node);
+        }
+    }
+
+    // the kept children are linked already, unless their order changed.
+    // The missing ones are parsed at the end of the list and moved in place
+    if (reordered) {
+        TAILQ_INIT(&root->children);
+        for (i = 0; i < state->nunits; i++) {
+            if (state->units[i].node)
+                TAILQ_INSERT_TAIL(&root->children, state->units[i].node, siblings);
+        }
+    }
+    for (i = 0; i < state->nunits; i++) {
+        unit = &state->units[i];
+        if (unit->node) {
+            prev_node = unit->node;
+            continue;
+        }
+        if (err != TXML_NOERR)
+            continue; // the document will be parsed again anyway
+        last = TAILQ_LAST(&root->children, nodelist_head);
+        c = buf[unit->start + unit->length];
+        buf[unit->start + unit->length] = 0;
+        xml->cnode = root;
+        err = txml_parse_content(xml, buf + unit->start, NULL, 0, NULL);
+        buf[unit->start + unit->length] = c;
+        node = TAILQ_LAST(&root->children, nodelist_head);
+        if (err == TXML_NOERR && (node == last || TAILQ_PREV(node, nodelist_head, siblings) != last))
+            err = TXML_GENERIC_ERR; // not exactly one node
+        if (err != TXML_NOERR)
+            continue;
+        unit->node = node;
+        unit->node_hash = txml_node_hash_unlocked(node);
+        if (node != (prev_node ? TAILQ_NEXT(prev_node, siblings) : TAILQ_FIRST(&root->children))) {
+            TAILQ_REMOVE(&root->children, node, siblings);
+            if (prev_node)
+                TAILQ_INSERT_AFTER(&root->children, prev_node, node, siblings);
+            else
+                TAILQ_INSERT_HEAD(&root->children, node, siblings);
+        }
+        prev_node = node;
+    }
+    xml->cnode = NULL;
+    txml_node_changed(root, TXML_NODE_CHANGED_CHILDREN);
+    // the new children have been parsed at the end and moved in place
+    txml_name_index_invalidate(xml);
+    txml_order_invalidate(xml);
+    if (err != TXML_NOERR)
+        return err;
+
+    // the hashes of the children are known, no need to walk them
+    hash = txml_node_hash_self(root);
+    for (i = 0; i < state->nunits; i++)
+        hash = txml_hash_add_child(hash, state->units[i].node_hash);
+    state->root = root;
+    state->root_hash = txml_node_hash_store(root, hash);
+    return TXML_NOERR;
+}
+
+static txml_err_t
+txml_reload_buffer_unlocked(txml_t *xml, char *buf, txml_reload_t *state)
+{
+    txml_reload_t *old = xml->reload;
+    txml_err_t err = TXML_GENERIC_ERR;
+    int split = -1;
+
+    // lazy, filtered and tracked documents are always parsed again
+    // (the kept children would be left with their old positions)
+    if (!xml->lazy && !xml->filter && !xml->track && xml->ignore_white_spaces)
+        split = txml_reload_split(buf, state);
+    if (split != 0)
+        state->nunits = 0;
+
+    // the root element and its children must be untouched since the last load
+    if (split == 0 && old && old->root && old->frame == state->frame &&
+        txml_node_cached_hash(old->root) == old->root_hash)
+    {
+        err = txml_reload_merge(xml, buf, old, state);
+        if (!xml->pool.max)
+            txml_scratch_release(&xml->scratch);
+        if (err == TXML_NOERR) {
+            txml_reload_destroy(old);
+            xml->reload = state;
+            return TXML_NOERR;
+        }
+    }
+
+    err = txml_parse_buffer_unlocked(xml, buf); // drops the old state
+    if (err != TXML_NOERR) {
+        txml_reload_destroy(state);
+        return err;
+    }
+    if (split == 0)
+        txml_reload_bind(xml, state);
+    xml->reload = state;
+    return TXML_NOERR;
+}
+
+txml_err_t
+txml_reload_file(txml_t *xml, char *path)
+{
+    txml_reload_t *state;
+    struct stat filestat;
+    unsigned long long hash;
+    char *buffer;
+    txml_err_t err;
+    int same;
 
-    // get handle from stream
-    fd = _fileno (filestream);
-    hFile = (HANDLE)_get_osfhandle(fd);
+    if (!xml || !path)
+        return TXML_BADARGS;
+    if (stat(path, &filestat) != 0)
+        return TXML_BADARGS;
 
-    // lock file until access is permitted
-    size = GetFileSize(hFile, NULL);
-    res = LockFile (hFile, 0, 0, size, 0);
-    if (res)
-        res = 0;
+    TXML_RDLOCK(xml);
+    same = xml->reload && strcmp(xml->reload->path, path) == 0 &&
+           xml->reload->size == filestat.st_size &&
+           xml->reload->mtime == filestat.st_mtime &&
+           xml->reload->mtime_nsec == txml_stat_mtime_nsec(&filestat);
+    TXML_RDUNLOCK(xml);
+    if (same)
+        return TXML_NOERR;
 
-    return res;
+    // read the file without holding the lock
+    err = txml_file_read(path, &filestat, &buffer, &hash);
+    if (err != TXML_NOERR)
+        return err;
+    state = (txml_reload_t *)calloc(1, sizeof(txml_reload_t));
+    if (!state || !(state->path = strdup(path))) {
+        free(state);
+        free(buffer);
+        return TXML_MEMORY_ERR;
+    }
+    state->size = filestat.st_size;
+    state->mtime = filestat.st_mtime;
+    state->mtime_nsec = txml_stat_mtime_nsec(&filestat);
+    state->hash = hash;
+
+    TXML_WRLOCK(xml);
+    if (xml->reload && strcmp(xml->reload->path, path) == 0 && xml->reload->hash == state->hash) {
+        // just touched
+        xml->reload->size = state->size;
+        xml->reload->mtime = state->mtime;
+        xml->reload->mtime_nsec = state->mtime_nsec;
+        txml_reload_destroy(state);
+    } else {
+        err = txml_reload_buffer_unlocked(xml, buffer, state);
+    }
+    TXML_WRUNLOCK(xml);
+    free(buffer);
+    return err;
 }
 
-//************************************************************************
-// BOOL W32UnlockFile (FILE* filestream)
 //
-// unlocks the specific file locked by W32LockFile
+// FILE WATCHER
+// A thread waits for changes of a file (through inotify, where available),
+// parses each new version into a new context and publishes it. Readers take
+// a reference to the current version, which stays valid (and unchanged)
+// until they release it, even if newer versions get published meanwhile
 //
-// returns 0 on success
-//************************************************************************
-static BOOL
-W32UnlockFile (FILE* filestream)
-{
-    BOOL res = TRUE;
-    HANDLE hFile = INVALID_HANDLE_VALUE;
-    unsigned long size = 0;
-    int tries = 0;
-    int fd = 0;
 
-    // check params
-    if (!filestream)
-        return FALSE;
+#if defined(THREAD_SAFE) && !defined(WIN32)
 
-    // get handle from stream
-    fd = _fileno (filestream);
-    hFile = (HANDLE)_get_osfhandle(fd);
+#define TXML_WATCH_DEBOUNCE 100      // ms without events before loading the file
+#define TXML_WATCH_POLL_INTERVAL 1000 // ms between checks if inotify is not available
 
-    // unlock
-    size = GetFileSize(hFile, NULL);
-    res = UnlockFile (hFile, 0, 0, size, 0);
-    if (res)
-        res = 0;
+struct __txml_watch_s {
+    char *path;
+    txml_watch_callback_t cb;
+    void *priv;
+    txml_t *xml;          // the current version, the watcher holds a reference to it
+    char lock;            // protects the swap of 'xml' against acquirers
+    struct stat filestat; // of the file last loaded
+    int notify;           // inotify descriptor, -1 if polling
+    int links;            // the path goes through symbolic links, polled as well
+    int stop[2];          // pipe waking up the watcher thread when destroying it
+    pthread_t thread;
+};
+
+txml_t *
+txml_watch_acquire(txml_watch_t *watch)
+{
+    txml_t *xml;
+
+    txml_spin_lock(&watch->lock);
+    xml = watch->xml;
+    __atomic_add_fetch(&xml->refcnt, 1, __ATOMIC_RELAXED);
+    txml_spin_unlock(&watch->lock);
+    return xml;
+}
+
+void
+txml_watch_release(txml_t *xml)
+{
+    if (xml && __atomic_sub_fetch(&xml->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+        txml_context_destroy(xml);
+}
 
+// whether any component of a path is a symbolic link
+static int
+txml_watch_links(char *path)
+{
+    struct stat linkstat;
+    char *copy = strdup(path);
+    char *p;
+    int res = 0;
+
+    if (!copy)
+        return 1; // assume so, polling is always safe
+    for (p = copy; !res && p; ) {
+        p = strchr(p + 1, '/');
+        if (p)
+            *p = 0;
+        if (*copy && lstat(copy, &linkstat) == 0 && S_ISLNK(linkstat.st_mode))
+            res = 1;
+        if (p)
+            *p = '/';
+    }
+    free(copy);
     return res;
 }
-#endif // #ifdef WIN32
 
+// parse the file again if it's not the one loaded last time
+// (it can be the same after a touch, or if the event was about another file)
 static txml_err_t
-txml_file_lock(FILE *file)
+txml_watch_load(txml_watch_t *watch)
 {
-    int tries = 0;
-    if(file) {
-#ifdef WIN32
-        while(W32LockFile(file) != 0) {
-#else
-        while(ftrylockfile(file) != 0) {
+    struct stat filestat;
+    txml_t *xml, *old;
+    txml_err_t err;
+
+    // inotify sees only the directory holding the path: changes behind
+    // symbolic links (the file they point to edited in place, or a link to
+    // a directory swapped) are found by checking the file periodically
+    watch->links = txml_watch_links(watch->path);
+    if (stat(watch->path, &filestat) != 0)
+        return watch->xml ? TXML_NOERR : TXML_BADARGS; // maybe being replaced, wait for the next event
+    if (watch->xml &&
+        filestat.st_ino == watch->filestat.st_ino && filestat.st_dev == watch->filestat.st_dev &&
+        filestat.st_size == watch->filestat.st_size && filestat.st_mtime == watch->filestat.st_mtime &&
+        txml_stat_mtime_nsec(&filestat) == txml_stat_mtime_nsec(&watch->filestat))
+    {
+        return TXML_NOERR;
+    }
+    // a broken file is reported once, not at each check
+    watch->filestat = filestat;
+
+    xml = txml_context_create();
+    if (!xml)
+        return TXML_MEMORY_ERR;
+    err = txml_parse_file(xml, watch->path);
+    if (err != TXML_NOERR) {
+        txml_context_destroy(xml);
+        if (watch->cb)
+            watch->cb(NULL, err, watch->priv);
+        return err;
+    }
+
+    xml->refcnt = 1;
+    txml_spin_lock(&watch->lock);
+    old = watch->xml;
+    watch->xml = xml;
+    txml_spin_unlock(&watch->lock);
+    txml_watch_release(old); // freed as soon as the last reader releases it
+    if (watch->cb)
+        watch->cb(xml, TXML_NOERR, watch->priv);
+    return TXML_NOERR;
+}
+
+#ifdef __linux__
+// drain the pending events, returns -1 if the directory can't be watched anymore
+static int
+txml_watch_events(txml_watch_t *watch)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *event;
+    ssize_t len;
+    char *p;
+
+    while ((len = read(watch->notify, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + event->len) {
+            event = (struct inotify_event *)p;
+            if ((event->mask & IN_IGNORED))
+                return -1;
+        }
+    }
+    return 0;
+}
 #endif
-    // warning("can't obtain a lock on xml file %s... waiting (%d)", xml_file, tries);
-            tries++;
-            if(tries>5) {
-                fprintf(stderr, "sticky lock on xml file!!!");
-                return TXML_GENERIC_ERR;
+
+static void *
+txml_watch_run(void *priv)
+{
+    txml_watch_t *watch = (txml_watch_t *)priv;
+    struct pollfd fds[2];
+    int nfds = 1;
+    int changed = 0;
+    int timeout, rc;
+
+    fds[0].fd = watch->stop[0];
+    fds[0].events = POLLIN;
+    if (watch->notify >= 0) {
+        fds[1].fd = watch->notify;
+        fds[1].events = POLLIN;
+        nfds = 2;
+    }
+    for (;;) {
+        if (changed && watch->notify >= 0)
+            timeout = TXML_WATCH_DEBOUNCE;
+        else if (watch->notify < 0 || watch->links)
+            timeout = TXML_WATCH_POLL_INTERVAL;
+        else
+            timeout = -1;
+        rc = poll(fds, nfds, timeout);
+        if (rc < 0 && errno != EINTR)
+            break;
+        if (rc > 0 && fds[0].revents)
+            break; // destroyed
+        if (rc == 0) {
+            // editors write, rename and touch files in bursts, which
+            // are over once nothing happened for a while
+            if (changed || watch->notify < 0 || watch->links)
+                txml_watch_load(watch);
+            changed = 0;
+            continue;
+        }
+#ifdef __linux__
+        if (rc > 0 && nfds > 1 && fds[1].revents) {
+            // any event in the directory can be about the file (or about
+            // the symbolic links leading to it), the stat tells
+            changed = 1;
+            if (txml_watch_events(watch) != 0) {
+                // the directory has gone, fall back to polling
+                close(watch->notify);
+                watch->notify = -1;
+                nfds = 1;
             }
-            sleep(1);
         }
-        return TXML_NOERR;
+#endif
     }
-    return TXML_GENERIC_ERR;
+    return NULL;
 }
 
-static txml_err_t
-txml_file_unlock(FILE *file)
+static void
+txml_watch_free(txml_watch_t *watch)
 {
-    if(file) {
-#ifdef WIN32
-        if(W32UnlockFile(file) == 0)
-#else
-        funlockfile(file);
+    if (watch->notify >= 0)
+        close(watch->notify);
+    if (watch->stop[0] >= 0)
+        close(watch->stop[0]);
+    if (watch->stop[1] >= 0)
+        close(watch->stop[1]);
+    txml_watch_release(watch->xml);
+    free(watch->path);
+    free(watch);
+}
+
+txml_watch_t *
+txml_watch(char *path, txml_watch_callback_t on_change, void *priv)
+{
+    txml_watch_t *watch;
+
+    if (!path)
+        return NULL;
+    watch = (txml_watch_t *)calloc(1, sizeof(txml_watch_t));
+    if (!watch)
+        return NULL;
+    watch->notify = -1;
+    watch->stop[0] = watch->stop[1] = -1;
+    watch->path = strdup(path);
+    if (!watch->path || pipe(watch->stop) != 0) {
+        txml_watch_free(watch);
+        return NULL;
+    }
 
+#ifdef __linux__
+    // watch the directory: editors (and deployment tools) often replace
+    // the file with a new one, or swap a symbolic link leading to it.
+    // The watch is in place before the first load, the changes made
+    // meanwhile are pending events for the watcher thread
+    char *dir = txml_dirname(path);
+    watch->notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->notify >= 0 &&
+        (!dir || inotify_add_watch(watch->notify, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF) < 0))
+    {
+        close(watch->notify); // poll the file then
+        watch->notify = -1;
+    }
+    free(dir);
 #endif
-        return TXML_NOERR;
+
+    if (txml_watch_load(watch) != TXML_NOERR) {
+        txml_watch_free(watch);
+        return NULL;
     }
-    return TXML_GENERIC_ERR;
+
+    watch->cb = on_change; // not notified of the initial load
+    watch->priv = priv;
+    if (pthread_create(&watch->thread, NULL, txml_watch_run, watch) != 0) {
+        txml_watch_free(watch);
+        return NULL;
+    }
+    return watch;
+}
+
+void
+txml_watch_destroy(txml_watch_t *watch)
+{
+    if (!watch)
+        return;
+    if (write(watch->stop[1], "", 1) == 1)
+        pthread_join(watch->thread, NULL);
+    txml_watch_free(watch);
+}
+
+#else // THREAD_SAFE
+
+txml_watch_t *
+txml_watch(char *path, txml_watch_callback_t on_change, void *priv)
+{
+    return NULL; // there is no thread to watch the file with
+}
+
+txml_t *
+txml_watch_acquire(txml_watch_t *watch)
+{
+    return NULL;
 }
 
+void
+txml_watch_release(txml_t *xml)
+{
+}
+
+void
+txml_watch_destroy(txml_watch_t *watch)
+{
+}
+
+#endif // THREAD_SAFE
+
+//
+// SOURCE POSITIONS
+// Nodes built while tracking the positions carry a txml_node_source_t
+// with the spans of the element, of its value and of its attributes
+// in the document they have been parsed from
+//
+
 txml_err_t
-txml_parse_file(txml_t *xml, char *path)
+txml_node_get_offsets(txml_node_t *node, size_t *start, size_t *end)
 {
-    FILE *infile;
-    char *buffer;
-    txml_err_t err;
-    struct stat filestat;
-    int rc = 0;
+    txml_node_source_t *source;
+    txml_err_t res = TXML_BADARGS;
 
-    infile = NULL;
-    err = TXML_NOERR;
-    if(!path)
+    if (!node)
         return TXML_BADARGS;
-    rc = stat(path, &filestat);
-    if (rc != 0)
+    TXML_NODE_RDLOCK(node);
+    source = TXML_NODE_SOURCE(node);
+    // an element not terminated has no end
+    if (source && source->element.start != TXML_SPAN_NONE && source->element.len) {
+        if (start)
+            *start = source->element.start;
+        if (end)
+            *end = source->element.start + source->element.len;
+        res = TXML_NOERR;
+    }
+    TXML_NODE_RDUNLOCK(node);
+    return res;
+}
+
+txml_err_t
+txml_node_get_value_offsets(txml_node_t *node, size_t *start, size_t *end)
+{
+    txml_node_source_t *source;
+    txml_err_t res = TXML_BADARGS;
+
+    if (!node)
         return TXML_BADARGS;
-    xml->cnode = NULL;
-    if(filestat.st_size>0) {
-        infile = fopen(path, "r");
-        if(infile) {
-#ifdef USE_ICONV
-            iconv_t ich;
-            char *iconvin, *iconvout;
-#endif
-            size_t rb, ilen, olen;
-            char *encoding_from = NULL;
+    TXML_NODE_RDLOCK(node);
+    source = TXML_NODE_SOURCE(node);
+    if (source && source->value.start != TXML_SPAN_NONE) {
+        if (start)
+            *start = source->value.start;
+        if (end)
+            *end = source->value.start + source->value.len;
+        res = TXML_NOERR;
+    }
+    TXML_NODE_RDUNLOCK(node);
+    return res;
+}
 
-            if(txml_file_lock(infile) != TXML_NOERR) {
-                fprintf(stderr, "Can't lock %s for opening ", path);
-                return -1;
-            }
-            olen = ilen = filestat.st_size;
-            buffer = (char *)malloc(ilen+1);
-            rb = fread(buffer, 1, ilen, infile);
-            if (ilen != rb) {
-                fprintf(stderr, "Can't read %s content", path);
-                return -1;
-            }
-            buffer[ilen] = 0;
-            switch(detect_encoding(buffer)) {
-                case ENCODING_UTF16LE:
-                    encoding_from = "UTF-16LE";
-                    break;
-                case ENCODING_UTF16BE:
-                    encoding_from = "UTF-16BE";
-                    break;
-                case ENCODING_UTF32LE:
-                    encoding_from = "UTF-32LE";
-                    break;
-                case ENCODING_UTF32BE:
-                    encoding_from = "UTF-32BE";
-                    break;
-                case ENCODING_UTF7:
-                    encoding_from = "UTF-7";
-                    olen = ilen*2; // we need a bigger output buffer
-                    break;
-            }
-            if (encoding_from) {
-#ifdef USE_ICONV
-                ich = iconv_open ("UTF-8", encoding_from);
-                if (ich == (iconv_t)(-1)) {
-                    fprintf(stderr, "Can't init iconv: %s\n", strerror(errno));
-                    free(buffer);
-                    txml_file_unlock(infile);
-                    fclose(infile);
-                    return -1;
-                }
-                char *out = (char *)calloc(1, olen);
-                iconvin = buffer;
-                iconvout = out;
-                int cb = iconv(ich, &iconvin, &ilen, &iconvout, &olen);
-                if (cb == -1) {
-                    fprintf(stderr, "Can't convert encoding: %s\n", strerror(errno));
-                    free(buffer);
-                    free(out);
-                    txml_file_unlock(infile);
-                    fclose(infile);
-                    return -1;
-                }
-                free(buffer); // release initial buffer
-                buffer = out; // point to the converted buffer
-                iconv_close(ich);
-#else
-                fprintf(stderr, "Iconv missing: can't open file %s encoded in %s. Convert it to utf8 and try again\n",
-                        path, encoding_from);
-                free(buffer);
-                txml_file_unlock(infile);
-                fclose(infile);
-                return -1;
-#endif
-            }
-            err = txml_parse_buffer(xml, buffer);
-            free(buffer); // release either the initial or the converted buffer
-            txml_file_unlock(infile);
-            fclose(infile);
-        } else {
-            fprintf(stderr, "Can't open xmlfile %s\n", path);
-            return -1;
+txml_err_t
+txml_attribute_get_offsets(txml_attribute_t *attr, size_t *start, size_t *end)
+{
+    txml_attribute_source_t *source;
+    txml_err_t res = TXML_BADARGS;
+
+    if (!attr || !attr->node)
+        return TXML_BADARGS;
+    TXML_NODE_RDLOCK(attr->node);
+    if ((source = txml_attribute_source(attr))) {
+        if (start)
+            *start = source->start;
+        if (end) // past the closing quote
+            *end = source->value.start + source->value.len + 1;
+        res = TXML_NOERR;
+    }
+    TXML_NODE_RDUNLOCK(attr->node);
+    return res;
+}
+
+txml_err_t
+txml_attribute_get_value_offsets(txml_attribute_t *attr, size_t *start, size_t *end)
+{
+    txml_attribute_source_t *source;
+    txml_err_t res = TXML_BADARGS;
+
+    if (!attr || !attr->node)
+        return TXML_BADARGS;
+    TXML_NODE_RDLOCK(attr->node);
+    if ((source = txml_attribute_source(attr))) {
+        if (start)
+            *start = source->value.start;
+        if (end)
+            *end = source->value.start + source->value.len;
+        res = TXML_NOERR;
+    }
+    TXML_NODE_RDUNLOCK(attr->node);
+    return res;
+}
+
+txml_err_t
+txml_get_line(txml_t *xml, size_t offset, unsigned long *line, unsigned long *column)
+{
+    txml_err_t res = TXML_BADARGS;
+    size_t lo = 0, hi, mid;
+
+    if (!xml)
+        return TXML_BADARGS;
+    TXML_DOC_RDLOCK(xml);
+    if (xml->lines && offset <= xml->length) {
+        // the number of lines starting up to the offset
+        hi = xml->nlines;
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+            if (xml->lines[mid] <= offset)
+                lo = mid + 1;
+            else
+                hi = mid;
         }
-    } else {
-        fprintf(stderr, "Can't stat xmlfile %s\n", path);
-        return -1;
+        if (line)
+            *line = lo + 1;
+        if (column)
+            *column = offset - (lo ? xml->lines[lo - 1] : 0) + 1;
+        res = TXML_NOERR;
+    }
+    TXML_DOC_RDUNLOCK(xml);
+    return res;
+}
+
+//
+// MAPPED FILES
+// A document opened by txml_map_file() keeps its file mapped in memory
+// and its nodes know where their values are in there. A value replaced
+// by one taking the same number of bytes (once escaped) is written over
+// the old one, any other change makes the whole document saved again:
+// the new positions are recorded while writing it out and the new file
+// gets mapped in place of the old one
+//
+
+// drop the mapping (the positions in the nodes are kept)
+static void
+txml_map_close(txml_map_t *map)
+{
+#ifndef WIN32
+    if (map->data)
+        munmap(map->data, map->length);
+#endif
+    if (map->fd >= 0)
+        close(map->fd);
+    map->data = NULL;
+    map->fd = -1;
+}
+
+static void
+txml_map_destroy(txml_map_t *map)
+{
+    if (!map)
+        return;
+    txml_map_close(map);
+    free(map->path);
+    free(map);
+}
+
+// map the file (again), to be patched if 'writable'
+static txml_err_t
+txml_map_open(txml_map_t *map, int writable)
+{
+#ifndef WIN32
+    struct stat filestat;
+    size_t page = sysconf(_SC_PAGESIZE);
+    int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    char *data;
+    int fd;
+
+    txml_map_close(map);
+    fd = open(map->path, writable ? O_RDWR : O_RDONLY);
+    if (fd < 0 || fstat(fd, &filestat) != 0 || filestat.st_size == 0) {
+        fprintf(stderr, "Can't map %s\n", map->path);
+        if (fd >= 0)
+            close(fd);
+        return TXML_GENERIC_ERR;
+    }
+    // an extra page of zeros past the file terminates the document
+    map->length = (filestat.st_size / page + 1) * page;
+    data = mmap(NULL, map->length, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        return TXML_MEMORY_ERR;
+    }
+    if (mmap(data, filestat.st_size, prot, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        fprintf(stderr, "Can't map %s\n", map->path);
+        munmap(data, map->length);
+        close(fd);
+        return TXML_GENERIC_ERR;
     }
+    map->data = data;
+    map->fd = fd;
+    map->size = filestat.st_size;
+    map->dev = filestat.st_dev;
+    map->ino = filestat.st_ino;
     return TXML_NOERR;
+#else
+    return TXML_GENERIC_ERR;
+#endif
 }
 
-char *
-txml_dump_branch(txml_t *xml, txml_node_t *rnode, unsigned int depth)
+// check if a path leads to the mapped file
+static int
+txml_map_is(txml_map_t *map, char *path)
 {
-    unsigned int i, n;
-    char *out = NULL;
-    int out_offset = 0;
-    char *start_tag;
-    int start_offset = 0;
-    char *end_tag;
-    int end_offset = 0;
-    char *child_dump;
-    int child_offset = 0;
-    char *value = NULL;
-    int namelen = 0;
-    int ns_namelen = 0;
-    txml_attribute_t *attr;
-    txml_node_t *child;
-    unsigned long nattrs;
+    struct stat filestat;
+    return stat(path, &filestat) == 0 && filestat.st_dev == map->dev && filestat.st_ino == map->ino;
+}
 
+// save the document over the mapped file, and map the new one.
+// The caller excludes the readers (the positions of the values change)
+static txml_err_t
+txml_map_save(txml_t *xml)
+{
+    txml_map_t *map = xml->map;
+    int positions = 1;
+    txml_err_t err;
 
-    if (rnode->value) {
-        if (rnode->type == TXML_NODETYPE_SIMPLE) {
-            value = xmlize(rnode->value);
-        } else {
-            value = strdup(rnode->value);
+    err = txml_save_file(xml, map->path, NULL, &positions);
+    if (err == TXML_NOERR)
+        err = txml_map_open(map, 1);
+    if (err == TXML_NOERR && xml->lines) { // the lines moved as well
+        free(xml->lines);
+        if (txml_lines_build(xml, map->data) != 0) {
+            free(xml->lines);
+            xml->lines = NULL;
         }
     }
+    // the positions can't be trusted after a failure, patches will save the whole document
+    map->stale = (err != TXML_NOERR || !positions);
+    return err;
+}
 
-    if(rnode->name)
-        namelen = (unsigned int)strlen(rnode->name);
-    else
-        return NULL;
+// flush the pages holding a patched span to the disk, according to the sync policy
+static int
+txml_map_flush(txml_t *xml, size_t start, size_t len)
+{
+#ifndef WIN32
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t first = start / page * page;
 
-    /* First check if this is a special node (a comment or a CDATA) */
-    if(rnode->type == TXML_NODETYPE_COMMENT) {
-        out = malloc(strlen(value)+depth+9);
-        *out = 0;
-        if (xml->ignore_blanks) {
-            for(n = 0; n < depth; n++)
-                out[n] = '\t';
-            sprintf(out+depth, "<!--%s-->\n", value);
-        } else {
-            sprintf(out+depth, "<!--%s-->", value);
-        }
-        return out;
-    } else if(rnode->type == TXML_NODETYPE_CDATA) {
-        out = malloc(strlen(value)+depth+14);
-        *out = 0;
-        if (xml->ignore_blanks) {
-            for(n = 0; n < depth; n++)
-                out[n] = '\t';
-            sprintf(out+depth, "<![CDATA[%s]]>\n", value);
-        } else {
-            sprintf(out+depth, "<![CDATA[%s]]>", value);
-        }
-        return out;
-    }
-
-    child_dump = (char *)calloc(1, 1);
-
-    if (rnode->ns && rnode->ns->name)
-        ns_namelen = (unsigned int)strlen(rnode->ns->name)+1;
-    start_tag = (char *)calloc(1, depth+namelen+ns_namelen+7); // :/<>\n
-    end_tag = (char *)calloc(1, depth+namelen+ns_namelen+7);
-
-    if (xml->ignore_blanks) {
-        for(start_offset = 0; start_offset < depth; start_offset++)
-            start_tag[start_offset] = '\t';
-    }
-    start_tag[start_offset++] = '<';
-    if (rnode->ns && rnode->ns->name) {
-        // TODO - optimize
-        strcpy(start_tag + start_offset, rnode->ns->name);
-        start_offset += ns_namelen;
-        start_tag[start_offset-1] = ':';
-    }
-    memcpy(start_tag + start_offset, rnode->name, namelen);
-    start_offset += namelen;
-    nattrs = txml_node_count_attributes(rnode);
-    if(nattrs>0) {
-        for(i = 0; i < nattrs; i++) {
-            attr = txml_node_get_attribute(rnode, i);
-            if(attr) {
-                int anlen, avlen;
-                char *attr_value;
-
-                attr_value = xmlize(attr->value);
-                anlen = strlen(attr->name);
-                avlen = strlen (attr_value);
-                start_tag = (char *)realloc(start_tag, start_offset + anlen + avlen + 8);
-                sprintf(start_tag + start_offset, " %s=\"%s\"", attr->name, attr_value);
-                start_offset += anlen + avlen + 4;
-                if (attr_value)
-                    free(attr_value);
-            }
-        }
+    if (xml->save_sync == TXML_SYNC_NONE)
+        return 0;
+    if (msync(xml->map->data + first, start + len - first, MS_SYNC) != 0)
+        return -1;
+    if (xml->save_sync == TXML_SYNC_FULL)
+        return txml_sync_fd(xml->map->fd, TXML_SYNC_FULL);
+#endif
+    return 0;
+}
+
+// write a value over its span in the mapped file, if it takes exactly the same room.
+// Returns 1 if done, 0 if the whole document must be saved, -1 on errors
+static int
+txml_map_patch(txml_t *xml, txml_span_t *span, char *value)
+{
+    txml_map_t *map = xml->map;
+    txml_buffer_t buf = TXML_BUFFER_INIT;
+    int rc = 0;
+
+    if (!map->data || map->stale || !span || span->start == TXML_SPAN_NONE ||
+        span->start + span->len > map->size)
+    {
+        return 0;
     }
-    if((value && *value) || !TAILQ_EMPTY(&rnode->children)) {
-        if(!TAILQ_EMPTY(&rnode->children)) {
-            if (xml->ignore_blanks) {
-                strcpy(start_tag + start_offset, ">\n");
-                start_offset += 2;
-                for(end_offset = 0; end_offset < depth; end_offset++)
-                    end_tag[end_offset] = '\t';
-            } else {
-                start_tag[start_offset++] = '>';
-            }
-            TAILQ_FOREACH(child, &rnode->children, siblings) {
-                char *childbuff = txml_dump_branch(xml, child, depth+1); /* let's recurse */
-                if(childbuff) {
-                    int child_bufflen = strlen(childbuff);
-                    child_dump = (char *)realloc(child_dump, child_offset+child_bufflen+1);
-                    // ensure copying the null-terminating byte as well
-                    memcpy(child_dump + child_offset, childbuff, child_bufflen + 1);
-                    child_offset += child_bufflen;
-                    free(childbuff);
-                }
-            }
-        } else {
-            // TODO - allow to specify a flag to determine if we want white spaces or not
-            start_tag[start_offset++] = '>';
-        }
-        start_tag[start_offset] = 0; // ensure null-terminating the start-tag
-        strcpy(end_tag + end_offset, "</");
-        end_offset += 2;
-        if (rnode->ns && rnode->ns->name) {
-            // TODO - optimize
-            strcpy(end_tag + end_offset, rnode->ns->name);
-            end_offset += ns_namelen;
-            end_tag[end_offset-1] = ':';
-        }
-        sprintf(end_tag + end_offset, "%s>", rnode->name);
-        end_offset += namelen + 1;
-        if (xml->ignore_blanks)
-            end_tag[end_offset++] = '\n';
-        end_tag[end_offset] = 0; // ensure null-terminating
-        out = (char *)malloc(depth+strlen(start_tag)+strlen(end_tag)+
-            (value?strlen(value)+1:1)+strlen(child_dump)+3);
-        strcpy(out, start_tag);
-        out_offset += start_offset;
-        if(value && *value) { // skip also if value is an empty string (not only if it's a null pointer)
-            if(!TAILQ_EMPTY(&rnode->children)) {
-                if (xml->ignore_blanks) {
-                    for(; out_offset < depth; out_offset++)
-                        out[out_offset] = '\t';
-                }
-                if (value) {
-                    sprintf(out + out_offset, "%s", value);
-                    out_offset += strlen(value);
-                    if (xml->ignore_blanks)
-                        out[out_offset++] = '\n';
-                }
-            }
-            else {
-                if (value)
-                    strcpy(out + out_offset, value);
-                    out_offset += strlen(value);
-            }
+    txml_buffer_append_escaped(&buf, value);
+    if (buf.err) {
+        rc = -1;
+    } else if (buf.len == span->len) {
+        if (buf.len)
+            memcpy(map->data + span->start, buf.data, buf.len);
+        rc = txml_map_flush(xml, span->start, span->len) == 0 ? 1 : -1;
+    }
+    free(buf.data);
+    return rc;
+}
+
+// complete a patch (the caller doesn't hold any lock anymore)
+static txml_err_t
+txml_map_patched(txml_t *xml, int rc)
+{
+    txml_err_t err = (rc < 0) ? TXML_GENERIC_ERR : TXML_NOERR;
+
+    if (rc == 0) {
+        TXML_WRLOCK(xml);
+        if (xml->map) // not reset meanwhile
+            err = txml_map_save(xml);
+        TXML_WRUNLOCK(xml);
+    }
+    return err;
+}
+
+txml_err_t
+txml_map_file(txml_t *xml, char *path)
+{
+    txml_map_t *map;
+    txml_err_t err;
+    int track;
+
+    if (!path)
+        return TXML_BADARGS;
+    map = (txml_map_t *)calloc(1, sizeof(txml_map_t));
+    if (!map || !(map->path = strdup(path))) {
+        free(map);
+        return TXML_MEMORY_ERR;
+    }
+    map->fd = -1;
+    TXML_WRLOCK(xml);
+    if (xml->journal) { // the journal applies on top of the base file as it is
+        err = TXML_BADARGS;
+    } else if ((err = txml_map_open(map, 1)) == TXML_NOERR) {
+        // parsed straight from the mapping, which drops the previous one (if any)
+        track = xml->track;
+        xml->track |= TXML_TRACK_OFFSETS;
+        err = txml_parse_buffer_unlocked(xml, map->data);
+        xml->track = track;
+        if (err == TXML_NOERR) {
+            xml->map = map;
+            map = NULL;
         }
-        memcpy(out + out_offset, child_dump, child_offset);
-        out_offset += child_offset;
-        strcpy(out + out_offset, end_tag);
     }
-    else {
-        strcpy(start_tag + start_offset, "/>");
-        start_offset += 2;
-        if (xml->ignore_blanks)
-            start_tag[start_offset++] = '\n';
-        start_tag[start_offset] = 0;
-        out = strdup(start_tag);
+    TXML_WRUNLOCK(xml);
+    txml_map_destroy(map);
+    return err;
+}
+
+txml_err_t
+txml_node_patch_value(txml_node_t *node, char *value)
+{
+    txml_node_source_t *source = TXML_NODE_SOURCE(node);
+    txml_t *xml;
+    txml_err_t res;
+    int rc = 1;
+
+    TXML_NODE_WRLOCK(node);
+    xml = txml_context_get(node);
+    if (!xml || !xml->map) {
+        res = TXML_BADARGS;
+    } else if ((res = txml_node_set_value_unlocked(NULL, node, value)) == TXML_NOERR) {
+        rc = txml_map_patch(xml, source ? &source->value : NULL, node->value);
     }
-    free(start_tag);
-    free(end_tag);
-    free(child_dump);
-    if (value)
-        free(value);
-    return out;
+    TXML_NODE_WRUNLOCK(node);
+    if (res != TXML_NOERR)
+        return res;
+    return txml_map_patched(xml, rc);
 }
 
-char *
-txml_dump(txml_t *xml, int *outlen)
+txml_err_t
+txml_attribute_patch_value(txml_attribute_t *attr, char *value)
 {
-    char *dump;
-    txml_node_t *rnode;
-    char *branch;
-#ifdef USE_ICONV
-    int do_conversion = 0;
-#endif
-    char head[256]; // should be enough
-    int hlen;
-    unsigned int offset;
+    txml_node_t *node = attr->node;
+    txml_attribute_source_t *source;
+    txml_t *xml;
+    txml_err_t res = TXML_NOERR;
+    char *copy;
+    int rc = 1;
+
+    TXML_NODE_WRLOCK(node);
+    xml = txml_context_get(node);
+    if (!xml || !xml->map) {
+        res = TXML_BADARGS;
+    } else if (!(copy = txml_strdup_value(NULL, value))) {
+        res = TXML_MEMORY_ERR;
+    } else {
+        if (xml->nindexes)
+            txml_index_attribute(xml, NULL, attr, 0);
+        txml_free_value(NULL, attr->value);
+        attr->value = copy;
+        if (xml->nindexes)
+            txml_index_attribute(xml, NULL, attr, 1);
+        txml_node_changed(node, TXML_NODE_CHANGED_SELF);
+        source = txml_attribute_source(attr);
+        rc = txml_map_patch(xml, source ? &source->value : NULL, attr->value);
+    }
+    TXML_NODE_WRUNLOCK(node);
+    if (res != TXML_NOERR)
+        return res;
+    return txml_map_patched(xml, rc);
+}
 
-    memset(head, 0, sizeof(head));
-    if (xml->head) {
-        int quote;
-        char *start, *end, *encoding;
-        char *initial = strdup(xml->head);
-        start = strstr(initial, "encoding=");
-        if (start) {
-            *start = 0;
-            encoding = start+9;
-            if (*encoding == '"' || *encoding == '\'') {
-                quote = *encoding;
-                encoding++;
-                end = (char *)strchr(encoding, quote);
-                if (!end) {
-                    /* TODO - Error Messages */
-                } else if ((end-encoding) >= sizeof(xml->output_encoding)) {
-                    /* TODO - Error Messages */
-                }
-                *end = 0;
-                // check if document encoding matches
-                if (strncasecmp(encoding, xml->document_encoding, end-encoding) != 0) {
-                    /* TODO - Error Messages */
-                } 
-                if (strncasecmp(encoding, xml->output_encoding, end-encoding) != 0) {
-#ifdef USE_ICONV
-                    snprintf(head, sizeof(head), "%sencoding=\"%s\"%s",
-                        initial, xml->output_encoding, ++end);
-                    do_conversion = 1;
-#else
-                    fprintf(stderr, "Iconv missing: will not convert output to %s\n", xml->output_encoding);
-                    snprintf(head, sizeof(head), "%s", xml->head);
-#endif
-                } else {
-                    snprintf(head, sizeof(head), "%s", xml->head);
-                }
+txml_err_t
+txml_map_sync(txml_t *xml)
+{
+    txml_err_t err = TXML_NOERR;
 
-            }
-        } else {
-#ifdef USE_ICONV
-            if (xml->output_encoding && strcasecmp(xml->output_encoding, "utf-8") != 0) {
-                do_conversion = 1;
-                fprintf(stderr, "Iconv missing: will not convert output to %s\n", xml->output_encoding);
-            }
-            snprintf(head, sizeof(head), "xml version=\"1.0\" encoding=\"%s\"", 
-                xml->output_encoding?xml->output_encoding:"utf-8");
-#else
-            if (xml->output_encoding && strcasecmp(xml->output_encoding, "utf-8") != 0) {
-                fprintf(stderr, "Iconv missing: will not convert output to %s\n", xml->output_encoding);
-            }
-            snprintf(head, sizeof(head), "xml version=\"1.0\" encoding=\"utf-8\"");
+    TXML_DOC_RDLOCK(xml);
+    if (!xml->map || !xml->map->data) {
+        err = TXML_BADARGS;
+    }
+#ifndef WIN32
+    else if (msync(xml->map->data, xml->map->size, MS_SYNC) != 0 ||
+             (xml->save_sync == TXML_SYNC_FULL && txml_sync_fd(xml->map->fd, TXML_SYNC_FULL) != 0))
+    {
+        err = TXML_GENERIC_ERR;
+    }
 #endif
+    TXML_DOC_RDUNLOCK(xml);
+    return err;
+}
+
+//
+// SIDECAR INDEXES
+// The elements of a (huge) file down to a given depth are located by a
+// markup scan, without parsing anything, and recorded in a separate file
+// with their path and the value of a key attribute. Looking an element up
+// is a binary search over the mapped index, then just its bytes are read
+// from the indexed file and parsed
+//
+
+// hash a path and a key the way the entries of a sidecar are sorted
+static unsigned long long
+txml_sidecar_hash(char *path, size_t path_len, char *key, size_t key_len)
+{
+    return txml_hash_word(txml_hash_bytes(path, path_len), txml_hash_bytes(key, key_len));
+}
+
+static int
+txml_sidecar_entry_compare(const void *a, const void *b)
+{
+    const txml_sidecar_entry_t *e1 = (const txml_sidecar_entry_t *)a;
+    const txml_sidecar_entry_t *e2 = (const txml_sidecar_entry_t *)b;
+
+    if (e1->hash != e2->hash)
+        return e1->hash < e2->hash ? -1 : 1;
+    return e1->start < e2->start ? -1 : e1->start > e2->start;
+}
+
+#define TXML_IS_WHITESPACE(__c) ((__c) == ' ' || (__c) == '\t' || (__c) == '\r' || (__c) == '\n')
+
+// the raw value of attribute 'name' in the start tag [tag, end), NULL if missing
+static char *
+txml_tag_attribute(char *tag, char *end, char *name, size_t *len)
+{
+    size_t name_len = strlen(name);
+    char *p = tag + 1;
+    char *attr;
+    char quote;
+
+    while (p < end && !TXML_IS_WHITESPACE(*p) && *p != '>' && *p != '/')
+        p++;
+    for (;;) {
+        while (p < end && TXML_IS_WHITESPACE(*p))
+            p++;
+        attr = p;
+        while (p < end && !TXML_IS_WHITESPACE(*p) && *p != '=' && *p != '>' && *p != '/')
+            p++;
+        if (p == attr)
+            return NULL;
+        if ((size_t)(p - attr) != name_len || strncmp(attr, name, name_len) != 0)
+            attr = NULL;
+        while (p < end && TXML_IS_WHITESPACE(*p))
+            p++;
+        if (p >= end || *p != '=')
+            return NULL;
+        p++;
+        while (p < end && TXML_IS_WHITESPACE(*p))
+            p++;
+        if (p >= end || (*p != '"' && *p != '\''))
+            return NULL;
+        quote = *p++;
+        if (attr) {
+            attr = p;
+            while (p < end && *p != quote)
+                p++;
+            *len = p - attr;
+            return attr;
         }
-        free(initial);
-    } else {
-#ifdef USE_ICONV
-        if (xml->output_encoding && strcasecmp(xml->output_encoding, "utf-8") != 0) {
-            do_conversion = 1;
-        }
-        snprintf(head, sizeof(head), "xml version=\"1.0\" encoding=\"%s\"", 
-            xml->output_encoding?xml->output_encoding:"utf-8");
-#else
-        if (xml->output_encoding && strcasecmp(xml->output_encoding, "utf-8") != 0) {
-            fprintf(stderr, "Iconv missing: will not convert output to %s\n", xml->output_encoding);
-        }
-        snprintf(head, sizeof(head), "xml version=\"1.0\" encoding=\"utf-8\"");
-#endif
+        while (p < end && *p != quote)
+            p++;
+        p++;
     }
-    hlen = strlen(head);
-    dump = malloc(hlen+6);
-    sprintf(dump, "<?%s?>\n", head);
-    offset = hlen +5;
-    TAILQ_FOREACH(rnode, &xml->root_elements, siblings) {
-        branch = txml_dump_branch(xml, rnode, 0);
-        if(branch) {
-            int blen = strlen(branch);
-            dump = (char *)realloc(dump, offset + blen + 1);
-            // ensure copying the null-terminating byte as well
-            memcpy(dump + offset, branch, blen + 1); 
-            offset += blen;
-            free(branch);
+}
+
+typedef struct {
+    txml_sidecar_entry_t *entries;
+    unsigned long long count;
+    unsigned long long size;
+    txml_buffer_t strings;
+    unsigned long long *paths; // open addressing table of the paths among the strings
+    unsigned long long npaths;
+    unsigned long long paths_size;
+} txml_sidecar_builder_t;
+
+// the offset of a path among the strings, adding it if new
+static long long
+txml_sidecar_path(txml_sidecar_builder_t *builder, char *path, size_t len)
+{
+    unsigned long long *table, hash = txml_hash_bytes(path, len);
+    unsigned long long i, slot, size, offset;
+    char *old;
+
+    if ((builder->npaths + 1) * 2 > builder->paths_size) {
+        size = builder->paths_size ? builder->paths_size * 2 : 64;
+        table = (unsigned long long *)calloc(size, sizeof(unsigned long long));
+        if (!table)
+            return -1;
+        for (i = 0; i < builder->paths_size; i++) {
+            if (!(offset = builder->paths[i]))
+                continue;
+            old = builder->strings.data + offset;
+            slot = txml_hash_bytes(old, strlen(old)) & (size - 1);
+            while (table[slot])
+                slot = (slot + 1) & (size - 1);
+            table[slot] = offset;
         }
+        free(builder->paths);
+        builder->paths = table;
+        builder->paths_size = size;
     }
-    if (outlen) // check if we need to report the output size
-        *outlen = strlen(dump);
-#ifdef USE_ICONV
-    if (do_conversion) {
-        iconv_t ich;
-        size_t ilen, olen, cb;
-        char *out;
-        char *iconvin;
-        char *iconvout;
-        ilen = strlen(dump);
-        // the most expensive conversion would be from ascii to utf-32/ucs-4
-        // ( 4 bytes for each char )
-        olen = ilen * 4; 
-        // we still don't know how big the output buffer is going to be
-        // we will update outlen later once iconv tell us the size
-        if (outlen) 
-            *outlen = olen;
-        out = (char *)calloc(1, olen);
-        ich = iconv_open (xml->output_encoding, xml->document_encoding);
-        if (ich == (iconv_t)(-1)) {
-            free(dump);
-            free(out);
-            fprintf(stderr, "Can't init iconv: %s\n", strerror(errno));
-            return NULL;
-        }
-        iconvin = dump;
-        iconvout = out;
-        cb = iconv(ich, &iconvin, &ilen, &iconvout, &olen);
-        if (cb == -1) {
-            free(dump);
-            free(out);
-            fprintf(stderr, "Error from iconv: %s\n", strerror(errno));
+    for (slot = hash & (builder->paths_size - 1); (offset = builder->paths[slot]);
+         slot = (slot + 1) & (builder->paths_size - 1))
+    {
+        if (strncmp(builder->strings.data + offset, path, len) == 0 && !builder->strings.data[offset + len])
+            return offset;
+    }
+    offset = builder->strings.len;
+    txml_buffer_append(&builder->strings, path, len);
+    txml_buffer_append(&builder->strings, "", 1);
+    if (builder->strings.err)
+        return -1;
+    builder->paths[slot] = offset;
+    builder->npaths++;
+    return offset;
+}
+
+// add an entry for the element starting at 'tag' (its end is set later)
+static txml_sidecar_entry_t *
+txml_sidecar_add(txml_sidecar_builder_t *builder, char *data, char *tag, char *tag_end,
+                 char *path, size_t path_len, char **keys)
+{
+    txml_sidecar_entry_t *entry, *entries;
+    unsigned long long size;
+    long long offset;
+    char *key = NULL;
+    size_t key_len = 0;
+    char *copy;
+    int i;
+
+    if (builder->count == builder->size) {
+        size = builder->size ? builder->size * 2 : 1024;
+        entries = (txml_sidecar_entry_t *)realloc(builder->entries, size * sizeof(txml_sidecar_entry_t));
+        if (!entries)
             return NULL;
-        }
-        iconv_close(ich);
-        free(dump); // release the old buffer (in the original encoding)
-        dump = out;
-        if (outlen) // update the outputsize if we have to
-            *outlen -= olen;
+        builder->entries = entries;
+        builder->size = size;
     }
-#endif
-    return(dump);
+    entry = &builder->entries[builder->count];
+    if ((offset = txml_sidecar_path(builder, path, path_len)) < 0)
+        return NULL;
+    entry->path = offset;
+    entry->key = 0;
+    for (i = 0; keys && keys[i] && !key; i++)
+        key = txml_tag_attribute(tag, tag_end, keys[i], &key_len);
+    if (key && key_len) { // stored unescaped, as looked up
+        entry->key = builder->strings.len;
+        txml_buffer_append(&builder->strings, key, key_len);
+        txml_buffer_append(&builder->strings, "", 1);
+        if (builder->strings.err)
+            return NULL;
+        copy = builder->strings.data + entry->key;
+        if (txml_unescape(copy, copy) == 0)
+            key_len = strlen(copy);
+        builder->strings.len = entry->key + key_len + 1;
+        key = copy;
+    }
+    entry->hash = txml_sidecar_hash(path, path_len, key ? key : "", key ? key_len : 0);
+    entry->start = tag - data;
+    entry->end = 0;
+    builder->count++;
+    return entry;
+}
+
+// write the index out (atomically replacing an old one)
+static txml_err_t
+txml_sidecar_write(txml_sidecar_builder_t *builder, char *index_path, struct stat *filestat)
+{
+    txml_sidecar_header_t header;
+    char *tmp_path;
+    FILE *out = NULL;
+    int fd;
+    txml_err_t err = TXML_GENERIC_ERR;
+
+    tmp_path = (char *)malloc(strlen(index_path) + 32);
+    if (!tmp_path)
+        return TXML_MEMORY_ERR;
+    if ((fd = txml_tmp_open(index_path, tmp_path)) < 0) {
+        free(tmp_path);
+        return TXML_GENERIC_ERR;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TXML_SIDECAR_MAGIC, sizeof(header.magic));
+    header.size = filestat->st_size;
+    header.mtime = filestat->st_mtime;
+    header.mtime_nsec = txml_stat_mtime_nsec(filestat);
+    header.count = builder->count;
+    header.strings = builder->strings.len;
+    if ((out = fdopen(fd, "w")) &&
+        fwrite(&header, sizeof(header), 1, out) == 1 &&
+        fwrite(builder->entries, sizeof(txml_sidecar_entry_t), builder->count, out) == builder->count &&
+        fwrite(builder->strings.data, 1, builder->strings.len, out) == builder->strings.len &&
+        fflush(out) == 0 && txml_sync_fd(fd, TXML_SYNC_DATA) == 0)
+    {
+        err = TXML_NOERR;
+    }
+    if (out ? fclose(out) != 0 : close(fd) != 0)
+        err = TXML_GENERIC_ERR;
+    if (err == TXML_NOERR && rename(tmp_path, index_path) != 0) {
+        fprintf(stderr, "Can't replace %s", index_path);
+        err = TXML_GENERIC_ERR;
+    }
+    if (err != TXML_NOERR)
+        unlink(tmp_path);
+    free(tmp_path);
+    return err;
 }
 
 txml_err_t
-txml_save(txml_t *xml, char *xml_file)
+txml_sidecar_build(char *path, char *index_path, char **keys, unsigned int depth)
 {
-    size_t rb;
+    txml_sidecar_builder_t builder;
+    unsigned long long *open = NULL; // the elements being indexed, by depth (entries move while growing)
+    txml_buffer_t element_path = TXML_BUFFER_INIT;
+    size_t *lengths = NULL; // of the element path at each depth
     struct stat filestat;
-    FILE *save_file = NULL;
-    char *dump = NULL;
-    int dump_len = 0;
-    char *backup = NULL;
-    char *backup_path = NULL;
-    FILE *backup_file = NULL;
+    txml_map_t map;
+    unsigned long level = 0;
+    char *p, *tag, *name;
+    int kind;
+    txml_err_t err = TXML_NOERR;
 
+    if (!path || !index_path || !depth)
+        return TXML_BADARGS;
+    memset(&map, 0, sizeof(map));
+    map.fd = -1;
+    map.path = path;
+    if ((err = txml_map_open(&map, 0)) != TXML_NOERR)
+        return err;
+    memset(&builder, 0, sizeof(builder));
+    open = (unsigned long long *)calloc(depth, sizeof(unsigned long long));
+    lengths = (size_t *)calloc(depth + 1, sizeof(size_t));
+    txml_buffer_append(&builder.strings, "", 1); // the empty key
+    if (!open || !lengths || builder.strings.err || fstat(map.fd, &filestat) != 0) {
+        err = TXML_MEMORY_ERR;
+        goto done;
+    }
 
-    if (stat(xml_file, &filestat) == 0) {
-        if(filestat.st_size>0) { /* backup old profiles */
-            save_file = fopen(xml_file, "r");
-            if(!save_file) {
-                fprintf(stderr, "Can't open %s for reading !!", xml_file);
-                return TXML_GENERIC_ERR;
-            }
-            if(txml_file_lock(save_file) != TXML_NOERR) {
-                fprintf(stderr, "Can't lock %s for reading ", xml_file);
-                return TXML_GENERIC_ERR;
+    for (p = map.data; (p = strchr(p, '<')); ) {
+        tag = p;
+        if (!(p = txml_scan_markup(tag, &kind))) {
+            err = TXML_PARSER_GENERIC_ERR; // not terminated
+            break;
+        }
+        if (kind == TXML_MARKUP_END) {
+            if (!level) {
+                err = TXML_PARSER_GENERIC_ERR;
+                break;
             }
-            backup = (char *)malloc(filestat.st_size+1);
-            rb = fread(backup, 1, filestat.st_size, save_file);
-            if (rb != filestat.st_size) {
-                fprintf(stderr, "Can't read %s content", xml_file);
-                return -1;
+            if (--level < depth) {
+                builder.entries[open[level]].end = p - map.data;
+                element_path.len = lengths[level];
             }
-            backup[filestat.st_size] = 0;
-            txml_file_unlock(save_file);
-            fclose(save_file);
-            backup_path = (char *)malloc(strlen(xml_file)+5);
-            sprintf(backup_path, "%s.bck", xml_file);
-            backup_file = fopen(backup_path, "w+");
-            if(backup_file) {
-                if(txml_file_lock(backup_file) != TXML_NOERR) {
-                    fprintf(stderr, "Can't lock %s for writing ", backup_path);
-                    free(backup_path);
-                    free(backup);
-                    return TXML_GENERIC_ERR;
+        } else if (kind == TXML_MARKUP_START || kind == TXML_MARKUP_UNIQUE) {
+            if (level < depth) {
+                txml_sidecar_entry_t *entry;
+                lengths[level] = element_path.len;
+                name = tag + 1;
+                while (*name && !TXML_IS_WHITESPACE(*name) && *name != '>' && *name != '/')
+                    name++;
+                txml_buffer_append(&element_path, "/", 1);
+                txml_buffer_append(&element_path, tag + 1, name - tag - 1);
+                if (element_path.err ||
+                    !(entry = txml_sidecar_add(&builder, map.data, tag, p, element_path.data,
+                                               element_path.len, keys)))
+                {
+                    err = TXML_MEMORY_ERR;
+                    break;
+                }
+                if (kind == TXML_MARKUP_UNIQUE) {
+                    entry->end = p - map.data;
+                    element_path.len = lengths[level];
+                } else {
+                    open[level] = entry - builder.entries;
                 }
-                fwrite(backup, 1, filestat.st_size, backup_file);
-                txml_file_unlock(backup_file);
-                fclose(backup_file);
-            }
-            else {
-                fprintf(stderr, "Can't open backup file (%s) for writing! ", backup_path);
-                free(backup_path);
-                free(backup);
-                return TXML_GENERIC_ERR;
-            }
-            free(backup_path);
-            free(backup);
-        } /* end of backup */
-    }
-    dump = txml_dump(xml, &dump_len);
-     if(dump && dump_len) {
-        save_file = fopen(xml_file, "w+");
-        if(save_file) {
-            if(txml_file_lock(save_file) != TXML_NOERR) {
-                fprintf(stderr, "Can't lock %s for writing ", xml_file);
-                free(dump);
-                return TXML_GENERIC_ERR;
-            }
-            fwrite(dump, 1, dump_len, save_file);
-            free(dump);
-            txml_file_unlock(save_file);
-            fclose(save_file);
-        }
-        else {
-            fprintf(stderr, "Can't open output file %s", xml_file);
-            if(!save_file) {
-                free(dump);
-                return TXML_GENERIC_ERR;
             }
+            if (kind == TXML_MARKUP_START)
+                level++;
         }
     }
-    return TXML_NOERR;
-}
+    if (err == TXML_NOERR && level)
+        err = TXML_PARSER_GENERIC_ERR;
+    if (err == TXML_NOERR) {
+        qsort(builder.entries, builder.count, sizeof(txml_sidecar_entry_t), txml_sidecar_entry_compare);
+        err = txml_sidecar_write(&builder, index_path, &filestat);
+    }
 
-unsigned long
-txml_node_count_attributes(txml_node_t *node)
-{
-    txml_attribute_t *attr;
-    int cnt = 0;
-    TAILQ_FOREACH(attr, &node->attributes, list) 
-        cnt++;
-    return cnt;
+done:
+    map.path = NULL;
+    txml_map_close(&map);
+    free(open);
+    free(lengths);
+    free(element_path.data);
+    free(builder.entries);
+    free(builder.strings.data);
+    free(builder.paths);
+    return err;
 }
 
-unsigned long
-txml_node_count_children(txml_node_t *node)
+txml_sidecar_t *
+txml_sidecar_open(char *path, char *index_path)
 {
-    txml_node_t *child;
-    int cnt = 0; 
-    TAILQ_FOREACH(child, &node->children, siblings)
-        cnt++;
-    return cnt;
-}
+#ifndef WIN32
+    txml_sidecar_t *sidecar;
+    txml_sidecar_header_t *header;
+    struct stat filestat, index_stat;
+    int fd;
 
-unsigned long
-txml_count_branches(txml_t *xml)
-{
-    txml_node_t *node;
-    int cnt = 0;
-    TAILQ_FOREACH(node, &xml->root_elements, siblings)
-        cnt++;
-    return cnt;
+    if (!path || !index_path)
+        return NULL;
+    sidecar = (txml_sidecar_t *)calloc(1, sizeof(txml_sidecar_t));
+    if (!sidecar)
+        return NULL;
+    sidecar->fd = open(path, O_RDONLY);
+    fd = open(index_path, O_RDONLY);
+    if (sidecar->fd < 0 || fd < 0 || fstat(sidecar->fd, &filestat) != 0 ||
+        fstat(fd, &index_stat) != 0 || index_stat.st_size < sizeof(txml_sidecar_header_t))
+    {
+        goto failed;
+    }
+    sidecar->length = index_stat.st_size;
+    sidecar->index = mmap(NULL, sidecar->length, PROT_READ, MAP_SHARED, fd, 0);
+    if (sidecar->index == MAP_FAILED) {
+        sidecar->index = NULL;
+        goto failed;
+    }
+    close(fd);
+    fd = -1;
+    header = sidecar->header = (txml_sidecar_header_t *)sidecar->index;
+    // an index of another version of the file is of no use
+    if (memcmp(header->magic, TXML_SIDECAR_MAGIC, sizeof(header->magic)) != 0 ||
+        header->count > (sidecar->length - sizeof(txml_sidecar_header_t)) / sizeof(txml_sidecar_entry_t) ||
+        sizeof(txml_sidecar_header_t) + header->count * sizeof(txml_sidecar_entry_t) + header->strings != sidecar->length ||
+        !header->strings || sidecar->index[sidecar->length - 1] != 0 ||
+        header->size != filestat.st_size || header->mtime != filestat.st_mtime ||
+        header->mtime_nsec != txml_stat_mtime_nsec(&filestat))
+    {
+        fprintf(stderr, "Stale or invalid index %s\n", index_path);
+        goto failed;
+    }
+    sidecar->entries = (txml_sidecar_entry_t *)(header + 1);
+    sidecar->strings = (char *)(sidecar->entries + header->count);
+    return sidecar;
+
+failed:
+    if (fd >= 0)
+        close(fd);
+    txml_sidecar_close(sidecar);
+#endif
+    return NULL;
 }
 
-txml_err_t
-txml_remove_node(txml_t *xml, char *path)
+void
+txml_sidecar_close(txml_sidecar_t *sidecar)
 {
-    /* XXX - UNIMPLEMENTED */
-    return TXML_GENERIC_ERR;
+    if (!sidecar)
+        return;
+#ifndef WIN32
+    if (sidecar->index)
+        munmap(sidecar->index, sidecar->length);
+#endif
+    if (sidecar->fd >= 0)
+        close(sidecar->fd);
+    free(sidecar);
 }
 
 txml_err_t
-txml_remove_branch(txml_t *xml, unsigned long index)
+txml_sidecar_find(txml_sidecar_t *sidecar, char *path, char *key, unsigned long index,
+                  size_t *start, size_t *end)
 {
-    int count = 0;
-    txml_node_t *branch, *tmp;
-    TAILQ_FOREACH_SAFE(branch, &xml->root_elements, siblings, tmp) {
-        if (count++ == index) {
-            TAILQ_REMOVE(&xml->root_elements, branch, siblings);
-            txml_node_destroy(branch);
-            return TXML_NOERR;
+    txml_sidecar_entry_t *entry;
+    unsigned long long hash, lo = 0, hi, mid;
+    size_t strings;
+
+    if (!sidecar || !path)
+        return TXML_BADARGS;
+    if (!key)
+        key = "";
+    hash = txml_sidecar_hash(path, strlen(path), key, strlen(key));
+    hi = sidecar->header->count;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (sidecar->entries[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    strings = sidecar->header->strings;
+    for (; lo < sidecar->header->count && sidecar->entries[lo].hash == hash; lo++) {
+        entry = &sidecar->entries[lo];
+        // the hash could be shared with other elements
+        if (entry->path >= strings || entry->key >= strings ||
+            strcmp(sidecar->strings + entry->path, path) != 0 ||
+            strcmp(sidecar->strings + entry->key, key) != 0 || index--)
+        {
+            continue;
         }
+        if (start)
+            *start = entry->start;
+        if (end)
+            *end = entry->end;
+        return TXML_NOERR;
     }
-    return TXML_GENERIC_ERR;
+    return TXML_BADARGS;
 }
 
-txml_node_t
-*txml_node_get_child(txml_node_t *node, unsigned long index)
+txml_err_t
+txml_sidecar_parse(txml_sidecar_t *sidecar, char *path, char *key, unsigned long index, txml_t *xml)
 {
-    txml_node_t *child;
-    int count = 0;
-    if(!node)
-        return NULL;
-    TAILQ_FOREACH(child, &node->children, siblings) {
-        if (count++ == index) {
-            return child;
-            break;
+    size_t start, end, done = 0;
+    ssize_t rb;
+    char *buf;
+    txml_err_t err;
+
+    if (!xml)
+        return TXML_BADARGS;
+    if ((err = txml_sidecar_find(sidecar, path, key, index, &start, &end)) != TXML_NOERR)
+        return err;
+    if (end <= start || !(buf = (char *)malloc(end - start + 1)))
+        return end <= start ? TXML_BADARGS : TXML_MEMORY_ERR;
+    // reads of many threads don't get in the way of each other
+    while (done < end - start) {
+        rb = pread(sidecar->fd, buf + done, end - start - done, start + done);
+        if (rb <= 0) {
+            free(buf);
+            return TXML_GENERIC_ERR;
         }
+        done += rb;
     }
-    return NULL;
+    buf[done] = 0;
+    err = txml_parse_buffer(xml, buf);
+    free(buf);
+    return err;
 }
 
-/* XXX - if multiple children shares the same name, only the first is returned */
-txml_node_t
-*txml_node_get_child_byname(txml_node_t *node, char *name)
+//
+// JOURNAL
+// The mutations applied to a document are appended to a log, one record each,
+// and replayed on top of the base file when the document is opened again.
+// Once the log grows past a threshold the document is saved as the new base
+// file (in background, if possible) and an empty log replaces the old one.
+//
+// The log starts with the hash of the base file it applies to ( "J <hash>\n" ):
+// a log found next to a different base file is stale (a crash interrupted
+// a compaction after the new base file was in place) and it's dropped.
+// Each record is a line holding an operation and its fields, each one preceded
+// by a space. Nodes are referred to by their position ( "0/3/1" is the second
+// child of the fourth child of the first root node ) and strings are prefixed
+// by their length ( "5:hello" ):
+//   V node value         set the value of a node
+//   A node name value    add an attribute
+//   R node index         remove an attribute
+//   X node               remove all the attributes
+//   D node               destroy a node (or a root branch)
+//   C parent branch      add a (serialized) branch under a node
+//   T parent type value  add a comment, CDATA or text node under a node
+//   M node parent        move a node under a new parent
+//   N branch             add a root branch
+//   S node branch        replace a root branch
+// Text nodes don't survive a save (their text becomes the value of the parent),
+// so positions don't count them. Changes to a text node itself can't be recorded:
+// the document is marked to be saved as a whole instead
+//
+
+#ifdef THREAD_SAFE
+#define TXML_JOURNAL_LOCK(__j) pthread_mutex_lock(&(__j)->lock)
+#define TXML_JOURNAL_UNLOCK(__j) pthread_mutex_unlock(&(__j)->lock)
+#else
+#define TXML_JOURNAL_LOCK(__j)
+#define TXML_JOURNAL_UNLOCK(__j)
+#endif
+
+// the list holding a node
+#define TXML_JOURNAL_LIST(__x, __n) \
+    ((__n)->parent ? (void *)&(__n)->parent->children : (void *)&(__x)->root_elements)
+
+// Positions are looked up in (and resolved through) an index of the list, when it's long.
+// Indexes survive the nodes added at the end of their list, the records of the other
+// structural changes drop them. The caller holds the journal lock
+
+static void
+txml_positions_reset(txml_positions_t *positions)
 {
-    txml_node_t *child;
-    unsigned int i = 0;
-    char *attr_name = NULL;
-    char *attr_val = NULL;
-    char *node_name = NULL;
-    int name_len = 0;
-    char *p;
+    free(positions->nodes);
+    free(positions->slots);
+    memset(positions, 0, sizeof(txml_positions_t));
+}
 
-    if(!node)
-        return NULL;
+static inline unsigned long
+txml_positions_slot(txml_positions_t *positions, txml_node_t *node)
+{
+    unsigned long h = (unsigned long)((size_t)node >> 4);
+    h ^= h >> 16;
+    h *= 0x45d9f3b;
+    h ^= h >> 16;
+    return h & (positions->nslots - 1);
+}
 
-    node_name = strdup(name); // make a copy to avoid changing the provided buffer
-    name_len = strlen(node_name);
+static void
+txml_positions_hash(txml_positions_t *positions, unsigned long index)
+{
+    unsigned long slot = txml_positions_slot(positions, positions->nodes[index]);
+    while (positions->slots[slot])
+        slot = (slot + 1) & (positions->nslots - 1);
+    positions->slots[slot] = index + 1;
+}
 
-    if (node_name[name_len-1] == ']') {
-        p = strchr(node_name, '[');
-        *p = 0;
-        p++;
-        if (sscanf(p, "%d]", &i) == 1) {
-            i--;
-        } else if (*p == '@') {
-            p++;
-            p[strlen(p)-1] = 0;
-            attr_name = p;
-            attr_val = strchr(p, '=');
-            if (attr_val) {
-                *attr_val = 0;
-                attr_val++;
-                if (*attr_val == '\'' || *attr_val == '"') {
-                    char quote = *attr_val;
-                    int n, j=0;
-                    // inplace dequoting
-                    attr_val++;
-                    for (n = 0; attr_val[n] != 0; n++) {
-                        if (attr_val[n] == quote) {
-                            if (n && attr_val[n-1] == quote) { // quote escaping (XXX - perhaps out of spec)
-                                if (j)
-                                    j--;
-                            } else {
-                                attr_val[n] = 0;
-                                break;
-                            }
-                        }
-                        if (j != n)
-                            attr_val[j] = attr_val[n];
-                        j++;
-                    }
+static int
+txml_positions_add(txml_positions_t *positions, txml_node_t *node)
+{
+    unsigned long size, i;
+    void *p;
+
+    if (node->type == TXML_NODETYPE_TEXT)
+        return 0;
+    if (positions->count == positions->size) {
+        size = positions->size ? positions->size * 2 : TXML_JOURNAL_SHORT_LIST * 2;
+        if (!(p = realloc(positions->nodes, size * sizeof(txml_node_t *))))
+            return -1;
+        positions->nodes = (txml_node_t **)p;
+        positions->size = size;
+    }
+    if ((positions->count + 1) * 2 > positions->nslots) {
+        size = positions->nslots ? positions->nslots * 2 : TXML_JOURNAL_SHORT_LIST * 4;
+        if (!(p = calloc(size, sizeof(unsigned long))))
+            return -1;
+        free(positions->slots);
+        positions->slots = (unsigned long *)p;
+        positions->nslots = size;
+        for (i = 0; i < positions->count; i++)
+            txml_positions_hash(positions, i);
+    }
+    positions->nodes[positions->count] = node;
+    txml_positions_hash(positions, positions->count++);
+    return 0;
+}
 
-                }
-            }
-        }
+// position of a node + 1, 0 if it's not there
+static unsigned long
+txml_positions_lookup(txml_positions_t *positions, txml_node_t *node)
+{
+    unsigned long slot = txml_positions_slot(positions, node);
+    while (positions->slots[slot]) {
+        if (positions->nodes[positions->slots[slot] - 1] == node)
+            return positions->slots[slot];
+        slot = (slot + 1) & (positions->nslots - 1);
     }
+    return 0;
+}
 
-    TAILQ_FOREACH(child, &node->children, siblings) {
-        if(strcmp(child->name, node_name) == 0) {
-            if (attr_name) {
-                txml_attribute_t *attr = txml_node_get_attribute_byname(child, attr_name);
-                if (attr) {
-                    if (attr_val) {
-                        char *dexmlized = dexmlize(attr_val);
-                        if (strcmp(attr->value, dexmlized) != 0) {
-                            free(dexmlized);
-                            continue; // the attr value doesn't match .. let's skip to next matching node
-                        }
-                        free(dexmlized);
-                    }
-                    free(node_name);
-                    return child;
-                }
-            } else if (i == 0) {
-                free(node_name);
-                return child;
-            } else {
-                i--;
-            }
+// the index of a list starting with 'first', built if there is none. NULL if out of memory
+static txml_positions_t *
+txml_journal_positions(txml_journal_t *journal, void *list, txml_node_t *first)
+{
+    txml_positions_t *positions;
+    int i;
+
+    for (i = 0; i < TXML_JOURNAL_POSITIONS; i++) {
+        if (journal->positions[i].list == list)
+            return &journal->positions[i];
+    }
+    positions = &journal->positions[journal->next_positions++ % TXML_JOURNAL_POSITIONS];
+    txml_positions_reset(positions);
+    for (; first; first = TAILQ_NEXT(first, siblings)) {
+        if (txml_positions_add(positions, first) != 0) {
+            txml_positions_reset(positions);
+            return NULL;
         }
     }
-    free(node_name);
-    return NULL;
+    positions->list = list;
+    return positions;
 }
 
-txml_node_t *
-txml_get_node(txml_t *xml, char *path)
+// a node has been added at the end of a list
+static void
+txml_journal_appended(txml_journal_t *journal, void *list, txml_node_t *node)
 {
-    char *buff, *walk;
-    char *tag;
-    unsigned long i = 0;
-    txml_node_t *cnode = NULL;
-    txml_node_t *wnode = NULL;
-//#ifndef WIN32
-    char *brkb;
-//#endif
-    if(!path)
-        return NULL;
+    int i;
+    for (i = 0; i < TXML_JOURNAL_POSITIONS; i++) {
+        if (journal->positions[i].list == list && txml_positions_add(&journal->positions[i], node) != 0)
+            txml_positions_reset(&journal->positions[i]);
+    }
+}
 
-    buff = strdup(path);
-    walk = buff;
+// a list changed otherwise (NULL if nodes are going to be destroyed: any list could go with them)
+static void
+txml_journal_forget(txml_journal_t *journal, void *list)
+{
+    int i;
+    for (i = 0; i < TXML_JOURNAL_POSITIONS; i++) {
+        if (!list || journal->positions[i].list == list)
+            txml_positions_reset(&journal->positions[i]);
+    }
+}
 
-    // check if we are allowing multiple rootnodes to determine
-    // if it's included in the path or not
-    if (xml->allow_multiple_root_nodes) {
-        /* skip leading slashes '/' */
-        while(*walk == '/')
-            walk++;
+// position of a node among its siblings
+static unsigned long
+txml_journal_position(txml_journal_t *journal, txml_node_t *node)
+{
+    txml_positions_t *positions;
+    txml_node_t *p = node;
+    unsigned long index = 0, steps = 0;
 
-        /* select the root node */
-#ifndef WIN32
-        tag  = strtok_r(walk, "/", &brkb);
-#else
-        tag = strtok(walk, "/");
-#endif
-        if(!tag) {
-            free(buff);
-            return NULL;
-        }
+    while ((p = TAILQ_PREV(p, nodelist_head, siblings)) && steps++ < TXML_JOURNAL_SHORT_LIST) {
+        if (p->type != TXML_NODETYPE_TEXT)
+            index++;
+    }
+    if (!p)
+        return index;
+    positions = txml_journal_positions(journal, TXML_JOURNAL_LIST(journal->xml, node),
+                                       node->parent ? TAILQ_FIRST(&node->parent->children)
+                                                    : TAILQ_FIRST(&journal->xml->root_elements));
+    if (positions && (index = txml_positions_lookup(positions, node)))
+        return index - 1;
+    // no memory for the index, or a text node (the record will be dropped anyway)
+    for (index = 0; (node = TAILQ_PREV(node, nodelist_head, siblings)); ) {
+        if (node->type != TXML_NODETYPE_TEXT)
+            index++;
+    }
+    return index;
+}
 
-        for(i = 0; i < txml_count_branches(xml); i++) {
-            wnode = txml_get_branch(xml, i);
-            if(strcmp(wnode->name, tag) == 0) {
-                cnode = wnode;
-                break;
-            }
-        }
-        /* now cnode points to the root node ... let's find requested node */
-#ifndef WIN32
-        tag = strtok_r(NULL, "/", &brkb);
-#else
-        tag = strtok(NULL, "/");
+static void
+txml_journal_free(txml_journal_t *journal)
+{
+    txml_journal_forget(journal, NULL);
+    if (journal->fd >= 0)
+        close(journal->fd);
+#ifdef THREAD_SAFE
+    pthread_mutex_destroy(&journal->lock);
 #endif
-    } else { // no multiple rootnodes
-        cnode = txml_get_branch(xml, 0);
-        // TODO - this could be done in a cleaner and more efficient way
-        if (*walk != '/') {
-            buff = malloc(strlen(walk)+2);
-            sprintf(buff, "/%s", walk);
-            free(walk);
-            walk = buff;
-        }
+    free(journal->path);
+    free(journal->log_path);
+    free(journal);
+}
+
+// replace the log with an empty one, applying to the base file with the given hash.
+// The caller holds the journal lock
+static txml_err_t
+txml_journal_create(txml_journal_t *journal, unsigned long long hash)
+{
+    struct stat filestat;
+    char header[32];
+    char *tmp_path;
+    int fd, len;
+
+    tmp_path = (char *)malloc(strlen(journal->log_path) + 5);
+    if (!tmp_path)
+        return TXML_MEMORY_ERR;
+    sprintf(tmp_path, "%s.tmp", journal->log_path);
+    len = sprintf(header, "J %016llx\n", hash);
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
 #ifndef WIN32
-        tag = strtok_r(walk, "/", &brkb);
-#else
-        tag = strtok(walk, "/");
+    if (fd >= 0 && stat(journal->path, &filestat) == 0)
+        fchmod(fd, filestat.st_mode & 07777); // as readable as the document itself
 #endif
+    if (fd < 0 || write(fd, header, len) != len ||
+        txml_sync_fd(fd, journal->xml->save_sync) != 0 || rename(tmp_path, journal->log_path) != 0)
+    {
+        fprintf(stderr, "Can't create %s\n", journal->log_path);
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp_path);
+        }
+        free(tmp_path);
+        return TXML_GENERIC_ERR;
     }
+    free(tmp_path);
+    if (journal->xml->save_sync == TXML_SYNC_FULL)
+        txml_sync_dir(journal->log_path);
+    if (journal->fd >= 0)
+        close(journal->fd);
+    journal->fd = fd;
+    journal->size = len;
+    return TXML_NOERR;
+}
 
-    if(!cnode) {
-        free(buff);
-        return NULL;
+// save the document as the new base file and start a new log on top of it.
+// The caller excludes the writers
+static txml_err_t
+txml_journal_compact_unlocked(txml_journal_t *journal)
+{
+    txml_hasher_t hasher;
+    txml_err_t err;
+
+    // compactions requested explicitly can run along with the background ones
+    TXML_JOURNAL_LOCK(journal);
+    txml_hasher_init(&hasher);
+    err = txml_save_file(journal->xml, journal->path, &hasher, NULL);
+    if (err == TXML_NOERR) {
+        // if the old log is still there, it's stale and it must not grow anymore
+        err = txml_journal_create(journal, txml_hasher_final(&hasher));
+        journal->dirty = (err != TXML_NOERR);
     }
+    TXML_JOURNAL_UNLOCK(journal);
+    return err;
+}
 
-    while(tag) {
-        wnode = txml_node_get_child_byname(cnode, tag);
-        if(!wnode) {
-            free(buff);
-            return NULL;
-        }
-        cnode = wnode; // update current node
-#ifndef WIN32
-        tag = strtok_r(NULL, "/", &brkb);
+#ifdef THREAD_SAFE
+static void *
+txml_journal_run(void *priv)
+{
+    txml_journal_t *journal = (txml_journal_t *)priv;
+    txml_t *xml = journal->xml;
+    TXML_DOC_RDLOCK(xml);
+    if (xml->journal == journal) // not being closed
+        txml_journal_compact_unlocked(journal);
+    TXML_DOC_RDUNLOCK(xml);
+    __atomic_store_n(&journal->compacting, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+#endif
+
+// compact the log, in a new thread if possible. The caller holds the journal lock
+// (and the locks of the mutation it just recorded, the thread waits for them)
+static void
+txml_journal_schedule(txml_journal_t *journal)
+{
+#ifdef THREAD_SAFE
+    if (__atomic_load_n(&journal->compacting, __ATOMIC_ACQUIRE))
+        return;
+    if (journal->thread_started)
+        pthread_join(journal->thread, NULL); // done already
+    __atomic_store_n(&journal->compacting, 1, __ATOMIC_RELAXED);
+    journal->thread_started = (pthread_create(&journal->thread, NULL, txml_journal_run, journal) == 0);
+    if (!journal->thread_started) // retried at the next record
+        __atomic_store_n(&journal->compacting, 0, __ATOMIC_RELAXED);
 #else
-        tag = strtok(NULL, "/");
+    txml_journal_compact_unlocked(journal);
 #endif
+}
+
+// append a record to the log. The caller holds the journal lock
+static void
+txml_journal_append(txml_journal_t *journal, char *data, size_t len)
+{
+    ssize_t wb;
+
+    if (journal->dirty) // the log doesn't describe the document anymore
+        return;
+    while (len) {
+        wb = write(journal->fd, data, len);
+        if (wb < 0 && errno == EINTR)
+            continue;
+        if (wb <= 0)
+            break;
+        data += wb;
+        len -= wb;
+        journal->size += wb;
+    }
+    if (len || txml_sync_fd(journal->fd, journal->xml->save_sync) != 0) {
+        fprintf(stderr, "Can't append to %s\n", journal->log_path);
+        journal->dirty = 1;
     }
+}
 
-    free(buff);
-    return cnode;
+static int
+txml_record_begin(txml_record_t *rec, txml_t *xml, char op)
+{
+    rec->journal = xml ? xml->journal : NULL;
+    if (!rec->journal)
+        return 0;
+    rec->destroys = (op == 'D' || op == 'S');
+    txml_buffer_append(&rec->buf, &op, 1);
+    return 1;
 }
 
-txml_node_t
-*txml_get_branch(txml_t *xml, unsigned long index)
+static void
+txml_record_node(txml_record_t *rec, txml_node_t *node)
 {
-    txml_node_t *node;
-    int cnt = 0;
-    if(!xml)
-        return NULL;
-    TAILQ_FOREACH(node, &xml->root_elements, siblings) {
-        if (cnt++ == index)
-            return node;
+    unsigned long stack[64];
+    unsigned long *path = stack;
+    unsigned long depth = 0, i;
+    txml_node_t *p;
+    char index[32];
+
+    if (!rec->journal)
+        return;
+    if (node->type == TXML_NODETYPE_TEXT)
+        rec->dirty = 1;
+    for (p = node; p; p = p->parent)
+        depth++;
+    if (depth > sizeof(stack) / sizeof(stack[0]) &&
+        !(path = (unsigned long *)malloc(depth * sizeof(unsigned long))))
+    {
+        rec->buf.err = 1;
+        path = stack;
+        depth = 0;
     }
-    return NULL;
+    TXML_JOURNAL_LOCK(rec->journal);
+    for (p = node, i = depth; p; p = p->parent)
+        path[--i] = txml_journal_position(rec->journal, p);
+    if (rec->destroys) // before any node is freed, its address could be reused
+        txml_journal_forget(rec->journal, NULL);
+    TXML_JOURNAL_UNLOCK(rec->journal);
+    for (i = 0; i < depth; i++)
+        txml_buffer_append(&rec->buf, index, sprintf(index, i ? "/%lu" : " %lu", path[i]));
+    if (path != stack)
+        free(path);
 }
 
-txml_err_t
-txml_subst_branch(txml_t *xml, unsigned long index, txml_node_t *new_branch)
+static void
+txml_record_number(txml_record_t *rec, unsigned long number)
 {
-    txml_node_t *branch, *tmp;
-    int cnt = 0;
-    TAILQ_FOREACH_SAFE(branch, &xml->root_elements, siblings, tmp) {
-        if (cnt++ == index) {
-            TAILQ_INSERT_BEFORE(branch, new_branch, siblings);
-            TAILQ_REMOVE(&xml->root_elements, branch, siblings);
-            return TXML_NOERR;
-        }
-    }
-    return TXML_LINKLIST_ERR;
+    char field[32];
+    if (rec->journal)
+        txml_buffer_append(&rec->buf, field, sprintf(field, " %lu", number));
 }
 
-txml_namespace_t *
-txml_namespace_create(char *ns_name, char *ns_uri) {
-    txml_namespace_t *new_ns;
-    new_ns = (txml_namespace_t *)calloc(1, sizeof(txml_namespace_t));
-    if (ns_name)
-        new_ns->name = strdup(ns_name);
-    new_ns->uri = strdup(ns_uri);
-    return new_ns;
+static void
+txml_record_data(txml_record_t *rec, char *data, size_t len)
+{
+    char field[32];
+    txml_buffer_append(&rec->buf, field, sprintf(field, " %lu:", (unsigned long)len));
+    txml_buffer_append(&rec->buf, data, len);
 }
 
-void
-txml_namespace_destroy(txml_namespace_t *ns)
+static void
+txml_record_string(txml_record_t *rec, char *string)
 {
-    if (ns) {
-        if (ns->name)
-            free(ns->name);
-        if (ns->uri)
-            free(ns->uri);
-        free(ns);
-    }
+    if (rec->journal)
+        txml_record_data(rec, string ? string : "", string ? strlen(string) : 0);
 }
 
-txml_namespace_t *
-txml_node_add_namespace(txml_node_t *node, char *ns_name, char *ns_uri) {
-    txml_namespace_t *new_ns = NULL;
-    if (!node || !ns_uri)
-        return NULL;
+static void
+txml_record_branch(txml_record_t *rec, txml_t *xml, txml_node_t *node)
+{
+    txml_buffer_t buf = TXML_BUFFER_INIT;
+
+    if (!rec->journal)
+        return;
+    if (node->type == TXML_NODETYPE_TEXT)
+        rec->dirty = 1;
+    txml_dump_branch_to_buffer(xml, &buf, node, 0);
+    if (buf.err)
+        rec->buf.err = 1;
+    else
+        txml_record_data(rec, buf.data, buf.len);
+    free(buf.data);
+}
 
-    if ((new_ns = txml_namespace_create(ns_name, ns_uri)))
-        TAILQ_INSERT_TAIL(&node->namespaces, new_ns, list);
-    return new_ns;
+// after a node has been added at the end of a parent (or of the root nodes)
+static void
+txml_record_added(txml_record_t *rec, txml_node_t *parent, txml_node_t *node)
+{
+    if (!rec->journal)
+        return;
+    TXML_JOURNAL_LOCK(rec->journal);
+    txml_journal_appended(rec->journal, parent ? (void *)&parent->children
+                                               : (void *)&rec->journal->xml->root_elements, node);
+    TXML_JOURNAL_UNLOCK(rec->journal);
 }
 
-txml_namespace_t *
-txml_node_get_namespace_byname(txml_node_t *node, char *ns_name) {
-    txml_namespace_set_t *item;
-    // TODO - check if node->known_namespaces needs to be updated
-    TAILQ_FOREACH(item, &node->known_namespaces, next) {
-        if (item->ns->name && strcmp(item->ns->name, ns_name) == 0)
-            return item->ns;
+// write out a record if the mutation succeeded
+static void
+txml_record_end(txml_record_t *rec, txml_err_t err)
+{
+    txml_journal_t *journal = rec->journal;
+
+    if (!journal)
+        return;
+    if (err == TXML_NOERR) {
+        txml_buffer_append(&rec->buf, "\n", 1);
+        TXML_JOURNAL_LOCK(journal);
+        if (rec->dirty || rec->buf.err)
+            journal->dirty = 1;
+        else
+            txml_journal_append(journal, rec->buf.data, rec->buf.len);
+        if (journal->dirty || (journal->threshold && journal->size >= journal->threshold))
+            txml_journal_schedule(journal);
+        TXML_JOURNAL_UNLOCK(journal);
     }
-    return NULL;
+    free(rec->buf.data);
+    rec->journal = NULL;
 }
 
-txml_namespace_t *
-txml_node_get_namespace_byuri(txml_node_t *node, char *ns_uri) {
-    txml_namespace_set_t *item;
-    // TODO - check if node->known_namespaces needs to be updated
-    TAILQ_FOREACH(item, &node->known_namespaces, next) {
-        if (strcmp(item->ns->uri, ns_uri) == 0)
-            return item->ns;
+// before a node is added to a parent: moves within a document are recorded
+// as such, nodes leaving a document as removals
+static void
+txml_record_move(txml_record_t *rec, txml_t *from, txml_t *to, txml_node_t *parent, txml_node_t *child)
+{
+    if (!child)
+        return;
+    if (from == to) {
+        if (txml_record_begin(rec, from, 'M')) {
+            txml_record_node(rec, child);
+            txml_record_node(rec, parent);
+            TXML_JOURNAL_LOCK(rec->journal);
+            txml_journal_forget(rec->journal, TXML_JOURNAL_LIST(from, child));
+            txml_journal_forget(rec->journal, &parent->children);
+            TXML_JOURNAL_UNLOCK(rec->journal);
+        }
+    } else if (txml_record_begin(rec, from, 'D')) {
+        txml_record_node(rec, child);
     }
-    return NULL;
 }
 
-txml_namespace_t *
-txml_node_get_namespace(txml_node_t *node) {
-    txml_node_t *p = node->parent;
-    if (node->ns) // my namespace
-        return node->ns;
-    if (node->hns) // hinerited namespace
-        return node->hns;
-    // search for a default naspace defined in our hierarchy
-    // this should happen only if a node has been moved across 
-    // multiple documents and it's hinerited namespace has been lost
-    while (p) { 
-        if (p->cns)
-            return p->cns;
-        p = p->parent;
+// after a node coming from outside a document has been added to a parent
+static void
+txml_record_insert(txml_record_t *rec, txml_t *from, txml_t *to, txml_node_t *parent,
+                   txml_node_t *child, txml_err_t err)
+{
+    if (err != TXML_NOERR || from == to ||
+        !txml_record_begin(rec, to, child->type == TXML_NODETYPE_SIMPLE ? 'C' : 'T'))
+    {
+        return;
     }
-    return NULL;
+    txml_record_added(rec, parent, child);
+    txml_record_node(rec, parent);
+    if (child->type == TXML_NODETYPE_SIMPLE) {
+        txml_record_branch(rec, to, child);
+    } else {
+        txml_record_number(rec, child->type);
+        txml_record_string(rec, child->value);
+    }
+    txml_record_end(rec, TXML_NOERR);
 }
 
-unsigned long
-txml_node_count_namespaces(txml_node_t *node)
+// the next field of a record ( 'p'osition, 'n'umber or 's'tring ).
+// Returns 1 if found, 0 if the log ends before the field does, -1 if malformed
+static int
+txml_journal_field(char **p, char *end, char kind, char **data, size_t *len)
 {
-    txml_namespace_t *ns;
-    int cnt = 0;
-    TAILQ_FOREACH(ns, &node->namespaces, list) 
-        cnt++;
-    return cnt;
+    char *s = *p;
+    size_t n = 0;
+
+    if (s == end)
+        return 0;
+    if (*s++ != ' ')
+        return -1;
+    *data = s;
+    if (kind == 's') {
+        while (s < end && *s >= '0' && *s <= '9') {
+            if (n > (size_t)(end - s))
+                return 0; // longer than what is left, it's being written
+            n = n * 10 + (*s++ - '0');
+        }
+        if (s == end)
+            return 0;
+        if (*s != ':' || s == *data)
+            return -1;
+        if (n >= (size_t)(end - s))
+            return 0;
+        *data = s + 1;
+        *len = n;
+        *p = s + 1 + n;
+        return 1;
+    }
+    while (s < end && ((*s >= '0' && *s <= '9') || (kind == 'p' && *s == '/')))
+        s++;
+    if (s == end)
+        return 0;
+    if (s == *data)
+        return -1;
+    *len = s - *data;
+    *p = s;
+    return 1;
 }
 
-unsigned long
-txml_node_get_namespaces(txml_node_t *node, txml_namespace_t **output_list, unsigned long list_size)
+// the node at a position, NULL if there is none
+static txml_node_t *
+txml_journal_resolve(txml_journal_t *journal, char *position)
 {
-    txml_namespace_t *ns;
-    int cnt = 0;
-    TAILQ_FOREACH(ns, &node->namespaces, list) {
-        output_list[cnt++] = ns;
-        cnt++;
-        if (cnt >= list_size)
+    txml_positions_t *positions;
+    txml_node_t *node = NULL;
+    void *list;
+    unsigned long index;
+    char *end;
+
+    for (;;) {
+        if (*position < '0' || *position > '9')
+            return NULL;
+        index = strtoul(position, &end, 10);
+        if (node) {
+            TXML_NODE_EXPAND(node);
+            list = &node->children;
+            node = TAILQ_FIRST(&node->children);
+        } else {
+            list = &journal->xml->root_elements;
+            node = TAILQ_FIRST(&journal->xml->root_elements);
+        }
+        if (index >= TXML_JOURNAL_SHORT_LIST && (positions = txml_journal_positions(journal, list, node))) {
+            node = index < positions->count ? positions->nodes[index] : NULL;
+        } else {
+            for (; node; node = TAILQ_NEXT(node, siblings)) {
+                if (node->type != TXML_NODETYPE_TEXT && index-- == 0)
+                    break;
+            }
+        }
+        if (!node || !*end)
+            return node;
+        if (*end != '/')
+            return NULL;
+        position = end + 1;
+    }
+}
+
+// parse exactly one serialized branch under a node (or as a new root node)
+static txml_err_t
+txml_journal_parse(txml_journal_t *journal, txml_node_t *parent, char *branch)
+{
+    txml_t *xml = journal->xml;
+    txml_node_t *last, *node;
+    txml_err_t err;
+
+    if (parent)
+        TXML_NODE_EXPAND(parent);
+    last = parent ? TAILQ_LAST(&parent->children, nodelist_head) : TAILQ_LAST(&xml->root_elements, nodelist_head);
+    xml->cnode = parent;
+    err = txml_parse_content(xml, branch, NULL, 0, NULL);
+    xml->cnode = NULL;
+    node = parent ? TAILQ_LAST(&parent->children, nodelist_head) : TAILQ_LAST(&xml->root_elements, nodelist_head);
+    if (err == TXML_NOERR && (node == last || TAILQ_PREV(node, nodelist_head, siblings) != last))
+        err = TXML_GENERIC_ERR;
+    if (err == TXML_NOERR)
+        txml_journal_appended(journal, TXML_JOURNAL_LIST(xml, node), node);
+    return err;
+}
+
+// replace a root branch with a serialized one
+static txml_err_t
+txml_journal_subst(txml_t *xml, txml_node_t *branch, char *data)
+{
+    txml_t *tmp = txml_context_create();
+    txml_node_t *node, *p;
+    unsigned long index = 0;
+    txml_err_t err;
+
+    if (!tmp)
+        return TXML_MEMORY_ERR;
+    tmp->ignore_white_spaces = xml->ignore_white_spaces;
+    tmp->ignore_blanks = xml->ignore_blanks;
+    err = txml_parse_buffer_unlocked(tmp, data);
+    node = TAILQ_FIRST(&tmp->root_elements);
+    if (err == TXML_NOERR && node && !TAILQ_NEXT(node, siblings)) {
+        txml_node_unlink(node);
+        for (p = branch; (p = TAILQ_PREV(p, nodelist_head, siblings)); )
+            index++;
+        err = txml_subst_branch_unlocked(xml, index, node);
+        txml_node_destroy_unlocked(err == TXML_NOERR ? branch : node);
+    } else if (err == TXML_NOERR) {
+        err = TXML_GENERIC_ERR;
+    }
+    txml_context_destroy(tmp);
+    return err;
+}
+
+// apply the record starting at 'offset' in the log, and move past it.
+// Returns 1 if done, 0 if the log ends before the record does, -1 if it can't be applied
+static int
+txml_journal_apply(txml_journal_t *journal, char *log, size_t *offset, size_t size)
+{
+    txml_t *xml = journal->xml;
+    char *fields[3];
+    size_t lens[3];
+    char *signature;
+    char *op = log + *offset;
+    char *end = log + size;
+    char *s = op + 1;
+    txml_node_t *node = NULL, *target = NULL, *child;
+    unsigned long type;
+    txml_err_t err = TXML_GENERIC_ERR;
+    int i, rc;
+
+    switch (*op) {
+        case 'V': case 'C': case 'S':
+            signature = "ps";
+            break;
+        case 'A':
+            signature = "pss";
+            break;
+        case 'R':
+            signature = "pn";
+            break;
+        case 'X': case 'D':
+            signature = "p";
             break;
+        case 'T':
+            signature = "pns";
+            break;
+        case 'M':
+            signature = "pp";
+            break;
+        case 'N':
+            signature = "s";
+            break;
+        default:
+            return -1;
     }
-    return cnt;
-   
+    for (i = 0; signature[i]; i++) {
+        rc = txml_journal_field(&s, end, signature[i], &fields[i], &lens[i]);
+        if (rc != 1)
+            return rc;
+    }
+    if (s == end)
+        return 0;
+    if (*s != '\n')
+        return -1;
+    // the separators are not needed anymore
+    for (i = 0; signature[i]; i++)
+        fields[i][lens[i]] = 0;
+
+    if (signature[0] == 'p' && !(node = txml_journal_resolve(journal, fields[0])))
+        return -1;
+    if (signature[0] && signature[1] == 'p' && !(target = txml_journal_resolve(journal, fields[1])))
+        return -1;
+    switch (*op) {
+        case 'V':
+            err = txml_node_set_value_unlocked(NULL, node, fields[1]);
+            break;
+        case 'A':
+            err = txml_node_add_attribute_unlocked(NULL, node, fields[1], fields[2]);
+            break;
+        case 'R':
+            err = txml_node_remove_attribute_unlocked(node, strtoul(fields[1], NULL, 10));
+            break;
+        case 'X':
+            txml_node_clear_attributes_unlocked(node);
+            err = TXML_NOERR;
+            break;
+        case 'D':
+            txml_journal_forget(journal, NULL);
+            txml_node_unlink(node);
+            txml_node_destroy_unlocked(node);
+            err = TXML_NOERR;
+            break;
+        case 'C':
+            err = txml_journal_parse(journal, node, fields[1]);
+            break;
+        case 'T':
+            type = strtoul(fields[1], NULL, 10);
+            if (type < TXML_NODETYPE_COMMENT || type > TXML_NODETYPE_TEXT)
+                return -1;
+            TXML_NODE_EXPAND(node);
+            child = txml_node_create_special(NULL, type, fields[2], NULL);
+            err = child ? txml_node_add_child_unlocked(NULL, node, child) : TXML_MEMORY_ERR;
+            if (err == TXML_NOERR)
+                txml_journal_appended(journal, &node->children, child);
+            break;
+        case 'M':
+            TXML_NODE_EXPAND(target);
+            txml_journal_forget(journal, TXML_JOURNAL_LIST(xml, node));
+            txml_journal_forget(journal, &target->children);
+            err = txml_node_add_child_unlocked(NULL, target, node);
+            break;
+        case 'N':
+            err = txml_journal_parse(journal, NULL, fields[0]);
+            break;
+        case 'S':
+            txml_journal_forget(journal, NULL);
+            err = txml_journal_subst(xml, node, fields[1]);
+            break;
+    }
+    if (err != TXML_NOERR)
+        return -1;
+    *offset = s + 1 - log;
+    return 1;
 }
 
-char *
-txml_namespace_get_name(txml_namespace_t *ns)
+// apply the log to the document just loaded from the base file with the given hash,
+// then get ready to append new records
+static txml_err_t
+txml_journal_replay(txml_journal_t *journal, unsigned long long hash)
 {
-    if (!ns)
-        return NULL;
-    return ns->name;
+    txml_t *xml = journal->xml;
+    struct stat filestat;
+    char header[32];
+    char *log = NULL;
+    size_t header_len, offset;
+    off_t valid;
+    FILE *in;
+    int rc = 1;
+
+    if ((in = fopen(journal->log_path, "r"))) {
+        if (fstat(fileno(in), &filestat) != 0 || !(log = (char *)malloc(filestat.st_size + 1)) ||
+            fread(log, 1, filestat.st_size, in) != filestat.st_size)
+        {
+            fprintf(stderr, "Can't read %s\n", journal->log_path);
+            free(log);
+            fclose(in);
+            return TXML_GENERIC_ERR;
+        }
+        fclose(in);
+    }
+
+    // a log written for a different base file is stale
+    header_len = sprintf(header, "J %016llx\n", hash);
+    if (!log || filestat.st_size < header_len || memcmp(log, header, header_len) != 0) {
+        free(log);
+        TXML_JOURNAL_LOCK(journal);
+        rc = txml_journal_create(journal, hash);
+        TXML_JOURNAL_UNLOCK(journal);
+        return rc;
+    }
+
+    offset = header_len;
+    while (offset < filestat.st_size && (rc = txml_journal_apply(journal, log, &offset, filestat.st_size)) == 1)
+        ;
+    valid = offset;
+    free(log);
+    if (!xml->pool.max && !xml->pending)
+        txml_scratch_release(&xml->scratch);
+
+    if (rc < 0) {
+        // the document is what the records applied so far made of it, it becomes the new base
+        fprintf(stderr, "Can't apply the record at offset %lld of %s, dropping it and the following ones\n",
+                (long long)valid, journal->log_path);
+        return txml_journal_compact_unlocked(journal);
+    }
+    // an incomplete record at the end is one being written when the process died
+    journal->fd = open(journal->log_path, O_WRONLY);
+    if (journal->fd < 0 || (valid < filestat.st_size && ftruncate(journal->fd, valid) != 0) ||
+        lseek(journal->fd, valid, SEEK_SET) != valid)
+    {
+        fprintf(stderr, "Can't open %s\n", journal->log_path);
+        return TXML_GENERIC_ERR;
+    }
+    journal->size = valid;
+    return TXML_NOERR;
 }
 
-char *
-txml_namespace_get_uri(txml_namespace_t *ns)
+txml_err_t
+txml_journal_open(txml_t *xml, char *path, unsigned long threshold)
 {
-    if (!ns)
-        return NULL;
-    return ns->uri;
+    txml_journal_t *journal;
+    txml_filter_t *filter;
+    struct stat filestat;
+    unsigned long long hash;
+    char *buffer = NULL;
+    txml_err_t err;
+
+    if (!xml || !path || xml->journal)
+        return TXML_BADARGS;
+    journal = (txml_journal_t *)calloc(1, sizeof(txml_journal_t));
+    if (!journal)
+        return TXML_MEMORY_ERR;
+    journal->xml = xml;
+    journal->fd = -1;
+    journal->threshold = threshold;
+#ifdef THREAD_SAFE
+    pthread_mutex_init(&journal->lock, NULL);
+#endif
+    journal->path = strdup(path);
+    journal->log_path = (char *)malloc(strlen(path) + 9);
+    if (!journal->path || !journal->log_path) {
+        txml_journal_free(journal);
+        return TXML_MEMORY_ERR;
+    }
+    sprintf(journal->log_path, "%s.journal", path);
+
+    // a missing (or empty) base file holds an empty document
+    if (stat(path, &filestat) == 0 && filestat.st_size > 0) {
+        err = txml_file_read(path, &filestat, &buffer, &hash);
+        if (err != TXML_NOERR) {
+            txml_journal_free(journal);
+            return err;
+        }
+    } else {
+        hash = txml_hash_bytes("", 0);
+    }
+
+    TXML_WRLOCK(xml);
+    // the records refer to the whole document
+    filter = xml->filter;
+    xml->filter = NULL;
+    if (buffer) {
+        err = txml_parse_buffer_unlocked(xml, buffer);
+    } else {
+        txml_context_reset_unlocked(xml);
+        err = TXML_NOERR;
+    }
+    if (err == TXML_NOERR)
+        err = txml_journal_replay(journal, hash);
+    xml->filter = filter;
+    if (err == TXML_NOERR) {
+        xml->journal = journal;
+        __atomic_add_fetch(&txml_journals, 1, __ATOMIC_RELAXED);
+    }
+    TXML_WRUNLOCK(xml);
+    free(buffer);
+    if (err != TXML_NOERR)
+        txml_journal_free(journal);
+    return err;
 }
 
-int
-txml_node_is_linked(txml_node_t *node)
+txml_err_t
+txml_journal_compact(txml_t *xml)
+{
+    txml_err_t err = TXML_BADARGS;
+    TXML_DOC_RDLOCK(xml);
+    if (xml->journal)
+        err = txml_journal_compact_unlocked(xml->journal);
+    TXML_DOC_RDUNLOCK(xml);
+    return err;
+}
+
+void
+txml_journal_close(txml_t *xml)
 {
-    return (node->context != NULL || node->parent != NULL);
+    txml_journal_t *journal;
+
+    if (!xml || !xml->journal)
+        return;
+    TXML_WRLOCK(xml);
+    journal = xml->journal;
+    if (journal->dirty) // save what the log couldn't hold
+        txml_journal_compact_unlocked(journal);
+    xml->journal = NULL;
+    TXML_WRUNLOCK(xml);
+#ifdef THREAD_SAFE
+    if (journal->thread_started)
+        pthread_join(journal->thread, NULL);
+#endif
+    __atomic_sub_fetch(&txml_journals, 1, __ATOMIC_RELAXED);
+    txml_journal_free(journal);
 }
 
 int
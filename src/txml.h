@@ -20,13 +20,55 @@ extern "C" {
 #define TXML_LINKLIST_ERR -6
 #define TXML_BAD_CHARS -7
 #define TXML_MROOT_ERR -8
+#define TXML_BAD_VALUE -9
 
+#define TXML_NODETYPE_SIMPLE 0
+#define TXML_NODETYPE_COMMENT 1
+#define TXML_NODETYPE_CDATA 2
+#define TXML_NODETYPE_TEXT 3
+
+#define TXML_ITER_PREORDER 0
+#define TXML_ITER_POSTORDER 1
+
+#define TXML_DIFF_INSERTED 0
+#define TXML_DIFF_REMOVED 1
+#define TXML_DIFF_CHANGED 2
+
+#define TXML_SYNC_NONE 0
+#define TXML_SYNC_DATA 1
+#define TXML_SYNC_FULL 2
+
+#define TXML_TRACK_OFFSETS 0x01
+#define TXML_TRACK_LINES 0x02
+
+#include <stddef.h>
+#include <stdint.h>
 #include "bsd_queue.h"
 
 typedef struct __txml_s txml_t;
 typedef struct __txml_node_s txml_node_t;
 typedef struct __txml_attribute_s txml_attribute_t;
 typedef struct __txml_namespace_s txml_namespace_t;
+typedef struct __txml_snapshot_s txml_snapshot_t;
+typedef struct __txml_snapshot_node_s txml_snapshot_node_t;
+typedef struct __txml_watch_s txml_watch_t;
+typedef struct __txml_iter_s txml_iter_t;
+typedef struct __txml_sidecar_s txml_sidecar_t;
+typedef struct __txml_paths_s txml_paths_t;
+
+/*
+ * Thread safety:
+ *   When built with -DTHREAD_SAFE (the default in the provided Makefile)
+ *   each context carries a read-mostly reader/writer lock.
+ *   All the accessors (both the ones taking a txml_t and the ones taking
+ *   a node or an attribute) take it in read mode, all the mutators take it
+ *   in write mode. Accessors and mutators on detached nodes (not linked to
+ *   any context) don't lock anything, they are owned by the caller.
+ *   Pointers returned by the accessors stay valid only until the
+ *   referenced node/attribute/value is released by a mutator.
+ *   Writers working on different branches can run concurrently if
+ *   fine grained locking is enabled, see txml_set_lock_depth().
+ */
 
 /***
     @brief Create a new xml context
@@ -41,6 +83,102 @@ txml_t *txml_context_create();
 */
 void txml_context_reset(txml_t *xml);
 
+/***
+    @brief allow (or forbid) documents with more than one root element
+    @arg pointer to a valid xml context
+    @arg non zero to accept multiple root elements, 0 (the default) to fail
+         parsing (and txml_add_root_node()) with TXML_MROOT_ERR
+*/
+void txml_set_allow_multiple_root_nodes(txml_t *xml, int allow);
+
+/***
+    @brief set the granularity of the locks used by the node mutators
+    @arg pointer to a valid xml context
+    @arg 0 (the default) to lock the whole document for each change,
+         1 to give each root branch its own lock, 2 to give a lock to each
+         child of the root nodes and so on.
+    @note only changes confined to a single branch (values and attributes
+          of nodes at the branches level or below, adding/removing children
+          of those nodes, moving nodes across branches) run concurrently;
+          changes above the branches level, txml_dump(), txml_dump_branch()
+          and txml_save() still lock the whole document.
+          Fine grained locking is not used once snapshots are enabled,
+          since each change must then publish a consistent version of the whole document,
+          nor while the context has attribute indexes (see txml_index_create()).
+          Has no effect unless the library has been built with -DTHREAD_SAFE
+*/
+void txml_set_lock_depth(txml_t *xml, int depth);
+
+/***
+    @brief keep the memory released by txml_context_reset() for the next documents
+    @arg pointer to a valid xml context
+    @arg how many nodes, attributes, namespaces and strings (of each size class)
+         can be kept aside, 0 (the default) releases everything to the system
+    @note txml_parse_buffer() and txml_parse_file() reset the context before
+          parsing, so a context reused to parse a stream of similarly shaped
+          documents reaches a steady state where parsing doesn't allocate memory
+          at all. The parser scratch space is kept as well.
+          Lowering the limit releases the exceeding memory immediately
+*/
+void txml_set_retention(txml_t *xml, unsigned long max_items);
+
+/***
+    @brief parse only the parts of the documents matching some path patterns
+    @arg pointer to a valid xml context
+    @arg NULL-terminated list of patterns to include, NULL to include everything
+    @arg NULL-terminated list of patterns to exclude, NULL to exclude nothing
+    @return TXML_NOERR on success, TXML_BADARGS if a pattern is not valid
+    @note patterns are absolute paths starting from the root element
+          (e.g. "/catalog/meta"), each step being an element name (as it
+          appears in the document, namespace prefix included) or "*" to match
+          any element. The last step can select an attribute ("/catalog/items/item/@id").
+          An included element is parsed with all its attributes, value and
+          descendants (but for the excluded ones). The elements leading to it are
+          kept as well, but only with their name, the attributes selected by
+          attribute patterns and the namespace declarations (and only if anything
+          has been found below them, but for the root elements).
+          Anything else is skipped at tokenizer speed, without allocating memory.
+          Excluded elements and attributes are skipped even if included.
+          The filter applies to all the following txml_parse_buffer(),
+          txml_parse_file() (and parallel versions) calls,
+          passing NULL for both lists removes it
+*/
+txml_err_t txml_set_parse_filter(txml_t *xml, char **include, char **exclude);
+
+/***
+    @brief build the elements of the documents only when first accessed
+    @arg pointer to a valid xml context
+    @arg 1 to enable lazy parsing, 0 (the default) to parse the whole documents upfront
+    @note txml_parse_buffer() and txml_parse_file() build only the root elements,
+          the content of any other element is just skipped at tokenizer speed.
+          The children of an element are built as soon as they are reached through
+          txml_node_get_child(), txml_node_get_child_byname(), txml_get_node(),
+          txml_node_count_children(), an iterator, a dump or a clone.
+          Expanding an element is safe with concurrent readers.
+          The context keeps a copy of the document until the next reset.
+          Errors in the content of an element are not reported: the element keeps
+          the children built up to the error. Processing instructions below the
+          root elements don't update the document head.
+          Lazy parsing is ignored if a parse filter is set
+          (and by the parallel parser, which parses the whole document)
+*/
+void txml_set_lazy_parsing(txml_t *xml, int enable);
+
+/***
+    @brief record where the elements, attributes and values are in the parsed documents
+    @arg pointer to a valid xml context
+    @arg 0 (the default) to record nothing, TXML_TRACK_OFFSETS to record the byte offsets,
+         TXML_TRACK_OFFSETS|TXML_TRACK_LINES to be able to turn them into lines and columns
+    @note applies to the following txml_parse_buffer() and txml_parse_file() calls
+          (and to the elements expanded by lazy parsing). Only the nodes built by
+          the parser know their offsets, nothing is recorded for the others nor
+          updated when a node is modified. Documents parsed in parallel or
+          reloaded are parsed sequentially as a whole while tracking.
+          Untracked documents don't pay anything for it, tracked nodes take
+          some more memory (and TXML_TRACK_LINES a table of the line starts)
+*/
+void txml_set_track_positions(txml_t *xml, int flags);
+
 /***
     @brief release all resources associated to an xml context
     @arg pointer to a valid xml context
@@ -61,6 +199,72 @@ txml_err_t txml_parse_buffer(txml_t *xml, char *buf);
 */
 txml_err_t txml_parse_file(txml_t *xml, char *path);
 
+/***
+    @brief parse a file again, only if it changed since the last call
+    @arg pointer to a valid xml context
+    @arg a null terminating string representing the path to the xml file
+    @return an txml_err_t error status (XML_NOERR if the file was parsed successfully or didn't change)
+    @note the first call parses the file as txml_parse_file() does. The next ones
+          return immediately if the size and the modification time of the file are
+          the same, and leave the document as it is if the content is the same.
+          Otherwise, if the file still has a single root element and only its
+          children changed, the children whose source is the same are kept
+          (pointers to them and to their descendants stay valid) and only the
+          others are parsed again. The whole file is parsed again if anything
+          else changed, if the root element or its children have been modified
+          in the meantime, or for lazy and filtered parsing.
+          Any other parse or reset of the context forgets about the file
+*/
+txml_err_t txml_reload_file(txml_t *xml, char *path);
+
+/***
+    @brief parse a single (big) document using many threads
+    @arg pointer to a valid xml context
+    @arg the null terminated string buffer containing the xml profile
+    @arg the number of threads to use (including the calling one)
+    @return an txml_err_t error status (XML_NOERR if buffer was parsed successfully)
+    @note a quick pre-scan of the buffer finds the boundaries of the children
+          of the root element, the content of the root element is split there
+          in slices of at least 64KB and the slices are parsed concurrently.
+          Documents with many root elements (see txml_set_allow_multiple_root_nodes())
+          are split between the root elements instead.
+          The result is the same as txml_parse_buffer(), which is used anyway
+          for small documents, documents including DTD declarations and for
+          reporting errors. Each slice is copied while parsing, so up to another
+          copy of the buffer is allocated temporarily.
+          Without -DTHREAD_SAFE this is the same as txml_parse_buffer()
+*/
+txml_err_t txml_parse_buffer_parallel(txml_t *xml, char *buf, int nthreads);
+
+/***
+    @brief same as txml_parse_buffer_parallel(), but parsing a file (see txml_parse_file())
+*/
+txml_err_t txml_parse_file_parallel(txml_t *xml, char *path, int nthreads);
+
+/***
+    @brief parse many independent documents concurrently
+    @arg the null terminated string buffers to parse
+    @arg the number of buffers
+    @arg one context per buffer, each one must be a different context.
+         NULL entries are filled with new contexts (to be released by the caller
+         using txml_context_destroy(), even if parsing failed)
+    @arg if not NULL, the txml_err_t status of each document is stored here
+    @arg the number of threads to use (including the calling one)
+    @return XML_NOERR if all the documents have been parsed successfully,
+            XML_PARSER_GENERIC_ERR if any of them failed (see 'results')
+    @note the documents are handed out largest first, each thread picks
+          the next one as soon as it's done with the previous one.
+          Reusing the same contexts across batches with txml_set_retention()
+          enabled keeps the workers from contending on the system allocator.
+          Without -DTHREAD_SAFE the documents are parsed by the calling thread
+*/
+txml_err_t txml_parse_batch(char **buffers, unsigned long count, txml_t **contexts, txml_err_t *results, int nthreads);
+
+/***
+    @brief same as txml_parse_batch(), but parsing files (see txml_parse_file())
+*/
+txml_err_t txml_parse_file_batch(char **paths, unsigned long count, txml_t **contexts, txml_err_t *results, int nthreads);
+
 /***
     @brief dump the entire xml configuration tree that reflects the status of internal structures
     @arg pointer to a valid xml context
@@ -99,6 +303,40 @@ txml_err_t txml_add_root_node(txml_t *xml, txml_node_t *node);
 
 txml_node_t *txml_node_create(char *name, char *val, txml_node_t *parent);
 
+/***
+    @brief allocates a comment node (<!-- ... -->).
+    @arg the text of the comment
+    @arg parent of the new node if present, NULL otherwise
+    @return the newly created node
+    @note comment, cdata and text nodes carry no name of their own,
+          txml_node_get_name() returns "#comment", "#cdata-section" or "#text" for them
+ */
+txml_node_t *txml_node_create_comment(char *text, txml_node_t *parent);
+
+/***
+    @brief allocates a CDATA node (<![CDATA[ ... ]]>).
+    @arg the raw content of the CDATA section
+    @arg parent of the new node if present, NULL otherwise
+    @return the newly created node
+ */
+txml_node_t *txml_node_create_cdata(char *data, txml_node_t *parent);
+
+/***
+    @brief allocates a text node (dumped escaped, without any enclosing tag).
+    @arg the text
+    @arg parent of the new node if present, NULL otherwise
+    @return the newly created node
+ */
+txml_node_t *txml_node_create_text(char *text, txml_node_t *parent);
+
+/***
+    @brief get the kind of a node
+    @arg pointer to a valid txml_node_t structure
+    @return one of TXML_NODETYPE_SIMPLE, TXML_NODETYPE_COMMENT,
+            TXML_NODETYPE_CDATA or TXML_NODETYPE_TEXT
+ */
+int txml_node_get_type(txml_node_t *node);
+
 /*** 
     @brief associate a value to txml_node_t *node. XML_NOERR is returned if no error occurs 
     @arg the node we want to modify
@@ -114,6 +352,39 @@ txml_err_t txml_node_set_value(txml_node_t *node, char *val);
  */
 char *txml_node_get_value(txml_node_t *node);
 
+/***
+    @brief get the value of a node as a 64 bits integer
+    @arg the txml_node_t containing the value we want to access
+    @arg where to store the integer
+    @return TXML_NOERR on success, TXML_BAD_VALUE if the value is not
+            a decimal integer (or doesn't fit), TXML_BADARGS if node is NULL
+    @note the leading and trailing whitespace is ignored. The value decoded
+          is cached in the node until its value changes, so that repeated reads
+          of the same node (as the same type) don't parse it again
+ */
+txml_err_t txml_node_get_int64(txml_node_t *node, int64_t *value);
+
+/***
+    @brief get the value of a node as a double
+    @arg the txml_node_t containing the value we want to access
+    @arg where to store the number
+    @return TXML_NOERR on success, TXML_BAD_VALUE if the value is not a number
+            ("1.5", "-2E3", ".5", "INF", "-INF", "NaN" ...), TXML_BADARGS if node is NULL
+    @note the decimal point is always '.', whatever the locale.
+          Cached as by txml_node_get_int64()
+ */
+txml_err_t txml_node_get_double(txml_node_t *node, double *value);
+
+/***
+    @brief get the value of a node as a boolean
+    @arg the txml_node_t containing the value we want to access
+    @arg where to store the boolean (1 or 0)
+    @return TXML_NOERR on success, TXML_BAD_VALUE if the value is none of
+            "true", "false", "1" and "0", TXML_BADARGS if node is NULL
+    @note cached as by txml_node_get_int64()
+ */
+txml_err_t txml_node_get_bool(txml_node_t *node, int *value);
+
 char *txml_node_get_name(txml_node_t *node);
 
 /****
@@ -130,6 +401,39 @@ void txml_node_destroy(txml_node_t *node);
 */
 txml_err_t txml_node_add_child(txml_node_t *parent, txml_node_t *child);
 
+/***
+    @brief make a deep copy of a node and all its descendants
+    @arg the node to copy
+    @arg the context the copy is going to be used with (can be NULL).
+         If provided, the names of the copied nodes are shared with all the other
+         copies made for the same context
+    @return the (detached) copy, to be linked using txml_node_add_child() or
+            txml_add_root_node(), NULL in case of errors
+    @note namespaces defined outside of the copied branch are declared again
+          on the nodes using them (and the default namespace in scope on the
+          copy itself), so the copy is self-contained
+*/
+txml_node_t *txml_node_clone(txml_node_t *node, txml_t *target_ctx);
+
+/***
+    @brief start a batch of changes on a document
+    @arg pointer to a valid xml context
+    @note the document stays locked (in write mode) until txml_batch_end() is called
+          by the same thread, batches can be nested.
+          Within a batch txml_node_add_child() only relinks the nodes, the namespace
+          scopes (txml_node_get_namespace*()) of the moved nodes are updated
+          at the end of the outermost batch, with a single traversal of the document.
+          Snapshots are published once as well, at the end of the outermost batch
+*/
+void txml_batch_begin(txml_t *xml);
+
+/***
+    @brief complete a batch of changes started with txml_batch_begin()
+    @arg pointer to a valid xml context
+    @return XML_NOERR on success, XML_GENERIC_ERR if no batch was in progress
+*/
+txml_err_t txml_batch_end(txml_t *xml);
+
 /***
     @brief access next sibling of a node (if any)
     @arg pointer to a valid txml_node_t structure
@@ -144,6 +448,46 @@ txml_node_t *txml_node_next_sibling(txml_node_t *node);
 */
 txml_node_t *txml_node_prev_sibling(txml_node_t *node);
 
+/***
+    @brief create an iterator over a node and all its descendants
+    @arg the root of the branch to walk
+    @arg TXML_ITER_PREORDER (parents first) or TXML_ITER_POSTORDER (children first)
+    @return a new iterator to be released using txml_iter_destroy(),
+            NULL in case of errors
+    @note the walk doesn't recurse nor use indexed access, each step is O(1)
+          (amortized). The branch must not be modified while it's being walked
+*/
+txml_iter_t *txml_iter_create(txml_node_t *root, int order);
+
+/***
+    @brief advance an iterator
+    @arg pointer to a valid txml_iter_t
+    @return the next node in the requested order, NULL once all the nodes
+            have been returned (the root being the first one in pre-order
+            and the last one in post-order)
+*/
+txml_node_t *txml_iter_next(txml_iter_t *iter);
+
+/***
+    @brief depth of the node last returned by txml_iter_next()
+    @arg pointer to a valid txml_iter_t
+    @return the depth relative to the root of the iteration (which is at depth 0)
+*/
+unsigned int txml_iter_depth(txml_iter_t *iter);
+
+/***
+    @brief don't descend into the children of the node last returned by txml_iter_next()
+    @arg pointer to a valid txml_iter_t
+    @note meaningful only for pre-order iterators, ignored otherwise
+*/
+void txml_iter_skip(txml_iter_t *iter);
+
+/***
+    @brief release an iterator
+    @arg pointer to a valid txml_iter_t
+*/
+void txml_iter_destroy(txml_iter_t *iter);
+
 
 /***
     @brief add an attribute to txml_node_t *node 
@@ -203,6 +547,48 @@ unsigned long txml_node_count_attributes(txml_node_t *node);
  */
 txml_node_t *txml_get_node(txml_t *xml, char *path);
 
+/***
+    @brief Returns the txml_node_t at each of the specified paths
+    @arg the xml context pointer
+    @arg the paths, formatted as for txml_get_node()
+    @arg the number of paths
+    @arg where to store the nodes found (NULL for the paths not found),
+         in the same order as the paths
+    @return the number of paths found
+    @note all the paths are resolved in a single descent, each node along
+          the way being scanned only once even if shared by many paths.
+          When the same set of paths is looked up in many documents, compile it
+          once with txml_paths_compile() and use txml_paths_resolve() instead
+ */
+unsigned long txml_get_nodes(txml_t *xml, char **paths, unsigned long count, txml_node_t **nodes);
+
+/***
+    @brief compile a set of paths for txml_paths_resolve()
+    @arg the paths, formatted as for txml_get_node()
+    @arg the number of paths
+    @return the compiled paths (to be released with txml_paths_destroy()),
+            NULL on errors
+    @note the compiled paths don't refer to any document and can be
+          shared among threads
+ */
+txml_paths_t *txml_paths_compile(char **paths, unsigned long count);
+
+/***
+    @brief release paths compiled by txml_paths_compile()
+    @arg the compiled paths
+ */
+void txml_paths_destroy(txml_paths_t *paths);
+
+/***
+    @brief Returns the txml_node_t at each of the compiled paths
+    @arg the xml context pointer
+    @arg the compiled paths
+    @arg where to store the nodes found (NULL for the paths not found),
+         in the same order as the paths have been compiled
+    @return the number of paths found
+ */
+unsigned long txml_paths_resolve(txml_t *xml, txml_paths_t *paths, txml_node_t **nodes);
+
 /***
     @brief get the root node at a specific index
     @arg the xml context pointer
@@ -264,15 +650,43 @@ char *txml_attribute_get_name(txml_attribute_t *attr);
 char *txml_attribute_get_value(txml_attribute_t *attr);
 
 /***
-    @brief save the configuration stored in the xml file containing the current profile
-           the xml file name is obtained appending '.xml' to the category name . The xml file is stored 
-           in the repository directory specified during object construction.
+    @brief get the value of an attribute as a 64 bits integer, a double or a boolean
+    @arg pointer to a valid txml_attribute_t structure
+    @arg where to store the value
+    @return TXML_NOERR on success, TXML_BAD_VALUE if the value can't be
+            converted (see txml_node_get_int64(), txml_node_get_double()
+            and txml_node_get_bool()), TXML_BADARGS if attr is NULL
+    @note attribute values are not cached
+ */
+txml_err_t txml_attribute_get_int64(txml_attribute_t *attr, int64_t *value);
+txml_err_t txml_attribute_get_double(txml_attribute_t *attr, double *value);
+txml_err_t txml_attribute_get_bool(txml_attribute_t *attr, int *value);
+
+/***
+    @brief save the document to a file
     @arg pointer to a valid xml context
     @arg the path where to save the file
-    @return an txml_err_t error status (XML_NOERR if buffer was parsed successfully)
+    @return an txml_err_t error status (XML_NOERR if the file was saved successfully)
+    @note the document is streamed to a temporary file in the same directory,
+          which then replaces the file at once: readers (and crashes) find either
+          the old content or the new one. The previous version is kept
+          as path.bck (a hard link to it where possible, nothing is copied).
+          If the path is a symbolic link, the file it leads to is replaced
+          (or created, if the link is dangling), the link is left as it is.
+          Documents converted to another output encoding are dumped in memory first.
+          How the new file is flushed to the disk is set by txml_set_save_sync()
 */
 txml_err_t txml_save(txml_t *xml, char *path);
 
+/***
+    @brief set how txml_save() makes sure the saved file reached the disk
+    @arg pointer to a valid xml context
+    @arg TXML_SYNC_NONE (leave it to the system), TXML_SYNC_DATA (the default,
+         flush the content of the new file before replacing the old one) or
+         TXML_SYNC_FULL (flush its metadata too, and the directory after the rename)
+*/
+void txml_set_save_sync(txml_t *xml, int policy);
+
 /***
     @brief search for a specific namespace defined within the current document
     @arg pointer to a valid txml_node_t structure
@@ -315,6 +729,556 @@ char *txml_namespace_get_uri(txml_namespace_t *ns);
 
 int txml_node_is_linked(txml_node_t *node);
 
+/*
+ * Snapshots:
+ *   A snapshot is an immutable, refcounted view of a whole document.
+ *   Once the first snapshot has been requested, a new version is published
+ *   each time a mutator completes (or, for nested/batched changes, when the
+ *   outermost write lock is released). Only the nodes along the modified
+ *   paths are copied, the rest of the tree is shared with older versions.
+ *   Readers holding a snapshot never block, neither on writers nor on
+ *   reloads, and the snapshot stays valid (even after the context has been
+ *   destroyed) until released.
+ */
+
+/***
+    @brief acquire the most recent snapshot of a document
+    @arg pointer to a valid xml context
+    @return a reference to the current snapshot (to be released using txml_snapshot_release()),
+            NULL in case of errors
+    @note the first call builds the initial snapshot and waits for pending writers
+*/
+txml_snapshot_t *txml_snapshot(txml_t *xml);
+
+/***
+    @brief release a reference to a snapshot (the last one frees it)
+    @arg pointer to a snapshot returned by txml_snapshot()
+*/
+void txml_snapshot_release(txml_snapshot_t *snapshot);
+
+unsigned long txml_snapshot_count_branches(txml_snapshot_t *snapshot);
+
+txml_snapshot_node_t *txml_snapshot_get_branch(txml_snapshot_t *snapshot, unsigned long index);
+
+/***
+    @brief Returns the snapshot node at specified path
+    @arg pointer to a valid snapshot
+    @arg the path that references requested node (same syntax accepted by txml_get_node())
+    @return the node at specified path, NULL if not found
+ */
+txml_snapshot_node_t *txml_snapshot_get_node(txml_snapshot_t *snapshot, char *path);
+
+char *txml_snapshot_node_get_name(txml_snapshot_node_t *node);
+
+char *txml_snapshot_node_get_value(txml_snapshot_node_t *node);
+
+int txml_snapshot_node_get_type(txml_snapshot_node_t *node);
+
+unsigned long txml_snapshot_node_count_children(txml_snapshot_node_t *node);
+
+txml_snapshot_node_t *txml_snapshot_node_get_child(txml_snapshot_node_t *node, unsigned long index);
+
+txml_snapshot_node_t *txml_snapshot_node_get_child_byname(txml_snapshot_node_t *node, char *name);
+
+unsigned long txml_snapshot_node_count_attributes(txml_snapshot_node_t *node);
+
+char *txml_snapshot_node_get_attribute_name(txml_snapshot_node_t *node, unsigned long index);
+
+char *txml_snapshot_node_get_attribute_value(txml_snapshot_node_t *node, unsigned long index);
+
+/***
+    @brief get the value of the attribute with the specified name
+    @arg pointer to a valid snapshot node
+    @arg the name of the desired attribute
+    @return the attribute value if found, NULL otherwise
+*/
+char *txml_snapshot_node_get_attribute_byname(txml_snapshot_node_t *node, char *name);
+
+/*
+ * Hashing and diff:
+ *   Each node caches a hash of its whole branch (name, namespace, value,
+ *   attributes and children), computed when first needed and dropped by
+ *   any mutation along the path up to the root element, so after a few
+ *   changes only the modified paths need to be hashed again.
+ */
+
+/***
+    @brief get the content hash of a branch
+    @arg pointer to a valid txml_node_t structure
+    @return the hash of the branch starting at the node (never 0, unless the node is NULL)
+    @note branches with the same content have the same hash in any document
+*/
+unsigned long long txml_node_hash(txml_node_t *node);
+
+/***
+    @brief callback notified of each difference found by txml_diff()
+    @arg the node in the old document (NULL for TXML_DIFF_INSERTED)
+    @arg the node in the new document (NULL for TXML_DIFF_REMOVED)
+    @arg TXML_DIFF_INSERTED, TXML_DIFF_REMOVED (the whole branch has been
+         added or removed, its descendants are not notified) or TXML_DIFF_CHANGED
+         (the name, value or attributes of a node changed, changes in its
+         children are notified separately)
+    @arg the private pointer passed to txml_diff()
+    @return 0 to go on, anything else to stop the diff
+*/
+typedef int (*txml_diff_callback_t)(txml_node_t *old_node, txml_node_t *new_node, int change, void *priv);
+
+/***
+    @brief compare two documents
+    @arg pointer to the context holding the old document
+    @arg pointer to the context holding the new document
+    @arg the callback to notify the differences to
+    @arg private pointer passed to the callback
+    @return TXML_NOERR on success (also if stopped by the callback), an error code otherwise
+    @note branches with the same hash are skipped without looking into them.
+          Siblings are matched first by content (so that identical branches
+          which just moved are not reported) and then by name, in document order.
+          Differences in the order of the siblings are not reported.
+          Both documents are read locked for the whole comparison, the callback
+          is notified once they have been unlocked (so it can access them, but
+          the nodes still to be notified must not be destroyed meanwhile)
+*/
+txml_err_t txml_diff(txml_t *a, txml_t *b, txml_diff_callback_t cb, void *priv);
+
+/*
+ * Watching files:
+ *   A watcher keeps the most recent version of a file parsed. Each new
+ *   version is parsed (by the watcher thread) into a new context, which is
+ *   then published atomically. Readers take a reference to the current
+ *   version, which is never modified, and release it when done: the old
+ *   versions are released as soon as their last reader is done with them.
+ *   The directory holding the file is watched through inotify, so that
+ *   files replaced by renames (or by swapping a symbolic link in that
+ *   directory) are followed as well. A new version is loaded once no events
+ *   came for 100ms, and only if the file changed. Where inotify is not
+ *   available, or if the path goes through symbolic links (whose targets
+ *   may change outside of the watched directory), the file is also checked
+ *   every second.
+ */
+
+/***
+    @brief callback notified of each new version of a watched file
+    @arg the context holding the new version, already published
+         (NULL if the file couldn't be parsed, the previous version is kept)
+    @arg TXML_NOERR, or the error returned by txml_parse_file()
+    @arg the private pointer passed to txml_watch()
+    @note called by the watcher thread, which doesn't look for new changes meanwhile.
+          The context is valid until the callback returns, unless a reference
+          is acquired through txml_watch_acquire()
+*/
+typedef void (*txml_watch_callback_t)(txml_t *xml, txml_err_t err, void *priv);
+
+/***
+    @brief start watching a file
+    @arg a null terminating string representing the path to the xml file
+    @arg the callback to notify the changes to (can be NULL)
+    @arg private pointer passed to the callback
+    @return a new watcher, NULL if the file can't be parsed (or without -DTHREAD_SAFE)
+    @note the file is parsed before returning, the callback is not notified of this first version
+*/
+txml_watch_t *txml_watch(char *path, txml_watch_callback_t on_change, void *priv);
+
+/***
+    @brief get the current version of a watched file
+    @arg pointer to a valid watcher
+    @return a reference to the context holding the current version (to be released
+            using txml_watch_release()). Never blocks on the watcher
+    @note the context must not be modified
+*/
+txml_t *txml_watch_acquire(txml_watch_t *watch);
+
+/***
+    @brief release a reference to a version of a watched file (the last one frees it)
+    @arg pointer to a context returned by txml_watch_acquire()
+*/
+void txml_watch_release(txml_t *xml);
+
+/***
+    @brief stop watching a file
+    @arg pointer to a valid watcher
+    @note versions still referenced by readers survive the watcher
+*/
+void txml_watch_destroy(txml_watch_t *watch);
+
+/*
+ * Journal:
+ *   A context can keep its document in a file without saving it as a whole
+ *   at each change: the mutations are appended to a log (path.journal) as they
+ *   happen, and replayed on top of the file when the document is opened again.
+ *   Once the log grows past a threshold the document is saved (in background
+ *   when built with -DTHREAD_SAFE, blocking the writers only while saving) and
+ *   the log starts over. Crashes lose at most the last record being written,
+ *   records are flushed to the disk according to txml_set_save_sync().
+ *   Recorded mutations are the ones done through txml_node_set_value(),
+ *   txml_node_add_attribute(), txml_node_remove_attribute(),
+ *   txml_node_clear_attributes(), txml_node_add_child() (and the functions
+ *   creating nodes under a parent), txml_node_destroy(), txml_add_root_node(),
+ *   txml_remove_branch() and txml_subst_branch().
+ *   Nodes are referred to by their position in the document, the file and its
+ *   log must be modified by a single context at a time, and the context must
+ *   not be filled with a different document (parsing, resetting or reloading it)
+ *   while its journal is open
+ */
+
+/***
+    @brief load a document from a file and its journal, recording the mutations from now on
+    @arg pointer to a valid xml context
+    @arg a null terminating string representing the path to the xml file
+         (a missing file holds an empty document, it's created by the first compaction)
+    @arg size of the log (in bytes) triggering a compaction, 0 to compact only through
+         txml_journal_compact() (and when closing the journal, if needed)
+    @return an txml_err_t error status (TXML_BADARGS if a journal is open already)
+    @note the whole document is loaded, regardless of the parse filter (if any).
+          Incomplete records at the end of the log are dropped, as well as a log
+          which doesn't apply to the file (left by a crash after the file was saved)
+*/
+txml_err_t txml_journal_open(txml_t *xml, char *path, unsigned long threshold);
+
+/***
+    @brief save the document to its file and start an empty journal
+    @arg pointer to a valid xml context
+    @return an txml_err_t error status (TXML_BADARGS if no journal is open)
+*/
+txml_err_t txml_journal_compact(txml_t *xml);
+
+/***
+    @brief stop recording the mutations, waiting for a compaction in progress
+    @arg pointer to a valid xml context
+    @note the changes which couldn't be recorded (e.g. to text nodes, which don't
+          survive a save as such) are saved before returning.
+          Called by txml_context_destroy()
+*/
+void txml_journal_close(txml_t *xml);
+
+/*
+ * Mapped files:
+ *   A document parsed by txml_map_file() keeps its file mapped in memory
+ *   and its nodes know where their values (and attribute values) are in there.
+ *   Fixed-width fields (counters, timestamps, flags...) can then be updated
+ *   writing just their bytes over the old ones, without saving the whole file.
+ *   Values whose escaped form doesn't take exactly the same number of bytes,
+ *   as well as values of nodes added after parsing, make the whole document
+ *   saved again (see txml_save()) and the new file mapped in place of the old one.
+ *   The file must be modified only through its context while it's mapped
+ */
+
+/***
+    @brief parse a file keeping it mapped in memory, to patch its values in place
+    @arg pointer to a valid xml context
+    @arg a null terminating string representing the path to the xml file
+    @return an txml_err_t error status (TXML_BADARGS if the context has a journal open)
+    @note the document is parsed straight from the mapping, the mapping is released
+          when the context is reset or destroyed (or filled with another document).
+          Saving the document over the same file through txml_save() maps the new file
+*/
+txml_err_t txml_map_file(txml_t *xml, char *path);
+
+/***
+    @brief set the value of a node, writing it in the mapped file as well
+    @arg pointer to a valid txml_node_t structure, belonging to a document
+         parsed by txml_map_file()
+    @arg a null terminating string representing the new value
+    @return an txml_err_t error status (TXML_BADARGS if the document is not mapped)
+    @note the new value overwrites the old one in place if it takes the same room
+          once escaped, otherwise the whole document is saved to the file.
+          Patched pages are flushed to the disk according to txml_set_save_sync()
+          (TXML_SYNC_NONE leaves them to the system, see txml_map_sync())
+*/
+txml_err_t txml_node_patch_value(txml_node_t *node, char *value);
+
+/***
+    @brief set the value of an attribute, writing it in the mapped file as well
+    @arg pointer to a valid txml_attribute_t structure, belonging to a document
+         parsed by txml_map_file()
+    @arg a null terminating string representing the new value
+    @return an txml_err_t error status (TXML_BADARGS if the document is not mapped)
+    @note see txml_node_patch_value()
+*/
+txml_err_t txml_attribute_patch_value(txml_attribute_t *attr, char *value);
+
+/***
+    @brief flush all the values patched in the mapped file to the disk
+    @arg pointer to a valid xml context
+    @return an txml_err_t error status (TXML_BADARGS if the document is not mapped)
+*/
+txml_err_t txml_map_sync(txml_t *xml);
+
+/*
+ * Source positions:
+ *   The nodes built by a parser tracking the positions (see txml_set_track_positions())
+ *   know where they are in the document they have been parsed from, as byte offsets
+ *   from its start. Ranges are returned as the offset of their first byte and the
+ *   offset right after their last one (the raw bytes are document[start..end-1])
+ */
+
+/***
+    @brief get the range taken by an element, from its start tag to its end tag (included)
+    @arg pointer to a valid txml_node_t structure
+    @arg where to store the offset of the '<' starting the element
+    @arg where to store the offset right after the '>' ending the element
+    @return an txml_err_t error status (TXML_BADARGS if the positions of the node are not known)
+*/
+txml_err_t txml_node_get_offsets(txml_node_t *node, size_t *start, size_t *end);
+
+/***
+    @brief get the range taken by the value of an element (escaped, as in the document)
+    @arg pointer to a valid txml_node_t structure
+    @arg where to store the offset of the first byte of the value
+    @arg where to store the offset right after the value
+    @return an txml_err_t error status (TXML_BADARGS if the node has no value in the
+            document or its positions are not known)
+    @note the leading and trailing whitespace ignored by the parser is not included
+*/
+txml_err_t txml_node_get_value_offsets(txml_node_t *node, size_t *start, size_t *end);
+
+/***
+    @brief get the range taken by an attribute, from its name to the closing quote of its value
+    @arg pointer to a valid txml_attribute_t structure
+    @arg where to store the offset of the first byte of the name
+    @arg where to store the offset right after the closing quote
+    @return an txml_err_t error status (TXML_BADARGS if the positions of the attribute are not known)
+*/
+txml_err_t txml_attribute_get_offsets(txml_attribute_t *attr, size_t *start, size_t *end);
+
+/***
+    @brief get the range taken by the value of an attribute (escaped, without the quotes)
+    @arg pointer to a valid txml_attribute_t structure
+    @arg where to store the offset of the first byte of the value
+    @arg where to store the offset right after the value
+    @return an txml_err_t error status (TXML_BADARGS if the positions of the attribute are not known)
+*/
+txml_err_t txml_attribute_get_value_offsets(txml_attribute_t *attr, size_t *start, size_t *end);
+
+/***
+    @brief turn an offset in the last parsed document into a line and a column
+    @arg pointer to a valid xml context
+    @arg the byte offset
+    @arg where to store the line (starting from 1)
+    @arg where to store the column (in bytes, starting from 1)
+    @return an txml_err_t error status (TXML_BADARGS if the document has not been
+            parsed tracking TXML_TRACK_LINES, or the offset is past its end)
+    @note runs in O(log(lines))
+*/
+txml_err_t txml_get_line(txml_t *xml, size_t offset, unsigned long *line, unsigned long *column);
+
+/*
+ * Sidecar indexes:
+ *   Files too big to be parsed (or even scanned) at each lookup can be indexed
+ *   once: txml_sidecar_build() records in a separate file where each element
+ *   down to a given depth is, by its path and the value of a key attribute.
+ *   Single elements can then be located and parsed on their own, reading just
+ *   their bytes from the indexed file.
+ *   Paths are absolute, each step being an element name as it appears in
+ *   the document (e.g. "/archive/records/record").
+ *   The indexed file is scanned as bytes, it must use an encoding compatible
+ *   with ASCII (e.g. UTF-8) and must not change while its index is in use
+ */
+
+/***
+    @brief index the elements of a file by path and key
+    @arg a null terminating string representing the path to the xml file
+    @arg a null terminating string representing the path to the index file
+         (replaced atomically if it exists)
+    @arg NULL-terminated list of the names of the key attributes: the key of an
+         element is the value of the first one it has (NULL or no such attribute
+         leaves the element without a key)
+    @arg how deep to index, 1 for the root elements only, 2 for their children as well...
+    @return an txml_err_t error status (TXML_PARSER_GENERIC_ERR if the tags are
+            not balanced, the whole file is checked)
+    @note the file is scanned without being parsed, the index takes about 40 bytes
+          per element (plus its key and the distinct paths)
+*/
+txml_err_t txml_sidecar_build(char *path, char *index_path, char **keys, unsigned int depth);
+
+/***
+    @brief open the index of a file
+    @arg a null terminating string representing the path to the xml file
+    @arg a null terminating string representing the path to the index file
+    @return the index, NULL if it can't be opened or if the file changed
+            since it has been indexed
+    @note the index is mapped in memory, not read. It can be used by many threads at once
+*/
+txml_sidecar_t *txml_sidecar_open(char *path, char *index_path);
+
+/***
+    @brief close an index opened by txml_sidecar_open()
+    @arg the index
+*/
+void txml_sidecar_close(txml_sidecar_t *sidecar);
+
+/***
+    @brief find where an element is in the indexed file
+    @arg the index
+    @arg the path of the element
+    @arg the key of the element, NULL for elements without a key
+    @arg which one of the elements with the same path and key, in document order
+    @arg where to store the offset of the '<' starting the element
+    @arg where to store the offset right after the element
+    @return an txml_err_t error status (TXML_BADARGS if no such element is indexed)
+    @note runs in O(log(elements)), plus the number of elements sharing path and key
+*/
+txml_err_t txml_sidecar_find(txml_sidecar_t *sidecar, char *path, char *key, unsigned long index,
+                             size_t *start, size_t *end);
+
+/***
+    @brief parse an indexed element on its own
+    @arg the index
+    @arg the path of the element
+    @arg the key of the element, NULL for elements without a key
+    @arg which one of the elements with the same path and key, in document order
+    @arg pointer to a valid xml context, filled as by txml_parse_buffer()
+         (the element becomes its root element)
+    @return an txml_err_t error status (TXML_BADARGS if no such element is indexed)
+    @note namespaces declared by the ancestors of the element are not known
+          to the parsed fragment. Offsets tracked by the context
+          (see txml_set_track_positions()) are relative to the element
+*/
+txml_err_t txml_sidecar_parse(txml_sidecar_t *sidecar, char *path, char *key, unsigned long index,
+                              txml_t *xml);
+
+/*
+ * Attribute indexes:
+ *   A context can index the nodes of its document by the value of an attribute
+ *   (typically an identifier like "id"). The index is kept up to date by all
+ *   the mutators and survives txml_context_reset(), new documents parsed in
+ *   the context are indexed as well.
+ *   Predicates on an indexed attribute ( "name[@id='value']" ) given to
+ *   txml_node_get_child_byname() and txml_get_node() use it automatically.
+ *   While a context has indexes its documents are never parsed lazily and
+ *   its writers always lock the whole document (see txml_set_lock_depth()).
+ *   Values shared by many nodes make the lookups linear in their number
+ */
+
+/***
+    @brief index the nodes of a document by the value of an attribute
+    @arg pointer to a valid xml context
+    @arg a null terminating string representing the name of the attribute
+    @return an txml_err_t error status (TXML_NOERR if the index exists already)
+    @note takes O(nodes). Each indexed attribute takes 24 more bytes,
+          the values themselves are not copied
+*/
+txml_err_t txml_index_create(txml_t *xml, char *attr_name);
+
+/***
+    @brief drop an index created by txml_index_create()
+    @arg pointer to a valid xml context
+    @arg a null terminating string representing the name of the attribute
+    @return an txml_err_t error status (TXML_BADARGS if there is no such index)
+*/
+txml_err_t txml_index_destroy(txml_t *xml, char *attr_name);
+
+/***
+    @brief find a node by the value of an indexed attribute (e.g. getElementById)
+    @arg pointer to a valid xml context
+    @arg a null terminating string representing the name of the attribute
+    @arg a null terminating string representing the value to look for
+    @return the first node in document order whose attribute has the given value,
+            NULL if there is none or if the attribute is not indexed
+    @note only the first attribute with the given name counts on each node
+*/
+txml_node_t *txml_index_lookup(txml_t *xml, char *attr_name, char *value);
+
+/*
+ * Name index:
+ *   A context can list the elements of its document by name, in document order,
+ *   so that finding all the elements with a name anywhere takes O(elements found).
+ *   Elements added at the end of the document (as while parsing) are indexed
+ *   right away, other structural changes make the next query walk the document
+ *   once to rebuild the lists.
+ *   Like attribute indexes, it disables lazy parsing and fine grained locking
+ */
+
+/***
+    @brief index the elements of a document by name
+    @arg pointer to a valid xml context
+    @return an txml_err_t error status (TXML_NOERR if the index exists already)
+    @note the lists are built by the first query. The index survives
+          txml_context_reset(), new documents parsed in the context are indexed as well
+*/
+txml_err_t txml_name_index_create(txml_t *xml);
+
+/***
+    @brief drop the index created by txml_name_index_create()
+    @arg pointer to a valid xml context
+*/
+void txml_name_index_destroy(txml_t *xml);
+
+/***
+    @brief find all the elements with a given name, anywhere in a document
+    @arg pointer to a valid xml context
+    @arg a null terminating string representing the name of the elements
+    @arg where to store the elements found, in document order
+    @arg how many elements can be stored
+    @return how many elements have been found, only the first ones are stored
+            if there is not enough room for all of them
+    @note runs in O(elements found) with a name index, walks the whole document otherwise
+*/
+unsigned long txml_get_elements_byname(txml_t *xml, char *name, txml_node_t **nodes, unsigned long size);
+
+/***
+    @brief find all the descendants of a node with a given name
+    @arg a valid txml_node_t pointer
+    @arg a null terminating string representing the name of the elements
+    @arg where to store the elements found, in document order
+    @arg how many elements can be stored
+    @return how many elements have been found, only the first ones are stored
+            if there is not enough room for all of them
+    @note with a name index runs in O(log(elements with the name) + elements found),
+          otherwise the branch is walked
+*/
+unsigned long txml_node_get_descendants_byname(txml_node_t *node, char *name, txml_node_t **nodes, unsigned long size);
+
+/*
+ * Document order:
+ *   The nodes of a document are numbered in document order the first time one
+ *   of the calls below needs it, then ordering, ancestry and depth are plain
+ *   comparisons. Branches added later take positions in the gaps left by the
+ *   numbering; when a gap is full only the positions around it are spread out
+ *   again, the document is numbered again after a batch (see txml_batch_begin()).
+ *   Once known, the depths are kept up to date by every branch added outside of
+ *   a batch; txml_node_depth() never numbers the document, it walks up the
+ *   ancestors when the depths are not known.
+ *   Numbering is not used while fine grained locking is in effect, nor while
+ *   some nodes are still pending (see txml_set_lazy_parsing()): the tree is walked instead
+ */
+
+/***
+    @brief compare the positions of two nodes of the same document
+    @arg a valid txml_node_t pointer
+    @arg a valid txml_node_t pointer, in the same document
+    @return -1 if the first node comes first in document order, 1 if the second does,
+            0 if they are the same node
+    @note O(1) once the document is numbered (finding the document of the first node
+          to lock it still walks up its ancestors)
+*/
+int txml_node_compare_order(txml_node_t *a, txml_node_t *b);
+
+/***
+    @brief check if a node is an ancestor of another one
+    @arg a valid txml_node_t pointer
+    @arg a valid txml_node_t pointer, in the same document
+    @return 1 if the first node is an ancestor of the second one (a node is not
+            an ancestor of itself), 0 otherwise
+*/
+int txml_node_is_ancestor(txml_node_t *a, txml_node_t *b);
+
+/***
+    @brief get the depth of a node
+    @arg a valid txml_node_t pointer
+    @return the depth of the node, 0 for the root nodes
+*/
+unsigned int txml_node_depth(txml_node_t *node);
+
+/***
+    @brief sort nodes in document order and remove the duplicates
+    @arg pointer to a valid xml context
+    @arg the nodes to sort, all belonging to the document of the context
+    @arg how many nodes there are
+    @return how many distinct nodes are left at the start of the array
+    @note runs in O(n log(n)) once the document is numbered
+*/
+unsigned long txml_sort_nodes(txml_t *xml, txml_node_t **nodes, unsigned long count);
+
 int txml_has_iconv();
 
 #ifdef __cplusplus
@@ -0,0 +1,278 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <ut.h>
+#include "txml.h"
+
+static char dir[] = "/tmp/txml_journal_test.XXXXXX";
+static char path[256];
+static char log_path[256];
+
+static void
+write_file(char *file, char *data)
+{
+    FILE *out = fopen(file, "w");
+    fputs(data, out);
+    fclose(out);
+}
+
+static char *
+read_file(char *file, size_t *size)
+{
+    struct stat st;
+    FILE *in;
+    char *data;
+
+    if (stat(file, &st) != 0 || !(in = fopen(file, "r")))
+        return NULL;
+    data = malloc(st.st_size + 1);
+    *size = fread(data, 1, st.st_size, in);
+    data[*size] = 0;
+    fclose(in);
+    return data;
+}
+
+static off_t
+file_size(char *file)
+{
+    struct stat st;
+    return stat(file, &st) == 0 ? st.st_size : -1;
+}
+
+// the document as reopened (file and journal) by a new context
+static char *
+reopen_dump(void)
+{
+    txml_t *xml = txml_context_create();
+    char *dump = NULL;
+    if (txml_journal_open(xml, path, 0) == TXML_NOERR)
+        dump = txml_dump(xml, NULL);
+    txml_context_destroy(xml);
+    return dump;
+}
+
+static void
+test_torn_record(void)
+{
+    txml_t *xml;
+    txml_node_t *root;
+    char *before_last, *dump;
+    size_t size, last;
+    off_t truncated;
+
+    write_file(path, "<root><a>1</a><b/></root>");
+    unlink(log_path);
+
+    ut_testing("txml_journal_open() on a file without a journal");
+    xml = txml_context_create();
+    ut_validate_int(txml_journal_open(xml, path, 0), TXML_NOERR);
+
+    root = txml_get_branch(xml, 0);
+    txml_node_set_value(txml_get_node(xml, "/a"), "2");
+    txml_node_add_attribute(txml_get_node(xml, "/b"), "k", "v");
+    txml_node_create("c", "3", root);
+    before_last = txml_dump(xml, NULL);
+    last = file_size(log_path); // where the last record starts
+    txml_node_create("d", "a value long enough to be torn in half", root);
+    txml_context_destroy(xml); // closes the journal, nothing left to save
+
+    ut_testing("the base file is untouched until a compaction");
+    dump = read_file(path, &size);
+    ut_validate_string(dump, "<root><a>1</a><b/></root>");
+    free(dump);
+
+    // cut the last record in the middle, as a crash while appending it would
+    size = file_size(log_path);
+    truncated = last + (size - last) / 2;
+    if (truncate(log_path, truncated) != 0)
+        perror("truncate");
+
+    ut_testing("replaying a journal whose last record is truncated");
+    dump = reopen_dump();
+    ut_validate_string(dump, before_last);
+    free(dump);
+    free(before_last);
+
+    ut_testing("the truncated record is dropped from the journal");
+    ut_validate_int(file_size(log_path), last);
+
+    ut_testing("records appended after the dropped one are replayed");
+    xml = txml_context_create();
+    txml_journal_open(xml, path, 0);
+    txml_node_create("e", "4", txml_get_branch(xml, 0));
+    before_last = txml_dump(xml, NULL);
+    txml_context_destroy(xml);
+    dump = reopen_dump();
+    ut_validate_string(dump, before_last);
+    free(dump);
+    free(before_last);
+}
+
+typedef struct {
+    txml_t *xml;
+    int stop;
+    int compactions;
+} compactor_t;
+
+static void *
+compactor(void *priv)
+{
+    compactor_t *c = (compactor_t *)priv;
+    while (!__atomic_load_n(&c->stop, __ATOMIC_ACQUIRE)) {
+        if (txml_journal_compact(c->xml) == TXML_NOERR)
+            c->compactions++;
+        usleep(100);
+    }
+    return NULL;
+}
+
+static void
+test_compaction_while_appending(void)
+{
+    txml_t *xml;
+    txml_node_t *root, *node;
+    compactor_t c;
+    pthread_t thread;
+    char name[32], value[32];
+    char *expected, *dump;
+    off_t max_size = 0;
+    int i;
+
+    write_file(path, "<root/>");
+    unlink(log_path);
+
+    // a small threshold triggers background compactions all along,
+    // explicit ones run at the same time from another thread
+    xml = txml_context_create();
+    ut_testing("txml_journal_open() with a compaction threshold");
+    ut_validate_int(txml_journal_open(xml, path, 512), TXML_NOERR);
+    root = txml_get_branch(xml, 0);
+    memset(&c, 0, sizeof(c));
+    c.xml = xml;
+    pthread_create(&thread, NULL, compactor, &c);
+    for (i = 0; i < 2000; i++) {
+        sprintf(name, "n%d", i % 50);
+        sprintf(value, "%d", i);
+        node = txml_node_create(name, value, root);
+        if (i % 3 == 0)
+            txml_node_add_attribute(node, "i", value);
+        if (i % 7 == 0)
+            txml_node_destroy(txml_node_get_child(root, 0));
+        if (i % 11 == 0 && txml_node_get_child(root, 0))
+            txml_node_set_value(txml_node_get_child(root, 0), value);
+        if (i % 100 == 99) { // let the compactions in
+            if (file_size(log_path) > max_size)
+                max_size = file_size(log_path);
+            usleep(1000);
+        }
+    }
+    __atomic_store_n(&c.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    expected = txml_dump(xml, NULL);
+
+    ut_testing("compactions ran while appending");
+    // without them the journal would grow past 50KB
+    if (c.compactions > 1 && max_size < 16 * 1024)
+        ut_success();
+    else
+        ut_failure("%d explicit compactions, the journal grew up to %lld bytes", c.compactions, (long long)max_size);
+
+    txml_context_destroy(xml);
+    ut_testing("reopening the document gives what was left in memory");
+    dump = reopen_dump();
+    ut_validate_string(dump, expected);
+    free(dump);
+    free(expected);
+}
+
+static void
+test_reopen_after_compaction(void)
+{
+    txml_t *xml;
+    char *expected, *dump, *base;
+    size_t size;
+
+    write_file(path, "<root><a>1</a></root>");
+    unlink(log_path);
+
+    xml = txml_context_create();
+    txml_journal_open(xml, path, 0);
+    txml_node_set_value(txml_get_node(xml, "/a"), "2");
+    txml_node_create("b", "x", txml_get_branch(xml, 0));
+
+    ut_testing("txml_journal_compact()");
+    ut_validate_int(txml_journal_compact(xml), TXML_NOERR);
+
+    ut_testing("the journal is empty after a compaction");
+    ut_validate_int(file_size(log_path), strlen("J 0123456789abcdef\n"));
+
+    ut_testing("the base file holds the document after a compaction");
+    expected = txml_dump(xml, NULL);
+    base = read_file(path, &size);
+    txml_context_destroy(xml);
+    xml = txml_context_create();
+    txml_parse_buffer(xml, base);
+    dump = txml_dump(xml, NULL);
+    ut_validate_string(dump, expected);
+    txml_context_destroy(xml);
+    free(dump);
+    free(base);
+
+    ut_testing("reopening after a compaction");
+    dump = reopen_dump();
+    ut_validate_string(dump, expected);
+    free(dump);
+    free(expected);
+
+    ut_testing("records appended after a compaction are replayed");
+    xml = txml_context_create();
+    txml_journal_open(xml, path, 0);
+    txml_node_destroy(txml_get_node(xml, "/a"));
+    txml_node_add_attribute(txml_get_node(xml, "/b"), "k", "v");
+    expected = txml_dump(xml, NULL);
+    txml_context_destroy(xml);
+    dump = reopen_dump();
+    ut_validate_string(dump, expected);
+    free(dump);
+    free(expected);
+
+    ut_testing("a journal left over by a different base file is dropped");
+    write_file(path, "<other/>");
+    xml = txml_context_create();
+    txml_parse_buffer(xml, "<other/>");
+    expected = txml_dump(xml, NULL);
+    txml_context_destroy(xml);
+    dump = reopen_dump();
+    ut_validate_string(dump, expected);
+    free(dump);
+    free(expected);
+}
+
+int
+main(int argc, char **argv)
+{
+    ut_init(basename(argv[0]));
+
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/doc.xml", dir);
+    snprintf(log_path, sizeof(log_path), "%s/doc.xml.journal", dir);
+
+    test_torn_record();
+    test_compaction_while_appending();
+    test_reopen_after_compaction();
+
+    unlink(log_path);
+    unlink(path);
+    rmdir(dir);
+
+    ut_summary();
+
+    return ut_failed;
+}
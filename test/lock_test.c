@@ -0,0 +1,380 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <ut.h>
+#include "txml.h"
+
+#define READERS 8
+#define MANY_READERS 100 // more than the reader slots of a context
+#define WRITERS 2
+#define CHANGES 2000
+
+typedef struct {
+    txml_t *xml;
+    int id;
+    int changes;
+    int stop;
+    int reads;
+    int errors;
+} worker_t;
+
+static int64_t
+get_counter(txml_t *xml)
+{
+    int64_t value = -1;
+    txml_node_get_int64(txml_get_node(xml, "/counter"), &value);
+    return value;
+}
+
+// the counter and the items are changed together, within a batch
+static int
+check_dump(txml_t *xml)
+{
+    txml_t *copy = txml_context_create();
+    char *dump = txml_dump(xml, NULL);
+    int ok;
+
+    ok = txml_parse_buffer(copy, dump) == TXML_NOERR &&
+         get_counter(copy) == txml_node_count_children(txml_get_node(copy, "/items"));
+    free(dump);
+    txml_context_destroy(copy);
+    return ok;
+}
+
+static void *
+reader(void *priv)
+{
+    worker_t *w = (worker_t *)priv;
+    txml_node_t *items = txml_get_node(w->xml, "/items");
+    int64_t before, after, last = 0;
+    unsigned long count;
+
+    while (!__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE)) {
+        before = get_counter(w->xml);
+        count = txml_node_count_children(items);
+        after = get_counter(w->xml);
+        if (before < last || before > count || count > after)
+            w->errors++;
+        last = after;
+        if (w->reads++ % 100 == 0 && !check_dump(w->xml))
+            w->errors++;
+    }
+    return NULL;
+}
+
+static void *
+writer(void *priv)
+{
+    worker_t *w = (worker_t *)priv;
+    txml_node_t *items = txml_get_node(w->xml, "/items");
+    char value[32];
+    int i;
+
+    for (i = 0; i < w->changes; i++) {
+        txml_batch_begin(w->xml);
+        // reads within a batch are done by the thread holding the write lock
+        sprintf(value, "%lld", (long long)get_counter(w->xml) + 1);
+        txml_node_set_value(txml_get_node(w->xml, "/counter"), value);
+        txml_node_create("item", value, items);
+        if (i % 200 == 0 && !check_dump(w->xml))
+            w->errors++;
+        txml_batch_end(w->xml);
+    }
+    return NULL;
+}
+
+static txml_t *
+create_document(void)
+{
+    txml_t *xml = txml_context_create();
+    txml_parse_buffer(xml, "<root><counter>0</counter><items/></root>");
+    return xml;
+}
+
+// runs the readers until the writers are done, returns the errors they found
+static int
+run(txml_t *xml, worker_t *readers, int nreaders, worker_t *writers, int nwriters, int changes)
+{
+    pthread_t *threads = calloc(nreaders + nwriters, sizeof(pthread_t));
+    int i, errors = 0;
+
+    for (i = 0; i < nreaders; i++) {
+        memset(&readers[i], 0, sizeof(worker_t));
+        readers[i].xml = xml;
+        readers[i].id = i;
+        pthread_create(&threads[i], NULL, reader, &readers[i]);
+    }
+    for (i = 0; i < nwriters; i++) {
+        memset(&writers[i], 0, sizeof(worker_t));
+        writers[i].xml = xml;
+        writers[i].id = i;
+        writers[i].changes = changes;
+        pthread_create(&threads[nreaders + i], NULL, writer, &writers[i]);
+    }
+    for (i = 0; i < nwriters; i++) {
+        pthread_join(threads[nreaders + i], NULL);
+        errors += writers[i].errors;
+    }
+    for (i = 0; i < nreaders; i++)
+        __atomic_store_n(&readers[i].stop, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < nreaders; i++) {
+        pthread_join(threads[i], NULL);
+        errors += readers[i].errors;
+    }
+    free(threads);
+    return errors;
+}
+
+static void
+test_readers_and_writers(void)
+{
+    txml_t *xml = create_document();
+    worker_t readers[READERS], writers[WRITERS];
+
+    ut_testing("concurrent readers and writers see consistent documents");
+    ut_validate_int(run(xml, readers, READERS, writers, WRITERS, CHANGES), 0);
+    ut_testing("no change was lost by the concurrent writers");
+    ut_validate_int(get_counter(xml) == WRITERS * CHANGES &&
+                    txml_node_count_children(txml_get_node(xml, "/items")) == WRITERS * CHANGES, 1);
+    txml_context_destroy(xml);
+}
+
+static void
+test_more_readers_than_slots(void)
+{
+    txml_t *xml = create_document();
+    worker_t *readers = calloc(MANY_READERS, sizeof(worker_t));
+    worker_t writers[1];
+
+    // threads share the reader slots once there are more of them
+    ut_testing("more concurrent readers than reader slots");
+    ut_validate_int(run(xml, readers, MANY_READERS, writers, 1, CHANGES / 10), 0);
+    ut_testing("the writer went through the shared reader slots");
+    ut_validate_int(get_counter(xml), CHANGES / 10);
+    free(readers);
+    txml_context_destroy(xml);
+}
+
+static void
+test_reads_within_batches(void)
+{
+    txml_t *xml = create_document();
+    char *dump;
+
+    ut_testing("reading the document within nested batches");
+    txml_batch_begin(xml);
+    txml_node_set_value(txml_get_node(xml, "/counter"), "1");
+    txml_batch_begin(xml);
+    txml_node_create("item", "1", txml_get_node(xml, "/items"));
+    dump = txml_dump(xml, NULL);
+    ut_validate_int(get_counter(xml) == 1 && txml_node_count_children(txml_get_node(xml, "/items")) == 1, 1);
+    txml_batch_end(xml);
+    ut_testing("txml_dump() within a batch");
+    ut_validate_int(strstr(dump, "<counter>1</counter>") && strstr(dump, "<item>1</item>"), 1);
+    free(dump);
+    ut_testing("txml_batch_end() of the outermost batch");
+    ut_validate_int(txml_batch_end(xml), TXML_NOERR);
+    ut_testing("txml_batch_end() without a batch in progress");
+    ut_validate_int(txml_batch_end(xml), TXML_GENERIC_ERR);
+    txml_context_destroy(xml);
+}
+
+#define BRANCHES 8
+#define MOVED 10
+
+typedef struct {
+    txml_t *xml;
+    txml_node_t *branch;
+    int stop;
+    int errors;
+} branch_worker_t;
+
+// each writer owns a branch, with its own lock
+static void *
+branch_writer(void *priv)
+{
+    branch_worker_t *w = (branch_worker_t *)priv;
+    txml_node_t *counter = txml_node_get_child_byname(w->branch, "v");
+    int64_t value;
+    char buf[32];
+    int i;
+
+    for (i = 0; i < CHANGES; i++) {
+        if (txml_node_get_int64(counter, &value) != TXML_NOERR || value != i)
+            w->errors++;
+        sprintf(buf, "%d", i + 1);
+        txml_node_set_value(counter, buf);
+        txml_node_add_attribute(txml_node_create("n", buf, w->branch), "i", buf);
+        if (i % 4 == 0)
+            txml_node_destroy(txml_node_get_child(w->branch, 1));
+    }
+    return NULL;
+}
+
+// moves nodes back and forth between two branches
+static void *
+branch_mover(void *priv)
+{
+    branch_worker_t *w = (branch_worker_t *)priv;
+    txml_node_t *from = txml_get_node(w->xml, "/p0");
+    txml_node_t *to = txml_get_node(w->xml, "/p1");
+    txml_node_t *tmp, *node;
+    int i;
+
+    for (i = 0; i < CHANGES; i++) {
+        if ((node = txml_node_get_child(from, 0)))
+            txml_node_add_child(to, node);
+        if (!txml_node_count_children(from)) {
+            tmp = from;
+            from = to;
+            to = tmp;
+        }
+    }
+    return NULL;
+}
+
+// changes above the branches level lock the whole document
+static void *
+context_writer(void *priv)
+{
+    branch_worker_t *w = (branch_worker_t *)priv;
+    txml_node_t *root = txml_get_branch(w->xml, 0);
+    txml_node_t *q = txml_get_node(w->xml, "/q");
+    txml_node_t *node;
+    int i;
+
+    for (i = 0; i < CHANGES / 10; i++) {
+        node = txml_node_create("extra", NULL, root);
+        txml_node_add_child(q, node); // from the context level into a branch
+        node = txml_node_create("top", NULL, root);
+        txml_node_destroy(node);
+        txml_node_set_value(q, i % 2 ? "odd" : "even");
+    }
+    return NULL;
+}
+
+static void *
+branch_reader(void *priv)
+{
+    branch_worker_t *w = (branch_worker_t *)priv;
+    txml_node_t *counter, *p0 = txml_get_node(w->xml, "/p0");
+    int64_t value, last[BRANCHES] = { 0 };
+    char path[32];
+    int i, reads = 0;
+
+    while (!__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE)) {
+        for (i = 0; i < BRANCHES; i++) {
+            sprintf(path, "/b%d/v", i);
+            counter = txml_get_node(w->xml, path);
+            if (txml_node_get_int64(counter, &value) != TXML_NOERR || value < last[i])
+                w->errors++;
+            last[i] = value;
+        }
+        txml_node_count_children(p0);
+        // a dump locks the whole document, the moves are all done or not started
+        if (reads++ % 50 == 0) {
+            txml_t *copy = txml_context_create();
+            char *dump = txml_dump(w->xml, NULL);
+            txml_parse_buffer(copy, dump);
+            if (txml_node_count_children(txml_get_node(copy, "/p0")) +
+                txml_node_count_children(txml_get_node(copy, "/p1")) != MOVED)
+            {
+                w->errors++;
+            }
+            free(dump);
+            txml_context_destroy(copy);
+        }
+    }
+    return NULL;
+}
+
+static void
+test_branch_locks(void)
+{
+    txml_t *xml = txml_context_create();
+    txml_node_t *root;
+    branch_worker_t writers[BRANCHES], others[3];
+    pthread_t threads[BRANCHES + 3];
+    char name[32];
+    int i, errors = 0, ok = 1;
+
+    txml_parse_buffer(xml, "<root><p0/><p1/><q/></root>");
+    root = txml_get_branch(xml, 0);
+    for (i = 0; i < BRANCHES; i++) {
+        sprintf(name, "b%d", i);
+        txml_node_create("v", "0", txml_node_create(name, NULL, root));
+    }
+    for (i = 0; i < MOVED; i++)
+        txml_node_create("m", NULL, txml_get_node(xml, "/p0"));
+    // the children of the root node get their own locks
+    txml_set_lock_depth(xml, 2);
+
+    memset(writers, 0, sizeof(writers));
+    memset(others, 0, sizeof(others));
+    for (i = 0; i < 3; i++)
+        others[i].xml = xml;
+    pthread_create(&threads[BRANCHES], NULL, branch_reader, &others[0]);
+    for (i = 0; i < BRANCHES; i++) {
+        writers[i].xml = xml;
+        writers[i].branch = txml_node_get_child(root, 3 + i);
+        pthread_create(&threads[i], NULL, branch_writer, &writers[i]);
+    }
+    pthread_create(&threads[BRANCHES + 1], NULL, branch_mover, &others[1]);
+    pthread_create(&threads[BRANCHES + 2], NULL, context_writer, &others[2]);
+    for (i = 0; i < BRANCHES; i++) {
+        pthread_join(threads[i], NULL);
+        errors += writers[i].errors;
+    }
+    pthread_join(threads[BRANCHES + 1], NULL);
+    pthread_join(threads[BRANCHES + 2], NULL);
+    __atomic_store_n(&others[0].stop, 1, __ATOMIC_RELEASE);
+    pthread_join(threads[BRANCHES], NULL);
+    errors += others[0].errors;
+
+    ut_testing("concurrent writers on different branches with txml_set_lock_depth()");
+    ut_validate_int(errors, 0);
+
+    ut_testing("no change was lost by the branch writers");
+    for (i = 0; i < BRANCHES; i++) {
+        // the counter and the nodes left over by one every 4 removals
+        if (txml_node_count_children(writers[i].branch) != 1 + CHANGES - CHANGES / 4)
+            ok = 0;
+    }
+    ut_validate_int(ok, 1);
+    ut_testing("no node was lost by the moves across branches");
+    ut_validate_int(txml_node_count_children(txml_get_node(xml, "/p0")) +
+                    txml_node_count_children(txml_get_node(xml, "/p1")), MOVED);
+    ut_testing("changes above the branches level");
+    ut_validate_int(txml_node_count_children(root) == 3 + BRANCHES &&
+                    txml_node_count_children(txml_get_node(xml, "/q")) == CHANGES / 10, 1);
+    ut_testing("the document after the concurrent changes");
+    {
+        txml_t *copy = txml_context_create();
+        char *dump = txml_dump(xml, NULL), *copy_dump;
+        txml_parse_buffer(copy, dump);
+        copy_dump = txml_dump(copy, NULL);
+        ut_validate_string(copy_dump, dump);
+        free(dump);
+        free(copy_dump);
+        txml_context_destroy(copy);
+    }
+    txml_context_destroy(xml);
+}
+
+int
+main(int argc, char **argv)
+{
+    ut_init(basename(argv[0]));
+
+    test_readers_and_writers();
+    test_more_readers_than_slots();
+    test_reads_within_batches();
+    test_branch_locks();
+
+    ut_summary();
+
+    return ut_failed;
+}
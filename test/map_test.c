@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <ut.h>
+#include "txml.h"
+
+static char dir[] = "/tmp/txml_map_test.XXXXXX";
+static char path[256];
+
+static char *
+read_file(char *file)
+{
+    struct stat st;
+    FILE *in;
+    char *data;
+    size_t size;
+
+    if (stat(file, &st) != 0 || !(in = fopen(file, "r")))
+        return NULL;
+    data = malloc(st.st_size + 1);
+    size = fread(data, 1, st.st_size, in);
+    data[size] = 0;
+    fclose(in);
+    return data;
+}
+
+static ino_t
+file_inode(char *file)
+{
+    struct stat st;
+    return stat(file, &st) == 0 ? st.st_ino : 0;
+}
+
+// the raw bytes of a value in the file, as its offsets tell
+static int
+check_value(char *data, txml_node_t *node, char *raw)
+{
+    size_t start, end;
+
+    if (txml_node_get_value_offsets(node, &start, &end) != TXML_NOERR)
+        return 0;
+    return end - start == strlen(raw) && memcmp(data + start, raw, end - start) == 0;
+}
+
+static int
+check_attribute(char *data, txml_attribute_t *attr, char *raw)
+{
+    size_t start, end;
+
+    if (txml_attribute_get_value_offsets(attr, &start, &end) != TXML_NOERR)
+        return 0;
+    return end - start == strlen(raw) && memcmp(data + start, raw, end - start) == 0;
+}
+
+// the mapped file says what the document holds, offsets included
+static void
+check_file(txml_t *xml, char *counter, char *id, char *name, char *item)
+{
+    txml_t *fresh;
+    char *data, *dump, *fresh_dump;
+    int ok;
+
+    data = read_file(path);
+    ok = check_value(data, txml_get_node(xml, "/counter"), counter) &&
+         check_attribute(data, txml_node_get_attribute_byname(txml_get_node(xml, "/name"), "id"), id) &&
+         check_value(data, txml_get_node(xml, "/name"), name) &&
+         check_value(data, txml_get_node(xml, "/list/i[2]"), item);
+
+    fresh = txml_context_create();
+    txml_parse_buffer(fresh, data);
+    dump = txml_dump(xml, NULL);
+    fresh_dump = txml_dump(fresh, NULL);
+    if (!ok)
+        ut_failure("the offsets don't match the file:\n%s", data);
+    else if (strcmp(dump, fresh_dump) != 0)
+        ut_failure("the file doesn't hold the document:\n%s\n%s", fresh_dump, dump);
+    else
+        ut_success();
+    free(dump);
+    free(fresh_dump);
+    txml_context_destroy(fresh);
+    free(data);
+}
+
+int
+main(int argc, char **argv)
+{
+    txml_t *xml;
+    txml_node_t *counter, *name;
+    txml_attribute_t *id;
+    FILE *out;
+    ino_t inode;
+    char value[16];
+    int i;
+
+    ut_init(basename(argv[0]));
+
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/doc.xml", dir);
+    out = fopen(path, "w");
+    fputs("<root>\n"
+          "  <counter>0001</counter>\n"
+          "  <name id=\"ab\">abcdef</name>\n"
+          "  <list><i>1</i><i>22</i></list>\n"
+          "</root>\n", out);
+    fclose(out);
+
+    xml = txml_context_create();
+    ut_testing("txml_map_file()");
+    ut_validate_int(txml_map_file(xml, path), TXML_NOERR);
+    counter = txml_get_node(xml, "/counter");
+    name = txml_get_node(xml, "/name");
+    id = txml_node_get_attribute_byname(name, "id");
+
+    ut_testing("the offsets of the parsed values");
+    check_file(xml, "0001", "ab", "abcdef", "22");
+
+    inode = file_inode(path);
+    ut_testing("patching a value of the same length");
+    ut_validate_int(txml_node_patch_value(counter, "0002"), TXML_NOERR);
+    ut_testing("the value is written in place");
+    ut_validate_int(file_inode(path) == inode, 1);
+    ut_testing("the file after patching a value in place");
+    check_file(xml, "0002", "ab", "abcdef", "22");
+
+    ut_testing("patching an attribute value of the same length");
+    ut_validate_int(txml_attribute_patch_value(id, "cd"), TXML_NOERR);
+    ut_testing("a value taking the same room once escaped is written in place");
+    txml_node_patch_value(name, "a<b");
+    ut_validate_int(file_inode(path) == inode, 1);
+    ut_testing("the file after patching escaped values in place");
+    check_file(xml, "0002", "cd", "a&lt;b", "22");
+
+    ut_testing("patching a shorter value");
+    ut_validate_int(txml_node_patch_value(name, "xy"), TXML_NOERR);
+    ut_testing("the document is saved again for a shorter value");
+    ut_validate_int(file_inode(path) != inode, 1);
+    ut_testing("the file after saving a shorter value");
+    check_file(xml, "0002", "cd", "xy", "22");
+
+    inode = file_inode(path);
+    ut_testing("patching a longer value");
+    ut_validate_int(txml_node_patch_value(txml_get_node(xml, "/list/i[2]"), "a longer value"), TXML_NOERR);
+    ut_testing("the document is saved again for a longer value");
+    ut_validate_int(file_inode(path) != inode, 1);
+    ut_testing("the file after saving a longer value");
+    check_file(xml, "0002", "cd", "xy", "a longer value");
+
+    ut_testing("patching a longer attribute value");
+    inode = file_inode(path);
+    txml_attribute_patch_value(id, "longer");
+    ut_validate_int(file_inode(path) != inode, 1);
+    ut_testing("the file after saving a longer attribute value");
+    check_file(xml, "0002", "longer", "xy", "a longer value");
+
+    // the offsets found by the new mapping keep working for in-place patches
+    inode = file_inode(path);
+    ut_testing("several patches in place after the document was saved again");
+    for (i = 3; i < 100; i++) {
+        sprintf(value, "%04d", i);
+        if (txml_node_patch_value(counter, value) != TXML_NOERR)
+            break;
+        txml_attribute_patch_value(id, i % 2 ? "LONGER" : "longer");
+    }
+    ut_validate_int(i == 100 && file_inode(path) == inode, 1);
+    ut_testing("the file after several patches in place");
+    check_file(xml, "0099", "LONGER", "xy", "a longer value");
+
+    ut_testing("mixing patches in place and patches saving the document");
+    for (i = 0; i < 10; i++) {
+        txml_node_patch_value(name, i % 2 ? "xy" : "xyz");
+        txml_node_patch_value(counter, i % 2 ? "1111" : "2222");
+    }
+    check_file(xml, "1111", "LONGER", "xy", "a longer value");
+
+    ut_testing("txml_map_sync()");
+    ut_validate_int(txml_map_sync(xml), TXML_NOERR);
+
+    txml_context_destroy(xml);
+    unlink(path);
+    rmdir(dir);
+
+    ut_summary();
+
+    return ut_failed;
+}
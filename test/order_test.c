@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <ut.h>
+#include "txml.h"
+
+#define MAX_NODES 50000
+
+static txml_node_t *nodes[MAX_NODES]; // in document order, as found walking the tree
+static int parents[MAX_NODES];
+static unsigned int depths[MAX_NODES];
+static int count;
+static int mismatches; // found by the checks since the last report
+
+static void
+collect(txml_node_t *node, int parent, unsigned int depth)
+{
+    txml_node_t *child;
+    int index = count++;
+
+    nodes[index] = node;
+    parents[index] = parent;
+    depths[index] = depth;
+    for (child = txml_node_get_child(node, 0); child; child = txml_node_next_sibling(child))
+        collect(child, index, depth + 1);
+}
+
+static void
+collect_all(txml_t *xml)
+{
+    unsigned long i;
+
+    count = 0;
+    for (i = 0; i < txml_count_branches(xml); i++)
+        collect(txml_get_branch(xml, i), -1, 0);
+}
+
+static int
+is_ancestor(int a, int b)
+{
+    while ((b = parents[b]) >= 0) {
+        if (b == a)
+            return 1;
+    }
+    return 0;
+}
+
+// compare what the numbering says to a walk of the document, returns the mismatches
+static int
+check_order_quiet(txml_t *xml)
+{
+    int j, k, errors = 0;
+
+    collect_all(xml);
+    for (j = 0; j < count; j++) {
+        if (txml_node_depth(nodes[j]) != depths[j])
+            errors++;
+        if (j && (txml_node_compare_order(nodes[j - 1], nodes[j]) != -1 ||
+                  txml_node_compare_order(nodes[j], nodes[j - 1]) != 1))
+        {
+            errors++;
+        }
+        if (parents[j] >= 0 && !txml_node_is_ancestor(nodes[parents[j]], nodes[j]))
+            errors++;
+        // a few more pairs, anywhere in the document
+        for (k = j % 13; k < count; k += 97) {
+            if (txml_node_compare_order(nodes[j], nodes[k]) != (j < k ? -1 : j > k) ||
+                txml_node_is_ancestor(nodes[j], nodes[k]) != is_ancestor(j, k))
+            {
+                errors++;
+            }
+        }
+    }
+    if (errors)
+        mismatches += errors;
+    return errors;
+}
+
+static void
+check_order(txml_t *xml)
+{
+    if (check_order_quiet(xml) || mismatches)
+        ut_failure("%d mismatches (among %d nodes at last)", mismatches, count);
+    else
+        ut_success();
+    mismatches = 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    txml_t *xml;
+    txml_node_t *root, *a, *b, *c, *node, *moved, *outside;
+    int i;
+
+    ut_init(basename(argv[0]));
+
+    xml = txml_context_create();
+    txml_parse_buffer(xml, "<root><a><x/></a><b/><c/></root>");
+    root = txml_get_branch(xml, 0);
+    a = txml_get_node(xml, "/a");
+    b = txml_get_node(xml, "/b");
+    c = txml_get_node(xml, "/c");
+
+    ut_testing("txml_node_compare_order() on a parsed document");
+    check_order(xml);
+
+    // all in the gap between the last node under 'a' and 'b'
+    ut_testing("inserting many times at the same gap");
+    for (i = 0; i < 5000; i++) {
+        node = txml_node_create("n", NULL, a);
+        if (i % 10 == 0)
+            txml_node_create("m", NULL, node);
+        if (txml_node_compare_order(node, b) != -1 || txml_node_compare_order(a, node) != -1)
+            break;
+    }
+    ut_validate_int(i, 5000);
+    ut_testing("the order after inserting many times at the same gap");
+    check_order(xml);
+
+    // the positions of the last nodes under 'a' are given to the nodes
+    // inserted right after it, 'a' must not claim them anymore
+    ut_testing("the order after inserting where nodes have been removed");
+    for (i = 0; i < 300; i++)
+        txml_node_destroy(txml_node_get_child(a, txml_node_count_children(a) - 1));
+    for (i = 0; i < 3000; i++)
+        txml_node_create("e", NULL, b);
+    check_order(xml);
+
+    ut_testing("depths of nested nodes appended one under the other");
+    node = c;
+    for (i = 0; i < 1000; i++) {
+        node = txml_node_create("k", NULL, node);
+        if (txml_node_depth(node) != i + 2)
+            break;
+    }
+    ut_validate_int(i, 1000);
+    ut_testing("the order after nesting many nodes");
+    check_order(xml);
+
+    // detaching moves nodes out of the document, they get new positions when back
+    outside = txml_node_create("outside", NULL, NULL);
+    ut_testing("the order after detaching a branch");
+    txml_node_add_child(outside, a);
+    check_order(xml);
+    ut_testing("the order after attaching the branch back somewhere else");
+    txml_node_add_child(c, a);
+    check_order(xml);
+    ut_testing("the order after moving nodes back and forth");
+    for (i = 0; i < 200; i++) {
+        node = txml_node_get_child(a, i);
+        txml_node_add_child(outside, node);
+        txml_node_add_child(i % 2 ? b : root, node);
+    }
+    check_order(xml);
+
+    ut_testing("sorting nodes in document order after the relabellings");
+    {
+        txml_node_t *sorted[5] = { c, root, b, a, c };
+        ut_validate_int(txml_sort_nodes(xml, sorted, 5), 4);
+        ut_testing("the sorted nodes");
+        ut_validate_int(sorted[0] == root && sorted[1] == b && sorted[2] == c && sorted[3] == a, 1);
+    }
+
+    // hot spots anywhere, with nodes leaving and coming back
+    ut_testing("the order after random inserts, moves and removals");
+    srand(1);
+    for (i = 0; i < 10000; i++) {
+        if (i % 500 == 0)
+            check_order_quiet(xml);
+        else if (!count) // the nodes as they are now
+            collect_all(xml);
+        node = nodes[rand() % (count < 20 ? count : (rand() % 2 ? 20 : count))];
+        switch (rand() % 10) {
+            case 0:
+                moved = nodes[1 + rand() % (count - 1)];
+                if (moved != node && !txml_node_is_ancestor(moved, node)) {
+                    txml_node_add_child(outside, moved);
+                    txml_node_add_child(node, moved);
+                }
+                count = 0;
+                break;
+            case 1:
+                if (node != root && txml_node_count_children(node) < 5) {
+                    txml_node_destroy(node);
+                    count = 0;
+                }
+                break;
+            default:
+                txml_node_create("r", NULL, node);
+                break;
+        }
+    }
+    check_order(xml);
+
+    txml_node_destroy(outside);
+    txml_context_destroy(xml);
+
+    ut_summary();
+
+    return ut_failed;
+}
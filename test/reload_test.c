@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <ut.h>
+#include "txml.h"
+
+#define MAX_ELEMENTS 16
+
+static char dir[] = "/tmp/txml_reload_test.XXXXXX";
+static char path[256];
+static time_t version;
+
+static void
+write_file(char *data)
+{
+    struct timespec times[2];
+    FILE *out = fopen(path, "w");
+
+    fputs(data, out);
+    fclose(out);
+    // a new modification time even if the size is the same and the clock is coarse
+    times[0].tv_sec = times[1].tv_sec = ++version;
+    times[0].tv_nsec = times[1].tv_nsec = 0;
+    utimensat(AT_FDCWD, path, times, 0);
+}
+
+static int
+same_string(char *a, char *b)
+{
+    return (!a && !b) || (a && b && strcmp(a, b) == 0);
+}
+
+// the reloaded document, its indexes and its snapshot against a fresh parse of the file
+static void
+check_reload(txml_t *xml)
+{
+    txml_t *fresh = txml_context_create();
+    txml_snapshot_t *snapshot = txml_snapshot(xml);
+    txml_snapshot_node_t *snapshot_root, *snapshot_child;
+    txml_node_t *root, *child, *found[MAX_ELEMENTS];
+    txml_attribute_t *id, *other_id;
+    char *dump, *fresh_dump;
+    unsigned long i, n, first;
+    int errors = 0;
+
+    txml_parse_file(fresh, path);
+    dump = txml_dump(xml, NULL);
+    fresh_dump = txml_dump(fresh, NULL);
+    if (strcmp(dump, fresh_dump) != 0) {
+        ut_failure("the reloaded document differs from the file:\n%s\n%s", fresh_dump, dump);
+        goto out;
+    }
+
+    root = txml_get_branch(fresh, 0);
+    snapshot_root = txml_snapshot_get_branch(snapshot, 0);
+    if (txml_snapshot_node_count_children(snapshot_root) != txml_node_count_children(root))
+        errors++;
+    for (i = 0; i < txml_node_count_children(root); i++) {
+        child = txml_node_get_child(root, i);
+        snapshot_child = txml_snapshot_node_get_child(snapshot_root, i);
+        if (!snapshot_child || !same_string(txml_snapshot_node_get_name(snapshot_child), txml_node_get_name(child)) ||
+            !same_string(txml_snapshot_node_get_value(snapshot_child), txml_node_get_value(child)))
+        {
+            errors++;
+        }
+        if (txml_node_get_type(child) != TXML_NODETYPE_SIMPLE)
+            continue;
+        n = txml_get_elements_byname(xml, txml_node_get_name(child), found, MAX_ELEMENTS);
+        if (n != txml_get_elements_byname(fresh, txml_node_get_name(child), found, MAX_ELEMENTS))
+            errors++;
+        // the index gives the first node with an id, as found in the fresh document
+        if ((id = txml_node_get_attribute_byname(child, "id"))) {
+            for (first = 0; first < i; first++) {
+                other_id = txml_node_get_attribute_byname(txml_node_get_child(root, first), "id");
+                if (other_id && strcmp(txml_attribute_get_value(other_id), txml_attribute_get_value(id)) == 0)
+                    break;
+            }
+            if (txml_index_lookup(xml, "id", txml_attribute_get_value(id)) !=
+                txml_node_get_child(txml_get_branch(xml, 0), first))
+            {
+                errors++;
+            }
+        }
+    }
+    if (errors)
+        ut_failure("%d mismatches in the indexes or the snapshot", errors);
+    else
+        ut_success();
+
+out:
+    free(dump);
+    free(fresh_dump);
+    txml_snapshot_release(snapshot);
+    txml_context_destroy(fresh);
+}
+
+static void
+reload(txml_t *xml, char *data, char *description)
+{
+    write_file(data);
+    ut_testing(description);
+    ut_validate_int(txml_reload_file(xml, path), TXML_NOERR);
+    ut_testing("the document after the reload");
+    check_reload(xml);
+}
+
+int
+main(int argc, char **argv)
+{
+    txml_t *xml;
+    txml_node_t *a, *b, *c, *d;
+
+    ut_init(basename(argv[0]));
+
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/doc.xml", dir);
+    version = time(NULL) - 3600;
+
+    xml = txml_context_create();
+    txml_index_create(xml, "id");
+    txml_name_index_create(xml);
+    txml_snapshot_release(txml_snapshot(xml));
+
+    reload(xml, "<root>\n"
+                "  <a id=\"1\">one</a>\n"
+                "  <b id=\"2\"><c>two</c></b>\n"
+                "  <d id=\"3\">three</d>\n"
+                "</root>\n", "the first txml_reload_file()");
+    a = txml_get_node(xml, "/a");
+    b = txml_get_node(xml, "/b");
+    c = txml_get_node(xml, "/b/c");
+
+    reload(xml, "<root>\n"
+                "  <a id=\"1\">one</a>\n"
+                "  <b id=\"2\"><c>two</c></b>\n"
+                "  <d id=\"3\">four</d>\n"
+                "</root>\n", "reloading a file with a changed child");
+    ut_testing("the unchanged children are kept");
+    ut_validate_int(txml_get_node(xml, "/a") == a && txml_get_node(xml, "/b") == b &&
+                    txml_get_node(xml, "/b/c") == c, 1);
+    ut_testing("the values of the unchanged children");
+    ut_validate_string(txml_node_get_value(c), "two");
+    d = txml_get_node(xml, "/d");
+
+    reload(xml, "<root>\n"
+                "  <a id=\"1\">one</a>\n"
+                "  <e id=\"5\">five</e>\n"
+                "  <b id=\"2\"><c>two</c></b>\n"
+                "  <!-- a comment -->\n"
+                "  <d id=\"3\">four</d>\n"
+                "</root>\n", "reloading a file with new children");
+    ut_testing("the children around the new ones are kept");
+    ut_validate_int(txml_get_node(xml, "/a") == a && txml_get_node(xml, "/b") == b &&
+                    txml_get_node(xml, "/d") == d, 1);
+
+    reload(xml, "<root>\n"
+                "  <d id=\"3\">four</d>\n"
+                "  <b id=\"2\"><c>two</c></b>\n"
+                "  <e id=\"5\">five</e>\n"
+                "  <a id=\"1\">one</a>\n"
+                "</root>\n", "reloading a file with the children in a different order");
+    ut_testing("the reordered children are kept");
+    ut_validate_int(txml_get_node(xml, "/a") == a && txml_get_node(xml, "/b") == b &&
+                    txml_get_node(xml, "/d") == d && txml_get_node(xml, "/b/c") == c, 1);
+
+    reload(xml, "<root>\n"
+                "  <d id=\"3\">four</d>\n"
+                "  <a id=\"1\">one</a>\n"
+                "  <a id=\"1\">one</a>\n"
+                "</root>\n", "reloading a file with removed and duplicated children");
+    ut_testing("the children left are kept");
+    ut_validate_int(txml_get_node(xml, "/d") == d &&
+                    (txml_get_node(xml, "/a[1]") == a || txml_get_node(xml, "/a[2]") == a), 1);
+
+    ut_testing("reloading a file which didn't change");
+    ut_validate_int(txml_reload_file(xml, path), TXML_NOERR);
+    ut_testing("nothing is parsed again when the file didn't change");
+    ut_validate_int(txml_get_node(xml, "/d") == d, 1);
+
+    // the whole document is parsed again from now on
+    reload(xml, "<root version=\"2\">\n"
+                "  <d id=\"3\">four</d>\n"
+                "  <a id=\"1\">one</a>\n"
+                "</root>\n", "reloading a file whose root element changed");
+    reload(xml, "<root>\n"
+                "  <d id=\"3\">four</d>\n"
+                "  some text\n"
+                "  <a id=\"1\">one</a>\n"
+                "</root>\n", "reloading a file with text among the children");
+    reload(xml, "<root>\n"
+                "  <d id=\"3\">four</d>\n"
+                "  <a id=\"1\">one</a>\n"
+                "</root>\n", "reloading a file after a full parse");
+
+    // the tags of the changed child don't match, it can't be told apart from the others
+    reload(xml, "<root>\n"
+                "  <d id=\"3\">four</d>\n"
+                "  <a id=\"1\"><x>one</a>\n"
+                "</root>\n", "reloading a file with a malformed child");
+
+    write_file("<root>\n"
+               "  <d id=\"3\">four</d>\n"
+               "  <a id=\"1\">one</a></a>\n"
+               "</root>\n");
+    ut_testing("reloading a file which can't be parsed");
+    ut_validate_int(txml_reload_file(xml, path) != TXML_NOERR, 1);
+
+    reload(xml, "<root>\n"
+                "  <d id=\"3\">four</d>\n"
+                "  <a id=\"1\">fixed</a>\n"
+                "</root>\n", "reloading the file fixed");
+    a = txml_get_node(xml, "/a");
+    d = txml_get_node(xml, "/d");
+
+    reload(xml, "<root>\n"
+                "  <d id=\"3\">four</d>\n"
+                "  <a id=\"1\">fixed</a>\n"
+                "  <f id=\"6\"/>\n"
+                "</root>\n", "reloading a file with a new child after a failed reload");
+    ut_testing("the children are kept again after a failed reload");
+    ut_validate_int(txml_get_node(xml, "/a") == a && txml_get_node(xml, "/d") == d, 1);
+
+    reload(xml, "<root>\n"
+                "  <d id=\"3\">five</d>\n"
+                "  <a id=\"1\">fixed</a>\n"
+                "  <f id=\"6\"/>\n"
+                "</root>\n", "reloading a file with a changed child after a failed reload");
+    ut_testing("the unchanged children are kept after a failed reload");
+    ut_validate_int(txml_get_node(xml, "/a") == a, 1);
+
+    txml_context_destroy(xml);
+    unlink(path);
+    rmdir(dir);
+
+    ut_summary();
+
+    return ut_failed;
+}